@@ -1,5 +1,6 @@
+import json
 import requests
-from typing import Dict, List, Optional, Any, TypedDict
+from typing import Dict, List, Optional, Any, Iterable, Iterator, TypedDict
 
 
 class Document(TypedDict):
@@ -7,19 +8,35 @@ class Document(TypedDict):
     text: str
     metadata: Optional[Dict[str, str]]
 
+# Accept headers for the search response encodings the server can write
+RESPONSE_ENCODINGS = {
+    "json": "application/json",
+    "msgpack": "application/msgpack",
+    "cbor": "application/cbor",
+}
+
 class Client:
     """OpenAI-style client for the semantic search API."""
     
-    def __init__(self, base_url: str = "http://localhost:8080"):
+    def __init__(self, base_url: str = "http://localhost:8080", encoding: str = "json", compression: bool = True):
         """
         Initialize the client.
         
         Args:
             base_url: The base URL of the server.
+            encoding: Body encoding of search responses: "json" (default), "msgpack" (needs the msgpack
+                      package) or "cbor" (needs cbor2). The binary ones are smaller and faster to decode.
+            compression: Accept gzip (and zstd, when the zstandard package is installed) compressed
+                         responses; requests decompresses them transparently. False asks for identity.
         """
+        if encoding not in RESPONSE_ENCODINGS:
+            raise ValueError(f"Unknown encoding '{encoding}', expected one of {', '.join(RESPONSE_ENCODINGS)}")
         self.base_url = base_url
+        self.encoding = encoding
         self.session = requests.Session()
         self.session.headers.update({"Content-Type": "application/json"})
+        if not compression:
+            self.session.headers["Accept-Encoding"] = "identity"
         
         # Create sub-clients
         self.documents = DocumentsClient(self)
@@ -38,6 +55,19 @@ class Client:
         response = self.session.request(method, url, **kwargs)
         response.raise_for_status()
         return response
+    
+    def _search(self, endpoint: str, payload: Dict[str, Any]) -> Any:
+        """Internal method to run a search, decoding the response in whichever encoding it came back in."""
+        response = self._request("POST", endpoint, json=payload,
+                                 headers={"Accept": RESPONSE_ENCODINGS[self.encoding]})
+        content_type = response.headers.get("Content-Type", "")
+        if content_type.startswith("application/msgpack"):
+            import msgpack
+            return msgpack.unpackb(response.content, raw=False)
+        if content_type.startswith("application/cbor"):
+            import cbor2
+            return cbor2.loads(response.content)
+        return response.json()
 
 
 class DocumentsClient:
@@ -51,7 +81,8 @@ class DocumentsClient:
         """Get the total count of documents in the database."""
         return self.count()
     
-    def create(self, text: str, metadata: Optional[Dict[str, str]] = None, id: Optional[str] = None) -> Document:
+    def create(self, text: str, metadata: Optional[Dict[str, str]] = None, id: Optional[str] = None,
+               wait: bool = False) -> Document:
         """
         Create a new document.
         
@@ -59,6 +90,7 @@ class DocumentsClient:
             text: The document text.
             metadata: Optional metadata dictionary.
             id: Optional custom ID for the document (e.g., file path).
+            wait: Return only once the document is searchable, not just durably stored.
             
         Returns:
             Response containing the document ID.
@@ -68,6 +100,8 @@ class DocumentsClient:
             payload["metadata"] = metadata
         if id:
             payload["id"] = id
+        if wait:
+            payload["wait"] = True
         
         response = self.client._request("POST", "/documents", json=payload)
         return response.json()
@@ -88,7 +122,22 @@ class DocumentsClient:
         response = self.client._request("GET", f"/documents/{encoded_id}")
         return response.json()
     
-    def update(self, document_id: str, text: str, metadata: Optional[Dict[str, str]] = None) -> Document:
+    def retrieve_batch(self, document_ids: List[str]) -> List[Dict[str, Any]]:
+        """
+        Retrieve several documents by ID in one request.
+        
+        Args:
+            document_ids: The document IDs (strings).
+            
+        Returns:
+            The documents found, in the order requested.
+        """
+        payload = {"ids": [str(document_id) for document_id in document_ids]}
+        response = self.client._request("POST", "/documents/get", json=payload)
+        return response.json()
+    
+    def update(self, document_id: str, text: str, metadata: Optional[Dict[str, str]] = None,
+               wait: bool = False) -> Document:
         """
         Update an existing document.
         
@@ -96,6 +145,7 @@ class DocumentsClient:
             document_id: The document ID to update (string).
             text: The new document text.
             metadata: Optional new metadata.
+            wait: Return only once the new text is searchable.
             
         Returns:
             Response containing update status.
@@ -105,11 +155,14 @@ class DocumentsClient:
         payload = {"text": text}
         if metadata:
             payload["metadata"] = metadata
+        if wait:
+            payload["wait"] = True
         
         response = self.client._request("PUT", f"/documents/{encoded_id}", json=payload)
         return response.json()
     
-    def upsert(self, document_id: str, text: str, metadata: Optional[Dict[str, str]] = None) -> Document:
+    def upsert(self, document_id: str, text: str, metadata: Optional[Dict[str, str]] = None,
+               wait: bool = False) -> Document:
         """
         Upsert a document (insert if doesn't exist, update if exists).
         
@@ -117,6 +170,7 @@ class DocumentsClient:
             document_id: The document ID (string).
             text: The document text.
             metadata: Optional metadata.
+            wait: Return only once the document is searchable.
             
         Returns:
             Response containing upsert status.
@@ -126,23 +180,27 @@ class DocumentsClient:
         payload = {"text": text}
         if metadata:
             payload["metadata"] = metadata
+        if wait:
+            payload["wait"] = True
         
         response = self.client._request("PUT", f"/documents/{encoded_id}", json=payload)
         return response.json()
     
-    def delete(self, document_id: str) -> Document:
+    def delete(self, document_id: str, wait: bool = False) -> Document:
         """
         Delete a document.
         
         Args:
             document_id: The document ID to delete (string).
+            wait: Return only once the document no longer appears in search results.
             
         Returns:
             Response containing deletion status.
         """
         from urllib.parse import quote
         encoded_id = quote(str(document_id), safe='')
-        response = self.client._request("DELETE", f"/documents/{encoded_id}")
+        params = {"wait": "true"} if wait else None
+        response = self.client._request("DELETE", f"/documents/{encoded_id}", params=params)
         return response.json()
     
     def count(self, key: Optional[str] = None, value: Optional[str] = None) -> int:
@@ -181,28 +239,77 @@ class DocumentsClient:
         response = self.client._request("GET", "/documents", params=params)
         return response.json()
     
-    def create_batch(self, documents: List[Document]) -> List[Document]:
+    def create_batch(self, documents: List[Document], wait: bool = False) -> List[Document]:
         """
         Create multiple documents in a batch.
         
         Args:
             documents: List of document dictionaries with 'text', optional 'metadata', and optional 'id'.
                       Example: [{'text': 'content', 'metadata': {'key': 'value'}, 'id': 'custom_id'}]
+                      The batch is one transaction sent as one request; use create_stream for
+                      large uploads.
+            wait: Return only once every document in the batch is searchable.
             
         Returns:
             Response containing batch creation status.
         """
         payload = {"documents": documents}
+        if wait:
+            payload["wait"] = True
         response = self.client._request("POST", "/documents/batch", json=payload)
         return response.json()
     
-    def upsert_batch(self, documents: List[Document]) -> List[Document]:
+    def create_stream(self, documents: Iterable[Document], wait: bool = False,
+                      chunk_bytes: int = 1 << 16) -> Iterator[Dict[str, Any]]:
+        """
+        Stream documents to the server as NDJSON without holding the upload in memory.
+        
+        Documents are pulled from the iterable lazily, so a generator over a large file or database
+        can be uploaded as is. The server commits them in chunks and stops reading while its indexer
+        catches up, which throttles this upload. Unlike create_batch, a bad record fails on its own.
+        
+        Args:
+            documents: Document dictionaries with 'text', optional 'metadata', optional 'id' and an
+                       optional precomputed 'embedding'.
+            wait: Return only once every document is searchable.
+            chunk_bytes: Approximate size of each piece of the request body.
+            
+        Yields:
+            One status per document in upload order, {'line': n, 'id': ..., 'status': 'ok'} or
+            {'line': n, 'status': 'error', 'error': ...}, then a summary with 'done': True and
+            the 'inserted' and 'failed' counts. Statuses arrive once the whole upload has been sent;
+            they are read from the response as it streams in, so none are held in memory here.
+        """
+        def body() -> Iterator[bytes]:
+            pending = []
+            size = 0
+            for document in documents:
+                line = json.dumps(document, separators=(",", ":")).encode() + b"\n"
+                pending.append(line)
+                size += len(line)
+                if size >= chunk_bytes:
+                    yield b"".join(pending)
+                    pending = []
+                    size = 0
+            if pending:
+                yield b"".join(pending)
+        
+        params = {"wait": "true"} if wait else None
+        response = self.client._request("POST", "/documents/stream", data=body(), params=params, stream=True,
+                                        headers={"Content-Type": "application/x-ndjson"})
+        with response:
+            for line in response.iter_lines():
+                if line:
+                    yield json.loads(line)
+    
+    def upsert_batch(self, documents: List[Document], wait: bool = False) -> List[Document]:
         """
         Upsert multiple documents (insert or update each).
         
         Args:
             documents: List of document dictionaries with 'id', 'text', and optional 'metadata'.
                       The 'id' field is required for upsert.
+            wait: Return only once every document is searchable.
             
         Returns:
             List of responses for each upsert operation.
@@ -216,7 +323,8 @@ class DocumentsClient:
             result = self.upsert(
                 document_id=doc['id'],
                 text=doc['text'],
-                metadata=doc.get('metadata')
+                metadata=doc.get('metadata'),
+                wait=wait
             )
             results.append(result)
         
@@ -235,7 +343,10 @@ class SearchClient:
               type: str = "semantic",
               metadata: Optional[Dict[str, str]] = None,
               threshold: float = 0.0,
-              efSearch: int = 200
+              efSearch: int = 200,
+              latency_budget_ms: Optional[float] = None,
+              target_recall: Optional[float] = None,
+              fields: Optional[List[str]] = None
     ) -> List[Document]:
         """
         Search for documents.
@@ -243,10 +354,17 @@ class SearchClient:
         Args:
             query: The search query text.
             k: Number of results to return (default: 10).
-            type: Search type - "semantic" (default), "text", or "fulltext".
-            metadata: Optional metadata filter with 'key' and 'value'.
+            type: Search type - "semantic" (default), "text", "fulltext", "hybrid", or "metadata".
+            metadata: Optional metadata filter with 'key' and 'value'. Restricts semantic and hybrid
+                      searches to matching documents; with type "metadata" it is an exact-match lookup.
             threshold: Minimum score threshold for results (default: 0.0).
             efSearch: HNSW search parameter for performance tuning (default: 350).
+            latency_budget_ms: Semantic searches only. Let the server pick efSearch from its calibration
+                               table to fit this budget, returning the best candidates found by the deadline.
+            target_recall: Semantic searches only. Smallest calibrated efSearch reaching this recall, e.g. 0.95.
+                           efSearch is only used while the index is uncalibrated when either is given.
+            fields: Parts of each result to return, from "id", "score", "text" and "metadata" (default: all).
+                    Leaving out text and metadata also saves the server reading them from storage.
             
         Returns:
             List of search results with scores.
@@ -268,10 +386,26 @@ class SearchClient:
         if efSearch != 200:
             payload["efSearch"] = efSearch
         
-        response = self.client._request("POST", "/search", json=payload)
-        return response.json()
+        if latency_budget_ms is not None:
+            payload["latency_budget_ms"] = latency_budget_ms
+        
+        if target_recall is not None:
+            payload["target_recall"] = target_recall
+        
+        if fields is not None:
+            payload["fields"] = fields
+        
+        return self.client._search("/search", payload)
     
-    def semantic(self, query: str, k: int = 10, threshold: float = 0.0, efSearch: int = 350) -> List[Document]:
+    def semantic(self,
+                 query: str,
+                 k: int = 10,
+                 threshold: float = 0.0,
+                 efSearch: int = 350,
+                 latency_budget_ms: Optional[float] = None,
+                 target_recall: Optional[float] = None,
+                 fields: Optional[List[str]] = None
+    ) -> List[Document]:
         """
         Perform semantic search using embeddings.
         
@@ -280,25 +414,77 @@ class SearchClient:
             k: Number of results to return.
             threshold: Minimum score threshold for results (default: 0.0).
             efSearch: HNSW search parameter for performance tuning (default: 200).
+            latency_budget_ms: Pick efSearch to fit this budget instead (see query()).
+            target_recall: Pick the smallest efSearch reaching this calibrated recall instead (see query()).
+            fields: Parts of each result to return, e.g. ["id", "score"] (see query()).
             
         Returns:
             List of search results with similarity scores.
         """
-        return self.query(query, k=k, type="semantic", threshold=threshold, efSearch=efSearch)
+        return self.query(query, k=k, type="semantic", threshold=threshold, efSearch=efSearch,
+                          latency_budget_ms=latency_budget_ms, target_recall=target_recall, fields=fields)
     
-    def fulltext(self, query: str, k: int = 10, threshold: float = 0.0) -> List[Document]:
+    def fulltext(self, query: str, k: int = 10, threshold: float = 0.0,
+                 fields: Optional[List[str]] = None) -> List[Document]:
         """
-        Perform full-text search using SQL LIKE.
+        Perform keyword search ranked by BM25.
         
         Args:
             query: The search query text.
             k: Number of results to return.
             threshold: Minimum score threshold for results (default: 0.0).
+            fields: Parts of each result to return, e.g. ["id", "score"] (see query()).
             
         Returns:
             List of search results.
         """
-        return self.query(query, k=k, type="text", threshold=threshold)
+        return self.query(query, k=k, type="text", threshold=threshold, fields=fields)
+    
+    def hybrid(self,
+               query: str,
+               k: int = 10,
+               fusion: str = "rrf",
+               alpha: float = 0.5,
+               candidates: Optional[int] = None,
+               threshold: float = 0.0,
+               efSearch: int = 200,
+               include_timings: bool = False,
+               fields: Optional[List[str]] = None
+    ) -> Any:
+        """
+        Perform semantic and keyword search in one request and fuse the rankings.
+        
+        Args:
+            query: The search query text.
+            k: Number of results to return.
+            fusion: "rrf" (reciprocal rank fusion, default) or "weighted" (normalized score blend).
+            alpha: Weight of the semantic score for "weighted" fusion (default: 0.5).
+            candidates: Hits taken from each retriever before fusion (default: max(4k, 50)).
+            threshold: Minimum fused score for results (default: 0.0).
+            efSearch: HNSW search parameter for performance tuning (default: 200).
+            include_timings: Return {"results": [...], "timings": {...}} with per-stage milliseconds.
+            fields: Parts of each result to return, e.g. ["id", "score"] (see query()).
+            
+        Returns:
+            List of search results with fused scores, or the results and timings when requested.
+        """
+        payload = {
+            "query": query,
+            "k": k,
+            "type": "hybrid",
+            "fusion": fusion,
+            "alpha": alpha,
+            "threshold": threshold,
+            "efSearch": efSearch
+        }
+        if candidates:
+            payload["candidates"] = candidates
+        if include_timings:
+            payload["include_timings"] = True
+        if fields is not None:
+            payload["fields"] = fields
+        
+        return self.client._search("/search", payload)
     
     def by_metadata(self, key: str, value: str, k: int = 10) -> List[Document]:
         """
@@ -312,7 +498,7 @@ class SearchClient:
         Returns:
             List of matching documents.
         """
-        return self.query("", k=k, metadata={"key": key, "value": value})
+        return self.query("", k=k, type="metadata", metadata={"key": key, "value": value})
 
 
 class IndexClient:
@@ -339,4 +525,19 @@ class IndexClient:
             Response containing save status.
         """
         response = self.client._request("POST", "/index/save")
+        return response.json()
+    
+    def calibrate(self, queries: int = 200, k: int = 10) -> Dict[str, Any]:
+        """
+        Measure recall@k and latency at each candidate efSearch on stored vectors sampled as queries.
+        Searches with latency_budget_ms or target_recall choose efSearch from this table.
+        
+        Args:
+            queries: Stored vectors sampled as queries.
+            k: Results per calibration search.
+            
+        Returns:
+            Response containing the calibration table.
+        """
+        response = self.client._request("POST", "/index/calibrate", params={"queries": queries, "k": k})
         return response.json()
\ No newline at end of file
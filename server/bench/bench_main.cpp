@@ -0,0 +1,18 @@
+#include <benchmark/benchmark.h>
+#include <cstring>
+#include "load_generator.h"
+
+// `bench [benchmark flags]` runs the microbenchmarks; `bench load [options]` runs the HTTP load generator
+int main(int argc, char** argv) {
+    if (argc > 1 && std::strcmp(argv[1], "load") == 0) {
+        return runLoadGenerator(argc - 1, argv + 1);
+    }
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
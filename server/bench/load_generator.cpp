@@ -0,0 +1,343 @@
+#include "load_generator.h"
+#include <httplib.h>
+#include <nlohmann/json.hpp>
+#include <faiss/IndexFlat.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include "synthetic.h"
+
+using json = nlohmann::json;
+
+namespace {
+
+constexpr size_t UPLOAD_CHUNK = 1000;
+
+struct LoadOptions {
+    std::string host = "localhost";
+    int port = 8080;
+    size_t corpus = 10000;         // Synthetic documents uploaded first; 0 searches what is already indexed
+    size_t queries = 1000;         // Distinct query vectors the requests cycle through
+    size_t recallQueries = 100;    // Leading queries whose recall is checked against exact search
+    size_t requests = 5000;
+    size_t concurrency = 8;
+    int k = 10;
+    int efSearch = 200;
+    uint64_t seed = 42;
+    std::string textQueries;       // One query per line, embedded by the server; recall is not measured
+};
+
+bool parseLoadOptions(int argc, char** argv, LoadOptions& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "--host" && i + 1 < argc) {
+            options.host = argv[++i];
+        } else if (arg == "--port" && i + 1 < argc) {
+            options.port = std::stoi(argv[++i]);
+        } else if (arg == "--corpus" && i + 1 < argc) {
+            options.corpus = std::stoul(argv[++i]);
+        } else if (arg == "--queries" && i + 1 < argc) {
+            options.queries = std::max<size_t>(1, std::stoul(argv[++i]));
+        } else if (arg == "--recall-queries" && i + 1 < argc) {
+            options.recallQueries = std::stoul(argv[++i]);
+        } else if (arg == "--requests" && i + 1 < argc) {
+            options.requests = std::stoul(argv[++i]);
+        } else if (arg == "--concurrency" && i + 1 < argc) {
+            options.concurrency = std::max<size_t>(1, std::stoul(argv[++i]));
+        } else if (arg == "--k" && i + 1 < argc) {
+            options.k = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--ef-search" && i + 1 < argc) {
+            options.efSearch = std::stoi(argv[++i]);
+        } else if (arg == "--seed" && i + 1 < argc) {
+            options.seed = std::stoull(argv[++i]);
+        } else if (arg == "--text-queries" && i + 1 < argc) {
+            options.textQueries = argv[++i];
+        } else if (arg == "--help") {
+            std::cout << "Usage: bench load [options]\n"
+                      << "  --host HOST            Server host (default: localhost)\n"
+                      << "  --port PORT            Server port (default: 8080)\n"
+                      << "  --corpus N             Synthetic documents to upload first, 0 for none (default: 10000)\n"
+                      << "  --queries N            Distinct query vectors (default: 1000)\n"
+                      << "  --recall-queries N     Queries checked against exact search (default: 100)\n"
+                      << "  --requests N           Searches to send (default: 5000)\n"
+                      << "  --concurrency N        Client threads, one connection each (default: 8)\n"
+                      << "  --k N                  Results per search (default: 10)\n"
+                      << "  --ef-search N          efSearch sent with each search (default: 200)\n"
+                      << "  --seed N               Seed for the corpus and queries (default: 42)\n"
+                      << "  --text-queries FILE    Send these text queries instead of vectors\n";
+            return false;
+        } else {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            return false;
+        }
+    }
+    options.recallQueries = std::min(options.recallQueries, options.queries);
+    return true;
+}
+
+std::string base64Encode(const unsigned char* data, size_t size) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string encoded;
+    encoded.reserve((size + 2) / 3 * 4);
+    for (size_t i = 0; i < size; i += 3) {
+        uint32_t group = static_cast<uint32_t>(data[i]) << 16;
+        if (i + 1 < size) group |= static_cast<uint32_t>(data[i + 1]) << 8;
+        if (i + 2 < size) group |= data[i + 2];
+        encoded += alphabet[(group >> 18) & 63];
+        encoded += alphabet[(group >> 12) & 63];
+        encoded += i + 1 < size ? alphabet[(group >> 6) & 63] : '=';
+        encoded += i + 2 < size ? alphabet[group & 63] : '=';
+    }
+    return encoded;
+}
+
+std::string vectorBytes(const float* vector, size_t dimension) {
+    return std::string(reinterpret_cast<const char*>(vector), dimension * sizeof(float));
+}
+
+std::string documentId(size_t i) {
+    return "bench-" + std::to_string(i);
+}
+
+// Exact top k of every recall query over the corpus, accumulated one upload chunk at a time so the
+// corpus never has to be held in memory at once. Higher scores are better for both metrics.
+class GroundTruth {
+public:
+    GroundTruth(const float* queries, size_t count, size_t dimension, int k, bool innerProduct)
+        : queries_(queries), count_(count), dimension_(dimension), k_(k), innerProduct_(innerProduct), best_(count) {}
+
+    void addChunk(const float* vectors, size_t rows, size_t firstId) {
+        if (count_ == 0 || rows == 0) {
+            return;
+        }
+        std::unique_ptr<faiss::IndexFlat> exact;
+        if (innerProduct_) {
+            exact = std::make_unique<faiss::IndexFlatIP>(static_cast<int>(dimension_));
+        } else {
+            exact = std::make_unique<faiss::IndexFlatL2>(static_cast<int>(dimension_));
+        }
+        exact->add(static_cast<faiss::idx_t>(rows), vectors);
+
+        const int k = std::min<int>(k_, static_cast<int>(rows));
+        std::vector<float> distances(count_ * k);
+        std::vector<faiss::idx_t> labels(count_ * k);
+        exact->search(static_cast<faiss::idx_t>(count_), queries_, k, distances.data(), labels.data());
+
+        for (size_t q = 0; q < count_; ++q) {
+            auto& best = best_[q];
+            for (int i = 0; i < k; ++i) {
+                float distance = distances[q * k + i];
+                best.emplace_back(innerProduct_ ? distance : -distance, firstId + static_cast<size_t>(labels[q * k + i]));
+            }
+            std::sort(best.begin(), best.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+            if (best.size() > static_cast<size_t>(k_)) {
+                best.resize(static_cast<size_t>(k_));
+            }
+        }
+    }
+
+    std::unordered_set<std::string> expectedIds(size_t query) const {
+        std::unordered_set<std::string> ids;
+        for (const auto& entry : best_[query]) {
+            ids.insert(documentId(entry.second));
+        }
+        return ids;
+    }
+
+private:
+    const float* queries_;
+    size_t count_;
+    size_t dimension_;
+    int k_;
+    bool innerProduct_;
+    std::vector<std::vector<std::pair<float, size_t>>> best_;
+};
+
+bool getJson(httplib::Client& client, const std::string& path, json& response) {
+    auto res = client.Get(path);
+    if (!res || res->status != 200) {
+        std::cerr << "GET " << path << " failed" << (res ? " with status " + std::to_string(res->status) : "") << std::endl;
+        return false;
+    }
+    response = json::parse(res->body, nullptr, false);
+    return !response.is_discarded();
+}
+
+bool uploadCorpus(httplib::Client& client, const LoadOptions& options, size_t dimension, GroundTruth& truth) {
+    auto started = std::chrono::steady_clock::now();
+    for (size_t first = 0; first < options.corpus; first += UPLOAD_CHUNK) {
+        const size_t rows = std::min(UPLOAD_CHUNK, options.corpus - first);
+        std::vector<float> vectors = syntheticVectors(rows, dimension, options.seed * 1000003 + first);
+
+        json documents = json::array();
+        for (size_t i = 0; i < rows; ++i) {
+            const float* vector = vectors.data() + i * dimension;
+            documents.push_back({
+                {"id", documentId(first + i)},
+                {"text", "bench document " + std::to_string(first + i)},
+                {"embedding", base64Encode(reinterpret_cast<const unsigned char*>(vector), dimension * sizeof(float))}
+            });
+        }
+        // Waiting on the last chunk makes the whole corpus searchable before the load starts
+        json request = {{"documents", documents}, {"wait", first + rows == options.corpus}};
+
+        auto res = client.Post("/documents/batch", request.dump(), "application/json");
+        if (!res || res->status != 200) {
+            std::cerr << "Upload of documents " << first << "-" << first + rows - 1 << " failed"
+                      << (res ? ": " + res->body : "") << std::endl;
+            return false;
+        }
+        truth.addChunk(vectors.data(), rows, first);
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    std::cout << "Uploaded " << options.corpus << " documents in " << seconds << " s ("
+              << (seconds > 0 ? static_cast<double>(options.corpus) / seconds : 0.0) << " docs/s)" << std::endl;
+    return true;
+}
+
+std::string searchPath(const LoadOptions& options) {
+    // Scores may be negative under inner product, so the threshold keeps every neighbor
+    return "/search?k=" + std::to_string(options.k) + "&efSearch=" + std::to_string(options.efSearch) + "&threshold=-2";
+}
+
+double percentile(const std::vector<double>& sorted, double fraction) {
+    if (sorted.empty()) {
+        return 0.0;
+    }
+    size_t rank = static_cast<size_t>(fraction * static_cast<double>(sorted.size() - 1) + 0.5);
+    return sorted[std::min(rank, sorted.size() - 1)];
+}
+
+}
+
+int runLoadGenerator(int argc, char** argv) {
+    LoadOptions options;
+    if (!parseLoadOptions(argc, argv, options)) {
+        return 1;
+    }
+
+    httplib::Client client(options.host, options.port);
+    client.set_read_timeout(300);
+    json stats;
+    json health;
+    if (!getJson(client, "/index/stats", stats) || !getJson(client, "/health", health)) {
+        std::cerr << "Is the server running on " << options.host << ":" << options.port << "?" << std::endl;
+        return 1;
+    }
+    const size_t dimension = stats.value("dimension", static_cast<size_t>(0));
+    const bool innerProduct = health.value("metric", "l2") == "ip";
+    if (dimension == 0) {
+        std::cerr << "Server reported no embedding dimension" << std::endl;
+        return 1;
+    }
+
+    std::vector<std::string> textQueries;
+    if (!options.textQueries.empty()) {
+        std::ifstream file(options.textQueries);
+        std::string line;
+        while (std::getline(file, line)) {
+            if (!line.empty()) {
+                textQueries.push_back(line);
+            }
+        }
+        if (textQueries.empty()) {
+            std::cerr << "No queries read from " << options.textQueries << std::endl;
+            return 1;
+        }
+    }
+
+    const size_t queryCount = textQueries.empty() ? options.queries : textQueries.size();
+    std::vector<float> queries = syntheticVectors(textQueries.empty() ? queryCount : 0, dimension, options.seed);
+    const size_t recallQueries = textQueries.empty() && options.corpus > 0 ? options.recallQueries : 0;
+    GroundTruth truth(queries.data(), recallQueries, dimension, options.k, innerProduct);
+
+    std::cout << "Server: " << options.host << ":" << options.port << ", dimension " << dimension
+              << ", metric " << (innerProduct ? "ip" : "l2") << ", " << stats.value("type", "?") << " index" << std::endl;
+    if (options.corpus > 0 && !uploadCorpus(client, options, dimension, truth)) {
+        return 1;
+    }
+
+    std::vector<std::string> bodies(queryCount);
+    for (size_t q = 0; q < queryCount; ++q) {
+        bodies[q] = textQueries.empty()
+            ? vectorBytes(queries.data() + q * dimension, dimension)
+            : json{{"query", textQueries[q]}, {"k", options.k}, {"efSearch", options.efSearch}, {"threshold", -2}}.dump();
+    }
+    const std::string path = textQueries.empty() ? searchPath(options) : "/search";
+    const std::string contentType = textQueries.empty() ? "application/octet-stream" : "application/json";
+
+    // Each thread keeps its own connection and latency list; requests are handed out from a shared counter
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> errors{0};
+    std::vector<std::vector<double>> latencies(options.concurrency);
+    std::vector<std::thread> threads;
+    auto started = std::chrono::steady_clock::now();
+    for (size_t t = 0; t < options.concurrency; ++t) {
+        threads.emplace_back([&, t]() {
+            httplib::Client threadClient(options.host, options.port);
+            threadClient.set_keep_alive(true);
+            threadClient.set_read_timeout(60);
+            for (size_t request = next++; request < options.requests; request = next++) {
+                auto sent = std::chrono::steady_clock::now();
+                auto res = threadClient.Post(path, bodies[request % queryCount], contentType);
+                double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - sent).count();
+                if (!res || res->status != 200) {
+                    errors++;
+                    continue;
+                }
+                latencies[t].push_back(ms);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    std::vector<double> all;
+    for (const auto& threadLatencies : latencies) {
+        all.insert(all.end(), threadLatencies.begin(), threadLatencies.end());
+    }
+    std::sort(all.begin(), all.end());
+
+    std::cout << "Requests: " << options.requests << " over " << options.concurrency << " connections, "
+              << errors.load() << " errors" << std::endl;
+    std::cout << "Throughput: " << (seconds > 0 ? static_cast<double>(all.size()) / seconds : 0.0) << " QPS" << std::endl;
+    std::cout << "Latency ms: p50 " << percentile(all, 0.50) << ", p90 " << percentile(all, 0.90)
+              << ", p99 " << percentile(all, 0.99) << ", max " << (all.empty() ? 0.0 : all.back()) << std::endl;
+
+    // Recall is checked after the load so it does not skew the latencies
+    if (recallQueries > 0) {
+        size_t found = 0;
+        size_t expected = 0;
+        for (size_t q = 0; q < recallQueries; ++q) {
+            auto res = client.Post(path, bodies[q], contentType);
+            if (!res || res->status != 200) {
+                continue;
+            }
+            json results = json::parse(res->body, nullptr, false);
+            auto ids = truth.expectedIds(q);
+            expected += ids.size();
+            if (!results.is_array()) {
+                continue;
+            }
+            for (const auto& result : results) {
+                found += ids.count(result.value("id", ""));
+            }
+        }
+        std::cout << "Recall@" << options.k << " over " << recallQueries << " queries: "
+                  << (expected ? static_cast<double>(found) / static_cast<double>(expected) : 0.0) << std::endl;
+    }
+
+    return errors.load() == 0 ? 0 : 1;
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+// `bench load [options]`: drives a running server over HTTP with a synthetic corpus and concurrent
+// searches, then reports throughput, latency percentiles and recall against exact search. Run it
+// against a server started with --new-db, since other documents in the index count as misses.
+int runLoadGenerator(int argc, char** argv);
@@ -0,0 +1,344 @@
+#include <benchmark/benchmark.h>
+#include <faiss/IndexFlat.h>
+#include <faiss/IndexHNSW.h>
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include "inference.h"
+#include "response_writer.h"
+#include "storage.h"
+#include "synthetic.h"
+
+// Reaches the engine's private stages so they can be timed without the rest of getEmbeddings
+struct InferenceEngineBench {
+    static size_t tokenize(InferenceEngine& engine, const std::vector<std::string>& texts, int64_t maxLen) {
+        auto batch = engine.tokenizeBatch(texts, maxLen);
+        benchmark::DoNotOptimize(batch.input_ids.data());
+        return static_cast<size_t>(batch.B * batch.S);
+    }
+
+    static void setDimension(InferenceEngine& engine, size_t dimension) {
+        engine.embeddingDim_ = dimension;
+    }
+
+    static void pool(InferenceEngine& engine, const float* hidden, const int64_t* mask,
+                     int64_t B, int64_t S, int64_t H, float* const* outputs) {
+        engine.meanPoolL2Norm(hidden, mask, B, S, H, outputs);
+    }
+};
+
+namespace {
+
+size_t envSize(const char* name, size_t fallback) {
+    const char* value = std::getenv(name);
+    return value ? static_cast<size_t>(std::strtoull(value, nullptr, 10)) : fallback;
+}
+
+// Loaded once for every model benchmark; null when the model files are missing
+InferenceEngine* sharedEngine() {
+    static std::unique_ptr<InferenceEngine> engine = [] {
+        const char* model = std::getenv("FASTFINDR_MODEL");
+        const char* tokenizer = std::getenv("FASTFINDR_TOKENIZER");
+        auto loaded = std::make_unique<InferenceEngine>();
+        if (!loaded->loadModel(model ? model : "../embeddinggemma-onnx/model.onnx",
+                               tokenizer ? tokenizer : "../embeddinggemma-onnx/tokenizer.json")) {
+            loaded.reset();
+        }
+        return loaded;
+    }();
+    return engine.get();
+}
+
+// Args: texts per batch, words per text
+void BM_TokenizeBatch(benchmark::State& state) {
+    InferenceEngine* engine = sharedEngine();
+    if (!engine) {
+        state.SkipWithError("Model not found; set FASTFINDR_MODEL and FASTFINDR_TOKENIZER");
+        return;
+    }
+    auto texts = syntheticTexts(static_cast<size_t>(state.range(0)), static_cast<size_t>(state.range(1)), 1);
+    size_t tokens = 0;
+    for (auto _ : state) {
+        tokens = InferenceEngineBench::tokenize(*engine, texts, 2048);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.counters["padded_tokens"] = static_cast<double>(tokens);
+}
+BENCHMARK(BM_TokenizeBatch)->ArgsProduct({{1, 8, 32}, {16, 64, 256}})->ArgNames({"B", "S"});
+
+// Args: texts per batch, words per text. Tokenization, ONNX Run and pooling together
+void BM_GetEmbeddings(benchmark::State& state) {
+    InferenceEngine* engine = sharedEngine();
+    if (!engine) {
+        state.SkipWithError("Model not found; set FASTFINDR_MODEL and FASTFINDR_TOKENIZER");
+        return;
+    }
+    auto texts = syntheticTexts(static_cast<size_t>(state.range(0)), static_cast<size_t>(state.range(1)), 2);
+    for (auto _ : state) {
+        EmbeddingMatrix embeddings = engine->getEmbeddings(texts, 2048);
+        benchmark::DoNotOptimize(embeddings.data());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_GetEmbeddings)->ArgsProduct({{1, 8, 32}, {16, 64, 256}})->ArgNames({"B", "S"})
+    ->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Args: sequences, sequence length; hidden size 768 as in EmbeddingGemma
+void BM_MeanPoolL2Norm(benchmark::State& state) {
+    const int64_t B = state.range(0);
+    const int64_t S = state.range(1);
+    const int64_t H = 768;
+    InferenceEngine engine;
+    InferenceEngineBench::setDimension(engine, static_cast<size_t>(H));
+
+    std::vector<float> hidden = syntheticVectors(static_cast<size_t>(B * S), static_cast<size_t>(H), 3);
+    std::vector<int64_t> mask(static_cast<size_t>(B * S), 1);
+    EmbeddingMatrix pooled(static_cast<size_t>(B), static_cast<size_t>(H));
+    std::vector<float*> outputs;
+    for (int64_t b = 0; b < B; ++b) {
+        outputs.push_back(pooled.row(static_cast<size_t>(b)));
+    }
+
+    for (auto _ : state) {
+        InferenceEngineBench::pool(engine, hidden.data(), mask.data(), B, S, H, outputs.data());
+        benchmark::DoNotOptimize(pooled.data());
+    }
+    state.SetBytesProcessed(state.iterations() * B * S * H * static_cast<int64_t>(sizeof(float)));
+}
+BENCHMARK(BM_MeanPoolL2Norm)->ArgsProduct({{1, 32}, {64, 256}})->ArgNames({"B", "S"});
+
+// Corpus and queries shared by the HNSW benchmarks; FASTFINDR_BENCH_VECTORS and FASTFINDR_BENCH_DIM
+// size it (default 50k x 768), and the graph is built once per process
+struct HnswCorpus {
+    size_t count;
+    size_t dimension;
+    std::vector<float> vectors;
+    std::vector<float> queries;
+    std::vector<faiss::idx_t> truth;  // Exact top RECALL_K per query
+    std::unique_ptr<faiss::IndexHNSWFlat> index;
+
+    static constexpr size_t QUERIES = 200;
+    static constexpr int RECALL_K = 10;
+
+    static HnswCorpus& get() {
+        static HnswCorpus corpus;
+        return corpus;
+    }
+
+private:
+    HnswCorpus()
+        : count(envSize("FASTFINDR_BENCH_VECTORS", 50000)), dimension(envSize("FASTFINDR_BENCH_DIM", 768))
+        , vectors(syntheticVectors(count, dimension, 4)), queries(syntheticVectors(QUERIES, dimension, 5)) {
+        index = std::make_unique<faiss::IndexHNSWFlat>(static_cast<int>(dimension), 16);
+        index->hnsw.efConstruction = 200;
+        index->add(static_cast<faiss::idx_t>(count), vectors.data());
+
+        faiss::IndexFlatL2 exact(static_cast<int>(dimension));
+        exact.add(static_cast<faiss::idx_t>(count), vectors.data());
+        std::vector<float> distances(QUERIES * RECALL_K);
+        truth.resize(QUERIES * RECALL_K);
+        exact.search(QUERIES, queries.data(), RECALL_K, distances.data(), truth.data());
+    }
+};
+
+// Args: vectors added to an empty graph
+void BM_HnswAdd(benchmark::State& state) {
+    const size_t dimension = envSize("FASTFINDR_BENCH_DIM", 768);
+    const size_t count = static_cast<size_t>(state.range(0));
+    std::vector<float> vectors = syntheticVectors(count, dimension, 6);
+    for (auto _ : state) {
+        faiss::IndexHNSWFlat index(static_cast<int>(dimension), 16);
+        index.hnsw.efConstruction = 200;
+        index.add(static_cast<faiss::idx_t>(count), vectors.data());
+        benchmark::DoNotOptimize(index.ntotal);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_HnswAdd)->Arg(1000)->Arg(10000)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Args: efSearch. One query per iteration, k = 10; recall@10 against exact search is reported as a counter
+void BM_HnswSearch(benchmark::State& state) {
+    HnswCorpus& corpus = HnswCorpus::get();
+    const int k = HnswCorpus::RECALL_K;
+    faiss::SearchParametersHNSW params;
+    params.efSearch = static_cast<int>(state.range(0));
+
+    std::vector<float> distances(k);
+    std::vector<faiss::idx_t> labels(k);
+    size_t query = 0;
+    for (auto _ : state) {
+        corpus.index->search(1, corpus.queries.data() + query * corpus.dimension, k,
+                             distances.data(), labels.data(), &params);
+        benchmark::DoNotOptimize(labels.data());
+        query = (query + 1) % HnswCorpus::QUERIES;
+    }
+
+    std::vector<float> allDistances(HnswCorpus::QUERIES * k);
+    std::vector<faiss::idx_t> allLabels(HnswCorpus::QUERIES * k);
+    corpus.index->search(HnswCorpus::QUERIES, corpus.queries.data(), k, allDistances.data(), allLabels.data(), &params);
+    size_t found = 0;
+    for (size_t q = 0; q < HnswCorpus::QUERIES; ++q) {
+        std::unordered_set<faiss::idx_t> exact(corpus.truth.begin() + q * k, corpus.truth.begin() + (q + 1) * k);
+        for (int i = 0; i < k; ++i) {
+            found += exact.count(allLabels[q * k + i]);
+        }
+    }
+    state.counters["recall@10"] = static_cast<double>(found) / static_cast<double>(HnswCorpus::QUERIES * k);
+    state.counters["vectors"] = static_cast<double>(corpus.count);
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_HnswSearch)->Arg(16)->Arg(32)->Arg(64)->Arg(128)->Arg(256)->ArgName("efSearch");
+
+// Results as a search over documents of 200 words with two metadata entries returns them
+std::vector<SearchResult> syntheticResults(size_t count) {
+    auto texts = syntheticTexts(count, 200, 10);
+    std::vector<SearchResult> results(count);
+    for (size_t i = 0; i < count; ++i) {
+        results[i].id = "doc-" + std::to_string(i);
+        results[i].text = std::move(texts[i]);
+        results[i].score = 1.0f / static_cast<float>(i + 1);
+        results[i].metadata = {{"source", "bench"}, {"shard", std::to_string(i % 16)}};
+    }
+    return results;
+}
+
+// Args: results, format (0 JSON, 1 MessagePack, 2 CBOR)
+void BM_WriteResults(benchmark::State& state) {
+    auto results = syntheticResults(static_cast<size_t>(state.range(0)));
+    const auto format = static_cast<ResponseFormat>(state.range(1));
+    size_t bytes = 0;
+    for (auto _ : state) {
+        ResponseWriter writer(format);
+        writer.results(results);
+        std::string body = writer.take();
+        bytes = body.size();
+        benchmark::DoNotOptimize(body.data());
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(bytes));
+    state.counters["body_bytes"] = static_cast<double>(bytes);
+}
+BENCHMARK(BM_WriteResults)->ArgsProduct({{10, 100}, {0, 1, 2}})->ArgNames({"k", "format"});
+
+// Args: results. The nlohmann::json document and dump() that search responses were built with before
+// ResponseWriter, for comparison with BM_WriteResults at format 0
+void BM_JsonDocumentResults(benchmark::State& state) {
+    auto results = syntheticResults(static_cast<size_t>(state.range(0)));
+    for (auto _ : state) {
+        nlohmann::json response = nlohmann::json::array();
+        for (const auto& result : results) {
+            response.push_back({{"id", result.id}, {"text", result.text}, {"score", result.score},
+                                {"metadata", result.metadata}});
+        }
+        std::string body = response.dump();
+        benchmark::DoNotOptimize(body.data());
+    }
+}
+BENCHMARK(BM_JsonDocumentResults)->Arg(10)->Arg(100)->ArgName("k");
+
+// Args: encoding (1 gzip, 2 zstd). A JSON body of 100 results; the ratio is reported as a counter
+void BM_CompressResults(benchmark::State& state) {
+    ResponseWriter writer(ResponseFormat::Json);
+    writer.results(syntheticResults(100));
+    const std::string body = writer.take();
+    const auto encoding = static_cast<ContentEncoding>(state.range(0));
+    size_t compressedBytes = 0;
+    for (auto _ : state) {
+        std::string compressed = body;
+        if (!compressBody(compressed, encoding)) {
+            state.SkipWithError("Encoding not supported by this build");
+            return;
+        }
+        compressedBytes = compressed.size();
+        benchmark::DoNotOptimize(compressed.data());
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(body.size()));
+    state.counters["ratio"] = static_cast<double>(body.size()) / static_cast<double>(compressedBytes);
+}
+BENCHMARK(BM_CompressResults)->Arg(1)->Arg(2)->ArgName("encoding");
+
+// Throwaway database in the temp directory, removed when the process exits
+class BenchDatabase {
+public:
+    static BenchDatabase& get() {
+        static BenchDatabase database;
+        return database;
+    }
+
+    Storage& storage() { return *storage_; }
+    const std::vector<std::string>& ids() const { return ids_; }
+
+    ~BenchDatabase() {
+        storage_.reset();
+        std::error_code ec;
+        for (const char* suffix : {"", "-wal", "-shm"}) {
+            std::filesystem::remove(path_ + suffix, ec);
+        }
+    }
+
+private:
+    static constexpr size_t DOCUMENTS = 10000;
+
+    std::string path_;
+    std::unique_ptr<Storage> storage_;
+    std::vector<std::string> ids_;
+
+    BenchDatabase()
+        : path_((std::filesystem::temp_directory_path() / ("fastfindr-bench-" + std::to_string(std::random_device{}()) + ".db")).string())
+        , storage_(std::make_unique<Storage>(path_)) {
+        storage_->initialize();
+        auto texts = syntheticTexts(DOCUMENTS, 48, 7);
+        storage_->beginTransaction();
+        for (size_t i = 0; i < texts.size(); ++i) {
+            ids_.push_back(storage_->addDocument(texts[i], {{"source", "bench"}, {"shard", std::to_string(i % 16)}}));
+        }
+        storage_->commitTransaction();
+    }
+};
+
+// Args: hits per search, whether texts and metadata are read. The batched lookup hydrateResults makes
+// for every search's top k; 0 is a request with fields ["id", "score"]
+void BM_HydrateResults(benchmark::State& state) {
+    BenchDatabase& database = BenchDatabase::get();
+    const DocumentFields fields{state.range(1) != 0, state.range(1) != 0};
+    std::mt19937_64 random(8);
+    std::uniform_int_distribution<size_t> pick(0, database.ids().size() - 1);
+    std::vector<std::string> ids(static_cast<size_t>(state.range(0)));
+    for (auto _ : state) {
+        state.PauseTiming();
+        for (auto& id : ids) {
+            id = database.ids()[pick(random)];
+        }
+        state.ResumeTiming();
+        auto documents = database.storage().getDocumentsByIds(ids, fields);
+        benchmark::DoNotOptimize(documents.data());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_HydrateResults)->ArgsProduct({{10, 100}, {0, 1}})->ArgNames({"k", "text"});
+
+// Args: documents per transaction; 1 is the autocommit cost of a single insert
+void BM_StorageInsert(benchmark::State& state) {
+    Storage& storage = BenchDatabase::get().storage();
+    const size_t batch = static_cast<size_t>(state.range(0));
+    auto texts = syntheticTexts(batch, 48, 9);
+    for (auto _ : state) {
+        if (batch > 1) {
+            storage.beginTransaction();
+        }
+        for (const auto& text : texts) {
+            benchmark::DoNotOptimize(storage.addDocument(text, {{"source", "bench"}}));
+        }
+        if (batch > 1) {
+            storage.commitTransaction();
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_StorageInsert)->Arg(1)->Arg(100)->Arg(1000)->ArgName("batch")->UseRealTime();
+
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+// Deterministic inputs for the benchmarks: the same seed gives the same data on every run and machine
+
+// `count` texts of `words` words each, drawn from a small fixed vocabulary
+inline std::vector<std::string> syntheticTexts(size_t count, size_t words, uint64_t seed) {
+    static const char* const vocabulary[] = {
+        "search", "vector", "index", "graph", "neighbor", "embedding", "query", "document", "server", "latency",
+        "memory", "cache", "shard", "recall", "token", "model", "batch", "thread", "storage", "metadata",
+        "the", "of", "and", "a", "to", "in", "is", "for", "on", "with", "that", "by", "from", "at", "as",
+        "quickly", "distributed", "approximate", "semantic", "relevant", "compressed", "parallel", "durable"
+    };
+    constexpr size_t vocabularySize = sizeof(vocabulary) / sizeof(vocabulary[0]);
+
+    std::mt19937_64 random(seed);
+    std::uniform_int_distribution<size_t> pick(0, vocabularySize - 1);
+    std::vector<std::string> texts(count);
+    for (auto& text : texts) {
+        for (size_t w = 0; w < words; ++w) {
+            if (w) {
+                text += ' ';
+            }
+            text += vocabulary[pick(random)];
+        }
+    }
+    return texts;
+}
+
+// `count` row-major unit vectors of `dimension` floats with Gaussian components
+inline std::vector<float> syntheticVectors(size_t count, size_t dimension, uint64_t seed) {
+    std::mt19937_64 random(seed);
+    std::normal_distribution<float> component(0.0f, 1.0f);
+    std::vector<float> vectors(count * dimension);
+    for (size_t i = 0; i < count; ++i) {
+        float* row = vectors.data() + i * dimension;
+        double norm = 0.0;
+        for (size_t j = 0; j < dimension; ++j) {
+            row[j] = component(random);
+            norm += static_cast<double>(row[j]) * row[j];
+        }
+        const float scale = norm > 0.0 ? static_cast<float>(1.0 / std::sqrt(norm)) : 0.0f;
+        for (size_t j = 0; j < dimension; ++j) {
+            row[j] *= scale;
+        }
+    }
+    return vectors;
+}
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <nlohmann/json.hpp>
+#include "vector_search.h"
+#include "worker_pool.h"
+
+constexpr size_t MAX_COLLECTION_SHARDS = 64;
+
+// Fixed when a collection is created and persisted in its collection.json
+struct CollectionConfig {
+    size_t shards = 1;
+    IndexOptions indexOptions;   // memoryMap is not persisted; it follows the server's --index-mmap
+    faiss::MetricType metric = faiss::METRIC_L2;
+    float compactionRatio = 0.2f;
+};
+
+// Reads the recognised fields of a create request or collection.json over `config`, keeping absent ones
+bool parseCollectionConfig(const nlohmann::json& json, CollectionConfig& config, std::string& error);
+nlohmann::json collectionConfigToJson(const CollectionConfig& config);
+
+struct ShardStats {
+    size_t documents = 0;
+    size_t tombstones = 0;
+    int64_t loggedSequence = 0;
+    int64_t appliedSequence = 0;
+    IndexStats index;
+};
+
+// Settings every shard of every collection is opened with
+struct ShardRuntimeOptions {
+    StorageOptions storage;
+    bool memoryMap = false;
+    std::chrono::seconds snapshotInterval{30};
+    size_t snapshotThreshold = 1000;
+};
+
+// Named set of documents spread over `shards` independent VectorSearch instances by a stable hash of the
+// document ID. Each shard has its own SQLite database, ingest log, index file, indexer and snapshots, so
+// shards are rebuilt, saved and accounted for one at a time. All shards share one loaded model, and
+// queries are embedded once by the server's primary VectorSearch so they use its cache and batching.
+// Searches fan out to the shards on a worker pool and merge the per-shard top k.
+//
+// Writes to one document go to one shard and are as durable and ordered as on a plain VectorSearch. A
+// batch touching several shards commits one transaction per shard, so a failure can leave other shards'
+// part of it written. Write methods fill `sequences` (one entry per shard, 0 where nothing was written)
+// for waitForIndexed.
+class Collection {
+public:
+    Collection(std::string name, std::string directory, CollectionConfig config,
+               std::shared_ptr<InferenceEngine> engine, VectorSearch& queryEmbedder, WorkerPool& pool);
+    ~Collection();
+
+    Collection(const Collection&) = delete;
+    Collection& operator=(const Collection&) = delete;
+
+    // Opens or creates every shard, loading or building its index, and starts the shard indexers
+    bool open(const ShardRuntimeOptions& options);
+
+    const std::string& getName() const { return name_; }
+    const std::string& getDirectory() const { return directory_; }
+    const CollectionConfig& getConfig() const { return config_; }
+    size_t getShardCount() const { return shards_.size(); }
+    size_t shardFor(const std::string& documentId) const;
+
+    std::string addDocument(const std::string& text, const std::map<std::string, std::string>& metadata,
+                            const std::string& customId, std::vector<int64_t>* sequences,
+                            const std::vector<float>* embedding = nullptr);
+    bool addDocuments(const std::vector<std::string>& texts,
+                      const std::vector<std::map<std::string, std::string>>& metadataList,
+                      const std::vector<std::string>& customIds, std::vector<int64_t>* sequences,
+                      const EmbeddingMatrix* embeddings = nullptr, std::vector<std::string>* documentIds = nullptr);
+    bool upsertDocument(const std::string& id, const std::string& text, const std::map<std::string, std::string>& metadata,
+                        std::vector<int64_t>* sequences, const std::vector<float>* embedding = nullptr);
+    bool deleteDocument(const std::string& id, std::vector<int64_t>* sequences);
+    // Blocks until each shard has applied its sequence; false if any shard timed out
+    bool waitForIndexed(const std::vector<int64_t>& sequences, std::chrono::milliseconds timeout);
+
+    Document getDocument(const std::string& id);
+    size_t getDocumentCount();
+
+    std::vector<SearchResult> searchText(const std::string& query, int k = 10, float threshold = 0.0f, int efSearch = 200,
+                                         const MetadataFilter* filter = nullptr, const ResultFields& fields = {});
+    std::vector<SearchResult> searchEmbedding(const std::vector<float>& queryEmbedding, int k = 10, float threshold = 0.0f,
+                                              int efSearch = 200, const MetadataFilter* filter = nullptr,
+                                              const ResultFields& fields = {});
+    // Each shard picks efSearch from its own calibration table; the budget is shared, so its deadline
+    // covers the whole fan-out
+    std::vector<SearchResult> searchText(const std::string& query, int k, float threshold, SearchBudget& budget,
+                                         const MetadataFilter* filter = nullptr, const ResultFields& fields = {});
+    std::vector<SearchResult> searchEmbedding(const std::vector<float>& queryEmbedding, int k, float threshold,
+                                              SearchBudget& budget, const MetadataFilter* filter = nullptr,
+                                              const ResultFields& fields = {});
+    // BM25 statistics are per shard, so scores of different shards are only roughly comparable
+    std::vector<SearchResult> searchKeyword(const std::string& query, int k = 10, float threshold = 0.0f,
+                                            const ResultFields& fields = {});
+    std::vector<SearchResult> searchByMetadata(const std::string& key, const std::string& value, int k = 10);
+
+    // False when the shard's index could not be saved
+    bool rebuildShard(size_t shard);
+    bool saveShard(size_t shard);
+    bool calibrateShard(size_t shard, size_t queries, int k);
+    EfSearchCalibration getShardCalibration(size_t shard) const { return shards_[shard]->getEfSearchCalibration(); }
+    std::vector<ShardStats> getShardStats();
+
+    // The collection's files are deleted once the last reference to it is released
+    void markDropped() { dropped_ = true; }
+
+private:
+    std::string name_;
+    std::string directory_;
+    CollectionConfig config_;
+    std::shared_ptr<InferenceEngine> engine_;
+    VectorSearch& queryEmbedder_;
+    WorkerPool& pool_;
+    std::vector<std::unique_ptr<VectorSearch>> shards_;
+    std::atomic<bool> dropped_;
+
+    std::string shardPath(size_t shard, const char* extension) const;
+    // Runs `search` on every shard, the first on the calling thread, and keeps the k best results
+    std::vector<SearchResult> fanOut(const std::function<std::vector<SearchResult>(VectorSearch&)>& search, int k,
+                                     bool rankByScore);
+};
+
+// Owns the collections under one directory, one subdirectory per collection, and the worker pool they
+// share for shard fan-out. Lookups hand out shared pointers so a dropped collection stays usable by
+// requests already holding it.
+class CollectionManager {
+public:
+    CollectionManager(std::string directory, std::shared_ptr<InferenceEngine> engine, VectorSearch& queryEmbedder,
+                      ShardRuntimeOptions options, size_t searchThreads);
+
+    // Opens every collection found in the directory; ones that fail to open are logged and skipped
+    void load();
+
+    std::shared_ptr<Collection> get(const std::string& name) const;
+    std::vector<std::shared_ptr<Collection>> list() const;
+    // Null with `error` set if the name is invalid or taken or the shards cannot be created
+    std::shared_ptr<Collection> create(const std::string& name, const CollectionConfig& config, std::string& error);
+    bool drop(const std::string& name);
+
+    // Names become directory names, so only [A-Za-z0-9_-] up to 64 characters are accepted
+    static bool isValidName(const std::string& name);
+
+private:
+    std::string directory_;
+    std::shared_ptr<InferenceEngine> engine_;
+    VectorSearch& queryEmbedder_;
+    ShardRuntimeOptions options_;
+    WorkerPool pool_;  // Declared before the collections so it outlives their shards
+    mutable std::mutex mutex_;
+    std::map<std::string, std::shared_ptr<Collection>> collections_;
+};
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+// Non-owning view of one embedding, valid while the matrix it came from is alive and unchanged
+class EmbeddingView {
+public:
+    EmbeddingView(const float* data, size_t size) : data_(data), size_(size) {}
+
+    const float* data() const { return data_; }
+    size_t size() const { return size_; }
+    const float* begin() const { return data_; }
+    const float* end() const { return data_ + size_; }
+    float operator[](size_t i) const { return data_[i]; }
+
+    std::vector<float> toVector() const { return std::vector<float>(data_, data_ + size_); }
+
+private:
+    const float* data_;
+    size_t size_;
+};
+
+// Batch of embeddings in one row-major allocation: row i occupies [i * dimension, (i + 1) * dimension).
+// data() can be handed to FAISS or SQLite as is, so embeddings are never copied between stages.
+class EmbeddingMatrix {
+public:
+    EmbeddingMatrix() = default;
+    EmbeddingMatrix(size_t rows, size_t dimension) : rows_(rows), dimension_(dimension), values_(rows * dimension) {}
+
+    size_t rows() const { return rows_; }
+    size_t dimension() const { return dimension_; }
+    bool empty() const { return rows_ == 0; }
+
+    float* data() { return values_.data(); }
+    const float* data() const { return values_.data(); }
+    float* row(size_t i) { return values_.data() + i * dimension_; }
+    EmbeddingView operator[](size_t i) const { return EmbeddingView(values_.data() + i * dimension_, dimension_); }
+
+    // Hands over the flat buffer without copying; the matrix is left empty
+    std::vector<float> release() {
+        rows_ = 0;
+        dimension_ = 0;
+        return std::move(values_);
+    }
+
+private:
+    size_t rows_ = 0;
+    size_t dimension_ = 0;
+    std::vector<float> values_;
+};
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <deque>
+#include <array>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <future>
+#include <chrono>
+#include <atomic>
+#include "inference.h"
+
+// Power-of-two batch size buckets: 1, 2, 4, ..., 128, and everything larger
+constexpr size_t SCHEDULER_HISTOGRAM_BUCKETS = 9;
+
+struct EmbeddingSchedulerStats {
+    size_t queueDepth{0};
+    uint64_t requests{0};
+    uint64_t batches{0};
+    std::array<uint64_t, SCHEDULER_HISTOGRAM_BUCKETS> batchSizeHistogram{};
+};
+
+// Coalesces concurrent single-text embedding requests into one InferenceEngine::getEmbeddings call.
+// A batch is dispatched once it reaches maxBatch texts or the oldest queued text has waited maxWait.
+class EmbeddingScheduler {
+public:
+    EmbeddingScheduler(InferenceEngine& engine, std::chrono::microseconds maxWait, size_t maxBatch);
+    ~EmbeddingScheduler();
+
+    EmbeddingScheduler(const EmbeddingScheduler&) = delete;
+    EmbeddingScheduler& operator=(const EmbeddingScheduler&) = delete;
+
+    std::future<std::vector<float>> submit(const std::string& text);
+    std::vector<float> embed(const std::string& text) { return submit(text).get(); }
+
+    EmbeddingSchedulerStats getStats() const;
+    static size_t histogramBucket(size_t batchSize);
+    static size_t histogramBucketBound(size_t bucket);
+
+private:
+    struct Pending {
+        std::string text;
+        std::promise<std::vector<float>> promise;
+        std::chrono::steady_clock::time_point enqueuedAt;
+    };
+
+    InferenceEngine& engine_;
+    std::chrono::microseconds maxWait_;
+    size_t maxBatch_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<Pending> queue_;
+    bool stopping_;
+    std::thread worker_;
+
+    std::atomic<uint64_t> requests_;
+    std::atomic<uint64_t> batches_;
+    std::array<std::atomic<uint64_t>, SCHEDULER_HISTOGRAM_BUCKETS> histogram_;
+
+    void run();
+};
@@ -5,24 +5,89 @@
 #include <string>
 #include <memory>
 #include <tuple>
+#include <mutex>
+#include <atomic>
+#include <functional>
 #include "tokenizers_cpp.h"
+#include "embedding_matrix.h"
 
 constexpr size_t DEFAULT_EMBEDDING_DIMENSION = 768;
+constexpr size_t EMBEDDING_BUCKET_SIZE = 32;  // Sequences per ONNX run when embedding large inputs
 
+enum class ExecutionProvider { Cpu, Cuda, TensorRT, CoreML };
+
+const char* executionProviderName(ExecutionProvider provider);
+bool parseExecutionProvider(const std::string& name, ExecutionProvider& provider);
+
+struct InferenceOptions {
+    int intraOpThreads = 0;      // Threads per operator; 0 lets ONNX Runtime use one per physical core
+    int interOpThreads = 0;      // > 1 runs independent graph branches in parallel on this many threads
+    bool allowSpinning = true;   // Idle ORT threads busy-wait: lower latency, but they burn CPU between runs
+    ExecutionProvider provider = ExecutionProvider::Cpu;  // Falls back to CPU if the build lacks it
+    int deviceId = 0;            // GPU ordinal for CUDA and TensorRT
+    bool ioBinding = true;       // Bind the hidden-state output to a reused per-thread buffer
+    bool warmup = true;          // Run representative shapes once at load so first queries skip the setup cost
+};
+
+// Cosine similarity between the embeddings two models produce for the same texts
+struct EmbeddingDrift {
+    size_t probes = 0;
+    double meanCosine = 0.0;
+    double p50Cosine = 0.0;
+    double p5Cosine = 0.0;   // 95% of probes agree at least this well
+    double minCosine = 0.0;
+};
+
+struct InferenceStats {
+    uint64_t runs{0};
+    uint64_t sequences{0};
+    uint64_t tokens{0};        // Real (unpadded) tokens fed to the model
+    uint64_t paddedTokens{0};  // B * S actually allocated per run
+    
+    double paddingEfficiency() const {
+        return paddedTokens ? static_cast<double>(tokens) / static_cast<double>(paddedTokens) : 1.0;
+    }
+};
+
+// getEmbeddings may be called from many threads at once. Ort::Session::Run is safe to call
+// concurrently on a shared session; the tokenizer binding is not, so encoding is serialized.
 class InferenceEngine {
 public:
     InferenceEngine();
     ~InferenceEngine();
     
-    bool loadModel(const std::string& modelPath, const std::string& tokenizerPath, bool useCuda = false);
+    bool loadModel(const std::string& modelPath, const std::string& tokenizerPath, const InferenceOptions& options = {});
     void unloadModel();
     bool isLoaded() const;
     
     std::vector<float> getEmbedding(const std::string& text, int64_t maxLen = 256);
-    std::vector<std::vector<float>> getEmbeddings(const std::vector<std::string>& texts, int64_t maxLen = 256);
-    std::vector<float> cosineSimMatrix(const std::vector<std::vector<float>>& embeddings);
+    // Row i is the embedding of texts[i]
+    EmbeddingMatrix getEmbeddings(const std::vector<std::string>& texts, int64_t maxLen = 256);
+    
+    // Streams texts through the model chunk by chunk: `next` fills the following chunk (returning false
+    // when exhausted) and `sink` receives each chunk's embeddings in order. The next chunk is tokenized
+    // while the current one runs, and only one chunk of embeddings is alive at a time.
+    using TextChunkSource = std::function<bool(std::vector<std::string>&)>;
+    using EmbeddingChunkSink = std::function<void(EmbeddingMatrix&)>;
+    void embedStream(const TextChunkSource& next, const EmbeddingChunkSink& sink, int64_t maxLen = 256);
+    
+    std::vector<float> cosineSimMatrix(const EmbeddingMatrix& embeddings);
     
+    // Matryoshka-trained models (EmbeddingGemma) keep most of their quality when embeddings are cut to
+    // a prefix: a nonzero dimension truncates pooled outputs to it before normalization. Call before loadModel().
+    void setOutputDimension(size_t dimension) { outputDim_ = dimension; }
     size_t getEmbeddingDimension() const { return embeddingDim_; }
+    size_t getModelDimension() const { return modelDim_; }
+    InferenceStats getStats() const;
+    // Provider the session actually runs on, after any fallback to CPU
+    ExecutionProvider getActiveProvider() const { return activeProvider_; }
+    // "fp32", "fp16" or "int8": the exporter's "precision" metadata entry if present, else the output type
+    const std::string& getPrecision() const { return precision_; }
+    // Identifies the model + tokenizer pair so persisted embeddings can be reused safely
+    const std::string& getModelFingerprint() const { return modelFingerprint_; }
+    
+    // bench/ times tokenization and pooling on their own
+    friend struct InferenceEngineBench;
     
 private:
     struct Batch {
@@ -35,6 +100,7 @@ private:
     std::unique_ptr<Ort::Session> session_;
     std::unique_ptr<Ort::Env> env_;
     std::unique_ptr<tokenizers::Tokenizer> tokenizer_;
+    std::mutex tokenizerMutex_;
     Ort::MemoryInfo memoryInfo_;
     
     std::vector<std::string> inputNames_;
@@ -42,17 +108,41 @@ private:
     std::vector<const char*> inputNamesCStr_;
     std::vector<const char*> outputNamesCStr_;
     
-    size_t embeddingDim_;
+    size_t embeddingDim_;  // Dimension of returned embeddings
+    size_t modelDim_;      // Hidden size the model emits
+    size_t outputDim_;     // Requested truncation; 0 keeps the full hidden size
+    InferenceOptions options_;
+    ExecutionProvider activeProvider_;
+    bool bindOutputs_;     // IOBinding is used only when the output shape is [B, S, modelDim_]
+    bool halfOutputs_;     // Hidden states come back as float16 (fp16 exports without fp32 I/O)
+    std::string precision_;
+    std::string modelFingerprint_;
     bool loaded_;
     
-    void initializeSession(const std::string& modelPath, bool useCuda);
+    std::atomic<uint64_t> runCount_;
+    std::atomic<uint64_t> sequenceCount_;
+    std::atomic<uint64_t> tokenCount_;
+    std::atomic<uint64_t> paddedTokenCount_;
+    
+    void initializeSession(const std::string& modelPath);
+    void appendExecutionProvider(Ort::SessionOptions& sessionOptions);
+    void warmup();
     void loadTokenizer(const std::string& tokenizerPath);
     void extractModelInfo();
+    std::string computeModelFingerprint(const std::string& modelPath, const std::string& tokenizerPath);
     
     Batch tokenizeBatch(const std::vector<std::string>& texts, int64_t maxLen);
+    std::vector<std::vector<int32_t>> encodeTexts(const std::vector<std::string>& texts, int64_t maxLen);
+    Batch buildBatch(const std::vector<std::vector<int32_t>>& encoded, const size_t* order, size_t count);
+    // Writes each sequence's pooled embedding to outputs[b], which must hold embeddingDim_ floats
+    void runBatch(const Batch& batch, float* const* outputs);
+    EmbeddingMatrix embedEncoded(const std::vector<std::vector<int32_t>>& encoded);
     std::vector<Ort::Value> createInputTensors(const Batch& batch);
-    std::vector<float> meanPoolL2Norm(const float* lastHidden, const int64_t* mask, 
-                                     int64_t B, int64_t S, int64_t H);
+    void meanPoolL2Norm(const float* lastHidden, const int64_t* mask,
+                        int64_t B, int64_t S, int64_t H, float* const* outputs);
+    // Same as above for float16 hidden states; rows are widened to float as they are summed
+    void meanPoolL2Norm(const Ort::Float16_t* lastHidden, const int64_t* mask,
+                        int64_t B, int64_t S, int64_t H, float* const* outputs);
     
     std::vector<uint8_t> readFileBytes(const std::string& path);
     
@@ -60,3 +150,8 @@ private:
     std::wstring toWideString(const std::string& s);
 #endif
 };
+
+// Embeds each probe with both engines and compares the results. Both must produce the same dimension;
+// used to check that a quantized export still agrees with the model an index was built from.
+EmbeddingDrift measureEmbeddingDrift(InferenceEngine& reference, InferenceEngine& candidate,
+                                     const std::vector<std::string>& probes);
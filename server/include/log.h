@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <sstream>
+#include <string>
+
+enum class LogLevel { Error, Warning, Info, Debug };
+
+// Lines one log statement may write per second; the rest are counted and dropped
+constexpr uint32_t LOG_LINES_PER_SECOND = 10;
+
+void setLogLevel(LogLevel level);
+bool logEnabled(LogLevel level);
+// Writes "[level] message" as one line: errors and warnings to stderr, the rest to stdout
+void writeLog(LogLevel level, const std::string& message);
+
+// Per-statement budget of LOG_LINES_PER_SECOND, kept in atomics so a hot path logging on every call
+// costs a clock read and two relaxed adds once its budget is spent
+class LogRateLimiter {
+public:
+    // True if the line may be written; `suppressed` then holds the lines dropped since the last one written
+    bool allow(uint64_t& suppressed);
+
+private:
+    std::atomic<int64_t> second_{-1};
+    std::atomic<uint32_t> written_{0};
+    std::atomic<uint64_t> dropped_{0};
+};
+
+// LOG_INFO("Rebuilt index with " << count << " vectors"): the stream expression is only evaluated
+// when the level is enabled and the statement's rate limit allows a line
+#define FASTFINDR_LOG(level, expression)                                                        \
+    do {                                                                                        \
+        if (logEnabled(level)) {                                                                \
+            static LogRateLimiter logLimiter_;                                                  \
+            uint64_t logSuppressed_ = 0;                                                        \
+            if (logLimiter_.allow(logSuppressed_)) {                                            \
+                std::ostringstream logLine_;                                                    \
+                logLine_ << expression;                                                         \
+                if (logSuppressed_ > 0) {                                                       \
+                    logLine_ << " (" << logSuppressed_ << " similar lines suppressed)";         \
+                }                                                                               \
+                writeLog(level, logLine_.str());                                                \
+            }                                                                                   \
+        }                                                                                       \
+    } while (false)
+
+#define LOG_ERROR(expression) FASTFINDR_LOG(LogLevel::Error, expression)
+#define LOG_WARN(expression) FASTFINDR_LOG(LogLevel::Warning, expression)
+#define LOG_INFO(expression) FASTFINDR_LOG(LogLevel::Info, expression)
+#define LOG_DEBUG(expression) FASTFINDR_LOG(LogLevel::Debug, expression)
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <string>
+#include <list>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <functional>
+#include <algorithm>
+#include <cstdint>
+
+struct CacheStats {
+    uint64_t hits{0};
+    uint64_t misses{0};
+    uint64_t evictions{0};
+    size_t entries{0};
+    size_t bytes{0};          // Approximate: keys, values and per-entry bookkeeping
+    size_t capacityBytes{0};
+
+    double hitRate() const {
+        uint64_t lookups = hits + misses;
+        return lookups ? static_cast<double>(hits) / static_cast<double>(lookups) : 0.0;
+    }
+};
+
+// Size-bounded LRU map from string keys to values, split into independently locked shards so
+// concurrent lookups rarely contend. Each shard evicts its least recently used entries once it holds
+// more than capacityBytes / shards; callers report each value's size when inserting it.
+template <typename Value>
+class ShardedLruCache {
+public:
+    explicit ShardedLruCache(size_t capacityBytes, size_t shardCount = 16)
+        : capacityBytes_(capacityBytes), shards_(std::max<size_t>(1, shardCount)) {
+        for (auto& shard : shards_) {
+            shard = std::make_unique<Shard>();
+        }
+    }
+
+    ShardedLruCache(const ShardedLruCache&) = delete;
+    ShardedLruCache& operator=(const ShardedLruCache&) = delete;
+
+    // Copies the cached value out and marks it most recently used
+    bool get(const std::string& key, Value& value) {
+        Shard& shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.lookup.find(key);
+        if (it == shard.lookup.end()) {
+            ++shard.misses;
+            return false;
+        }
+
+        shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+        value = it->second->value;
+        ++shard.hits;
+        return true;
+    }
+
+    void put(const std::string& key, Value value, size_t valueBytes) {
+        const size_t shardCapacity = capacityBytes_ / shards_.size();
+        const size_t bytes = entryBytes(key, valueBytes);
+        if (bytes > shardCapacity) {
+            return;  // Would evict the whole shard and still not fit
+        }
+
+        Shard& shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.lookup.find(key);
+        if (it != shard.lookup.end()) {
+            shard.bytes -= it->second->bytes;
+            shard.entries.erase(it->second);
+            shard.lookup.erase(it);
+        }
+
+        shard.entries.push_front(Entry{key, std::move(value), bytes});
+        shard.lookup.emplace(key, shard.entries.begin());
+        shard.bytes += bytes;
+
+        while (shard.bytes > shardCapacity) {
+            const Entry& oldest = shard.entries.back();
+            shard.bytes -= oldest.bytes;
+            shard.lookup.erase(oldest.key);
+            shard.entries.pop_back();
+            ++shard.evictions;
+        }
+    }
+
+    void clear() {
+        for (auto& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            shard->lookup.clear();
+            shard->entries.clear();
+            shard->bytes = 0;
+        }
+    }
+
+    CacheStats getStats() const {
+        CacheStats stats;
+        stats.capacityBytes = capacityBytes_;
+        for (const auto& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            stats.hits += shard->hits;
+            stats.misses += shard->misses;
+            stats.evictions += shard->evictions;
+            stats.entries += shard->entries.size();
+            stats.bytes += shard->bytes;
+        }
+        return stats;
+    }
+
+private:
+    // Rough cost per entry of the list node, the hash node and the two key string headers
+    static constexpr size_t ENTRY_OVERHEAD = 96;
+
+    struct Entry {
+        std::string key;
+        Value value;
+        size_t bytes;
+    };
+
+    struct Shard {
+        mutable std::mutex mutex;
+        std::list<Entry> entries;  // Most recently used first
+        std::unordered_map<std::string, typename std::list<Entry>::iterator> lookup;
+        size_t bytes{0};
+        uint64_t hits{0};
+        uint64_t misses{0};
+        uint64_t evictions{0};
+    };
+
+    size_t capacityBytes_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+
+    static size_t entryBytes(const std::string& key, size_t valueBytes) {
+        return 2 * key.size() + valueBytes + ENTRY_OVERHEAD;
+    }
+
+    Shard& shardFor(const std::string& key) {
+        return *shards_[std::hash<std::string>{}(key) % shards_.size()];
+    }
+};
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Monotonic count, bumped with one relaxed atomic add
+class Counter {
+public:
+    void increment(uint64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value_{0};
+};
+
+// Latency distribution over fixed buckets from 25 us to 10 s. observe() is two relaxed atomic adds, so a
+// concurrent scrape may see a bucket count one observation ahead of the sum.
+class LatencyHistogram {
+public:
+    static constexpr size_t BUCKETS = 18;
+    // Upper bounds in seconds; a final +Inf bucket follows them
+    static const std::array<double, BUCKETS>& bounds();
+
+    void observe(std::chrono::nanoseconds elapsed);
+
+    uint64_t bucketCount(size_t bucket) const { return counts_[bucket].load(std::memory_order_relaxed); }
+    double sumSeconds() const { return static_cast<double>(sumNanos_.load(std::memory_order_relaxed)) * 1e-9; }
+
+private:
+    std::array<std::atomic<uint64_t>, BUCKETS + 1> counts_{};
+    std::atomic<uint64_t> sumNanos_{0};
+};
+
+// Observes the time from construction to destruction
+class ScopedTimer {
+public:
+    explicit ScopedTimer(LatencyHistogram& histogram)
+        : histogram_(histogram), start_(std::chrono::steady_clock::now()) {}
+    ~ScopedTimer() { histogram_.observe(std::chrono::steady_clock::now() - start_); }
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+    LatencyHistogram& histogram_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+using MetricLabels = std::vector<std::pair<std::string, std::string>>;
+
+// Process-wide metrics rendered at GET /metrics in the Prometheus text format. Registering takes a lock
+// and belongs at startup or first use; the returned references live as long as the process, so hot paths
+// keep them and update without locking. Registering a name and label set again returns the same metric.
+// Gauges are read through their callback at scrape time, so they cost nothing between scrapes; the
+// callbacks run under the registry lock and must not register metrics themselves.
+class MetricsRegistry {
+public:
+    Counter& counter(const std::string& name, const std::string& help, const MetricLabels& labels = {});
+    LatencyHistogram& histogram(const std::string& name, const std::string& help, const MetricLabels& labels = {});
+    // Replaces the callback if the gauge already exists
+    void gauge(const std::string& name, const std::string& help, std::function<double()> read,
+               const MetricLabels& labels = {});
+    // A counter kept elsewhere, e.g. in InferenceStats, read through `read` when scraped
+    void counterFrom(const std::string& name, const std::string& help, std::function<double()> read,
+                     const MetricLabels& labels = {});
+
+    std::string render() const;
+
+private:
+    struct Series {
+        std::unique_ptr<Counter> counter;
+        std::unique_ptr<LatencyHistogram> histogram;
+        std::function<double()> read;  // Gauges and counterFrom
+    };
+    struct Family {
+        std::string type;
+        std::string help;
+        std::map<std::string, Series> series;  // Keyed by the rendered label set, e.g. {stage="parse"}
+    };
+
+    mutable std::mutex mutex_;
+    std::map<std::string, Family> families_;
+
+    Series& series(const std::string& name, const char* type, const std::string& help, const MetricLabels& labels);
+};
+
+MetricsRegistry& metrics();
+
+// Stages of serving a search, each timed into fastfindr_stage_duration_seconds{stage=...}. Tokenize,
+// infer and pool also cover document embedding on the indexer.
+enum class Stage {
+    Parse,      // Request JSON to values
+    Tokenize,
+    Infer,      // ONNX Runtime Run
+    Pool,       // Mean pooling and normalization
+    Vector,     // Index search, including re-ranking
+    Keyword,    // FTS5 BM25 query
+    Hydrate,    // SQLite reads of the hit documents
+    Serialize,  // Results to the response body
+    Compress    // gzip or zstd of the response body
+};
+
+LatencyHistogram& stageHistogram(Stage stage);
+
+// Resident set size of this process, or 0 where the platform does not report it
+size_t residentMemoryBytes();
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include "vector_search.h"
+
+// Responses smaller than this are sent uncompressed; headers and codec setup would outweigh the savings
+constexpr size_t MIN_COMPRESSED_BYTES = 1024;
+
+// Search response bodies, negotiated from the Accept header
+enum class ResponseFormat { Json, MessagePack, Cbor };
+
+// Response compression, negotiated from the Accept-Encoding header
+enum class ContentEncoding { Identity, Gzip, Zstd };
+
+// Highest-quality format the Accept header lists; JSON when it names none of them or is absent
+ResponseFormat negotiateFormat(const std::string& accept);
+const char* formatContentType(ResponseFormat format);
+
+// Highest-quality encoding Accept-Encoding allows among those this build supports; zstd wins ties
+ContentEncoding negotiateEncoding(const std::string& acceptEncoding);
+const char* contentEncodingName(ContentEncoding encoding);
+// Compresses `body` in place; false, leaving it untouched, for Identity or when the codec fails
+bool compressBody(std::string& body, ContentEncoding encoding);
+
+// Writes a response straight into its body in any ResponseFormat, without building a JSON document
+// first. Sizes are given up front because MessagePack and CBOR containers are length-prefixed; every
+// begin needs its matching end, which only JSON writes anything for.
+class ResponseWriter {
+public:
+    explicit ResponseWriter(ResponseFormat format, const ResultFields& fields = {});
+
+    void beginObject(size_t members);
+    void endObject();
+    void beginArray(size_t elements);
+    void endArray();
+    void key(const std::string& name);
+    void string(const std::string& value);
+    // An array of result objects holding the projected fields only
+    void results(const std::vector<SearchResult>& results);
+    // For small values that already are a DOM, such as hybrid search timings
+    void value(const nlohmann::json& value);
+
+    ResponseFormat format() const { return format_; }
+    std::string take() { return std::move(body_); }
+
+private:
+    ResponseFormat format_;
+    ResultFields fields_;
+    std::string body_;
+    // One entry per open JSON container: true until its first element is written
+    std::vector<bool> first_;
+    bool afterKey_ = false;
+
+    void separate();
+    void score(float value);
+    void header(uint8_t major, uint64_t length);  // CBOR initial byte and length
+    void bigEndian(uint64_t value, size_t bytes);
+};
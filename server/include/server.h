@@ -4,8 +4,11 @@
 #include <memory>
 #include <httplib.h>
 #include <onnxruntime_cxx_api.h>
+#include "log.h"
 
 class VectorSearch;
+class Collection;
+class CollectionManager;
 
 struct ServerConfig {
     std::string host = "localhost";
@@ -15,12 +18,50 @@ struct ServerConfig {
     std::string database_path = "database.db";
     std::string index_path = "vectors.index";
     bool create_new_db = false;
+    float compaction_ratio = 0.2f;
+    int intra_op_threads = 0;     // ONNX Runtime threads per operator; 0 uses one per physical core
+    int inter_op_threads = 0;     // > 1 runs independent graph branches in parallel
+    bool ort_spinning = true;
+    std::string execution_provider = "cpu";  // cpu, cuda, tensorrt or coreml
+    int device_id = 0;
+    bool io_binding = true;
+    bool warmup = true;
+    int embedding_dim = 0;        // Truncate embeddings to this many dimensions; 0 keeps the model's size
+    std::string index_type = "hnsw_flat";  // hnsw_flat, hnsw_sq8, hnsw_pq or ivf_pq
+    int pq_m = 0;                 // PQ code bytes per vector; 0 picks about dimension / 16
+    int ivf_lists = 0;            // 0 uses 4 * sqrt(documents)
+    int ivf_probes = 16;
+    int train_samples = 32768;
+    int rerank_factor = 0;        // Re-score k * factor candidates on stored full-precision vectors
+    bool index_mmap = false;      // Serve the index from mapped file pages shared with other processes
+    std::string metric = "l2";   // "l2", or "ip" for inner product (cosine similarity on normalized embeddings)
+    int threads = 0;  // HTTP worker threads; 0 uses the number of hardware threads
+    std::string collections_dir = "collections";  // One subdirectory of shard files per collection
+    int search_threads = 0;      // Workers searching collection shards in parallel; 0 uses hardware threads
+    double batch_wait_ms = 2.0;  // Max time a query waits for others to share its embedding batch
+    int batch_max_size = 32;     // Max queries embedded together; 0 disables query batching
+    int query_cache_mb = 64;     // Query text -> embedding LRU cache; 0 disables it
+    int result_cache_mb = 0;     // Ranked vector hits per query, dropped on any index change; 0 disables it
+    int snapshot_interval_s = 30;     // Max seconds an applied write waits before the index is snapshotted
+    int snapshot_threshold = 1000;    // Applied writes that trigger a snapshot before the interval is up
+    std::string sqlite_journal_mode = "WAL";
+    std::string sqlite_synchronous = "NORMAL";
+    int sqlite_mmap_mb = 256;    // 0 disables memory-mapped reads
+    int sqlite_cache_mb = 64;    // Page cache per connection
     OrtLoggingLevel logging_level = ORT_LOGGING_LEVEL_INFO;
+    LogLevel log_level = LogLevel::Info;  // Set together with logging_level by --level
+    std::string validate_model_path;    // Compare this model against --model and exit instead of serving
+    std::string validate_probes_path;   // One probe text per line; empty samples documents from the database
+    int validate_samples = 256;         // Documents sampled when no probe file is given
+    double validate_min_cosine = 0.98;  // Validation fails if the 5th-percentile cosine is below this
+    int calibrate_queries = 0;          // Calibrate efSearch on this many sampled vectors per index and exit
+    int calibrate_k = 10;
 };
 
 class SearchServer {
 private:
     std::unique_ptr<VectorSearch> vectorSearch_;
+    std::unique_ptr<CollectionManager> collections_;  // After vectorSearch_, which embeds their queries
     ServerConfig config_;
     httplib::Server server_;
 
@@ -29,23 +70,49 @@ public:
     
     bool initialize();
     void setupRoutes();
+    // Publishes index, ingest, cache and process gauges for GET /metrics
+    void registerMetrics();
+    // Calibrates efSearch on the default index and every collection shard; returns the process exit code
+    int calibrateIndexes();
     void run();
     void stop();
 
 private:
+    enum class IndexAction { Rebuild, Save, Calibrate };
+    
     void handleSearch(const httplib::Request& req, httplib::Response& res);
+    void handleSearchBatch(const httplib::Request& req, httplib::Response& res);
     void handleInsert(const httplib::Request& req, httplib::Response& res);
     void handleUpsert(const httplib::Request& req, httplib::Response& res);
     void handleGetById(const httplib::Request& req, httplib::Response& res);
     void handleGetByMetadata(const httplib::Request& req, httplib::Response& res);
     void handleDelete(const httplib::Request& req, httplib::Response& res);
     void handleBatchInsert(const httplib::Request& req, httplib::Response& res);
+    void handleStreamInsert(const httplib::Request& req, httplib::Response& res, const httplib::ContentReader& contentReader);
     void handleTextSearch(const httplib::Request& req, httplib::Response& res);
     void handleCount(const httplib::Request& req, httplib::Response& res);
     void handleBatchUpsert(const httplib::Request& req, httplib::Response& res);
     void handleDeleteByIds(const httplib::Request& req, httplib::Response& res);
     void handleGetByIds(const httplib::Request& req, httplib::Response& res);
+    void handleIndexStats(const httplib::Request& req, httplib::Response& res);
+    void handleIndexCalibrate(const httplib::Request& req, httplib::Response& res);
     void handleCountByMetadata(const httplib::Request& req, httplib::Response& res);
+    void handleCreateCollection(const httplib::Request& req, httplib::Response& res);
+    void handleGetCollection(const httplib::Request& req, httplib::Response& res);
+    void handleCollectionInsert(const httplib::Request& req, httplib::Response& res);
+    void handleCollectionBatchInsert(const httplib::Request& req, httplib::Response& res);
+    void handleCollectionUpsert(const httplib::Request& req, httplib::Response& res);
+    void handleCollectionGetById(const httplib::Request& req, httplib::Response& res);
+    void handleCollectionDelete(const httplib::Request& req, httplib::Response& res);
+    void handleCollectionSearch(const httplib::Request& req, httplib::Response& res);
+    void handleCollectionIndex(const httplib::Request& req, httplib::Response& res, IndexAction action);
+
+    // The collection named by the first path match, or null after answering 404
+    std::shared_ptr<Collection> findCollection(const httplib::Request& req, httplib::Response& res);
 };
 
-ServerConfig parseServerOptions(int argc, char** argv);
\ No newline at end of file
+ServerConfig parseServerOptions(int argc, char** argv);
+
+// Embeds the probe set with config.model_path and config.validate_model_path and reports how far they
+// drift apart. Returns the process exit code: 0 when the candidate is close enough to swap in.
+int runModelValidation(const ServerConfig& config);
\ No newline at end of file
@@ -4,8 +4,39 @@
 #include <vector>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
 #include <sqlite3.h>
 
+// Connection tuning applied when the database is opened (see https://sqlite.org/pragma.html).
+// With WAL, synchronous=NORMAL never corrupts the database; a power loss can only roll back the
+// most recent commits, while an application crash loses nothing.
+struct StorageOptions {
+    std::string journalMode = "WAL";          // WAL lets readers run alongside the writer
+    std::string synchronous = "NORMAL";
+    int64_t mmapSizeBytes = 256LL << 20;      // 0 disables memory-mapped I/O
+    int64_t cacheSizeKb = 64 * 1024;          // Page cache per connection
+    bool tempStoreMemory = true;              // Temporary tables and sort spills stay in memory
+};
+
+// Ingest log operations; upserts cover inserts and updates alike
+enum class LogOp { Upsert = 0, Delete = 1 };
+
+struct LogEntry {
+    int64_t sequence{0};
+    LogOp op{LogOp::Upsert};
+    std::string documentId;
+    bool documentExists{false};  // False once this or a later write deleted the document
+    std::string text;            // Current text of the document when it exists
+    std::vector<float> embedding;  // Precomputed vector sent with this write; empty if the text is to be embedded
+};
+
+// Columns getDocumentsByIds reads besides the id; what is left out comes back empty
+struct DocumentFields {
+    bool text = true;
+    bool metadata = true;
+};
+
 struct Document {
     std::string id;
     std::string text;
@@ -17,30 +48,70 @@ struct Document {
         : id(doc_id), text(doc_text), metadata(doc_metadata) {}
 };
 
+// Writes go through a single connection guarded by writerMutex_; callers that span several writes
+// in a transaction (VectorSearch) serialize themselves. Reads lease a pooled read-only connection so
+// concurrent searches never share a sqlite3 handle.
 class Storage {
 public:
     explicit Storage(const std::string& dbPath);
     ~Storage();
     
+    // Takes effect on the next initialize()
+    void setOptions(const StorageOptions& options) { options_ = options; }
     bool initialize();
     void close();
     bool isOpen() const { return db_ != nullptr; }
     
+    // "doc_" and 12 random alphanumerics, then the wall-clock time in milliseconds
+    static std::string generateRandomId();
+    
     std::string addDocument(const std::string& text, const std::map<std::string, std::string>& metadata = {}, const std::string& customId = "");
     bool updateDocument(const std::string& id, const std::string& text, const std::map<std::string, std::string>& metadata = {});
     bool upsertDocument(const std::string& id, const std::string& text, const std::map<std::string, std::string>& metadata = {});
     bool deleteDocument(const std::string& id);
     
     Document getDocument(const std::string& id);
+    // One row per requested id, in request order; ids with no document come back with an empty id
+    std::vector<Document> getDocumentsByIds(const std::vector<std::string>& ids, const DocumentFields& fields = {});
     std::vector<Document> getAllDocuments();
-    std::vector<Document> searchDocuments(const std::string& textQuery);
+    // Texts of up to `limit` documents picked uniformly at random
+    std::vector<std::string> sampleDocumentTexts(size_t limit);
+    // BM25-ranked keyword search over the FTS5 index; every query term must match. Scores are
+    // negated bm25() values, so higher is better.
+    size_t searchFullText(const std::string& textQuery, size_t limit,
+                          std::vector<std::string>& documentIds, std::vector<float>& scores);
     std::vector<Document> getDocumentsByMetadata(const std::string& key, const std::string& value);
+    std::vector<std::string> getDocumentIdsByMetadata(const std::string& key, const std::string& value);
     
     bool addMetadata(const std::string& documentId, const std::string& key, const std::string& value);
     bool updateMetadata(const std::string& documentId, const std::string& key, const std::string& value);
     bool deleteMetadata(const std::string& documentId, const std::string& key);
     std::map<std::string, std::string> getMetadata(const std::string& documentId);
     
+    // Embeddings are tagged with the model fingerprint and dimension that produced them
+    bool putEmbedding(const std::string& documentId, const std::string& model, const float* vector, size_t dimension);
+    // Drops the stored vector so the document is embedded from its text again
+    bool deleteEmbedding(const std::string& documentId);
+    // Paged by document id: pass the last id of the previous page (empty for the first page)
+    size_t getEmbeddings(const std::string& model, size_t dimension, const std::string& afterId, size_t limit,
+                         std::vector<std::string>& documentIds, std::vector<float>& vectors);
+    // Uniform random sample, e.g. for training quantizers; only rowids are shuffled, not vectors
+    size_t sampleEmbeddings(const std::string& model, size_t dimension, size_t limit,
+                            std::vector<std::string>& documentIds, std::vector<float>& vectors);
+    // Vectors for the given ids that have one from this model; found ids come back in no particular order
+    size_t getEmbeddingsByIds(const std::string& model, size_t dimension, const std::vector<std::string>& ids,
+                              std::vector<std::string>& documentIds, std::vector<float>& vectors);
+    std::vector<Document> getDocumentsWithoutEmbedding(const std::string& model, size_t dimension,
+                                                       const std::string& afterId, size_t limit);
+    
+    // Ingest log: document writes append an entry in the same transaction, and the vector index
+    // applies entries in sequence order. Sequences are never reused, even after truncation.
+    // A precomputed embedding travels with its entry, so replay indexes exactly the vector that was written
+    int64_t appendLog(LogOp op, const std::string& documentId, const float* embedding = nullptr, size_t dimension = 0);
+    std::vector<LogEntry> getLogEntries(int64_t afterSequence, size_t limit);
+    int64_t getLatestLogSequence();
+    bool truncateLog(int64_t throughSequence);
+    
     size_t getDocumentCount();
     std::vector<std::string> getAllDocumentIds();
     bool documentExists(const std::string& id);
@@ -50,18 +121,61 @@ public:
     bool rollbackTransaction();
 
 private:
+    class ReaderLease {
+    public:
+        ReaderLease(Storage* owner, sqlite3* db, std::unique_lock<std::recursive_mutex> writerLock)
+            : owner_(owner), db_(db), writerLock_(std::move(writerLock)) {}
+        ReaderLease(ReaderLease&& other) noexcept
+            : owner_(other.owner_), db_(other.db_), writerLock_(std::move(other.writerLock_)) {
+            other.db_ = nullptr;
+        }
+        ReaderLease(const ReaderLease&) = delete;
+        ReaderLease& operator=(const ReaderLease&) = delete;
+        ~ReaderLease() {
+            if (db_ && !writerLock_.owns_lock()) {
+                owner_->releaseReader(db_);
+            }
+        }
+        
+        sqlite3* get() const { return db_; }
+        
+    private:
+        Storage* owner_;
+        sqlite3* db_;
+        std::unique_lock<std::recursive_mutex> writerLock_;  // Held when falling back to the writer connection
+    };
+    
     sqlite3* db_;
     std::string dbPath_;
+    StorageOptions options_;
     bool inTransaction_;
     
+    std::recursive_mutex writerMutex_;
+    std::mutex readerPoolMutex_;
+    std::vector<sqlite3*> idleReaders_;
+    bool poolReaders_;
+    
+    // Prepared statements are cached per connection. A connection is only ever used by one thread at a
+    // time (writer under writerMutex_, readers while leased), so only the outer map needs the mutex.
+    std::mutex statementCacheMutex_;
+    std::unordered_map<sqlite3*, std::unordered_map<std::string, sqlite3_stmt*>> statementCache_;
+    
     bool createTables();
     bool executeSQL(const std::string& sql);
     sqlite3_stmt* prepareStatement(const std::string& sql);
+    sqlite3_stmt* prepareStatement(sqlite3* db, const std::string& sql);
     void finalizeStatement(sqlite3_stmt* stmt);
-    std::string generateRandomId();
+    void closeConnection(sqlite3* db);
+    void applyConnectionOptions(sqlite3* db, bool writer);
+    
+    ReaderLease acquireReader();
+    void releaseReader(sqlite3* db);
+    sqlite3* openReader();
+    bool documentExists(sqlite3* db, const std::string& id);
     
     Document buildDocumentFromRow(sqlite3_stmt* stmt);
-    void loadDocumentMetadata(Document& doc);
+    std::map<std::string, std::string> getMetadata(sqlite3* db, const std::string& documentId);
+    void loadDocumentMetadata(sqlite3* db, Document& doc);
     
     static int countCallback(void* data, int argc, char** argv, char** azColName);
     static int documentCallback(void* data, int argc, char** argv, char** azColName);
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Float vector kernels used on the embedding hot path. The implementation is picked once at startup
+// from what the CPU supports (AVX-512, AVX2+FMA, NEON, or a portable fallback), so one binary runs
+// everywhere and still uses the widest registers available.
+namespace vector_kernels {
+
+// dst[i] += src[i]
+void add(float* dst, const float* src, size_t n);
+// dst[i] += src[i], with src in IEEE half precision (raw bits)
+void addHalf(float* dst, const uint16_t* src, size_t n);
+// x[i] *= factor
+void scale(float* x, float factor, size_t n);
+float dot(const float* a, const float* b, size_t n);
+// Scales x to unit length; an all-zero vector is left as is
+void l2Normalize(float* x, size_t n);
+
+// Name of the selected implementation: "avx512", "avx2", "neon" or "scalar"
+const char* implementationName();
+
+}
@@ -3,10 +3,103 @@
 #include <vector>
 #include <string>
 #include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <limits>
 #include <faiss/IndexHNSW.h>
+#include <faiss/IndexIDMap.h>
 #include "inference.h"
+#include "embedding_scheduler.h"
+#include "lru_cache.h"
 #include "storage.h"
 
+constexpr size_t INGEST_CHUNK_SIZE = 256;  // Documents per embedding chunk on bulk ingest and rebuild
+
+// Filtered searches score matching vectors exactly instead of traversing HNSW when at most this many
+// documents match, or when they are under 1/FILTER_BRUTE_FORCE_DIVISOR of the index
+constexpr size_t FILTER_BRUTE_FORCE_MAX = 2048;
+constexpr size_t FILTER_BRUTE_FORCE_DIVISOR = 50;
+
+// Vector index layouts: HNSW over full-precision, 8-bit scalar quantized or product quantized codes,
+// or an inverted file over PQ codes. All but HnswFlat are trained on a sample of stored embeddings.
+enum class IndexType { HnswFlat, HnswSQ8, HnswPQ, IvfPQ };
+
+const char* indexTypeName(IndexType type);
+bool parseIndexType(const std::string& name, IndexType& type);
+
+struct IndexOptions {
+    IndexType type = IndexType::HnswFlat;
+    int pqSubquantizers = 0;         // Bytes per PQ code; 0 picks about d / 16 (rounded to a divisor of d)
+    int ivfLists = 0;                // IVF-PQ coarse centroids; 0 uses 4 * sqrt(documents)
+    int ivfProbes = 16;              // IVF-PQ lists scanned per query
+    size_t trainingSamples = 32768;  // Stored vectors sampled to train the quantizers
+    int rerankFactor = 0;            // Re-score k * factor candidates on full-precision stored vectors; <= 1 disables
+    bool memoryMap = false;          // Serve a loaded index from mapped file pages; the first insert copies it to the heap
+};
+
+struct IndexStats {
+    IndexType type = IndexType::HnswFlat;
+    long vectors = 0;
+    size_t memoryBytes = 0;   // Codes, graph or inverted lists, and the label map array
+    size_t codeBytes = 0;     // Bytes per stored vector code
+    double recall = -1.0;     // Last measured recall@recallK, or negative if never measured
+    int recallK = 0;
+    size_t recallQueries = 0;
+    bool mapped = false;      // Codes or inverted lists are file pages shared with other processes, not heap memory
+};
+
+// efSearch values calibrateEfSearch measures; adaptive searches use one of them
+constexpr int EF_SEARCH_CANDIDATES[] = {16, 32, 64, 128, 256, 512};
+
+// Recall@k and latency of index searches at one efSearch
+struct EfSearchPoint {
+    int efSearch = 0;
+    double recall = 0.0;
+    double meanMs = 0.0;
+    double p95Ms = 0.0;   // What adaptive searches budget for
+};
+
+struct EfSearchCalibration {
+    IndexType type = IndexType::HnswFlat;
+    int k = 0;
+    size_t queries = 0;
+    long vectors = 0;                   // Index size when calibrated; recall drifts as the index grows
+    std::vector<EfSearchPoint> points;  // Ascending efSearch; empty until calibrated
+};
+
+// Latency budget and recall target that stand in for a raw efSearch. Filled in by the search with what
+// it did; one budget may be shared by the shards of a collection searched in parallel.
+struct SearchBudget {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    double latencyMs = 0.0;      // Deadline measured from start; 0 for none
+    double targetRecall = 0.0;   // Calibrated recall@k to reach; 0 takes the best recall the budget allows
+    int fallbackEfSearch = 200;  // Used while the index is uncalibrated
+    
+    std::atomic<int> efSearch{0};           // Largest efSearch used
+    std::atomic<bool> deadlineExceeded{false};
+    
+    double remainingMs() const {
+        if (latencyMs <= 0.0) {
+            return std::numeric_limits<double>::infinity();
+        }
+        return latencyMs - std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+    bool expired() const { return remainingMs() <= 0.0; }
+};
+
+// Restricts vector search to documents whose metadata has key == value
+struct MetadataFilter {
+    std::string key;
+    std::string value;
+};
+
 struct SearchResult {
     std::string text;
     float score;
@@ -14,54 +107,291 @@ struct SearchResult {
     std::map<std::string, std::string> metadata;
 };
 
+// Parts of each result a client asked for. Ids and scores come from the index, so only text and
+// metadata change what hydration reads from storage; fields left out stay empty in SearchResult.
+struct ResultFields {
+    bool id = true;
+    bool score = true;
+    bool text = true;
+    bool metadata = true;
+    
+    DocumentFields stored() const { return {text, metadata}; }
+};
+
+// One query of a batch search: the text is embedded unless a raw embedding is given
+struct BatchQuery {
+    std::string text;
+    std::vector<float> embedding;
+    int k = 10;
+    float threshold = 0.0f;
+    int efSearch = 200;
+    bool hasFilter = false;
+    MetadataFilter filter;
+};
+
+// How hybrid search merges the semantic and keyword result lists
+enum class FusionMethod { ReciprocalRank, WeightedScore };
+
+struct HybridSearchOptions {
+    FusionMethod fusion = FusionMethod::ReciprocalRank;
+    int candidates = 0;           // Hits taken from each retriever before fusion; 0 uses max(4k, 50)
+    float rrfK = 60.0f;           // Rank damping constant for reciprocal rank fusion
+    float semanticWeight = 0.5f;  // Weighted fusion: share of the min-max normalized semantic score
+};
+
+// Wall-clock milliseconds spent in each search stage; stages that did not run stay at zero
+struct SearchTimings {
+    double embedMs{0};
+    double vectorMs{0};
+    double keywordMs{0};
+    double fusionMs{0};
+    double hydrateMs{0};
+    double totalMs{0};
+};
+
+// Concurrency model: any number of searches run in parallel under a shared lock on the index.
+// A document write commits the document and an ingest log entry in one SQLite transaction under
+// writeMutex_ and returns; embedding and index mutation happen when the log is applied, which is
+// serialized by applyMutex_ and only takes the index lock exclusively for the in-memory update.
+// Lock order: applyMutex_, then writeMutex_, then indexMutex_.
 class VectorSearch {
 public:
     VectorSearch(const std::string& modelPath, const std::string& tokenizerPath, 
                  const std::string& dbPath, int M = 16, int efConstruction = 300);
+    // Serves another database with an engine that is already loaded, e.g. one shard of a collection;
+    // initialize() then only opens storage
+    VectorSearch(std::shared_ptr<InferenceEngine> engine, const std::string& dbPath);
     ~VectorSearch();
     
     bool initialize();
     void loadOrCreateIndex(const std::string& index_file);
     
-    std::string addDocument(const std::string& text, const std::map<std::string, std::string>& metadata = {}, const std::string& customId = "");
-    void addDocuments(const std::vector<std::string>& texts, 
+    // Writes return once durable. With the background indexer running they become searchable
+    // asynchronously (see waitForIndexed); otherwise the log is applied before they return.
+    // `sequence` receives the ingest log sequence of the write. A precomputed embedding (of
+    // getEmbeddingDimension() floats) is stored with the document and indexed as is instead of
+    // embedding the text; writes without one have the text embedded.
+    std::string addDocument(const std::string& text, const std::map<std::string, std::string>& metadata = {},
+                            const std::string& customId = "", int64_t* sequence = nullptr,
+                            const std::vector<float>* embedding = nullptr);
+    // Row i of `embeddings`, when given, is the embedding of texts[i]. On success `documentIds`
+    // receives the stored ID of each text, generated where no custom ID was given.
+    bool addDocuments(const std::vector<std::string>& texts, 
                       const std::vector<std::map<std::string, std::string>>& metadataList = {},
-                      const std::vector<std::string>& customIds = {});
-    bool updateDocument(const std::string& id, const std::string& text, const std::map<std::string, std::string>& metadata = {});
-    bool upsertDocument(const std::string& id, const std::string& text, const std::map<std::string, std::string>& metadata = {});
-    bool deleteDocument(const std::string& id);
+                      const std::vector<std::string>& customIds = {}, int64_t* sequence = nullptr,
+                      const EmbeddingMatrix* embeddings = nullptr, std::vector<std::string>* documentIds = nullptr);
+    bool updateDocument(const std::string& id, const std::string& text, const std::map<std::string, std::string>& metadata = {},
+                        int64_t* sequence = nullptr, const std::vector<float>* embedding = nullptr);
+    bool upsertDocument(const std::string& id, const std::string& text, const std::map<std::string, std::string>& metadata = {},
+                        int64_t* sequence = nullptr, const std::vector<float>* embedding = nullptr);
+    bool deleteDocument(const std::string& id, int64_t* sequence = nullptr);
     
-    std::vector<SearchResult> searchText(const std::string& query, int k = 10, float threshold = 0.0f, int efSearch = 200);
-    std::vector<SearchResult> searchEmbedding(const std::vector<float>& queryEmbedding, int k = 10, float threshold = 0.0f, int efSearch = 200);
+    // Applies logged writes on a background thread and snapshots the index to index_file once
+    // snapshotThreshold writes are unsaved or snapshotInterval has passed since the last snapshot
+    void startIndexer(const std::string& index_file, std::chrono::seconds snapshotInterval, size_t snapshotThreshold);
+    void stopIndexer();
+    // Blocks until the write with this sequence is searchable; false on timeout
+    bool waitForIndexed(int64_t sequence, std::chrono::milliseconds timeout);
+    int64_t getAppliedSequence() const { return appliedSequence_; }
+    
+    std::vector<SearchResult> searchText(const std::string& query, int k = 10, float threshold = 0.0f, int efSearch = 200,
+                                         const MetadataFilter* filter = nullptr, const ResultFields& fields = {});
+    // Query embedding as searchText computes it, through the query cache and scheduler when enabled
+    std::vector<float> embedQuery(const std::string& query);
+    std::vector<SearchResult> searchEmbedding(const std::vector<float>& queryEmbedding, int k = 10, float threshold = 0.0f, int efSearch = 200,
+                                              const MetadataFilter* filter = nullptr, const ResultFields& fields = {});
+    // Adaptive variants: efSearch is picked by chooseEfSearch for what is left of the budget once the query
+    // is embedded. Past the deadline, exact scans of filtered candidates stop and quantized re-ranking is
+    // skipped, so the best candidates found by then are returned.
+    std::vector<SearchResult> searchText(const std::string& query, int k, float threshold, SearchBudget& budget,
+                                         const MetadataFilter* filter = nullptr, const ResultFields& fields = {});
+    std::vector<SearchResult> searchEmbedding(const std::vector<float>& queryEmbedding, int k, float threshold,
+                                              SearchBudget& budget, const MetadataFilter* filter = nullptr,
+                                              const ResultFields& fields = {});
+    // Semantic search for many queries at once: texts are embedded in one inference call, unfiltered
+    // queries share batched index searches and all hits are hydrated in one storage lookup.
+    // Element i holds the results of queries[i]. Throws std::invalid_argument on a wrong-sized embedding.
+    std::vector<std::vector<SearchResult>> searchBatch(const std::vector<BatchQuery>& queries, const ResultFields& fields = {});
+    std::vector<SearchResult> searchKeyword(const std::string& query, int k = 10, float threshold = 0.0f,
+                                            const ResultFields& fields = {});
+    // Runs semantic and keyword retrieval concurrently and fuses them; threshold applies to the fused score
+    std::vector<SearchResult> searchHybrid(const std::string& query, int k = 10, float threshold = 0.0f, int efSearch = 200,
+                                           const HybridSearchOptions& options = {}, SearchTimings* timings = nullptr,
+                                           const MetadataFilter* filter = nullptr, const ResultFields& fields = {});
     std::vector<SearchResult> searchByMetadata(const std::string& key, const std::string& value, int k = 10);
     
-    void saveIndex(const std::string& index_file);
+    // Writes the index and label map durably, then truncates the ingest log; false, logged, on failure
+    bool saveIndex(const std::string& index_file);
     void rebuildIndex();
     
     Document getDocument(const std::string& id);
+    std::vector<Document> getDocumentsByIds(const std::vector<std::string>& ids);
     std::vector<Document> getAllDocuments();
     size_t getDocumentCount();
     
     bool isInitialized() const { return index != nullptr && storage_ && storage_->isOpen(); }
     bool isModelLoaded() const { return inferenceEngine_ && inferenceEngine_->isLoaded(); }
-    long getIndexSize() const { return index ? index->ntotal : 0; }
+    long getIndexSize() const;
+    size_t getTombstoneCount() const;
     size_t getEmbeddingDimension() const;
+    ExecutionProvider getExecutionProvider() const {
+        return inferenceEngine_ ? inferenceEngine_->getActiveProvider() : ExecutionProvider::Cpu;
+    }
+    std::string getModelPrecision() const { return inferenceEngine_ ? inferenceEngine_->getPrecision() : "fp32"; }
+    InferenceStats getInferenceStats() const { return inferenceEngine_ ? inferenceEngine_->getStats() : InferenceStats{}; }
+    std::shared_ptr<InferenceEngine> getInferenceEngine() const { return inferenceEngine_; }
+    
+    // Route query embeddings through a micro-batching scheduler (call after initialize())
+    void enableQueryBatching(std::chrono::microseconds maxWait, size_t maxBatch);
+    const EmbeddingScheduler* getQueryScheduler() const { return queryScheduler_.get(); }
+    
+    // Caches query text -> embedding so repeated queries skip tokenization and inference (call after
+    // initialize()). Keys include the model fingerprint and token limit.
+    void enableQueryCache(size_t capacityBytes);
+    // Caches ranked vector hits per (embedding, k, threshold, efSearch, filter). Entries are tagged with
+    // the index generation, which every index mutation bumps, so a write never serves stale hits.
+    // Documents are still read from storage on every search.
+    void enableResultCache(size_t capacityBytes);
+    const ShardedLruCache<std::vector<float>>* getQueryCache() const { return queryCache_.get(); }
+    const ShardedLruCache<std::vector<std::pair<std::string, float>>>* getResultCache() const { return resultCache_.get(); }
+    uint64_t getIndexGeneration() const { return indexGeneration_; }
+    
+    // Session threading, execution provider and warmup; call before initialize()
+    void setInferenceOptions(const InferenceOptions& options) { inferenceOptions_ = options; }
+    
+    // Truncates embeddings to this many dimensions (0 keeps the model's full size). Call before initialize();
+    // an index or label map built at another dimension is rejected and rebuilt.
+    void setEmbeddingDimension(size_t dimension) { inferenceEngine_->setOutputDimension(dimension); }
+    
+    // METRIC_INNER_PRODUCT scores by cosine similarity; METRIC_L2 (default) by 1 / (1 + squared distance).
+    // Call before loadOrCreateIndex(); an index saved with another metric is rebuilt.
+    void setMetric(faiss::MetricType metric) { metric_ = metric; }
+    faiss::MetricType getMetric() const { return metric_; }
+    
+    // Call before loadOrCreateIndex(); an index of another type is rebuilt. Quantized types fall back
+    // to HnswFlat until storage holds enough vectors to train them.
+    void setIndexOptions(const IndexOptions& options) { indexOptions_ = options; }
+    const IndexOptions& getIndexOptions() const { return indexOptions_; }
+    IndexStats getIndexStats() const;
+    // Samples stored vectors as queries and compares search results with an exact scan of every stored
+    // vector; costs one pass over the embeddings table. Returns recall@k, or a negative value if empty.
+    double measureRecall(size_t queries, int k, int efSearch = 200);
+    // Samples stored vectors as queries and times searches at every EF_SEARCH_CANDIDATES value, recording
+    // recall@k against an exact scan and mean and p95 latency. The table is saved next to the index file
+    // and loaded with it. False if nothing is stored or the index ignores efSearch (IVF-PQ).
+    bool calibrateEfSearch(size_t queries = 200, int k = 10);
+    EfSearchCalibration getEfSearchCalibration() const;
+    // Smallest calibrated efSearch reaching targetRecall (0 for no target) whose p95 latency fits in budgetMs,
+    // else the largest that fits, else the smallest calibrated one; `fallback` while uncalibrated
+    int chooseEfSearch(double targetRecall, double budgetMs, int fallback) const;
+    
+    // Fraction of tombstoned vectors that triggers a background compaction (<= 0 disables it)
+    void setCompactionRatio(float ratio) { compactionRatio_ = ratio; }
     Storage* getStorage() const { return storage_.get(); }
 
 private:
-    std::unique_ptr<InferenceEngine> inferenceEngine_;
+    std::shared_ptr<InferenceEngine> inferenceEngine_;
+    std::unique_ptr<EmbeddingScheduler> queryScheduler_;  // Declared after the engine it borrows
+    std::unique_ptr<ShardedLruCache<std::vector<float>>> queryCache_;
+    std::unique_ptr<ShardedLruCache<std::vector<std::pair<std::string, float>>>> resultCache_;
     std::unique_ptr<Storage> storage_;
     std::string modelPath_;
     std::string tokenizerPath_;
     std::string dbPath_;
-    bool useCuda_;
+    InferenceOptions inferenceOptions_;
     
     int d;  // embedding dimension
-    faiss::IndexHNSWFlat* index;
-    std::vector<std::string> indexToDocumentId_;  // Maps FAISS index positions to document IDs
+    faiss::MetricType metric_;
+    IndexOptions indexOptions_;
+    faiss::IndexIDMap* index;  // HNSW graph addressed by stable 64-bit labels; id_map stays sorted by label
+    std::unordered_map<faiss::idx_t, std::string> labelToDocumentId_;
+    std::unordered_map<std::string, faiss::idx_t> documentIdToLabel_;
+    std::unordered_set<faiss::idx_t> tombstones_;  // Labels still in the graph but skipped by search
+    faiss::idx_t nextLabel_;
+    bool indexMapped_;             // index is read-only: its data are pages mapped from mappedIndexPath_
+    std::string mappedIndexPath_;
+    
+    float compactionRatio_;
+    uint64_t indexEpoch_;  // Bumped whenever the index is replaced wholesale
+    std::atomic<uint64_t> indexGeneration_;  // Bumped on every change to what searches can return
+    mutable std::shared_mutex indexMutex_;  // Shared for searches, exclusive for index mutation
+    std::recursive_mutex writeMutex_;       // Serializes writers; always acquired before indexMutex_
+    std::thread compactionThread_;
+    std::atomic<bool> compacting_;
+    
+    std::mutex applyMutex_;                  // Serializes log application, rebuilds and snapshots
+    std::atomic<int64_t> appliedSequence_;   // Last ingest log entry reflected in the index
+    std::atomic<size_t> unsavedWrites_;      // Log entries applied since the last snapshot
+    std::mutex indexerMutex_;
+    std::condition_variable indexerCv_;
+    std::condition_variable appliedCv_;      // Signalled whenever appliedSequence_ advances
+    std::thread indexerThread_;
+    bool indexerRunning_;
+    bool indexerStopping_;
+    bool writesPending_;
+    mutable std::mutex recallMutex_;
+    IndexStats lastRecall_;                  // Only the recall fields are used
+    mutable std::mutex calibrationMutex_;
+    EfSearchCalibration calibration_;
+    std::string calibrationFile_;            // Beside the index file loadOrCreateIndex was given
+    std::string snapshotFile_;
+    std::chrono::seconds snapshotInterval_;
+    size_t snapshotThreshold_;
     
-    void initializeIndex();
     std::vector<float> getEmbedding(const std::string& text);
-    void synchronizeIndex();
-    SearchResult buildSearchResult(const std::string& documentId, float score);
+    bool synchronizeIndex();
+    bool saveLabelMap(const std::string& path, int64_t appliedSequence);
+    bool loadLabelMap(const std::string& path);
+    bool saveCalibration(const EfSearchCalibration& calibration) const;
+    void loadCalibration();
+    // Exact top-k document IDs of each of `count` query vectors, in one pass over the stored embeddings
+    std::vector<std::unordered_set<std::string>> exactNeighbors(const std::vector<float>& queryVectors, size_t count, int k);
+    void rebuildIndexLocked();
+    faiss::IndexIDMap* createIndex(size_t expectedVectors) const;
+    size_t minTrainingVectors(const faiss::IndexIDMap* untrained) const;
+    faiss::IndexIDMap* buildIndexFromStorage(std::unordered_map<faiss::idx_t, std::string>& labelToDocumentId,
+                                             std::unordered_map<std::string, faiss::idx_t>& documentIdToLabel);
+    void installIndex(faiss::IndexIDMap* rebuilt,
+                      std::unordered_map<faiss::idx_t, std::string> labelToDocumentId,
+                      std::unordered_map<std::string, faiss::idx_t> documentIdToLabel);
+    // Heap copy of a mapped index, with the same vectors under the same labels so tombstones, label maps
+    // and an in-flight compaction stay valid. Call with applyMutex_ held and indexMutex_ held shared.
+    faiss::IndexIDMap* copyMappedIndex();
+    bool commitLogged(const std::function<int64_t()>& write, int64_t* sequence);
+    bool checkEmbeddingDimension(size_t dimension) const;
+    // Stores a caller-supplied embedding, or drops a stale one so the new text is embedded
+    bool storeProvidedEmbedding(const std::string& documentId, const float* embedding);
+    void onWriteLogged();
+    size_t applyPendingWrites();
+    size_t applyPendingWritesLocked();
+    // `stored[row]` marks rows whose vector is already in storage and need not be written again
+    void applyLogChunk(const std::vector<LogEntry>& entries, const EmbeddingMatrix& embeddings,
+                       const std::vector<bool>* stored = nullptr);
+    void publishAppliedSequence(int64_t sequence);
+    void runIndexer();
+    void tombstoneDocument(const std::string& documentId);
+    void scheduleCompactionIfNeeded();
+    void compactIndex();
+    using SearchHits = std::vector<std::pair<std::string, float>>;  // Document id and score, best first
+    // With a budget, stages after the index search are cut short once its deadline passes
+    SearchHits vectorHits(const std::vector<float>& queryEmbedding, int k, float threshold, int efSearch,
+                          const std::vector<std::string>* allowedIds = nullptr, SearchBudget* budget = nullptr);
+    // vectorHits behind the result cache; a filter is resolved only on a miss unless allowedIds is given.
+    // Hits cut short by a deadline are not cached.
+    SearchHits cachedVectorHits(const std::vector<float>& queryEmbedding, int k, float threshold, int efSearch,
+                                const MetadataFilter* filter, const std::vector<std::string>* allowedIds = nullptr,
+                                SearchBudget* budget = nullptr);
+    // Turns one query's search output into hits; call with indexMutex_ held
+    SearchHits collectHits(const float* distances, const faiss::idx_t* labels, int n, float cutoff) const;
+    // Fills hits[row] for each of `rows`, which must be unfiltered queries
+    void batchVectorHits(const EmbeddingMatrix& embeddings, const std::vector<size_t>& rows,
+                         const std::vector<BatchQuery>& queries, std::vector<SearchHits>& hits);
+    float scoreFromDistance(float distance) const;
+    float exactScore(const float* a, const float* b) const;
+    SearchHits rerankHits(const std::vector<float>& queryEmbedding, const SearchHits& candidates, int k, float threshold);
+    SearchHits exactHits(const std::vector<float>& queryEmbedding, std::vector<faiss::idx_t>& labels, int k, float threshold,
+                         SearchBudget* budget = nullptr);
+    SearchHits keywordHits(const std::string& query, int k, float threshold);
+    std::vector<SearchResult> hydrateResults(const SearchHits& hits, const ResultFields& fields);
+    std::vector<std::vector<SearchResult>> hydrateBatch(const std::vector<SearchHits>& hits, const ResultFields& fields);
 };
\ No newline at end of file
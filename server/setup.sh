@@ -1,2 +1,2 @@
 
-brew install cmake libomp faiss onnxruntime sqlite nlohmann_json httplib
+brew install cmake libomp faiss onnxruntime sqlite nlohmann_json httplib google-benchmark zstd
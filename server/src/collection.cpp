@@ -0,0 +1,500 @@
+#include "collection.h"
+#include "log.h"
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+#include <exception>
+#include <iterator>
+
+using json = nlohmann::json;
+
+namespace {
+
+constexpr char CONFIG_FILE[] = "collection.json";
+
+// FNV-1a: unlike std::hash its values are fixed, and shard placement is persistent
+uint64_t hashDocumentId(const std::string& id) {
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : id) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+}
+
+bool parseCollectionConfig(const json& request, CollectionConfig& config, std::string& error) {
+    try {
+        int shards = request.value("shards", static_cast<int>(config.shards));
+        if (shards < 1 || static_cast<size_t>(shards) > MAX_COLLECTION_SHARDS) {
+            error = "'shards' must be between 1 and " + std::to_string(MAX_COLLECTION_SHARDS);
+            return false;
+        }
+        config.shards = static_cast<size_t>(shards);
+
+        if (request.contains("index_type") &&
+            !parseIndexType(request["index_type"].get<std::string>(), config.indexOptions.type)) {
+            error = "Unknown index type, expected hnsw_flat, hnsw_sq8, hnsw_pq or ivf_pq";
+            return false;
+        }
+        if (request.contains("metric")) {
+            std::string metric = request["metric"].get<std::string>();
+            if (metric == "ip" || metric == "cosine") {
+                config.metric = faiss::METRIC_INNER_PRODUCT;
+            } else if (metric == "l2") {
+                config.metric = faiss::METRIC_L2;
+            } else {
+                error = "Unknown metric '" + metric + "', expected l2 or ip";
+                return false;
+            }
+        }
+
+        IndexOptions& options = config.indexOptions;
+        options.pqSubquantizers = request.value("pq_m", options.pqSubquantizers);
+        options.ivfLists = request.value("ivf_lists", options.ivfLists);
+        options.ivfProbes = request.value("ivf_probes", options.ivfProbes);
+        options.trainingSamples = static_cast<size_t>(
+            std::max(0, request.value("train_samples", static_cast<int>(options.trainingSamples))));
+        options.rerankFactor = request.value("rerank_factor", options.rerankFactor);
+        config.compactionRatio = request.value("compaction_ratio", config.compactionRatio);
+    } catch (const json::exception& e) {
+        error = e.what();
+        return false;
+    }
+    return true;
+}
+
+json collectionConfigToJson(const CollectionConfig& config) {
+    const IndexOptions& options = config.indexOptions;
+    return {
+        {"shards", config.shards},
+        {"index_type", indexTypeName(options.type)},
+        {"metric", config.metric == faiss::METRIC_INNER_PRODUCT ? "ip" : "l2"},
+        {"pq_m", options.pqSubquantizers},
+        {"ivf_lists", options.ivfLists},
+        {"ivf_probes", options.ivfProbes},
+        {"train_samples", options.trainingSamples},
+        {"rerank_factor", options.rerankFactor},
+        {"compaction_ratio", config.compactionRatio}
+    };
+}
+
+Collection::Collection(std::string name, std::string directory, CollectionConfig config,
+                       std::shared_ptr<InferenceEngine> engine, VectorSearch& queryEmbedder, WorkerPool& pool)
+    : name_(std::move(name)), directory_(std::move(directory)), config_(config), engine_(std::move(engine))
+    , queryEmbedder_(queryEmbedder), pool_(pool), dropped_(false) {}
+
+Collection::~Collection() {
+    // Shard indexers stop before their files go away
+    shards_.clear();
+
+    if (dropped_) {
+        std::error_code ec;
+        std::filesystem::remove_all(directory_, ec);
+        if (ec) {
+            LOG_WARN("Failed to remove collection directory " << directory_ << ": " << ec.message());
+        }
+    }
+}
+
+bool Collection::open(const ShardRuntimeOptions& options) {
+    shards_.clear();
+    for (size_t i = 0; i < config_.shards; ++i) {
+        auto shard = std::make_unique<VectorSearch>(engine_, shardPath(i, ".db"));
+        shard->setMetric(config_.metric);
+        IndexOptions indexOptions = config_.indexOptions;
+        indexOptions.memoryMap = options.memoryMap;
+        shard->setIndexOptions(indexOptions);
+        shard->setCompactionRatio(config_.compactionRatio);
+        shard->getStorage()->setOptions(options.storage);
+
+        if (!shard->initialize()) {
+            LOG_ERROR("Failed to open shard " << i << " of collection " << name_);
+            shards_.clear();
+            return false;
+        }
+        shards_.push_back(std::move(shard));
+    }
+
+    // Loading or rebuilding an index is the slow part of startup, and shards do it independently
+    std::vector<std::future<void>> loads;
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        loads.push_back(pool_.submit([this, i, &options] {
+            const std::string indexPath = shardPath(i, ".index");
+            shards_[i]->loadOrCreateIndex(indexPath);
+            shards_[i]->startIndexer(indexPath, options.snapshotInterval, options.snapshotThreshold);
+        }));
+    }
+    std::exception_ptr failure;
+    for (auto& load : loads) {
+        try {
+            load.get();
+        } catch (...) {
+            failure = failure ? failure : std::current_exception();
+        }
+    }
+    if (failure) {
+        shards_.clear();
+        std::rethrow_exception(failure);
+    }
+
+    LOG_INFO("Opened collection " << name_ << " with " << shards_.size() << " shard(s)");
+    return true;
+}
+
+size_t Collection::shardFor(const std::string& documentId) const {
+    return static_cast<size_t>(hashDocumentId(documentId) % shards_.size());
+}
+
+std::string Collection::shardPath(size_t shard, const char* extension) const {
+    return (std::filesystem::path(directory_) / ("shard-" + std::to_string(shard) + extension)).string();
+}
+
+std::string Collection::addDocument(const std::string& text, const std::map<std::string, std::string>& metadata,
+                                    const std::string& customId, std::vector<int64_t>* sequences,
+                                    const std::vector<float>* embedding) {
+    // The ID picks the shard, so it is generated here rather than by the shard
+    const std::string id = customId.empty() ? Storage::generateRandomId() : customId;
+    const size_t shard = shardFor(id);
+
+    int64_t sequence = 0;
+    std::string stored = shards_[shard]->addDocument(text, metadata, id, &sequence, embedding);
+    if (sequences) {
+        sequences->assign(shards_.size(), 0);
+        (*sequences)[shard] = stored.empty() ? 0 : sequence;
+    }
+    return stored;
+}
+
+bool Collection::addDocuments(const std::vector<std::string>& texts,
+                              const std::vector<std::map<std::string, std::string>>& metadataList,
+                              const std::vector<std::string>& customIds, std::vector<int64_t>* sequences,
+                              const EmbeddingMatrix* embeddings, std::vector<std::string>* documentIds) {
+    if (sequences) {
+        sequences->assign(shards_.size(), 0);
+    }
+    if (embeddings && embeddings->rows() != texts.size()) {
+        LOG_ERROR("Error adding documents: expected one embedding per text");
+        return false;
+    }
+
+    // One random, wall-clock-stamped prefix per batch keeps ids unique across restarts and hosts
+    const std::string prefix = Storage::generateRandomId() + "_";
+    std::vector<std::string> ids(texts.size());
+    std::vector<std::vector<size_t>> rowsByShard(shards_.size());
+    for (size_t i = 0; i < texts.size(); ++i) {
+        ids[i] = (i < customIds.size() && !customIds[i].empty()) ? customIds[i] : prefix + std::to_string(i);
+        rowsByShard[shardFor(ids[i])].push_back(i);
+    }
+
+    for (size_t shard = 0; shard < shards_.size(); ++shard) {
+        const auto& rows = rowsByShard[shard];
+        if (rows.empty()) {
+            continue;
+        }
+
+        std::vector<std::string> shardTexts;
+        std::vector<std::map<std::string, std::string>> shardMetadata;
+        std::vector<std::string> shardIds;
+        EmbeddingMatrix shardEmbeddings(embeddings ? rows.size() : 0, embeddings ? embeddings->dimension() : 0);
+        for (size_t j = 0; j < rows.size(); ++j) {
+            const size_t i = rows[j];
+            shardTexts.push_back(texts[i]);
+            shardMetadata.push_back(i < metadataList.size() ? metadataList[i] : std::map<std::string, std::string>{});
+            shardIds.push_back(ids[i]);
+            if (embeddings) {
+                EmbeddingView row = (*embeddings)[i];
+                std::copy(row.begin(), row.end(), shardEmbeddings.row(j));
+            }
+        }
+
+        int64_t sequence = 0;
+        if (!shards_[shard]->addDocuments(shardTexts, shardMetadata, shardIds, &sequence,
+                                          embeddings ? &shardEmbeddings : nullptr)) {
+            return false;
+        }
+        if (sequences) {
+            (*sequences)[shard] = sequence;
+        }
+    }
+
+    if (documentIds) {
+        *documentIds = std::move(ids);
+    }
+    return true;
+}
+
+bool Collection::upsertDocument(const std::string& id, const std::string& text, const std::map<std::string, std::string>& metadata,
+                                std::vector<int64_t>* sequences, const std::vector<float>* embedding) {
+    const size_t shard = shardFor(id);
+    int64_t sequence = 0;
+    bool written = shards_[shard]->upsertDocument(id, text, metadata, &sequence, embedding);
+    if (sequences) {
+        sequences->assign(shards_.size(), 0);
+        (*sequences)[shard] = written ? sequence : 0;
+    }
+    return written;
+}
+
+bool Collection::deleteDocument(const std::string& id, std::vector<int64_t>* sequences) {
+    const size_t shard = shardFor(id);
+    int64_t sequence = 0;
+    bool deleted = shards_[shard]->deleteDocument(id, &sequence);
+    if (sequences) {
+        sequences->assign(shards_.size(), 0);
+        (*sequences)[shard] = deleted ? sequence : 0;
+    }
+    return deleted;
+}
+
+bool Collection::waitForIndexed(const std::vector<int64_t>& sequences, std::chrono::milliseconds timeout) {
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    bool indexed = true;
+    for (size_t shard = 0; shard < sequences.size() && shard < shards_.size(); ++shard) {
+        if (sequences[shard] <= 0) {
+            continue;
+        }
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        indexed = shards_[shard]->waitForIndexed(sequences[shard], std::max(remaining, std::chrono::milliseconds(0))) && indexed;
+    }
+    return indexed;
+}
+
+Document Collection::getDocument(const std::string& id) {
+    return shards_[shardFor(id)]->getDocument(id);
+}
+
+size_t Collection::getDocumentCount() {
+    size_t count = 0;
+    for (auto& shard : shards_) {
+        count += shard->getDocumentCount();
+    }
+    return count;
+}
+
+std::vector<SearchResult> Collection::searchText(const std::string& query, int k, float threshold, int efSearch,
+                                                 const MetadataFilter* filter, const ResultFields& fields) {
+    return searchEmbedding(queryEmbedder_.embedQuery(query), k, threshold, efSearch, filter, fields);
+}
+
+std::vector<SearchResult> Collection::searchEmbedding(const std::vector<float>& queryEmbedding, int k, float threshold,
+                                                      int efSearch, const MetadataFilter* filter, const ResultFields& fields) {
+    return fanOut([&](VectorSearch& shard) {
+        return shard.searchEmbedding(queryEmbedding, k, threshold, efSearch, filter, fields);
+    }, k, true);
+}
+
+std::vector<SearchResult> Collection::searchText(const std::string& query, int k, float threshold, SearchBudget& budget,
+                                                 const MetadataFilter* filter, const ResultFields& fields) {
+    return searchEmbedding(queryEmbedder_.embedQuery(query), k, threshold, budget, filter, fields);
+}
+
+std::vector<SearchResult> Collection::searchEmbedding(const std::vector<float>& queryEmbedding, int k, float threshold,
+                                                      SearchBudget& budget, const MetadataFilter* filter,
+                                                      const ResultFields& fields) {
+    return fanOut([&](VectorSearch& shard) {
+        return shard.searchEmbedding(queryEmbedding, k, threshold, budget, filter, fields);
+    }, k, true);
+}
+
+std::vector<SearchResult> Collection::searchKeyword(const std::string& query, int k, float threshold,
+                                                    const ResultFields& fields) {
+    return fanOut([&](VectorSearch& shard) {
+        return shard.searchKeyword(query, k, threshold, fields);
+    }, k, true);
+}
+
+std::vector<SearchResult> Collection::searchByMetadata(const std::string& key, const std::string& value, int k) {
+    return fanOut([&](VectorSearch& shard) {
+        return shard.searchByMetadata(key, value, k);
+    }, k, false);
+}
+
+std::vector<SearchResult> Collection::fanOut(const std::function<std::vector<SearchResult>(VectorSearch&)>& search, int k,
+                                             bool rankByScore) {
+    std::vector<std::future<std::vector<SearchResult>>> pending;
+    pending.reserve(shards_.size());
+    for (size_t i = 1; i < shards_.size(); ++i) {
+        VectorSearch* shard = shards_[i].get();
+        pending.push_back(pool_.submit([&search, shard] { return search(*shard); }));
+    }
+
+    // Every task borrows `search`, so all of them finish before an error is rethrown
+    std::vector<SearchResult> merged;
+    std::exception_ptr failure;
+    try {
+        merged = search(*shards_[0]);
+    } catch (...) {
+        failure = std::current_exception();
+    }
+    for (auto& shardResults : pending) {
+        try {
+            auto results = shardResults.get();
+            merged.insert(merged.end(), std::make_move_iterator(results.begin()), std::make_move_iterator(results.end()));
+        } catch (...) {
+            failure = failure ? failure : std::current_exception();
+        }
+    }
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+
+    // Each shard returned its own top k, so the global top k is among them
+    if (rankByScore) {
+        std::stable_sort(merged.begin(), merged.end(), [](const SearchResult& a, const SearchResult& b) {
+            return a.score > b.score;
+        });
+    }
+    if (k >= 0 && merged.size() > static_cast<size_t>(k)) {
+        merged.resize(static_cast<size_t>(k));
+    }
+    return merged;
+}
+
+bool Collection::rebuildShard(size_t shard) {
+    shards_[shard]->rebuildIndex();
+    return shards_[shard]->saveIndex(shardPath(shard, ".index"));
+}
+
+bool Collection::saveShard(size_t shard) {
+    return shards_[shard]->saveIndex(shardPath(shard, ".index"));
+}
+
+bool Collection::calibrateShard(size_t shard, size_t queries, int k) {
+    return shards_[shard]->calibrateEfSearch(queries, k);
+}
+
+std::vector<ShardStats> Collection::getShardStats() {
+    std::vector<ShardStats> stats;
+    stats.reserve(shards_.size());
+    for (auto& shard : shards_) {
+        ShardStats shardStats;
+        shardStats.documents = shard->getDocumentCount();
+        shardStats.tombstones = shard->getTombstoneCount();
+        shardStats.loggedSequence = shard->getStorage()->getLatestLogSequence();
+        shardStats.appliedSequence = shard->getAppliedSequence();
+        shardStats.index = shard->getIndexStats();
+        stats.push_back(shardStats);
+    }
+    return stats;
+}
+
+CollectionManager::CollectionManager(std::string directory, std::shared_ptr<InferenceEngine> engine,
+                                     VectorSearch& queryEmbedder, ShardRuntimeOptions options, size_t searchThreads)
+    : directory_(std::move(directory)), engine_(std::move(engine)), queryEmbedder_(queryEmbedder)
+    , options_(std::move(options))
+    , pool_(searchThreads > 0 ? searchThreads : std::max(1u, std::thread::hardware_concurrency())) {}
+
+bool CollectionManager::isValidName(const std::string& name) {
+    if (name.empty() || name.size() > 64) {
+        return false;
+    }
+    return std::all_of(name.begin(), name.end(), [](char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '-';
+    });
+}
+
+void CollectionManager::load() {
+    std::error_code ec;
+    if (!std::filesystem::is_directory(directory_, ec)) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& entry : std::filesystem::directory_iterator(directory_, ec)) {
+        const std::string name = entry.path().filename().string();
+        const auto configPath = entry.path() / CONFIG_FILE;
+        if (!entry.is_directory() || !isValidName(name) || !std::filesystem::exists(configPath)) {
+            continue;
+        }
+
+        CollectionConfig config;
+        std::string error;
+        try {
+            std::ifstream in(configPath);
+            if (!parseCollectionConfig(json::parse(in), config, error)) {
+                LOG_WARN("Skipping collection " << name << ": " << error);
+                continue;
+            }
+
+            auto collection = std::make_shared<Collection>(name, entry.path().string(), config, engine_, queryEmbedder_, pool_);
+            if (collection->open(options_)) {
+                collections_[name] = std::move(collection);
+            }
+        } catch (const std::exception& e) {
+            LOG_WARN("Skipping collection " << name << ": " << e.what());
+        }
+    }
+}
+
+std::shared_ptr<Collection> CollectionManager::get(const std::string& name) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = collections_.find(name);
+    return it == collections_.end() ? nullptr : it->second;
+}
+
+std::vector<std::shared_ptr<Collection>> CollectionManager::list() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<std::shared_ptr<Collection>> collections;
+    for (const auto& [name, collection] : collections_) {
+        collections.push_back(collection);
+    }
+    return collections;
+}
+
+std::shared_ptr<Collection> CollectionManager::create(const std::string& name, const CollectionConfig& config, std::string& error) {
+    if (!isValidName(name)) {
+        error = "Collection names are 1 to 64 characters of letters, digits, '_' and '-'";
+        return nullptr;
+    }
+
+    // Held throughout so two creates of one name cannot race; a new collection opens quickly
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto directory = std::filesystem::path(directory_) / name;
+    std::error_code ec;
+    if (collections_.count(name) || std::filesystem::exists(directory, ec)) {
+        error = "Collection '" + name + "' already exists";
+        return nullptr;
+    }
+
+    std::filesystem::create_directories(directory, ec);
+    {
+        const auto tmpPath = directory / (std::string(CONFIG_FILE) + ".tmp");
+        std::ofstream out(tmpPath);
+        out << collectionConfigToJson(config).dump(2) << std::endl;
+        out.close();
+        if (!out || (std::filesystem::rename(tmpPath, directory / CONFIG_FILE, ec), ec)) {
+            error = "Failed to write " + (directory / CONFIG_FILE).string();
+            std::filesystem::remove_all(directory, ec);
+            return nullptr;
+        }
+    }
+
+    auto collection = std::make_shared<Collection>(name, directory.string(), config, engine_, queryEmbedder_, pool_);
+    bool opened = false;
+    try {
+        opened = collection->open(options_);
+    } catch (const std::exception& e) {
+        LOG_ERROR("Failed to open collection " << name << ": " << e.what());
+    }
+    if (!opened) {
+        collection->markDropped();
+        error = "Failed to create the shards of collection '" + name + "'";
+        return nullptr;
+    }
+
+    collections_[name] = collection;
+    return collection;
+}
+
+bool CollectionManager::drop(const std::string& name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = collections_.find(name);
+    if (it == collections_.end()) {
+        return false;
+    }
+    it->second->markDropped();
+    collections_.erase(it);
+    return true;
+}
@@ -0,0 +1,127 @@
+#include "embedding_scheduler.h"
+#include <algorithm>
+#include <stdexcept>
+
+EmbeddingScheduler::EmbeddingScheduler(InferenceEngine& engine, std::chrono::microseconds maxWait, size_t maxBatch)
+    : engine_(engine), maxWait_(maxWait), maxBatch_(std::max<size_t>(1, maxBatch))
+    , stopping_(false), requests_(0), batches_(0) {
+    for (auto& bucket : histogram_) {
+        bucket = 0;
+    }
+    worker_ = std::thread(&EmbeddingScheduler::run, this);
+}
+
+EmbeddingScheduler::~EmbeddingScheduler() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    if (worker_.joinable()) {
+        worker_.join();
+    }
+}
+
+std::future<std::vector<float>> EmbeddingScheduler::submit(const std::string& text) {
+    Pending pending;
+    pending.text = text;
+    pending.enqueuedAt = std::chrono::steady_clock::now();
+    auto future = pending.promise.get_future();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping_) {
+            pending.promise.set_exception(std::make_exception_ptr(std::runtime_error("Embedding scheduler stopped")));
+            return future;
+        }
+        queue_.push_back(std::move(pending));
+    }
+
+    requests_++;
+    cv_.notify_one();
+    return future;
+}
+
+EmbeddingSchedulerStats EmbeddingScheduler::getStats() const {
+    EmbeddingSchedulerStats stats;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats.queueDepth = queue_.size();
+    }
+    stats.requests = requests_.load();
+    stats.batches = batches_.load();
+    for (size_t i = 0; i < SCHEDULER_HISTOGRAM_BUCKETS; ++i) {
+        stats.batchSizeHistogram[i] = histogram_[i].load();
+    }
+    return stats;
+}
+
+size_t EmbeddingScheduler::histogramBucket(size_t batchSize) {
+    size_t bucket = 0;
+    while (bucket + 1 < SCHEDULER_HISTOGRAM_BUCKETS && histogramBucketBound(bucket) < batchSize) {
+        ++bucket;
+    }
+    return bucket;
+}
+
+size_t EmbeddingScheduler::histogramBucketBound(size_t bucket) {
+    return size_t{1} << bucket;
+}
+
+void EmbeddingScheduler::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    while (true) {
+        cv_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+        if (queue_.empty()) {
+            return; // Stopping and fully drained
+        }
+
+        // Give concurrent callers until the oldest request's deadline to join this batch
+        auto deadline = queue_.front().enqueuedAt + maxWait_;
+        cv_.wait_until(lock, deadline, [this] { return stopping_ || queue_.size() >= maxBatch_; });
+
+        size_t batchSize = std::min(queue_.size(), maxBatch_);
+        std::vector<Pending> batch;
+        batch.reserve(batchSize);
+        for (size_t i = 0; i < batchSize; ++i) {
+            batch.push_back(std::move(queue_.front()));
+            queue_.pop_front();
+        }
+
+        lock.unlock();
+
+        std::vector<std::string> texts;
+        texts.reserve(batch.size());
+        for (const auto& pending : batch) {
+            texts.push_back(pending.text);
+        }
+
+        // Every row is copied out before any promise is fulfilled, so a failure part way through
+        // never meets a promise that already holds a value
+        std::vector<std::vector<float>> rows;
+        try {
+            auto embeddings = engine_.getEmbeddings(texts);
+            if (embeddings.rows() < batch.size()) {
+                throw std::runtime_error("Inference returned fewer embeddings than requested");
+            }
+            rows.reserve(batch.size());
+            for (size_t i = 0; i < batch.size(); ++i) {
+                rows.push_back(embeddings[i].toVector());
+            }
+        } catch (...) {
+            for (auto& pending : batch) {
+                pending.promise.set_exception(std::current_exception());
+            }
+            rows.clear();
+        }
+        for (size_t i = 0; i < rows.size(); ++i) {
+            batch[i].promise.set_value(std::move(rows[i]));
+        }
+
+        batches_++;
+        histogram_[histogramBucket(batch.size())]++;
+
+        lock.lock();
+    }
+}
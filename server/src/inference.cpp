@@ -1,18 +1,52 @@
 #include "inference.h"
-#include <iostream>
+#include "vector_kernels.h"
+#include "log.h"
+#include "metrics.h"
 #include <fstream>
 #include <stdexcept>
 #include <numeric>
+#include <algorithm>
+#include <future>
 #include <cmath>
+#include <cstdio>
+#include <chrono>
 
 #ifdef _WIN32
 #include <windows.h>
 #endif
 
+const char* executionProviderName(ExecutionProvider provider) {
+    switch (provider) {
+        case ExecutionProvider::Cuda: return "cuda";
+        case ExecutionProvider::TensorRT: return "tensorrt";
+        case ExecutionProvider::CoreML: return "coreml";
+        case ExecutionProvider::Cpu: break;
+    }
+    return "cpu";
+}
+
+bool parseExecutionProvider(const std::string& name, ExecutionProvider& provider) {
+    for (ExecutionProvider candidate : {ExecutionProvider::Cpu, ExecutionProvider::Cuda,
+                                        ExecutionProvider::TensorRT, ExecutionProvider::CoreML}) {
+        if (name == executionProviderName(candidate)) {
+            provider = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
 InferenceEngine::InferenceEngine() 
     : memoryInfo_(Ort::MemoryInfo::CreateCpu(OrtArenaAllocator, OrtMemTypeDefault))
     , embeddingDim_(DEFAULT_EMBEDDING_DIMENSION)
-    , loaded_(false) {
+    , modelDim_(DEFAULT_EMBEDDING_DIMENSION)
+    , outputDim_(0)
+    , activeProvider_(ExecutionProvider::Cpu)
+    , bindOutputs_(false)
+    , halfOutputs_(false)
+    , precision_("fp32")
+    , loaded_(false)
+    , runCount_(0), sequenceCount_(0), tokenCount_(0), paddedTokenCount_(0) {
     env_ = std::make_unique<Ort::Env>(ORT_LOGGING_LEVEL_WARNING, "InferenceEngine");
 }
 
@@ -20,16 +54,25 @@ InferenceEngine::~InferenceEngine() {
     unloadModel();
 }
 
-bool InferenceEngine::loadModel(const std::string& modelPath, const std::string& tokenizerPath, bool useCuda) {
+bool InferenceEngine::loadModel(const std::string& modelPath, const std::string& tokenizerPath, const InferenceOptions& options) {
     try {
+        options_ = options;
         loadTokenizer(tokenizerPath);
-        initializeSession(modelPath, useCuda);
+        initializeSession(modelPath);
         extractModelInfo();
+        modelFingerprint_ = computeModelFingerprint(modelPath, tokenizerPath);
         loaded_ = true;
-        std::cout << "Model loaded successfully. Embedding dimension: " << embeddingDim_ << std::endl;
+        LOG_INFO("Model loaded successfully. Embedding dimension: " << embeddingDim_
+              << ", precision: " << precision_
+              << ", execution provider: " << executionProviderName(activeProvider_)
+              << ", vector kernels: " << vector_kernels::implementationName());
+        
+        if (options_.warmup) {
+            warmup();
+        }
         return true;
     } catch (const std::exception& e) {
-        std::cerr << "Failed to load model: " << e.what() << std::endl;
+        LOG_ERROR("Failed to load model: " << e.what());
         loaded_ = false;
         return false;
     }
@@ -44,8 +87,12 @@ void InferenceEngine::unloadModel() {
         inputNamesCStr_.clear();
         outputNamesCStr_.clear();
         embeddingDim_ = 0;
+        bindOutputs_ = false;
+        halfOutputs_ = false;
+        precision_ = "fp32";
+        modelFingerprint_.clear();
         loaded_ = false;
-        std::cout << "Model unloaded." << std::endl;
+        LOG_INFO("Model unloaded.");
     }
 }
 
@@ -58,27 +105,137 @@ std::vector<float> InferenceEngine::getEmbedding(const std::string& text, int64_
         throw std::runtime_error("Model not loaded");
     }
     
+    // A one-row matrix's buffer is exactly the embedding, so it is handed over without a copy
     std::vector<std::string> texts = {text};
-    auto embeddings = getEmbeddings(texts, maxLen);
-    return embeddings[0];
+    return getEmbeddings(texts, maxLen).release();
+}
+
+EmbeddingMatrix InferenceEngine::getEmbeddings(const std::vector<std::string>& texts, int64_t maxLen) {
+    if (!loaded_) {
+        throw std::runtime_error("Model not loaded");
+    }
+    
+    return embedEncoded(encodeTexts(texts, maxLen));
 }
 
-std::vector<std::vector<float>> InferenceEngine::getEmbeddings(const std::vector<std::string>& texts, int64_t maxLen) {
+void InferenceEngine::embedStream(const TextChunkSource& next, const EmbeddingChunkSink& sink, int64_t maxLen) {
     if (!loaded_) {
         throw std::runtime_error("Model not loaded");
     }
     
-    Batch batch = tokenizeBatch(texts, maxLen);
+    std::vector<std::string> texts;
+    if (!next(texts)) {
+        return;
+    }
+    
+    auto encodeAsync = [this, maxLen](std::vector<std::string> chunk) {
+        return std::async(std::launch::async, [this, maxLen, chunk = std::move(chunk)] {
+            return encodeTexts(chunk, maxLen);
+        });
+    };
+    
+    auto pending = encodeAsync(std::move(texts));
+    while (true) {
+        auto encoded = pending.get();
+        
+        std::vector<std::string> nextTexts;
+        bool more = next(nextTexts);
+        if (more) {
+            pending = encodeAsync(std::move(nextTexts));
+        }
+        
+        auto embeddings = embedEncoded(encoded);
+        sink(embeddings);
+        
+        if (!more) {
+            break;
+        }
+    }
+}
+
+EmbeddingMatrix InferenceEngine::embedEncoded(const std::vector<std::vector<int32_t>>& encoded) {
+    // Sort by token length so each run pads to a similar length, then scatter back to input order
+    std::vector<size_t> order(encoded.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&encoded](size_t a, size_t b) {
+        return encoded[a].size() < encoded[b].size();
+    });
+    
+    EmbeddingMatrix result(encoded.size(), embeddingDim_);
+    std::vector<float*> outputs(EMBEDDING_BUCKET_SIZE);
+    
+    for (size_t start = 0; start < order.size(); start += EMBEDDING_BUCKET_SIZE) {
+        size_t count = std::min(EMBEDDING_BUCKET_SIZE, order.size() - start);
+        Batch batch = buildBatch(encoded, order.data() + start, count);
+        
+        // Pooling writes straight into the result rows, already in input order
+        for (size_t i = 0; i < count; ++i) {
+            outputs[i] = result.row(order[start + i]);
+        }
+        runBatch(batch, outputs.data());
+    }
+    
+    return result;
+}
+
+void InferenceEngine::runBatch(const Batch& batch, float* const* outputs) {
     std::vector<Ort::Value> ortInputs = createInputTensors(batch);
     
-    auto ortOutputs = session_->Run(
-        Ort::RunOptions{nullptr},
-        inputNamesCStr_.data(),
-        ortInputs.data(),
-        ortInputs.size(),
-        outputNamesCStr_.data(),
-        outputNamesCStr_.size()
-    );
+    if (bindOutputs_) {
+        // The hidden states land in a per-thread buffer that grows to the largest batch seen and is then
+        // reused, so steady-state runs allocate nothing for the [B, S, H] activations
+        const int64_t H = static_cast<int64_t>(modelDim_);
+        const size_t elements = static_cast<size_t>(batch.B * batch.S * H);
+        const std::vector<int64_t> shape{batch.B, batch.S, H};
+        
+        Ort::IoBinding binding(*session_);
+        for (size_t i = 0; i < ortInputs.size(); ++i) {
+            binding.BindInput(inputNamesCStr_[i], ortInputs[i]);
+        }
+        
+        if (halfOutputs_) {
+            thread_local std::vector<Ort::Float16_t> halfBuffer;
+            if (halfBuffer.size() < elements) {
+                halfBuffer.resize(elements);
+            }
+            Ort::Value hidden = Ort::Value::CreateTensor<Ort::Float16_t>(memoryInfo_, halfBuffer.data(), elements,
+                                                                         shape.data(), shape.size());
+            binding.BindOutput(outputNamesCStr_.front(), hidden);
+            {
+                ScopedTimer timer(stageHistogram(Stage::Infer));
+                session_->Run(Ort::RunOptions{nullptr}, binding);
+            }
+            meanPoolL2Norm(halfBuffer.data(), batch.attention_mask.data(), batch.B, batch.S, H, outputs);
+            return;
+        }
+        
+        thread_local std::vector<float> hiddenBuffer;
+        if (hiddenBuffer.size() < elements) {
+            hiddenBuffer.resize(elements);
+        }
+        Ort::Value hidden = Ort::Value::CreateTensor<float>(memoryInfo_, hiddenBuffer.data(), elements,
+                                                            shape.data(), shape.size());
+        binding.BindOutput(outputNamesCStr_.front(), hidden);
+        {
+            ScopedTimer timer(stageHistogram(Stage::Infer));
+            session_->Run(Ort::RunOptions{nullptr}, binding);
+        }
+        meanPoolL2Norm(hiddenBuffer.data(), batch.attention_mask.data(), batch.B, batch.S, H, outputs);
+        return;
+    }
+    
+    std::vector<Ort::Value> ortOutputs;
+    {
+        ScopedTimer timer(stageHistogram(Stage::Infer));
+        ortOutputs = session_->Run(
+            Ort::RunOptions{nullptr},
+            inputNamesCStr_.data(),
+            ortInputs.data(),
+            ortInputs.size(),
+            outputNamesCStr_.data(),
+            outputNamesCStr_.size()
+        );
+    }
     
     auto& lastHiddenVal = ortOutputs.front();
     auto shapeInfo = lastHiddenVal.GetTensorTypeAndShapeInfo();
@@ -91,61 +248,68 @@ std::vector<std::vector<float>> InferenceEngine::getEmbeddings(const std::vector
     int64_t B = dims[0];
     int64_t S = dims[1]; 
     int64_t H = dims[2];
-    
-    const float* lastHidden = lastHiddenVal.GetTensorData<float>();
-    std::vector<float> flatEmbeddings = meanPoolL2Norm(lastHidden, batch.attention_mask.data(), B, S, H);
-    
-    std::vector<std::vector<float>> result;
-    result.reserve(B);
-    
-    for (int64_t i = 0; i < B; ++i) {
-        std::vector<float> embedding(flatEmbeddings.begin() + i * H, flatEmbeddings.begin() + (i + 1) * H);
-        result.push_back(embedding);
+    if (H < static_cast<int64_t>(embeddingDim_)) {
+        throw std::runtime_error("Model output is narrower than the embedding dimension");
     }
     
-    return result;
+    switch (shapeInfo.GetElementType()) {
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT:
+            meanPoolL2Norm(lastHiddenVal.GetTensorData<float>(), batch.attention_mask.data(), B, S, H, outputs);
+            break;
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT16:
+            meanPoolL2Norm(lastHiddenVal.GetTensorData<Ort::Float16_t>(), batch.attention_mask.data(), B, S, H, outputs);
+            break;
+        default:
+            throw std::runtime_error("Unsupported output element type; expected float or float16.");
+    }
 }
 
-std::vector<float> InferenceEngine::cosineSimMatrix(const std::vector<std::vector<float>>& embeddings) {
+InferenceStats InferenceEngine::getStats() const {
+    InferenceStats stats;
+    stats.runs = runCount_.load();
+    stats.sequences = sequenceCount_.load();
+    stats.tokens = tokenCount_.load();
+    stats.paddedTokens = paddedTokenCount_.load();
+    return stats;
+}
+
+std::vector<float> InferenceEngine::cosineSimMatrix(const EmbeddingMatrix& embeddings) {
     if (embeddings.empty()) {
         return {};
     }
     
-    int64_t B = embeddings.size();
-    int64_t H = embeddings[0].size();
-    
-    std::vector<float> flatEmbeddings;
-    flatEmbeddings.reserve(B * H);
-    
-    for (const auto& emb : embeddings) {
-        flatEmbeddings.insert(flatEmbeddings.end(), emb.begin(), emb.end());
-    }
+    const size_t B = embeddings.rows();
+    const size_t H = embeddings.dimension();
+    const float* rows = embeddings.data();
     
+    // Symmetric, so each pair is computed once
     std::vector<float> M(B * B, 0.f);
-    for (int64_t i = 0; i < B; ++i) {
-        const float* ei = &flatEmbeddings[i * H];
-        for (int64_t j = 0; j < B; ++j) {
-            const float* ej = &flatEmbeddings[j * H];
-            float dot = 0.f;
-            for (int64_t h = 0; h < H; ++h) {
-                dot += ei[h] * ej[h];
-            }
-            M[i * B + j] = dot;
+    for (size_t i = 0; i < B; ++i) {
+        for (size_t j = i; j < B; ++j) {
+            M[i * B + j] = M[j * B + i] = vector_kernels::dot(rows + i * H, rows + j * H, H);
         }
     }
     
     return M;
 }
 
-void InferenceEngine::initializeSession(const std::string& modelPath, bool useCuda) {
+void InferenceEngine::initializeSession(const std::string& modelPath) {
     Ort::SessionOptions sessionOptions;
     sessionOptions.SetGraphOptimizationLevel(GraphOptimizationLevel::ORT_ENABLE_ALL);
     
-    if (useCuda) {
-        //
-        // OrtSessionOptionsAppendExecutionProvider_CUDA(sessionOptions, 0);
-        std::cout << "Warning: CUDA requested but not available on this platform" << std::endl;
+    // ORT's pools compete with the HTTP workers and FAISS's OpenMP threads, so both sizes are configurable
+    if (options_.intraOpThreads > 0) {
+        sessionOptions.SetIntraOpNumThreads(options_.intraOpThreads);
+    }
+    if (options_.interOpThreads > 1) {
+        sessionOptions.SetExecutionMode(ExecutionMode::ORT_PARALLEL);
+        sessionOptions.SetInterOpNumThreads(options_.interOpThreads);
     }
+    const char* spinning = options_.allowSpinning ? "1" : "0";
+    sessionOptions.AddConfigEntry("session.intra_op.allow_spinning", spinning);
+    sessionOptions.AddConfigEntry("session.inter_op.allow_spinning", spinning);
+    
+    appendExecutionProvider(sessionOptions);
     
 #ifdef _WIN32
     session_ = std::make_unique<Ort::Session>(*env_, toWideString(modelPath).c_str(), sessionOptions);
@@ -154,6 +318,65 @@ void InferenceEngine::initializeSession(const std::string& modelPath, bool useCu
 #endif
 }
 
+void InferenceEngine::appendExecutionProvider(Ort::SessionOptions& sessionOptions) {
+    activeProvider_ = ExecutionProvider::Cpu;
+    if (options_.provider == ExecutionProvider::Cpu) {
+        return;
+    }
+    
+    // Providers missing from this ONNX Runtime build throw here; operators a provider cannot run
+    // stay on the CPU provider, which is always registered last
+    try {
+        if (options_.provider == ExecutionProvider::TensorRT) {
+            OrtTensorRTProviderOptions tensorRt{};
+            tensorRt.device_id = options_.deviceId;
+            sessionOptions.AppendExecutionProvider_TensorRT(tensorRt);
+        }
+        if (options_.provider == ExecutionProvider::TensorRT || options_.provider == ExecutionProvider::Cuda) {
+            // Also behind TensorRT, to run the subgraphs it rejects on the GPU
+            OrtCUDAProviderOptions cuda{};
+            cuda.device_id = options_.deviceId;
+            sessionOptions.AppendExecutionProvider_CUDA(cuda);
+        }
+        if (options_.provider == ExecutionProvider::CoreML) {
+            sessionOptions.AppendExecutionProvider("CoreML");
+        }
+        activeProvider_ = options_.provider;
+    } catch (const Ort::Exception& e) {
+        LOG_WARN(executionProviderName(options_.provider)
+              << " execution provider unavailable, using CPU: " << e.what());
+    }
+}
+
+void InferenceEngine::warmup() {
+    // The first run at each shape pays for kernel selection, memory arena growth and (on GPUs) engine
+    // builds. Exercise single queries and full buckets at short, typical and maximum lengths up front.
+    auto start = std::chrono::steady_clock::now();
+    std::vector<int32_t> sample = encodeTexts({"The quick brown fox jumps over the lazy dog."}, 256).front();
+    if (sample.empty()) {
+        return;
+    }
+    
+    for (size_t length : {16, 64, 256}) {
+        std::vector<int32_t> ids(length);
+        for (size_t i = 0; i < length; ++i) {
+            ids[i] = sample[i % sample.size()];
+        }
+        embedEncoded({ids});
+        embedEncoded(std::vector<std::vector<int32_t>>(EMBEDDING_BUCKET_SIZE, ids));
+    }
+    
+    // Warmup runs are not traffic
+    runCount_ = 0;
+    sequenceCount_ = 0;
+    tokenCount_ = 0;
+    paddedTokenCount_ = 0;
+    
+    LOG_INFO("Inference warmed up in "
+          << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count()
+          << " ms");
+}
+
 void InferenceEngine::loadTokenizer(const std::string& tokenizerPath) {
     auto blob = readFileBytes(tokenizerPath);
     std::string json(reinterpret_cast<const char*>(blob.data()), blob.size());
@@ -193,39 +416,88 @@ void InferenceEngine::extractModelInfo() {
             auto outputTensorInfo = outputTypeInfo.GetTensorTypeAndShapeInfo();
             auto outputShape = outputTensorInfo.GetShape();
             
-            if (!outputShape.empty()) {
-                embeddingDim_ = static_cast<size_t>(outputShape.back());
+            if (!outputShape.empty() && outputShape.back() > 0) {
+                modelDim_ = static_cast<size_t>(outputShape.back());
             }
+            bindOutputs_ = options_.ioBinding && outputShape.size() == 3 && outputShape.back() > 0;
+            halfOutputs_ = outputTensorInfo.GetElementType() == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT16;
         }
     }
     
     for (const auto& name : outputNames_) {
         outputNamesCStr_.push_back(name.c_str());
     }
+    
+    // Dynamically quantized graphs keep float I/O, so int8 is only visible through the exporter's tag
+    precision_ = halfOutputs_ ? "fp16" : "fp32";
+    Ort::ModelMetadata metadata = session_->GetModelMetadata();
+    auto precision = metadata.LookupCustomMetadataMapAllocated("precision", allocator);
+    if (precision && *precision.get()) {
+        precision_ = precision.get();
+    }
+    
+    if (outputDim_ > modelDim_) {
+        throw std::runtime_error("Embedding dimension " + std::to_string(outputDim_) +
+                                 " exceeds the model's hidden size " + std::to_string(modelDim_));
+    }
+    embeddingDim_ = outputDim_ > 0 ? outputDim_ : modelDim_;
 }
 
 InferenceEngine::Batch InferenceEngine::tokenizeBatch(const std::vector<std::string>& texts, int64_t maxLen) {
+    auto encoded = encodeTexts(texts, maxLen);
+    std::vector<size_t> order(encoded.size());
+    std::iota(order.begin(), order.end(), 0);
+    return buildBatch(encoded, order.data(), order.size());
+}
+
+std::vector<std::vector<int32_t>> InferenceEngine::encodeTexts(const std::vector<std::string>& texts, int64_t maxLen) {
+    std::vector<std::vector<int32_t>> encoded;
+    encoded.reserve(texts.size());
+    
+    // Timed from before the lock, so waiting for other threads' encoding counts too
+    ScopedTimer timer(stageHistogram(Stage::Tokenize));
+    std::lock_guard<std::mutex> lock(tokenizerMutex_);
+    for (const auto& text : texts) {
+        std::vector<int32_t> ids = tokenizer_->Encode(text);
+        if (static_cast<int64_t>(ids.size()) > maxLen) {
+            ids.resize(maxLen);
+        }
+        encoded.push_back(std::move(ids));
+    }
+    
+    return encoded;
+}
+
+InferenceEngine::Batch InferenceEngine::buildBatch(const std::vector<std::vector<int32_t>>& encoded, const size_t* order, size_t count) {
     Batch b;
-    b.B = static_cast<int64_t>(texts.size());
-    b.S = maxLen;
+    b.B = static_cast<int64_t>(count);
+    
+    // Pad only to the longest sequence in this batch rather than to maxLen
+    int64_t realTokens = 0;
+    b.S = 1;
+    for (size_t i = 0; i < count; ++i) {
+        int64_t len = static_cast<int64_t>(encoded[order[i]].size());
+        b.S = std::max(b.S, len);
+        realTokens += len;
+    }
     
     b.input_ids.assign(b.B * b.S, 0);
     b.attention_mask.assign(b.B * b.S, 0);
     b.token_type_ids.assign(b.B * b.S, 0);
     
     for (int64_t i = 0; i < b.B; ++i) {
-        std::vector<int32_t> ids = tokenizer_->Encode(texts[i]);
-        if (static_cast<int64_t>(ids.size()) > maxLen) {
-            ids.resize(maxLen);
-        }
-        
+        const auto& ids = encoded[order[i]];
         for (int64_t t = 0; t < static_cast<int64_t>(ids.size()); ++t) {
-            b.input_ids[i * maxLen + t] = static_cast<int64_t>(ids[t]);
-            b.attention_mask[i * maxLen + t] = 1;
-            b.token_type_ids[i * maxLen + t] = 0;
+            b.input_ids[i * b.S + t] = static_cast<int64_t>(ids[t]);
+            b.attention_mask[i * b.S + t] = 1;
         }
     }
     
+    runCount_++;
+    sequenceCount_ += static_cast<uint64_t>(b.B);
+    tokenCount_ += static_cast<uint64_t>(realTokens);
+    paddedTokenCount_ += static_cast<uint64_t>(b.B * b.S);
+    
     return b;
 }
 
@@ -269,41 +541,117 @@ std::vector<Ort::Value> InferenceEngine::createInputTensors(const Batch& batch)
     return ortInputs;
 }
 
-std::vector<float> InferenceEngine::meanPoolL2Norm(const float* lastHidden, const int64_t* mask, 
-                                                  int64_t B, int64_t S, int64_t H) {
-    std::vector<float> out(B * H, 0.f);
+void InferenceEngine::meanPoolL2Norm(const float* lastHidden, const int64_t* mask,
+                                     int64_t B, int64_t S, int64_t H, float* const* outputs) {
+    // Truncation happens before the norm, so only the kept prefix is pooled and the result is unit length
+    ScopedTimer timer(stageHistogram(Stage::Pool));
+    const size_t D = embeddingDim_;
     
     for (int64_t b = 0; b < B; ++b) {
-        float count = 0.f;
+        float* out = outputs[b];
+        std::fill(out, out + D, 0.f);
+        
+        const int64_t* rowMask = mask + b * S;
+        const float* rows = lastHidden + b * S * H;
         for (int64_t t = 0; t < S; ++t) {
-            if (mask[b * S + t]) {
-                const float* row = lastHidden + (b * S + t) * H;
-                for (int64_t h = 0; h < H; ++h) {
-                    out[b * H + h] += row[h];
-                }
-                count += 1.f;
+            if (rowMask[t]) {
+                vector_kernels::add(out, rows + t * H, D);
             }
         }
         
-        if (count > 0.f) {
-            for (int64_t h = 0; h < H; ++h) {
-                out[b * H + h] /= count;
-            }
-        }
+        // The mean points the same way as the sum, so the division by the token count folds into the norm
+        vector_kernels::l2Normalize(out, D);
+    }
+}
+
+void InferenceEngine::meanPoolL2Norm(const Ort::Float16_t* lastHidden, const int64_t* mask,
+                                     int64_t B, int64_t S, int64_t H, float* const* outputs) {
+    static_assert(sizeof(Ort::Float16_t) == sizeof(uint16_t), "Ort::Float16_t must be the raw half bits");
+    const uint16_t* halves = reinterpret_cast<const uint16_t*>(lastHidden);
+    ScopedTimer timer(stageHistogram(Stage::Pool));
+    const size_t D = embeddingDim_;
+    
+    // Accumulating in float keeps long sequences from losing precision in the sum
+    for (int64_t b = 0; b < B; ++b) {
+        float* out = outputs[b];
+        std::fill(out, out + D, 0.f);
         
-        double norm = 0.0;
-        for (int64_t h = 0; h < H; ++h) {
-            norm += out[b * H + h] * out[b * H + h];
+        const int64_t* rowMask = mask + b * S;
+        const uint16_t* rows = halves + b * S * H;
+        for (int64_t t = 0; t < S; ++t) {
+            if (rowMask[t]) {
+                vector_kernels::addHalf(out, rows + t * H, D);
+            }
         }
         
-        norm = std::sqrt(norm) + 1e-12;
-        
-        for (int64_t h = 0; h < H; ++h) {
-            out[b * H + h] = static_cast<float>(out[b * H + h] / norm);
-        }
+        vector_kernels::l2Normalize(out, D);
+    }
+}
+
+EmbeddingDrift measureEmbeddingDrift(InferenceEngine& reference, InferenceEngine& candidate,
+                                     const std::vector<std::string>& probes) {
+    if (reference.getEmbeddingDimension() != candidate.getEmbeddingDimension()) {
+        throw std::runtime_error("Models produce different embedding dimensions (" +
+                                 std::to_string(reference.getEmbeddingDimension()) + " vs " +
+                                 std::to_string(candidate.getEmbeddingDimension()) + ")");
+    }
+    
+    EmbeddingDrift drift;
+    if (probes.empty()) {
+        return drift;
     }
     
-    return out;
+    EmbeddingMatrix expected = reference.getEmbeddings(probes);
+    EmbeddingMatrix actual = candidate.getEmbeddings(probes);
+    
+    // Both sides are unit length, so the dot product is the cosine
+    std::vector<double> cosines(probes.size());
+    for (size_t i = 0; i < probes.size(); ++i) {
+        cosines[i] = vector_kernels::dot(expected[i].data(), actual[i].data(), expected.dimension());
+    }
+    std::sort(cosines.begin(), cosines.end());
+    
+    drift.probes = cosines.size();
+    drift.meanCosine = std::accumulate(cosines.begin(), cosines.end(), 0.0) / static_cast<double>(cosines.size());
+    drift.p50Cosine = cosines[cosines.size() / 2];
+    drift.p5Cosine = cosines[cosines.size() / 20];
+    drift.minCosine = cosines.front();
+    return drift;
+}
+
+std::string InferenceEngine::computeModelFingerprint(const std::string& modelPath, const std::string& tokenizerPath) {
+    // FNV-1a over the model size, its first and last megabyte and the full tokenizer.
+    // Hashing a multi-GB model in full would add seconds to every startup.
+    constexpr size_t SAMPLE_BYTES = 1 << 20;
+    uint64_t hash = 1469598103934665603ULL;
+    auto mix = [&hash](const uint8_t* data, size_t len) {
+        for (size_t i = 0; i < len; ++i) {
+            hash ^= data[i];
+            hash *= 1099511628211ULL;
+        }
+    };
+    
+    std::ifstream model(modelPath, std::ios::binary | std::ios::ate);
+    if (!model) {
+        throw std::runtime_error("Cannot open " + modelPath);
+    }
+    uint64_t modelSize = static_cast<uint64_t>(model.tellg());
+    mix(reinterpret_cast<const uint8_t*>(&modelSize), sizeof(modelSize));
+    
+    std::vector<uint8_t> sample(std::min<uint64_t>(SAMPLE_BYTES, modelSize));
+    model.seekg(0);
+    model.read(reinterpret_cast<char*>(sample.data()), sample.size());
+    mix(sample.data(), sample.size());
+    model.seekg(modelSize - sample.size());
+    model.read(reinterpret_cast<char*>(sample.data()), sample.size());
+    mix(sample.data(), sample.size());
+    
+    auto tokenizer = readFileBytes(tokenizerPath);
+    mix(tokenizer.data(), tokenizer.size());
+    
+    char buf[17];
+    std::snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(hash));
+    return buf;
 }
 
 std::vector<uint8_t> InferenceEngine::readFileBytes(const std::string& path) {
@@ -0,0 +1,51 @@
+#include "log.h"
+#include <chrono>
+#include <cstdio>
+
+namespace {
+
+std::atomic<int> currentLevel{static_cast<int>(LogLevel::Info)};
+
+const char* levelTag(LogLevel level) {
+    switch (level) {
+        case LogLevel::Error: return "[error] ";
+        case LogLevel::Warning: return "[warn] ";
+        case LogLevel::Info: return "[info] ";
+        case LogLevel::Debug: return "[debug] ";
+    }
+    return "";
+}
+
+}
+
+void setLogLevel(LogLevel level) {
+    currentLevel.store(static_cast<int>(level), std::memory_order_relaxed);
+}
+
+bool logEnabled(LogLevel level) {
+    return static_cast<int>(level) <= currentLevel.load(std::memory_order_relaxed);
+}
+
+void writeLog(LogLevel level, const std::string& message) {
+    // One fwrite per line: stdio locks the stream, so lines from concurrent threads do not interleave
+    std::string line = levelTag(level) + message + "\n";
+    FILE* stream = level <= LogLevel::Warning ? stderr : stdout;
+    std::fwrite(line.data(), 1, line.size(), stream);
+    std::fflush(stream);
+}
+
+bool LogRateLimiter::allow(uint64_t& suppressed) {
+    const int64_t now = std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    int64_t second = second_.load(std::memory_order_relaxed);
+    if (second != now && second_.compare_exchange_strong(second, now, std::memory_order_relaxed)) {
+        written_.store(0, std::memory_order_relaxed);
+    }
+
+    if (written_.fetch_add(1, std::memory_order_relaxed) < LOG_LINES_PER_SECOND) {
+        suppressed = dropped_.exchange(0, std::memory_order_relaxed);
+        return true;
+    }
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
@@ -0,0 +1,176 @@
+#include "metrics.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <unistd.h>
+#ifdef __APPLE__
+#include <mach/mach.h>
+#endif
+
+namespace {
+
+std::string escapeLabelValue(const std::string& value) {
+    std::string escaped;
+    escaped.reserve(value.size());
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            escaped += '\\';
+            escaped += c;
+        } else if (c == '\n') {
+            escaped += "\\n";
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+// Label set without braces, so histograms can append their le label
+std::string renderLabels(const MetricLabels& labels) {
+    std::string rendered;
+    for (const auto& [key, value] : labels) {
+        if (!rendered.empty()) {
+            rendered += ',';
+        }
+        rendered += key + "=\"" + escapeLabelValue(value) + "\"";
+    }
+    return rendered;
+}
+
+std::string formatNumber(double value) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.10g", value);
+    return buffer;
+}
+
+std::string withLabels(const std::string& name, const std::string& labels) {
+    return labels.empty() ? name : name + "{" + labels + "}";
+}
+
+}
+
+const std::array<double, LatencyHistogram::BUCKETS>& LatencyHistogram::bounds() {
+    static const std::array<double, BUCKETS> values = {
+        25e-6, 50e-6, 100e-6, 250e-6, 500e-6,
+        1e-3, 2.5e-3, 5e-3, 10e-3, 25e-3, 50e-3, 100e-3, 250e-3, 500e-3,
+        1.0, 2.5, 5.0, 10.0
+    };
+    return values;
+}
+
+void LatencyHistogram::observe(std::chrono::nanoseconds elapsed) {
+    const double seconds = static_cast<double>(elapsed.count()) * 1e-9;
+    const auto& upper = bounds();
+    const size_t bucket = static_cast<size_t>(std::lower_bound(upper.begin(), upper.end(), seconds) - upper.begin());
+    counts_[bucket].fetch_add(1, std::memory_order_relaxed);
+    sumNanos_.fetch_add(static_cast<uint64_t>(std::max<int64_t>(0, elapsed.count())), std::memory_order_relaxed);
+}
+
+MetricsRegistry::Series& MetricsRegistry::series(const std::string& name, const char* type, const std::string& help,
+                                                 const MetricLabels& labels) {
+    Family& family = families_[name];
+    if (family.type.empty()) {
+        family.type = type;
+        family.help = help;
+    }
+    return family.series[renderLabels(labels)];
+}
+
+Counter& MetricsRegistry::counter(const std::string& name, const std::string& help, const MetricLabels& labels) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Series& entry = series(name, "counter", help, labels);
+    if (!entry.counter) {
+        entry.counter = std::make_unique<Counter>();
+    }
+    return *entry.counter;
+}
+
+LatencyHistogram& MetricsRegistry::histogram(const std::string& name, const std::string& help, const MetricLabels& labels) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Series& entry = series(name, "histogram", help, labels);
+    if (!entry.histogram) {
+        entry.histogram = std::make_unique<LatencyHistogram>();
+    }
+    return *entry.histogram;
+}
+
+void MetricsRegistry::gauge(const std::string& name, const std::string& help, std::function<double()> read,
+                            const MetricLabels& labels) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    series(name, "gauge", help, labels).read = std::move(read);
+}
+
+void MetricsRegistry::counterFrom(const std::string& name, const std::string& help, std::function<double()> read,
+                                  const MetricLabels& labels) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    series(name, "counter", help, labels).read = std::move(read);
+}
+
+std::string MetricsRegistry::render() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string out;
+    for (const auto& [name, family] : families_) {
+        out += "# HELP " + name + " " + family.help + "\n";
+        out += "# TYPE " + name + " " + family.type + "\n";
+
+        for (const auto& [labels, entry] : family.series) {
+            if (entry.counter) {
+                out += withLabels(name, labels) + " " + std::to_string(entry.counter->value()) + "\n";
+            } else if (entry.read) {
+                out += withLabels(name, labels) + " " + formatNumber(entry.read()) + "\n";
+            } else if (entry.histogram) {
+                // Buckets are exported cumulatively, as Prometheus expects
+                const std::string prefix = labels.empty() ? "" : labels + ",";
+                const auto& upper = LatencyHistogram::bounds();
+                uint64_t cumulative = 0;
+                for (size_t i = 0; i <= LatencyHistogram::BUCKETS; ++i) {
+                    cumulative += entry.histogram->bucketCount(i);
+                    std::string le = i < LatencyHistogram::BUCKETS ? formatNumber(upper[i]) : "+Inf";
+                    out += name + "_bucket{" + prefix + "le=\"" + le + "\"} " + std::to_string(cumulative) + "\n";
+                }
+                out += withLabels(name + "_sum", labels) + " " + formatNumber(entry.histogram->sumSeconds()) + "\n";
+                out += withLabels(name + "_count", labels) + " " + std::to_string(cumulative) + "\n";
+            }
+        }
+    }
+    return out;
+}
+
+MetricsRegistry& metrics() {
+    static MetricsRegistry registry;
+    return registry;
+}
+
+LatencyHistogram& stageHistogram(Stage stage) {
+    static const std::array<LatencyHistogram*, 9> histograms = [] {
+        const char* names[] = {"parse", "tokenize", "infer", "pool", "vector", "keyword", "hydrate", "serialize", "compress"};
+        std::array<LatencyHistogram*, 9> registered{};
+        for (size_t i = 0; i < registered.size(); ++i) {
+            registered[i] = &metrics().histogram("fastfindr_stage_duration_seconds",
+                                                 "Time spent in each stage of embedding and search",
+                                                 {{"stage", names[i]}});
+        }
+        return registered;
+    }();
+    return *histograms[static_cast<size_t>(stage)];
+}
+
+size_t residentMemoryBytes() {
+#ifdef __APPLE__
+    mach_task_basic_info_data_t info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, reinterpret_cast<task_info_t>(&info), &count) == KERN_SUCCESS) {
+        return static_cast<size_t>(info.resident_size);
+    }
+    return 0;
+#else
+    // Second field of statm is resident pages
+    std::ifstream statm("/proc/self/statm");
+    size_t totalPages = 0;
+    size_t residentPages = 0;
+    if (statm >> totalPages >> residentPages) {
+        return residentPages * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    }
+    return 0;
+#endif
+}
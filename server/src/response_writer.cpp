@@ -0,0 +1,427 @@
+#include "response_writer.h"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+#ifdef FASTFINDR_HAS_ZLIB
+#include <zlib.h>
+#endif
+#ifdef FASTFINDR_HAS_ZSTD
+#include <zstd.h>
+#endif
+
+namespace {
+
+// The fastest levels of both codecs: JSON results shrink several times over at them, and higher levels
+// cost much more CPU per response for a few more percent
+constexpr int GZIP_LEVEL = 1;
+constexpr int ZSTD_LEVEL = 1;
+
+// "a;q=0.5, b" as (name, quality) pairs, names lowercased; parameters other than q are dropped
+std::vector<std::pair<std::string, double>> qualityList(const std::string& header) {
+    std::vector<std::pair<std::string, double>> entries;
+    size_t start = 0;
+    while (start < header.size()) {
+        size_t end = header.find(',', start);
+        if (end == std::string::npos) {
+            end = header.size();
+        }
+        std::string entry = header.substr(start, end - start);
+        start = end + 1;
+
+        double quality = 1.0;
+        size_t parameters = entry.find(';');
+        if (parameters != std::string::npos) {
+            size_t q = entry.find("q=", parameters);
+            if (q != std::string::npos) {
+                quality = std::strtod(entry.c_str() + q + 2, nullptr);
+            }
+            entry.resize(parameters);
+        }
+
+        entry.erase(std::remove_if(entry.begin(), entry.end(), [](unsigned char c) { return std::isspace(c); }),
+                    entry.end());
+        std::transform(entry.begin(), entry.end(), entry.begin(), [](unsigned char c) { return std::tolower(c); });
+        if (!entry.empty()) {
+            entries.emplace_back(std::move(entry), quality);
+        }
+    }
+    return entries;
+}
+
+bool formatFromMediaType(const std::string& type, ResponseFormat& format) {
+    if (type == "application/json" || type == "application/*" || type == "*/*") {
+        format = ResponseFormat::Json;
+    } else if (type == "application/msgpack" || type == "application/x-msgpack" || type == "application/vnd.msgpack") {
+        format = ResponseFormat::MessagePack;
+    } else if (type == "application/cbor") {
+        format = ResponseFormat::Cbor;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+}
+
+ResponseFormat negotiateFormat(const std::string& accept) {
+    // Ties go to the type listed first
+    ResponseFormat best = ResponseFormat::Json;
+    double bestQuality = 0.0;
+    for (const auto& [type, quality] : qualityList(accept)) {
+        ResponseFormat format;
+        if (quality > bestQuality && formatFromMediaType(type, format)) {
+            best = format;
+            bestQuality = quality;
+        }
+    }
+    return best;
+}
+
+const char* formatContentType(ResponseFormat format) {
+    switch (format) {
+        case ResponseFormat::MessagePack: return "application/msgpack";
+        case ResponseFormat::Cbor: return "application/cbor";
+        default: return "application/json";
+    }
+}
+
+ContentEncoding negotiateEncoding(const std::string& acceptEncoding) {
+    double gzip = -1.0;
+    double zstd = -1.0;
+    double any = 0.0;
+    for (const auto& [coding, quality] : qualityList(acceptEncoding)) {
+        if (coding == "gzip" || coding == "x-gzip") {
+            gzip = quality;
+        } else if (coding == "zstd") {
+            zstd = quality;
+        } else if (coding == "*") {
+            any = quality;
+        }
+    }
+    // Codings that are not listed get the quality of "*", if any
+    if (gzip < 0.0) {
+        gzip = any;
+    }
+    if (zstd < 0.0) {
+        zstd = any;
+    }
+
+#ifndef FASTFINDR_HAS_ZLIB
+    gzip = 0.0;
+#endif
+#ifndef FASTFINDR_HAS_ZSTD
+    zstd = 0.0;
+#endif
+    if (zstd > 0.0 && zstd >= gzip) {
+        return ContentEncoding::Zstd;
+    }
+    return gzip > 0.0 ? ContentEncoding::Gzip : ContentEncoding::Identity;
+}
+
+const char* contentEncodingName(ContentEncoding encoding) {
+    switch (encoding) {
+        case ContentEncoding::Gzip: return "gzip";
+        case ContentEncoding::Zstd: return "zstd";
+        default: return "identity";
+    }
+}
+
+bool compressBody(std::string& body, ContentEncoding encoding) {
+    std::string compressed;
+    switch (encoding) {
+#ifdef FASTFINDR_HAS_ZLIB
+        case ContentEncoding::Gzip: {
+            z_stream stream{};
+            // 16 added to the window bits asks for a gzip header and trailer instead of zlib's
+            if (deflateInit2(&stream, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                return false;
+            }
+            compressed.resize(deflateBound(&stream, static_cast<uLong>(body.size())));
+            stream.next_in = reinterpret_cast<Bytef*>(&body[0]);
+            stream.avail_in = static_cast<uInt>(body.size());
+            stream.next_out = reinterpret_cast<Bytef*>(&compressed[0]);
+            stream.avail_out = static_cast<uInt>(compressed.size());
+            const int status = deflate(&stream, Z_FINISH);
+            compressed.resize(stream.total_out);
+            deflateEnd(&stream);
+            if (status != Z_STREAM_END) {
+                return false;
+            }
+            break;
+        }
+#endif
+#ifdef FASTFINDR_HAS_ZSTD
+        case ContentEncoding::Zstd: {
+            compressed.resize(ZSTD_compressBound(body.size()));
+            const size_t written = ZSTD_compress(&compressed[0], compressed.size(), body.data(), body.size(), ZSTD_LEVEL);
+            if (ZSTD_isError(written)) {
+                return false;
+            }
+            compressed.resize(written);
+            break;
+        }
+#endif
+        default:
+            return false;
+    }
+
+    // Already-dense bodies, such as short binary ones, can come out larger
+    if (compressed.size() >= body.size()) {
+        return false;
+    }
+    body.swap(compressed);
+    return true;
+}
+
+ResponseWriter::ResponseWriter(ResponseFormat format, const ResultFields& fields)
+    : format_(format), fields_(fields) {}
+
+void ResponseWriter::bigEndian(uint64_t value, size_t bytes) {
+    for (size_t i = bytes; i-- > 0;) {
+        body_ += static_cast<char>((value >> (8 * i)) & 0xff);
+    }
+}
+
+void ResponseWriter::header(uint8_t major, uint64_t length) {
+    const uint8_t type = static_cast<uint8_t>(major << 5);
+    if (length < 24) {
+        body_ += static_cast<char>(type | length);
+    } else if (length <= 0xff) {
+        body_ += static_cast<char>(type | 24);
+        bigEndian(length, 1);
+    } else if (length <= 0xffff) {
+        body_ += static_cast<char>(type | 25);
+        bigEndian(length, 2);
+    } else if (length <= 0xffffffffULL) {
+        body_ += static_cast<char>(type | 26);
+        bigEndian(length, 4);
+    } else {
+        body_ += static_cast<char>(type | 27);
+        bigEndian(length, 8);
+    }
+}
+
+// JSON needs a comma before every element but the first, and none after a key
+void ResponseWriter::separate() {
+    if (format_ != ResponseFormat::Json) {
+        return;
+    }
+    if (afterKey_) {
+        afterKey_ = false;
+    } else if (!first_.empty()) {
+        if (!first_.back()) {
+            body_ += ',';
+        }
+        first_.back() = false;
+    }
+}
+
+void ResponseWriter::beginObject(size_t members) {
+    separate();
+    switch (format_) {
+        case ResponseFormat::Json:
+            body_ += '{';
+            first_.push_back(true);
+            break;
+        case ResponseFormat::MessagePack:
+            if (members < 16) {
+                body_ += static_cast<char>(0x80 | members);
+            } else if (members <= 0xffff) {
+                body_ += static_cast<char>(0xde);
+                bigEndian(members, 2);
+            } else {
+                body_ += static_cast<char>(0xdf);
+                bigEndian(members, 4);
+            }
+            break;
+        case ResponseFormat::Cbor:
+            header(5, members);
+            break;
+    }
+}
+
+void ResponseWriter::endObject() {
+    if (format_ == ResponseFormat::Json) {
+        body_ += '}';
+        first_.pop_back();
+    }
+}
+
+void ResponseWriter::beginArray(size_t elements) {
+    separate();
+    switch (format_) {
+        case ResponseFormat::Json:
+            body_ += '[';
+            first_.push_back(true);
+            break;
+        case ResponseFormat::MessagePack:
+            if (elements < 16) {
+                body_ += static_cast<char>(0x90 | elements);
+            } else if (elements <= 0xffff) {
+                body_ += static_cast<char>(0xdc);
+                bigEndian(elements, 2);
+            } else {
+                body_ += static_cast<char>(0xdd);
+                bigEndian(elements, 4);
+            }
+            break;
+        case ResponseFormat::Cbor:
+            header(4, elements);
+            break;
+    }
+}
+
+void ResponseWriter::endArray() {
+    if (format_ == ResponseFormat::Json) {
+        body_ += ']';
+        first_.pop_back();
+    }
+}
+
+void ResponseWriter::key(const std::string& name) {
+    string(name);
+    if (format_ == ResponseFormat::Json) {
+        body_ += ':';
+        afterKey_ = true;
+    }
+}
+
+void ResponseWriter::string(const std::string& value) {
+    separate();
+    switch (format_) {
+        case ResponseFormat::Json: {
+            // Bytes are copied through in runs; only quotes, backslashes and control characters are escaped
+            body_ += '"';
+            size_t run = 0;
+            for (size_t i = 0; i < value.size(); ++i) {
+                const unsigned char c = static_cast<unsigned char>(value[i]);
+                if (c >= 0x20 && c != '"' && c != '\\') {
+                    continue;
+                }
+                body_.append(value, run, i - run);
+                run = i + 1;
+                switch (c) {
+                    case '"': body_ += "\\\""; break;
+                    case '\\': body_ += "\\\\"; break;
+                    case '\n': body_ += "\\n"; break;
+                    case '\r': body_ += "\\r"; break;
+                    case '\t': body_ += "\\t"; break;
+                    case '\b': body_ += "\\b"; break;
+                    case '\f': body_ += "\\f"; break;
+                    default: {
+                        char escaped[8];
+                        snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                        body_ += escaped;
+                    }
+                }
+            }
+            body_.append(value, run, std::string::npos);
+            body_ += '"';
+            return;
+        }
+        case ResponseFormat::MessagePack:
+            if (value.size() < 32) {
+                body_ += static_cast<char>(0xa0 | value.size());
+            } else if (value.size() <= 0xff) {
+                body_ += static_cast<char>(0xd9);
+                bigEndian(value.size(), 1);
+            } else if (value.size() <= 0xffff) {
+                body_ += static_cast<char>(0xda);
+                bigEndian(value.size(), 2);
+            } else {
+                body_ += static_cast<char>(0xdb);
+                bigEndian(value.size(), 4);
+            }
+            break;
+        case ResponseFormat::Cbor:
+            header(3, value.size());
+            break;
+    }
+    body_ += value;
+}
+
+void ResponseWriter::score(float value) {
+    separate();
+    if (format_ == ResponseFormat::Json) {
+        if (!std::isfinite(value)) {
+            body_ += "null";
+            return;
+        }
+        // Shortest decimal that reads back as the same float; nine digits always do
+        char buffer[32];
+        for (int precision = 6; precision <= 9; ++precision) {
+            snprintf(buffer, sizeof(buffer), "%.*g", precision, static_cast<double>(value));
+            if (std::strtof(buffer, nullptr) == value) {
+                break;
+            }
+        }
+        body_ += buffer;
+        return;
+    }
+
+    // Binary formats carry the float32 as is
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    body_ += static_cast<char>(format_ == ResponseFormat::MessagePack ? 0xca : 0xfa);
+    bigEndian(bits, 4);
+}
+
+void ResponseWriter::results(const std::vector<SearchResult>& results) {
+    const size_t members = fields_.id + fields_.text + fields_.score + fields_.metadata;
+    size_t estimate = 0;
+    for (const auto& result : results) {
+        estimate += 64 + (fields_.text ? result.text.size() : 0);
+    }
+    body_.reserve(body_.size() + estimate);
+
+    beginArray(results.size());
+    for (const auto& result : results) {
+        beginObject(members);
+        if (fields_.id) {
+            key("id");
+            string(result.id);
+        }
+        if (fields_.text) {
+            key("text");
+            string(result.text);
+        }
+        if (fields_.score) {
+            key("score");
+            score(result.score);
+        }
+        if (fields_.metadata) {
+            key("metadata");
+            beginObject(result.metadata.size());
+            for (const auto& [name, value] : result.metadata) {
+                key(name);
+                string(value);
+            }
+            endObject();
+        }
+        endObject();
+    }
+    endArray();
+}
+
+void ResponseWriter::value(const nlohmann::json& value) {
+    separate();
+    switch (format_) {
+        case ResponseFormat::Json:
+            body_ += value.dump();
+            break;
+        case ResponseFormat::MessagePack: {
+            const std::vector<uint8_t> bytes = nlohmann::json::to_msgpack(value);
+            body_.append(bytes.begin(), bytes.end());
+            break;
+        }
+        case ResponseFormat::Cbor: {
+            const std::vector<uint8_t> bytes = nlohmann::json::to_cbor(value);
+            body_.append(bytes.begin(), bytes.end());
+            break;
+        }
+    }
+}
@@ -2,15 +2,658 @@
 #include <string>
 #include <memory>
 #include <filesystem>
+#include <thread>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <deque>
+#include <fstream>
+#include <atomic>
 #include <signal.h>
+#include <unistd.h>
 #include <httplib.h>
 #include <nlohmann/json.hpp>
 #include "server.h"
 #include "vector_search.h"
+#include "inference.h"
+#include "storage.h"
+#include "collection.h"
+#include "metrics.h"
+#include "response_writer.h"
+#include "log.h"
 #include "util.h"
 
 using json = nlohmann::json;
 
+namespace {
+
+// Upper bound on how long a write waits to become searchable when the client asks it to
+constexpr std::chrono::milliseconds INDEX_WAIT_TIMEOUT(30000);
+
+// Queries accepted by one POST /search/batch request
+constexpr size_t MAX_BATCH_QUERIES = 1024;
+
+// Records of a streamed upload are committed this many at a time, one transaction per chunk
+constexpr size_t STREAM_CHUNK_RECORDS = 256;
+// Committed chunks a stream may be ahead of the indexer before the upload stops being read
+constexpr size_t STREAM_CHUNKS_AHEAD = 4;
+// Longest single NDJSON record accepted
+constexpr size_t STREAM_MAX_RECORD_BYTES = 16 << 20;
+// Status lines held in memory before they are spilled to the stream's spool file, and the size of
+// the pieces the response is sent back in
+constexpr size_t STREAM_STATUS_BUFFER_BYTES = 64 << 10;
+
+// Reads {"key": ..., "value": ...}; non-string values are matched by their JSON text
+bool parseMetadataFilter(const json& metadata, MetadataFilter& filter) {
+    if (!metadata.is_object() || !metadata.contains("key") || !metadata.contains("value")) {
+        return false;
+    }
+    filter.key = metadata["key"].get<std::string>();
+    filter.value = metadata["value"].is_string() ? metadata["value"].get<std::string>() : metadata["value"].dump();
+    return true;
+}
+
+int base64Value(char c) {
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '+' || c == '-') return 62;
+    if (c == '/' || c == '_') return 63;
+    return -1;
+}
+
+// Accepts the standard and URL-safe alphabets, with or without '=' padding
+bool decodeBase64(const std::string& text, std::string& bytes) {
+    size_t end = text.size();
+    while (end > 0 && text[end - 1] == '=') {
+        --end;
+    }
+    
+    bytes.clear();
+    bytes.reserve(end / 4 * 3 + 2);
+    uint32_t buffer = 0;
+    int bits = 0;
+    for (size_t i = 0; i < end; ++i) {
+        int value = base64Value(text[i]);
+        if (value < 0) {
+            return false;
+        }
+        buffer = (buffer << 6) | static_cast<uint32_t>(value);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            bytes.push_back(static_cast<char>((buffer >> bits) & 0xffu));
+        }
+    }
+    return true;
+}
+
+// Vectors on the wire are little-endian float32 whatever the server's byte order
+bool embeddingFromBytes(const std::string& bytes, size_t dimension, std::vector<float>& embedding,
+                        const std::string& field, std::string& problem) {
+    if (bytes.size() != dimension * sizeof(float)) {
+        problem = "'" + field + "' has " + std::to_string(bytes.size()) + " bytes, expected " +
+                  std::to_string(dimension * sizeof(float)) + " (" + std::to_string(dimension) + " float32 values)";
+        return false;
+    }
+    embedding.resize(dimension);
+    std::memcpy(embedding.data(), bytes.data(), bytes.size());
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    for (float& value : embedding) {
+        uint32_t word;
+        std::memcpy(&word, &value, sizeof(word));
+        word = __builtin_bswap32(word);
+        std::memcpy(&value, &word, sizeof(word));
+    }
+#endif
+    return true;
+}
+
+// A precomputed embedding is a JSON number array or a base64 string of little-endian float32 values
+bool parseEmbedding(const json& value, size_t dimension, std::vector<float>& embedding,
+                    const std::string& field, std::string& problem) {
+    if (value.is_string()) {
+        std::string bytes;
+        if (!decodeBase64(value.get<std::string>(), bytes)) {
+            problem = "'" + field + "' is not valid base64";
+            return false;
+        }
+        return embeddingFromBytes(bytes, dimension, embedding, field, problem);
+    }
+    
+    if (!value.is_array() || !std::all_of(value.begin(), value.end(), [](const json& x) { return x.is_number(); })) {
+        problem = "'" + field + "' must be an array of numbers or a base64 string";
+        return false;
+    }
+    if (value.size() != dimension) {
+        problem = "'" + field + "' has " + std::to_string(value.size()) + " dimensions, expected " + std::to_string(dimension);
+        return false;
+    }
+    embedding = value.get<std::vector<float>>();
+    return true;
+}
+
+// `fields` in the body, or ?fields=id,score on binary queries, names the parts of each result to send
+// back; text and metadata that are left out are not read from storage either
+bool parseResultFields(const httplib::Request& req, const json& request, ResultFields& fields, std::string& problem) {
+    std::vector<std::string> names;
+    if (request.is_object() && request.contains("fields")) {
+        const json& value = request["fields"];
+        if (!value.is_array() || !std::all_of(value.begin(), value.end(), [](const json& x) { return x.is_string(); })) {
+            problem = "'fields' must be an array of strings";
+            return false;
+        }
+        names = value.get<std::vector<std::string>>();
+    } else if (req.has_param("fields")) {
+        std::string list = req.get_param_value("fields");
+        for (size_t start = 0; start <= list.size();) {
+            size_t end = std::min(list.find(',', start), list.size());
+            names.push_back(list.substr(start, end - start));
+            start = end + 1;
+        }
+    } else {
+        return true;
+    }
+    
+    if (names.empty()) {
+        problem = "'fields' must name at least one field";
+        return false;
+    }
+    fields = ResultFields{false, false, false, false};
+    for (const auto& name : names) {
+        if (name == "id") {
+            fields.id = true;
+        } else if (name == "score") {
+            fields.score = true;
+        } else if (name == "text") {
+            fields.text = true;
+        } else if (name == "metadata") {
+            fields.metadata = true;
+        } else {
+            problem = "Unknown field '" + name + "', expected id, score, text or metadata";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Search responses are written in the format the Accept header asks for
+ResponseWriter responseWriter(const httplib::Request& req, const ResultFields& fields) {
+    return ResponseWriter(negotiateFormat(req.get_header_value("Accept")), fields);
+}
+
+// Sends what `writer` holds, compressed with the best encoding the client accepts once it is big enough
+void sendResponse(const httplib::Request& req, httplib::Response& res, ResponseWriter& writer) {
+    std::string body = writer.take();
+    res.set_header("Vary", "Accept, Accept-Encoding");
+    if (body.size() >= MIN_COMPRESSED_BYTES) {
+        ContentEncoding encoding = negotiateEncoding(req.get_header_value("Accept-Encoding"));
+        ScopedTimer compressTimer(stageHistogram(Stage::Compress));
+        if (compressBody(body, encoding)) {
+            res.set_header("Content-Encoding", contentEncodingName(encoding));
+        }
+    }
+    res.set_content(std::move(body), formatContentType(writer.format()));
+}
+
+// Clients ask for read-your-writes with ?wait=true or "wait": true in the request body
+bool wantsIndexedWrite(const httplib::Request& req, const json& request) {
+    if (req.get_param_value("wait") == "true") {
+        return true;
+    }
+    return request.is_object() && request.contains("wait") && request["wait"].is_boolean() && request["wait"].get<bool>();
+}
+
+// latency_budget_ms and target_recall, from the body or the URL, let the server pick efSearch from its
+// calibration table; `efSearch` is used until the index is calibrated. True when either is given.
+bool parseSearchBudget(const httplib::Request& req, const json& request, int efSearch, SearchBudget& budget,
+                       std::string& problem) {
+    auto read = [&](const char* name, double& value) {
+        if (request.is_object() && request.contains(name) && request[name].is_number()) {
+            value = request[name].get<double>();
+        } else if (req.has_param(name)) {
+            value = std::stod(req.get_param_value(name));
+        }
+    };
+    read("latency_budget_ms", budget.latencyMs);
+    read("target_recall", budget.targetRecall);
+    budget.fallbackEfSearch = efSearch;
+    
+    if (budget.latencyMs < 0.0) {
+        problem = "'latency_budget_ms' must not be negative";
+    } else if (budget.targetRecall < 0.0 || budget.targetRecall > 1.0) {
+        problem = "'target_recall' must be between 0 and 1";
+    }
+    return problem.empty() && (budget.latencyMs > 0.0 || budget.targetRecall > 0.0);
+}
+
+// Tells the client of an adaptive search what its budget bought
+void setSearchBudgetHeaders(httplib::Response& res, const SearchBudget& budget) {
+    res.set_header("X-Ef-Search", std::to_string(budget.efSearch.load()));
+    res.set_header("X-Deadline-Exceeded", budget.deadlineExceeded ? "true" : "false");
+}
+
+json calibrationToJson(const EfSearchCalibration& calibration) {
+    json points = json::array();
+    for (const auto& point : calibration.points) {
+        points.push_back({
+            {"ef_search", point.efSearch},
+            {"recall", point.recall},
+            {"mean_ms", point.meanMs},
+            {"p95_ms", point.p95Ms}
+        });
+    }
+    return {
+        {"k", calibration.k},
+        {"queries", calibration.queries},
+        {"vectors", calibration.vectors},
+        {"points", points}
+    };
+}
+
+// Non-string metadata values are stored as their JSON text
+std::map<std::string, std::string> metadataFromJson(const json& metadata) {
+    std::map<std::string, std::string> values;
+    for (auto& [key, value] : metadata.items()) {
+        values[key] = value.is_string() ? value.get<std::string>() : value.dump();
+    }
+    return values;
+}
+
+// Documents of a batch insert request, in the form addDocuments takes them
+struct DocumentBatch {
+    std::vector<std::string> texts;
+    std::vector<std::map<std::string, std::string>> metadataList;
+    std::vector<std::string> customIds;
+    EmbeddingMatrix embeddings;
+    bool precomputed = false;
+};
+
+// Precomputed embeddings go to the index as one matrix, so a batch has them for all documents or none
+bool parseDocumentBatch(const json& documents, size_t dimension, DocumentBatch& batch, std::string& problem) {
+    batch.precomputed = !documents.empty() && documents.front().is_object() && documents.front().contains("embedding");
+    batch.embeddings = EmbeddingMatrix(batch.precomputed ? documents.size() : 0, dimension);
+    
+    for (const auto& doc : documents) {
+        if (!doc.contains("text") && !batch.precomputed) {
+            problem = "Each document must have 'text' field";
+            return false;
+        }
+        if (doc.contains("embedding") != batch.precomputed) {
+            problem = "Either every document has an 'embedding' or none does";
+            return false;
+        }
+        if (batch.precomputed) {
+            std::vector<float> embedding;
+            if (!parseEmbedding(doc["embedding"], dimension, embedding, "embedding", problem)) {
+                problem = "Document " + std::to_string(batch.texts.size()) + " " + problem;
+                return false;
+            }
+            std::copy(embedding.begin(), embedding.end(), batch.embeddings.row(batch.texts.size()));
+        }
+        
+        batch.texts.push_back(doc.value("text", ""));
+        // An empty ID asks for a generated one
+        batch.customIds.push_back(doc.contains("id") ? doc["id"].get<std::string>() : "");
+        
+        batch.metadataList.push_back(doc.contains("metadata") ? metadataFromJson(doc["metadata"])
+                                                              : std::map<std::string, std::string>{});
+    }
+    return true;
+}
+
+// Incremental state of a POST /documents/stream upload. Complete lines are parsed as they arrive and
+// buffered into chunks that are written with addDocuments. Once STREAM_CHUNKS_AHEAD committed chunks
+// wait for the indexer, consume() blocks until it catches up, so the socket is not read and TCP flow
+// control slows the client down instead of the log growing without bound. Status lines are spooled
+// to an anonymous temporary file, so memory stays bounded however many records the upload holds.
+class StreamIngest {
+public:
+    explicit StreamIngest(VectorSearch& vectorSearch)
+        : vectorSearch_(vectorSearch), dimension_(vectorSearch.getEmbeddingDimension())
+        , spool_(std::tmpfile(), &std::fclose) {
+        if (!spool_) {
+            throw std::runtime_error(std::string("Cannot create a spool file for stream statuses: ") + std::strerror(errno));
+        }
+    }
+    
+    // Takes the next piece of the upload; false stops reading when a record has no end in sight
+    bool consume(const char* data, size_t length) {
+        buffer_.append(data, length);
+        size_t start = 0;
+        for (size_t end; (end = buffer_.find('\n', start)) != std::string::npos; start = end + 1) {
+            addLine(buffer_.substr(start, end - start));
+        }
+        buffer_.erase(0, start);
+        
+        if (buffer_.size() > STREAM_MAX_RECORD_BYTES) {
+            error_ = "Record on line " + std::to_string(lines_ + 1) + " exceeds " +
+                     std::to_string(STREAM_MAX_RECORD_BYTES) + " bytes; the rest of the upload was not read";
+            buffer_.clear();
+            return false;
+        }
+        return true;
+    }
+    
+    // Writes what is still buffered and returns the spool, rewound, holding one status line per record
+    // followed by a summary line
+    std::shared_ptr<std::FILE> finish(bool waitForIndex) {
+        if (error_.empty() && !buffer_.empty()) {
+            addLine(buffer_);  // Last record without a trailing newline
+        }
+        flush();
+        
+        json summary = {
+            {"done", true},
+            {"inserted", inserted_},
+            {"failed", failed_},
+            {"sequence", lastSequence_}
+        };
+        if (waitForIndex) {
+            summary["indexed"] = vectorSearch_.waitForIndexed(lastSequence_, INDEX_WAIT_TIMEOUT);
+        }
+        if (!error_.empty()) {
+            summary["error"] = error_;
+        }
+        emit(summary);
+        spill();
+        std::rewind(spool_.get());
+        return spool_;
+    }
+    
+private:
+    struct Record {
+        size_t line;
+        std::string id;       // Requested ID, replaced by the stored one once written
+        std::string problem;  // Rejected before writing, or the write failed
+        size_t row;           // Index into the chunk's write vectors; unused for rejected records
+    };
+    
+    VectorSearch& vectorSearch_;
+    const size_t dimension_;
+    std::string buffer_;
+    std::string output_;  // Status lines not yet spilled
+    std::shared_ptr<std::FILE> spool_;
+    std::string error_;
+    size_t lines_ = 0;
+    size_t inserted_ = 0;
+    size_t failed_ = 0;
+    int64_t lastSequence_ = 0;
+    std::deque<int64_t> unindexed_;  // Log sequences of committed chunks the indexer may not have reached
+    
+    // The current chunk. Its records either all carry embeddings or none do, as addDocuments takes a
+    // matrix for the whole batch; a record of the other kind starts a new chunk.
+    std::vector<Record> records_;
+    std::vector<std::string> texts_;
+    std::vector<std::map<std::string, std::string>> metadata_;
+    std::vector<std::string> customIds_;
+    std::vector<float> embeddings_;
+    bool precomputed_ = false;
+    
+    void addLine(std::string line) {
+        ++lines_;
+        while (!line.empty() && (line.back() == '\r' || line.back() == ' ' || line.back() == '\t')) {
+            line.pop_back();
+        }
+        if (line.empty()) {
+            return;
+        }
+        
+        Record record{lines_, "", "", 0};
+        std::string text;
+        std::map<std::string, std::string> metadata;
+        std::vector<float> embedding;
+        try {
+            json doc = json::parse(line);
+            if (!doc.is_object() || (!doc.contains("text") && !doc.contains("embedding"))) {
+                record.problem = "Missing 'text' field";
+            } else if (doc.contains("id") && !doc["id"].is_string()) {
+                record.problem = "'id' must be a string";
+            } else {
+                record.id = doc.value("id", "");
+                text = doc.value("text", "");
+                if (doc.contains("metadata")) {
+                    for (auto& [key, value] : doc["metadata"].items()) {
+                        metadata[key] = value.is_string() ? value.get<std::string>() : value.dump();
+                    }
+                }
+                if (doc.contains("embedding")) {
+                    parseEmbedding(doc["embedding"], dimension_, embedding, "embedding", record.problem);
+                }
+            }
+        } catch (const std::exception& e) {
+            record.problem = e.what();
+        }
+        
+        if (!record.problem.empty()) {
+            records_.push_back(std::move(record));
+            return;
+        }
+        
+        const bool precomputed = !embedding.empty();
+        if (precomputed != precomputed_ && !texts_.empty()) {
+            flush();
+        }
+        precomputed_ = precomputed;
+        
+        record.row = texts_.size();
+        records_.push_back(std::move(record));
+        texts_.push_back(std::move(text));
+        metadata_.push_back(std::move(metadata));
+        customIds_.push_back(records_.back().id);
+        embeddings_.insert(embeddings_.end(), embedding.begin(), embedding.end());
+        
+        if (texts_.size() >= STREAM_CHUNK_RECORDS) {
+            flush();
+        }
+    }
+    
+    void flush() {
+        if (!texts_.empty()) {
+            writeChunk();
+        }
+        
+        for (const auto& record : records_) {
+            json status = {{"line", record.line}};
+            if (!record.id.empty()) {
+                status["id"] = record.id;
+            }
+            if (record.problem.empty()) {
+                status["status"] = "ok";
+                ++inserted_;
+            } else {
+                status["status"] = "error";
+                status["error"] = record.problem;
+                ++failed_;
+            }
+            emit(status);
+        }
+        
+        records_.clear();
+        texts_.clear();
+        metadata_.clear();
+        customIds_.clear();
+        embeddings_.clear();
+    }
+    
+    void emit(const json& status) {
+        output_ += status.dump();
+        output_ += '\n';
+        if (output_.size() >= STREAM_STATUS_BUFFER_BYTES) {
+            spill();
+        }
+    }
+    
+    void spill() {
+        if (std::fwrite(output_.data(), 1, output_.size(), spool_.get()) != output_.size()) {
+            throw std::runtime_error(std::string("Cannot spool stream statuses: ") + std::strerror(errno));
+        }
+        output_.clear();
+    }
+    
+    void writeChunk() {
+        EmbeddingMatrix matrix;
+        if (precomputed_) {
+            matrix = EmbeddingMatrix(texts_.size(), dimension_);
+            std::copy(embeddings_.begin(), embeddings_.end(), matrix.data());
+        }
+        
+        std::vector<std::string> ids;
+        int64_t sequence = 0;
+        if (vectorSearch_.addDocuments(texts_, metadata_, customIds_, &sequence, precomputed_ ? &matrix : nullptr, &ids)) {
+            for (auto& record : records_) {
+                if (record.problem.empty()) {
+                    record.id = ids[record.row];
+                }
+            }
+            trackSequence(sequence);
+            return;
+        }
+        
+        // One failing record rolls back the chunk's transaction; write them one by one to find it
+        int64_t lastWritten = 0;
+        for (auto& record : records_) {
+            if (!record.problem.empty()) {
+                continue;
+            }
+            std::vector<float> embedding;
+            if (precomputed_) {
+                EmbeddingView row = matrix[record.row];
+                embedding.assign(row.begin(), row.end());
+            }
+            std::string id = vectorSearch_.addDocument(texts_[record.row], metadata_[record.row], customIds_[record.row],
+                                                       &sequence, precomputed_ ? &embedding : nullptr);
+            if (id.empty()) {
+                record.problem = "Failed to insert document. If it has a custom ID, it may already exist.";
+            } else {
+                record.id = id;
+                lastWritten = sequence;
+            }
+        }
+        if (lastWritten > 0) {
+            trackSequence(lastWritten);
+        }
+    }
+    
+    void trackSequence(int64_t sequence) {
+        lastSequence_ = sequence;
+        unindexed_.push_back(sequence);
+        while (unindexed_.size() > STREAM_CHUNKS_AHEAD) {
+            vectorSearch_.waitForIndexed(unindexed_.front(), INDEX_WAIT_TIMEOUT);
+            unindexed_.pop_front();
+        }
+    }
+};
+
+// Reports the write's log sequence and, when requested, waits for the indexer to apply it
+void finishWrite(VectorSearch& vectorSearch, const httplib::Request& req, const json& request,
+                 int64_t sequence, json& response) {
+    response["sequence"] = sequence;
+    if (wantsIndexedWrite(req, request)) {
+        response["indexed"] = vectorSearch.waitForIndexed(sequence, INDEX_WAIT_TIMEOUT);
+    }
+}
+
+// Collection writes report one log sequence per shard, 0 for shards they did not touch
+void finishCollectionWrite(Collection& collection, const httplib::Request& req, const json& request,
+                           const std::vector<int64_t>& sequences, json& response) {
+    response["sequences"] = sequences;
+    if (wantsIndexedWrite(req, request)) {
+        response["indexed"] = collection.waitForIndexed(sequences, INDEX_WAIT_TIMEOUT);
+    }
+}
+
+// Request count by status code and latency for one route, labelled with the route pattern rather than
+// the path so IDs do not each become a series
+class RouteMetrics {
+public:
+    RouteMetrics(const std::string& method, const std::string& route) {
+        for (size_t i = 0; i < STATUS_CODES.size(); ++i) {
+            std::string code = STATUS_CODES[i] ? std::to_string(STATUS_CODES[i]) : "other";
+            requests_[i] = &metrics().counter("fastfindr_http_requests_total", "HTTP requests by route and status code",
+                                              {{"method", method}, {"route", route}, {"code", code}});
+        }
+        latency_ = &metrics().histogram("fastfindr_http_request_duration_seconds", "HTTP request handling time by route",
+                                        {{"method", method}, {"route", route}});
+    }
+    
+    void record(int status, std::chrono::steady_clock::time_point start) {
+        latency_->observe(std::chrono::steady_clock::now() - start);
+        // Handlers that leave the status unset answer 200
+        status = status > 0 ? status : 200;
+        size_t slot = STATUS_CODES.size() - 1;
+        for (size_t i = 0; i + 1 < STATUS_CODES.size(); ++i) {
+            if (STATUS_CODES[i] == status) {
+                slot = i;
+                break;
+            }
+        }
+        requests_[slot]->increment();
+    }
+    
+private:
+    // Codes the handlers answer with; anything else is counted as "other"
+    static constexpr std::array<int, 8> STATUS_CODES = {200, 201, 400, 404, 409, 500, 503, 0};
+    std::array<Counter*, STATUS_CODES.size()> requests_{};
+    LatencyHistogram* latency_ = nullptr;
+};
+
+httplib::Server::Handler instrumented(const std::string& method, const std::string& route, httplib::Server::Handler handler) {
+    auto routeMetrics = std::make_shared<RouteMetrics>(method, route);
+    return [routeMetrics, handler = std::move(handler)](const httplib::Request& req, httplib::Response& res) {
+        const auto start = std::chrono::steady_clock::now();
+        try {
+            handler(req, res);
+        } catch (...) {
+            routeMetrics->record(500, start);
+            throw;
+        }
+        routeMetrics->record(res.status, start);
+    };
+}
+
+httplib::Server::HandlerWithContentReader instrumented(const std::string& method, const std::string& route,
+                                                       httplib::Server::HandlerWithContentReader handler) {
+    auto routeMetrics = std::make_shared<RouteMetrics>(method, route);
+    return [routeMetrics, handler = std::move(handler)](const httplib::Request& req, httplib::Response& res,
+                                                        const httplib::ContentReader& contentReader) {
+        const auto start = std::chrono::steady_clock::now();
+        try {
+            handler(req, res, contentReader);
+        } catch (...) {
+            routeMetrics->record(500, start);
+            throw;
+        }
+        routeMetrics->record(res.status, start);
+    };
+}
+
+// json::parse of a request body, timed as the parse stage
+json parseRequest(const std::string& body) {
+    ScopedTimer timer(stageHistogram(Stage::Parse));
+    return json::parse(body);
+}
+
+bool buildInferenceOptions(const ServerConfig& config, InferenceOptions& options) {
+    if (!parseExecutionProvider(config.execution_provider, options.provider)) {
+        std::cerr << "Unknown execution provider '" << config.execution_provider
+                  << "', expected cpu, cuda, tensorrt or coreml" << std::endl;
+        return false;
+    }
+    options.intraOpThreads = config.intra_op_threads;
+    options.interOpThreads = config.inter_op_threads;
+    options.allowSpinning = config.ort_spinning;
+    options.deviceId = config.device_id;
+    options.ioBinding = config.io_binding;
+    options.warmup = config.warmup;
+    return true;
+}
+
+}
+
 SearchServer::SearchServer(const ServerConfig& config) : config_(config) {}
 
 bool SearchServer::initialize() {
@@ -25,6 +668,8 @@ bool SearchServer::initialize() {
         if (config_.create_new_db && std::filesystem::exists(config_.index_path)) {
             std::cout << "Removing existing index..." << std::endl;
             std::filesystem::remove(config_.index_path);
+            std::filesystem::remove(config_.index_path + ".ids");
+            std::filesystem::remove(config_.index_path + ".efsearch");
         }
 
         // Initialize VectorSearch
@@ -34,15 +679,74 @@ bool SearchServer::initialize() {
             config_.database_path,
             16, 200
         );
+        vectorSearch_->setCompactionRatio(config_.compaction_ratio);
+        InferenceOptions inferenceOptions;
+        if (!buildInferenceOptions(config_, inferenceOptions)) {
+            return false;
+        }
+        vectorSearch_->setInferenceOptions(inferenceOptions);
+        vectorSearch_->setEmbeddingDimension(static_cast<size_t>(std::max(0, config_.embedding_dim)));
+        
+        IndexOptions indexOptions;
+        if (!parseIndexType(config_.index_type, indexOptions.type)) {
+            std::cerr << "Unknown index type '" << config_.index_type
+                      << "', expected hnsw_flat, hnsw_sq8, hnsw_pq or ivf_pq" << std::endl;
+            return false;
+        }
+        indexOptions.pqSubquantizers = config_.pq_m;
+        indexOptions.ivfLists = config_.ivf_lists;
+        indexOptions.ivfProbes = config_.ivf_probes;
+        indexOptions.trainingSamples = static_cast<size_t>(std::max(0, config_.train_samples));
+        indexOptions.rerankFactor = config_.rerank_factor;
+        indexOptions.memoryMap = config_.index_mmap;
+        vectorSearch_->setIndexOptions(indexOptions);
+        
+        if (config_.metric == "ip" || config_.metric == "cosine") {
+            vectorSearch_->setMetric(faiss::METRIC_INNER_PRODUCT);
+        } else if (config_.metric != "l2") {
+            std::cerr << "Unknown metric '" << config_.metric << "', expected l2 or ip" << std::endl;
+            return false;
+        }
+        
+        StorageOptions storageOptions;
+        storageOptions.journalMode = config_.sqlite_journal_mode;
+        storageOptions.synchronous = config_.sqlite_synchronous;
+        storageOptions.mmapSizeBytes = static_cast<int64_t>(config_.sqlite_mmap_mb) << 20;
+        storageOptions.cacheSizeKb = static_cast<int64_t>(config_.sqlite_cache_mb) * 1024;
+        vectorSearch_->getStorage()->setOptions(storageOptions);
 
         if (!vectorSearch_->initialize()) {
             std::cerr << "Failed to initialize VectorSearch" << std::endl;
             return false;
         }
+        
+        if (config_.batch_max_size > 0) {
+            vectorSearch_->enableQueryBatching(
+                std::chrono::microseconds(static_cast<int64_t>(config_.batch_wait_ms * 1000.0)),
+                static_cast<size_t>(config_.batch_max_size));
+        }
+
+        vectorSearch_->enableQueryCache(static_cast<size_t>(std::max(0, config_.query_cache_mb)) << 20);
+        vectorSearch_->enableResultCache(static_cast<size_t>(std::max(0, config_.result_cache_mb)) << 20);
 
-        // Load or create index
+        // Load or create index, replaying writes logged since the last snapshot
         vectorSearch_->loadOrCreateIndex(config_.index_path);
+        vectorSearch_->startIndexer(config_.index_path,
+                                    std::chrono::seconds(config_.snapshot_interval_s),
+                                    static_cast<size_t>(std::max(1, config_.snapshot_threshold)));
 
+        // Collections share the loaded model and embed their queries through vectorSearch_
+        ShardRuntimeOptions shardOptions;
+        shardOptions.storage = storageOptions;
+        shardOptions.memoryMap = config_.index_mmap;
+        shardOptions.snapshotInterval = std::chrono::seconds(config_.snapshot_interval_s);
+        shardOptions.snapshotThreshold = static_cast<size_t>(std::max(1, config_.snapshot_threshold));
+        collections_ = std::make_unique<CollectionManager>(
+            config_.collections_dir, vectorSearch_->getInferenceEngine(), *vectorSearch_, shardOptions,
+            static_cast<size_t>(std::max(0, config_.search_threads)));
+        collections_->load();
+
+        registerMetrics();
         std::cout << "Server initialized with " << vectorSearch_->getDocumentCount() 
                   << " documents" << std::endl;
 
@@ -50,12 +754,130 @@ bool SearchServer::initialize() {
         return true;
     }
 
+void SearchServer::registerMetrics() {
+        MetricsRegistry& registry = metrics();
+        VectorSearch* search = vectorSearch_.get();
+        
+        registry.gauge("fastfindr_documents", "Documents stored in the default database",
+                       [search] { return static_cast<double>(search->getDocumentCount()); });
+        registry.gauge("fastfindr_index_vectors", "Vectors in the index, including tombstones",
+                       [search] { return static_cast<double>(search->getIndexSize()); });
+        registry.gauge("fastfindr_index_tombstones", "Deleted vectors awaiting compaction",
+                       [search] { return static_cast<double>(search->getTombstoneCount()); });
+        registry.gauge("fastfindr_index_tombstone_ratio", "Share of index vectors that are tombstones", [search] {
+            size_t size = search->getIndexSize();
+            return size ? static_cast<double>(search->getTombstoneCount()) / static_cast<double>(size) : 0.0;
+        });
+        registry.gauge("fastfindr_index_memory_bytes", "Heap held by the index",
+                       [search] { return static_cast<double>(search->getIndexStats().memoryBytes); });
+        registry.gauge("fastfindr_ingest_pending", "Logged writes the indexer has not applied yet", [search] {
+            int64_t pending = search->getStorage()->getLatestLogSequence() - search->getAppliedSequence();
+            return static_cast<double>(std::max<int64_t>(0, pending));
+        });
+        registry.gauge("fastfindr_process_resident_memory_bytes", "Resident set size of the server",
+                       [] { return static_cast<double>(residentMemoryBytes()); });
+        
+        CollectionManager* collections = collections_.get();
+        registry.gauge("fastfindr_collections", "Open collections",
+                       [collections] { return static_cast<double>(collections->list().size()); });
+        
+        if (const EmbeddingScheduler* scheduler = vectorSearch_->getQueryScheduler()) {
+            registry.gauge("fastfindr_embedding_queue_depth", "Queries waiting for an embedding batch",
+                           [scheduler] { return static_cast<double>(scheduler->getStats().queueDepth); });
+            registry.counterFrom("fastfindr_embedding_batches_total", "Query embedding batches run",
+                                 [scheduler] { return static_cast<double>(scheduler->getStats().batches); });
+            registry.counterFrom("fastfindr_embedding_requests_total", "Query texts embedded through the scheduler",
+                                 [scheduler] { return static_cast<double>(scheduler->getStats().requests); });
+            // Cumulative like Prometheus histogram buckets: batches of at most `le` texts
+            for (size_t i = 0; i < SCHEDULER_HISTOGRAM_BUCKETS; ++i) {
+                std::string bound = (i + 1 == SCHEDULER_HISTOGRAM_BUCKETS)
+                    ? "+Inf" : std::to_string(EmbeddingScheduler::histogramBucketBound(i));
+                registry.counterFrom("fastfindr_embedding_batches_by_size_total", "Query embedding batches by batch size", [scheduler, i] {
+                    EmbeddingSchedulerStats stats = scheduler->getStats();
+                    uint64_t batches = 0;
+                    for (size_t j = 0; j <= i; ++j) {
+                        batches += stats.batchSizeHistogram[j];
+                    }
+                    return static_cast<double>(batches);
+                }, {{"le", bound}});
+            }
+        }
+        
+        registry.counterFrom("fastfindr_inference_runs_total", "ONNX Runtime runs",
+                             [search] { return static_cast<double>(search->getInferenceStats().runs); });
+        registry.counterFrom("fastfindr_inference_sequences_total", "Texts embedded",
+                             [search] { return static_cast<double>(search->getInferenceStats().sequences); });
+        registry.counterFrom("fastfindr_inference_tokens_total", "Unpadded tokens fed to the model",
+                             [search] { return static_cast<double>(search->getInferenceStats().tokens); });
+        registry.counterFrom("fastfindr_inference_padded_tokens_total", "Token slots allocated per run, padding included",
+                             [search] { return static_cast<double>(search->getInferenceStats().paddedTokens); });
+        registry.gauge("fastfindr_inference_padding_efficiency", "Share of allocated token slots holding real tokens",
+                       [search] { return search->getInferenceStats().paddingEfficiency(); });
+        
+        auto cacheCounters = [&registry](const std::string& cache, std::function<CacheStats()> stats) {
+            registry.counterFrom("fastfindr_cache_hits_total", "Cache lookups that hit",
+                                 [stats] { return static_cast<double>(stats().hits); }, {{"cache", cache}});
+            registry.counterFrom("fastfindr_cache_misses_total", "Cache lookups that missed",
+                                 [stats] { return static_cast<double>(stats().misses); }, {{"cache", cache}});
+            registry.counterFrom("fastfindr_cache_evictions_total", "Entries evicted to stay within the cache budget",
+                                 [stats] { return static_cast<double>(stats().evictions); }, {{"cache", cache}});
+            registry.gauge("fastfindr_cache_bytes", "Bytes held by the cache",
+                           [stats] { return static_cast<double>(stats().bytes); }, {{"cache", cache}});
+        };
+        if (const auto* queryCache = vectorSearch_->getQueryCache()) {
+            cacheCounters("query_embeddings", [queryCache] { return queryCache->getStats(); });
+        }
+        if (const auto* resultCache = vectorSearch_->getResultCache()) {
+            cacheCounters("results", [resultCache] { return resultCache->getStats(); });
+        }
+    }
+
+int SearchServer::calibrateIndexes() {
+        const size_t queries = static_cast<size_t>(config_.calibrate_queries);
+        const int k = std::max(1, config_.calibrate_k);
+        auto report = [](const std::string& name, const EfSearchCalibration& calibration) {
+            std::cout << name << " (" << calibration.vectors << " vectors, recall@" << calibration.k << "):" << std::endl;
+            for (const auto& point : calibration.points) {
+                std::cout << "  efSearch " << point.efSearch << "  recall " << point.recall
+                          << "  mean " << point.meanMs << " ms  p95 " << point.p95Ms << " ms" << std::endl;
+            }
+        };
+        
+        int calibrated = 0;
+        if (vectorSearch_->calibrateEfSearch(queries, k)) {
+            report(config_.index_path, vectorSearch_->getEfSearchCalibration());
+            calibrated++;
+        }
+        for (const auto& collection : collections_->list()) {
+            for (size_t shard = 0; shard < collection->getShardCount(); ++shard) {
+                if (collection->calibrateShard(shard, queries, k)) {
+                    report(collection->getName() + " shard " + std::to_string(shard), collection->getShardCalibration(shard));
+                    calibrated++;
+                }
+            }
+        }
+        
+        if (calibrated == 0) {
+            std::cerr << "No index could be calibrated: all are empty or do not use efSearch" << std::endl;
+            return 1;
+        }
+        std::cout << "Calibrated " << calibrated << " index(es)" << std::endl;
+        return 0;
+    }
+
 void SearchServer::setupRoutes() {
+        // Searches run concurrently, so size the worker pool to the machine rather than httplib's default
+        size_t workerCount = config_.threads > 0 ? static_cast<size_t>(config_.threads)
+                                                 : std::max(1u, std::thread::hardware_concurrency());
+        server_.new_task_queue = [workerCount] { return new httplib::ThreadPool(workerCount); };
+        
         // CORS headers
         server_.set_pre_routing_handler([](const httplib::Request& req, httplib::Response& res) {
             res.set_header("Access-Control-Allow-Origin", "*");
             res.set_header("Access-Control-Allow-Methods", "GET, POST, PUT, DELETE, OPTIONS");
             res.set_header("Access-Control-Allow-Headers", "Content-Type, Authorization");
+            res.set_header("Access-Control-Expose-Headers", "Server-Timing, X-Ef-Search, X-Deadline-Exceeded");
+            res.set_header("Timing-Allow-Origin", "*");
             return httplib::Server::HandlerResponse::Unhandled;
         });
 
@@ -65,129 +887,1102 @@ void SearchServer::setupRoutes() {
         });
 
         // Health check
-        server_.Get("/health", [this](const httplib::Request&, httplib::Response& res) {
+        server_.Get("/health", instrumented("GET", "/health", [this](const httplib::Request&, httplib::Response& res) {
             json response = {
                 {"status", "healthy"},
                 {"documents", vectorSearch_->getDocumentCount()},
-                {"index_size", vectorSearch_->getIndexSize()}
+                {"index_size", vectorSearch_->getIndexSize()},
+                {"tombstones", vectorSearch_->getTombstoneCount()},
+                {"metric", vectorSearch_->getMetric() == faiss::METRIC_INNER_PRODUCT ? "ip" : "l2"}
+            };
+            
+            int64_t logged = vectorSearch_->getStorage()->getLatestLogSequence();
+            int64_t applied = vectorSearch_->getAppliedSequence();
+            response["ingest"] = {
+                {"logged_sequence", logged},
+                {"applied_sequence", applied},
+                {"pending", std::max<int64_t>(0, logged - applied)}
             };
+            
+            IndexStats indexStats = vectorSearch_->getIndexStats();
+            response["index"] = {
+                {"type", indexTypeName(indexStats.type)},
+                {"memory_bytes", indexStats.memoryBytes},
+                {"mapped", indexStats.mapped}
+            };
+            
+            InferenceStats inference = vectorSearch_->getInferenceStats();
+            response["inference"] = {
+                {"runs", inference.runs},
+                {"sequences", inference.sequences},
+                {"tokens", inference.tokens},
+                {"padded_tokens", inference.paddedTokens},
+                {"padding_efficiency", inference.paddingEfficiency()},
+                {"execution_provider", executionProviderName(vectorSearch_->getExecutionProvider())},
+                {"precision", vectorSearch_->getModelPrecision()}
+            };
+            
+            json caches = json::object();
+            auto cacheJson = [](const CacheStats& stats) {
+                return json{
+                    {"hits", stats.hits},
+                    {"misses", stats.misses},
+                    {"hit_rate", stats.hitRate()},
+                    {"evictions", stats.evictions},
+                    {"entries", stats.entries},
+                    {"bytes", stats.bytes},
+                    {"capacity_bytes", stats.capacityBytes}
+                };
+            };
+            if (const auto* queryCache = vectorSearch_->getQueryCache()) {
+                caches["query_embeddings"] = cacheJson(queryCache->getStats());
+            }
+            if (const auto* resultCache = vectorSearch_->getResultCache()) {
+                caches["results"] = cacheJson(resultCache->getStats());
+                caches["results"]["index_generation"] = vectorSearch_->getIndexGeneration();
+            }
+            response["caches"] = caches;
+            
+            if (const EmbeddingScheduler* scheduler = vectorSearch_->getQueryScheduler()) {
+                EmbeddingSchedulerStats stats = scheduler->getStats();
+                json histogram = json::object();
+                for (size_t i = 0; i < SCHEDULER_HISTOGRAM_BUCKETS; ++i) {
+                    std::string bucket = (i + 1 == SCHEDULER_HISTOGRAM_BUCKETS)
+                        ? "+Inf" : std::to_string(EmbeddingScheduler::histogramBucketBound(i));
+                    histogram[bucket] = stats.batchSizeHistogram[i];
+                }
+                response["embedding_scheduler"] = {
+                    {"queue_depth", stats.queueDepth},
+                    {"requests", stats.requests},
+                    {"batches", stats.batches},
+                    {"batch_size_histogram", histogram}
+                };
+            }
             res.set_content(response.dump(), "application/json");
+        }));
+
+        // Prometheus scrape endpoint
+        server_.Get("/metrics", [](const httplib::Request&, httplib::Response& res) {
+            res.set_content(metrics().render(), "text/plain; version=0.0.4");
         });
 
         // Search endpoint
-        server_.Post("/search", [this](const httplib::Request& req, httplib::Response& res) {
+        server_.Post("/search", instrumented("POST", "/search", [this](const httplib::Request& req, httplib::Response& res) {
             handleSearch(req, res);
-        });
+        }));
+
+        // Many semantic queries in one request
+        server_.Post("/search/batch", instrumented("POST", "/search/batch",
+            [this](const httplib::Request& req, httplib::Response& res) {
+            handleSearchBatch(req, res);
+        }));
 
         // Insert endpoint
-        server_.Post("/documents", [this](const httplib::Request& req, httplib::Response& res) {
+        server_.Post("/documents", instrumented("POST", "/documents",
+            [this](const httplib::Request& req, httplib::Response& res) {
             handleInsert(req, res);
-        });
+        }));
 
         // Upsert endpoint (accepts any non-slash characters as ID)
-        server_.Put("/documents/([^/]+)", [this](const httplib::Request& req, httplib::Response& res) {
+        server_.Put("/documents/([^/]+)", instrumented("PUT", "/documents/{id}",
+            [this](const httplib::Request& req, httplib::Response& res) {
             handleUpsert(req, res);
-        });
+        }));
 
         // Get by ID endpoint (accepts any non-slash characters as ID)
-        server_.Get("/documents/([^/]+)", [this](const httplib::Request& req, httplib::Response& res) {
+        server_.Get("/documents/([^/]+)", instrumented("GET", "/documents/{id}",
+            [this](const httplib::Request& req, httplib::Response& res) {
             handleGetById(req, res);
-        });
+        }));
 
         // Get by metadata endpoint
-        server_.Get("/documents", [this](const httplib::Request& req, httplib::Response& res) {
+        server_.Get("/documents", instrumented("GET", "/documents", [this](const httplib::Request& req, httplib::Response& res) {
             handleGetByMetadata(req, res);
-        });
+        }));
 
         // Delete endpoint (accepts any non-slash characters as ID)
-        server_.Delete("/documents/([^/]+)", [this](const httplib::Request& req, httplib::Response& res) {
+        server_.Delete("/documents/([^/]+)", instrumented("DELETE", "/documents/{id}",
+            [this](const httplib::Request& req, httplib::Response& res) {
             handleDelete(req, res);
-        });
+        }));
 
         // Batch insert endpoint
-        server_.Post("/documents/batch", [this](const httplib::Request& req, httplib::Response& res) {
+        server_.Post("/documents/batch", instrumented("POST", "/documents/batch",
+            [this](const httplib::Request& req, httplib::Response& res) {
             handleBatchInsert(req, res);
-        });
+        }));
+
+        // NDJSON bulk ingest, read from the socket as it arrives
+        server_.Post("/documents/stream", instrumented("POST", "/documents/stream",
+            [this](const httplib::Request& req, httplib::Response& res,
+                                                  const httplib::ContentReader& contentReader) {
+            handleStreamInsert(req, res, contentReader);
+        }));
+
+        // Get by IDs endpoint
+        server_.Post("/documents/get", instrumented("POST", "/documents/get",
+            [this](const httplib::Request& req, httplib::Response& res) {
+            handleGetByIds(req, res);
+        }));
+
+        // Count endpoint
+        server_.Get("/documents/count", instrumented("GET", "/documents/count",
+            [this](const httplib::Request& req, httplib::Response& res) {
+            handleCount(req, res);
+        }));
+
+        // Index management endpoints
+        server_.Post("/index/rebuild", instrumented("POST", "/index/rebuild",
+            [this](const httplib::Request& req, httplib::Response& res) {
+            vectorSearch_->rebuildIndex();
+            if (!vectorSearch_->saveIndex(config_.index_path)) {
+                json error = {{"error", "Index rebuilt but could not be saved"}};
+                res.status = 500;
+                res.set_content(error.dump(), "application/json");
+                return;
+            }
+            json response = {{"status", "success"}, {"message", "Index rebuilt"}};
+            res.set_content(response.dump(), "application/json");
+        }));
+
+        server_.Get("/index/stats", instrumented("GET", "/index/stats",
+            [this](const httplib::Request& req, httplib::Response& res) {
+            handleIndexStats(req, res);
+        }));
+
+        server_.Post("/index/calibrate", instrumented("POST", "/index/calibrate",
+            [this](const httplib::Request& req, httplib::Response& res) {
+            handleIndexCalibrate(req, res);
+        }));
+
+        server_.Post("/index/save", instrumented("POST", "/index/save",
+            [this](const httplib::Request& req, httplib::Response& res) {
+            if (!vectorSearch_->saveIndex(config_.index_path)) {
+                json error = {{"error", "Failed to save index"}};
+                res.status = 500;
+                res.set_content(error.dump(), "application/json");
+                return;
+            }
+            json response = {{"status", "success"}, {"message", "Index saved"}};
+            res.set_content(response.dump(), "application/json");
+        }));
+
+        // Collections: named document sets, each sharded over its own databases and indexes
+        server_.Get("/collections", instrumented("GET", "/collections", [this](const httplib::Request&, httplib::Response& res) {
+            json response = json::array();
+            for (const auto& collection : collections_->list()) {
+                response.push_back({
+                    {"name", collection->getName()},
+                    {"shards", collection->getShardCount()},
+                    {"documents", collection->getDocumentCount()}
+                });
+            }
+            res.set_content(response.dump(), "application/json");
+        }));
+
+        server_.Post("/collections", instrumented("POST", "/collections",
+            [this](const httplib::Request& req, httplib::Response& res) {
+            handleCreateCollection(req, res);
+        }));
+
+        server_.Get("/collections/([A-Za-z0-9_-]+)", instrumented("GET", "/collections/{name}",
+            [this](const httplib::Request& req, httplib::Response& res) {
+            handleGetCollection(req, res);
+        }));
+
+        server_.Delete("/collections/([A-Za-z0-9_-]+)", instrumented("DELETE", "/collections/{name}",
+            [this](const httplib::Request& req, httplib::Response& res) {
+            if (!collections_->drop(req.matches[1])) {
+                json error = {{"error", "Collection not found"}};
+                res.status = 404;
+                res.set_content(error.dump(), "application/json");
+                return;
+            }
+            json response = {{"message", "Collection dropped successfully"}};
+            res.set_content(response.dump(), "application/json");
+        }));
+
+        server_.Post("/collections/([A-Za-z0-9_-]+)/documents", instrumented("POST", "/collections/{name}/documents",
+            [this](const httplib::Request& req, httplib::Response& res) {
+            handleCollectionInsert(req, res);
+        }));
+
+        server_.Post("/collections/([A-Za-z0-9_-]+)/documents/batch", instrumented("POST", "/collections/{name}/documents/batch",
+            [this](const httplib::Request& req, httplib::Response& res) {
+            handleCollectionBatchInsert(req, res);
+        }));
+
+        server_.Put("/collections/([A-Za-z0-9_-]+)/documents/([^/]+)", instrumented("PUT", "/collections/{name}/documents/{id}",
+            [this](const httplib::Request& req, httplib::Response& res) {
+            handleCollectionUpsert(req, res);
+        }));
+
+        server_.Get("/collections/([A-Za-z0-9_-]+)/documents/([^/]+)", instrumented("GET", "/collections/{name}/documents/{id}",
+            [this](const httplib::Request& req, httplib::Response& res) {
+            handleCollectionGetById(req, res);
+        }));
+
+        server_.Delete("/collections/([A-Za-z0-9_-]+)/documents/([^/]+)", instrumented("DELETE", "/collections/{name}/documents/{id}",
+            [this](const httplib::Request& req, httplib::Response& res) {
+            handleCollectionDelete(req, res);
+        }));
+
+        server_.Post("/collections/([A-Za-z0-9_-]+)/search", instrumented("POST", "/collections/{name}/search",
+            [this](const httplib::Request& req, httplib::Response& res) {
+            handleCollectionSearch(req, res);
+        }));
+
+        server_.Post("/collections/([A-Za-z0-9_-]+)/index/rebuild", instrumented("POST", "/collections/{name}/index/rebuild",
+            [this](const httplib::Request& req, httplib::Response& res) {
+            handleCollectionIndex(req, res, IndexAction::Rebuild);
+        }));
+
+        server_.Post("/collections/([A-Za-z0-9_-]+)/index/save", instrumented("POST", "/collections/{name}/index/save",
+            [this](const httplib::Request& req, httplib::Response& res) {
+            handleCollectionIndex(req, res, IndexAction::Save);
+        }));
+
+        server_.Post("/collections/([A-Za-z0-9_-]+)/index/calibrate", instrumented("POST", "/collections/{name}/index/calibrate",
+            [this](const httplib::Request& req, httplib::Response& res) {
+            handleCollectionIndex(req, res, IndexAction::Calibrate);
+        }));
+    }
+
+void SearchServer::handleSearch(const httplib::Request& req, httplib::Response& res) {
+        try {
+            SearchBudget budget;  // Its deadline runs from here
+            const size_t dimension = vectorSearch_->getEmbeddingDimension();
+            
+            // A binary body is the query vector itself as little-endian float32; options come from the URL
+            if (req.get_header_value("Content-Type").rfind("application/octet-stream", 0) == 0) {
+                std::vector<float> embedding;
+                std::string problem;
+                if (!embeddingFromBytes(req.body, dimension, embedding, "body", problem)) {
+                    json error = {{"error", problem}};
+                    res.status = 400;
+                    res.set_content(error.dump(), "application/json");
+                    return;
+                }
+                int k = req.has_param("k") ? std::stoi(req.get_param_value("k")) : 10;
+                float threshold = req.has_param("threshold") ? std::stof(req.get_param_value("threshold")) : 0.0f;
+                int efSearch = req.has_param("efSearch") ? std::stoi(req.get_param_value("efSearch")) : 200;
+                ResultFields fields;
+                const bool adaptive = parseResultFields(req, json(), fields, problem) &&
+                                      parseSearchBudget(req, json(), efSearch, budget, problem);
+                if (!problem.empty()) {
+                    json error = {{"error", problem}};
+                    res.status = 400;
+                    res.set_content(error.dump(), "application/json");
+                    return;
+                }
+                
+                auto results = adaptive ? vectorSearch_->searchEmbedding(embedding, k, threshold, budget, nullptr, fields)
+                                        : vectorSearch_->searchEmbedding(embedding, k, threshold, efSearch, nullptr, fields);
+                if (adaptive) {
+                    setSearchBudgetHeaders(res, budget);
+                }
+                ResponseWriter writer = responseWriter(req, fields);
+                {
+                    ScopedTimer serializeTimer(stageHistogram(Stage::Serialize));
+                    writer.results(results);
+                }
+                sendResponse(req, res, writer);
+                return;
+            }
+            
+            json request = parseRequest(req.body);
+            
+            if (!request.contains("query") && !request.contains("embedding")) {
+                json error = {{"error", "Missing 'query' field"}};
+                res.status = 400;
+                res.set_content(error.dump(), "application/json");
+                return;
+            }
+
+            std::string query = request.value("query", "");
+            int k = request.value("k", 10);
+            float threshold = request.value("threshold", 0.0f);
+            int efSearch = request.value("efSearch", 200);
+            
+            std::vector<SearchResult> results;
+            std::string searchType = request.value("type", "semantic");
+            json timingsJson;
+            
+            std::string budgetProblem;
+            ResultFields fields;
+            const bool adaptive = parseResultFields(req, request, fields, budgetProblem) &&
+                                  parseSearchBudget(req, request, efSearch, budget, budgetProblem);
+            if (budgetProblem.empty() && adaptive && searchType != "semantic") {
+                budgetProblem = "'latency_budget_ms' and 'target_recall' apply to semantic searches only";
+            }
+            if (!budgetProblem.empty()) {
+                json error = {{"error", budgetProblem}};
+                res.status = 400;
+                res.set_content(error.dump(), "application/json");
+                return;
+            }
+            
+            // A metadata predicate filters semantic and hybrid searches; on its own (type "metadata"
+            // or an empty query) it is an exact-match lookup
+            std::unique_ptr<MetadataFilter> filter;
+            if (request.contains("metadata")) {
+                filter = std::make_unique<MetadataFilter>();
+                if (!parseMetadataFilter(request["metadata"], *filter)) {
+                    json error = {{"error", "'metadata' needs 'key' and 'value'"}};
+                    res.status = 400;
+                    res.set_content(error.dump(), "application/json");
+                    return;
+                }
+            }
+            
+            if (request.contains("embedding")) {
+                // A precomputed query vector skips inference; only the vector index can use it
+                std::vector<float> embedding;
+                std::string problem;
+                if (searchType != "semantic") {
+                    problem = "'embedding' applies to semantic searches only";
+                } else {
+                    parseEmbedding(request["embedding"], dimension, embedding, "embedding", problem);
+                }
+                if (!problem.empty()) {
+                    json error = {{"error", problem}};
+                    res.status = 400;
+                    res.set_content(error.dump(), "application/json");
+                    return;
+                }
+                results = adaptive ? vectorSearch_->searchEmbedding(embedding, k, threshold, budget, filter.get(), fields)
+                                   : vectorSearch_->searchEmbedding(embedding, k, threshold, efSearch, filter.get(), fields);
+            } else if (filter && (searchType == "metadata" || query.empty())) {
+                results = vectorSearch_->searchByMetadata(filter->key, filter->value, k);
+            } else if (filter && searchType != "semantic" && searchType != "hybrid") {
+                json error = {{"error", "Metadata filters apply to semantic and hybrid searches only"}};
+                res.status = 400;
+                res.set_content(error.dump(), "application/json");
+                return;
+            } else if (searchType == "text" || searchType == "fulltext") {
+                // Keyword search over the FTS5 index, ranked by BM25
+                results = vectorSearch_->searchKeyword(query, k, threshold, fields);
+            } else if (searchType == "hybrid") {
+                HybridSearchOptions options;
+                std::string fusion = request.value("fusion", "rrf");
+                if (fusion == "weighted") {
+                    options.fusion = FusionMethod::WeightedScore;
+                } else if (fusion != "rrf") {
+                    json error = {{"error", "Unknown fusion '" + fusion + "', expected 'rrf' or 'weighted'"}};
+                    res.status = 400;
+                    res.set_content(error.dump(), "application/json");
+                    return;
+                }
+                options.candidates = request.value("candidates", 0);
+                options.rrfK = request.value("rrf_k", 60.0f);
+                options.semanticWeight = request.value("alpha", 0.5f);
+                
+                SearchTimings timings;
+                results = vectorSearch_->searchHybrid(query, k, threshold, efSearch, options, &timings, filter.get(), fields);
+                
+                // Stage timings travel in the standard Server-Timing header so the body stays a result list
+                char serverTiming[256];
+                snprintf(serverTiming, sizeof(serverTiming),
+                         "embed;dur=%.3f, vector;dur=%.3f, keyword;dur=%.3f, fusion;dur=%.3f, hydrate;dur=%.3f, total;dur=%.3f",
+                         timings.embedMs, timings.vectorMs, timings.keywordMs, timings.fusionMs, timings.hydrateMs, timings.totalMs);
+                res.set_header("Server-Timing", serverTiming);
+                
+                if (request.value("include_timings", false)) {
+                    timingsJson = {
+                        {"embed_ms", timings.embedMs},
+                        {"vector_ms", timings.vectorMs},
+                        {"keyword_ms", timings.keywordMs},
+                        {"fusion_ms", timings.fusionMs},
+                        {"hydrate_ms", timings.hydrateMs},
+                        {"total_ms", timings.totalMs}
+                    };
+                }
+            } else {
+                // Semantic search (default)
+                results = adaptive ? vectorSearch_->searchText(query, k, threshold, budget, filter.get(), fields)
+                                   : vectorSearch_->searchText(query, k, threshold, efSearch, filter.get(), fields);
+            }
+            if (adaptive) {
+                setSearchBudgetHeaders(res, budget);
+            }
+
+            ResponseWriter writer = responseWriter(req, fields);
+            {
+                ScopedTimer serializeTimer(stageHistogram(Stage::Serialize));
+                // Clients that ask for timings in the body get the results wrapped in an object
+                if (!timingsJson.is_null()) {
+                    writer.beginObject(2);
+                    writer.key("results");
+                    writer.results(results);
+                    writer.key("timings");
+                    writer.value(timingsJson);
+                    writer.endObject();
+                } else {
+                    writer.results(results);
+                }
+            }
+            sendResponse(req, res, writer);
+        } catch (const std::exception& e) {
+            json error = {{"error", e.what()}};
+            res.status = 500;
+            res.set_content(error.dump(), "application/json");
+        }
+    }
+
+void SearchServer::handleSearchBatch(const httplib::Request& req, httplib::Response& res) {
+        try {
+            json request = parseRequest(req.body);
+            
+            if (!request.contains("queries") || !request["queries"].is_array()) {
+                json error = {{"error", "Missing 'queries' array"}};
+                res.status = 400;
+                res.set_content(error.dump(), "application/json");
+                return;
+            }
+            if (request["queries"].size() > MAX_BATCH_QUERIES) {
+                json error = {{"error", "At most " + std::to_string(MAX_BATCH_QUERIES) + " queries per batch"}};
+                res.status = 400;
+                res.set_content(error.dump(), "application/json");
+                return;
+            }
+            
+            // Top-level k, threshold and efSearch are defaults that each query may override
+            const int defaultK = request.value("k", 10);
+            const float defaultThreshold = request.value("threshold", 0.0f);
+            const int defaultEfSearch = request.value("efSearch", 200);
+            const size_t dimension = vectorSearch_->getEmbeddingDimension();
+            
+            ResultFields fields;
+            std::string fieldsProblem;
+            if (!parseResultFields(req, request, fields, fieldsProblem)) {
+                json error = {{"error", fieldsProblem}};
+                res.status = 400;
+                res.set_content(error.dump(), "application/json");
+                return;
+            }
+            
+            std::vector<BatchQuery> queries;
+            queries.reserve(request["queries"].size());
+            for (const auto& item : request["queries"]) {
+                BatchQuery query;
+                std::string problem;
+                if (item.is_object() && item.contains("vector")) {
+                    parseEmbedding(item["vector"], dimension, query.embedding, "vector", problem);
+                } else if (item.is_object() && item.contains("query") && item["query"].is_string()) {
+                    query.text = item["query"].get<std::string>();
+                } else {
+                    problem = "needs a 'query' string or a 'vector'";
+                }
+                if (problem.empty() && item.contains("metadata")) {
+                    query.hasFilter = parseMetadataFilter(item["metadata"], query.filter);
+                    if (!query.hasFilter) {
+                        problem = "'metadata' needs 'key' and 'value'";
+                    }
+                }
+                if (!problem.empty()) {
+                    json error = {{"error", "Query " + std::to_string(queries.size()) + " " + problem}};
+                    res.status = 400;
+                    res.set_content(error.dump(), "application/json");
+                    return;
+                }
+                
+                query.k = item.value("k", defaultK);
+                query.threshold = item.value("threshold", defaultThreshold);
+                query.efSearch = item.value("efSearch", defaultEfSearch);
+                queries.push_back(std::move(query));
+            }
+            
+            auto batchResults = vectorSearch_->searchBatch(queries, fields);
+            
+            ResponseWriter writer = responseWriter(req, fields);
+            {
+                ScopedTimer serializeTimer(stageHistogram(Stage::Serialize));
+                writer.beginObject(1);
+                writer.key("results");
+                writer.beginArray(batchResults.size());
+                for (const auto& queryResults : batchResults) {
+                    writer.results(queryResults);
+                }
+                writer.endArray();
+                writer.endObject();
+            }
+            sendResponse(req, res, writer);
+        } catch (const std::exception& e) {
+            json error = {{"error", e.what()}};
+            res.status = 500;
+            res.set_content(error.dump(), "application/json");
+        }
+    }
+
+void SearchServer::handleInsert(const httplib::Request& req, httplib::Response& res) {
+        try {
+            json request = parseRequest(req.body);
+            
+            // With a precomputed embedding the text is optional: it is stored for retrieval and keyword search
+            if (!request.contains("text") && !request.contains("embedding")) {
+                json error = {{"error", "Missing 'text' field"}};
+                res.status = 400;
+                res.set_content(error.dump(), "application/json");
+                return;
+            }
+
+            std::vector<float> embedding;
+            std::string problem;
+            if (request.contains("embedding") &&
+                !parseEmbedding(request["embedding"], vectorSearch_->getEmbeddingDimension(), embedding, "embedding", problem)) {
+                json error = {{"error", problem}};
+                res.status = 400;
+                res.set_content(error.dump(), "application/json");
+                return;
+            }
+
+            std::string text = request.value("text", "");
+            std::map<std::string, std::string> metadata;
+            std::string customId = request.value("id", "");
+            
+            if (request.contains("metadata")) {
+                for (auto& [key, value] : request["metadata"].items()) {
+                    metadata[key] = value.is_string() ? value.get<std::string>() : value.dump();
+                }
+            }
+
+            int64_t sequence = 0;
+            std::string documentId = vectorSearch_->addDocument(text, metadata, customId, &sequence,
+                                                                embedding.empty() ? nullptr : &embedding);
+            if (documentId.empty()) {
+                json error = {{"error", "Failed to insert document. If you provided a custom ID, it may already exist."}};
+                res.status = 500;
+                res.set_content(error.dump(), "application/json");
+                return;
+            }
+
+            json response = {
+                {"id", documentId},
+                {"message", "Document inserted successfully"}
+            };
+            finishWrite(*vectorSearch_, req, request, sequence, response);
+            res.set_content(response.dump(), "application/json");
+        } catch (const std::exception& e) {
+            json error = {{"error", e.what()}};
+            res.status = 500;
+            res.set_content(error.dump(), "application/json");
+        }
+    }
+
+void SearchServer::handleUpsert(const httplib::Request& req, httplib::Response& res) {
+        try {
+            std::string id = req.matches[1];
+            json request = parseRequest(req.body);
+            
+            if (!request.contains("text") && !request.contains("embedding")) {
+                json error = {{"error", "Missing 'text' field"}};
+                res.status = 400;
+                res.set_content(error.dump(), "application/json");
+                return;
+            }
+
+            std::vector<float> embedding;
+            std::string problem;
+            if (request.contains("embedding") &&
+                !parseEmbedding(request["embedding"], vectorSearch_->getEmbeddingDimension(), embedding, "embedding", problem)) {
+                json error = {{"error", problem}};
+                res.status = 400;
+                res.set_content(error.dump(), "application/json");
+                return;
+            }
+
+            std::string text = request.value("text", "");
+            std::map<std::string, std::string> metadata;
+            
+            if (request.contains("metadata")) {
+                for (auto& [key, value] : request["metadata"].items()) {
+                    metadata[key] = value.is_string() ? value.get<std::string>() : value.dump();
+                }
+            }
+
+            // Use upsert which handles both insert and update
+            int64_t sequence = 0;
+            bool success = vectorSearch_->upsertDocument(id, text, metadata, &sequence,
+                                                         embedding.empty() ? nullptr : &embedding);
+
+            if (!success) {
+                json error = {{"error", "Failed to upsert document"}};
+                res.status = 500;
+                res.set_content(error.dump(), "application/json");
+                return;
+            }
+
+            json response = {
+                {"id", id},
+                {"message", "Document upserted successfully"}
+            };
+            finishWrite(*vectorSearch_, req, request, sequence, response);
+            res.set_content(response.dump(), "application/json");
+        } catch (const std::exception& e) {
+            json error = {{"error", e.what()}};
+            res.status = 500;
+            res.set_content(error.dump(), "application/json");
+        }
+    }
+
+void SearchServer::handleGetById(const httplib::Request& req, httplib::Response& res) {
+        try {
+            std::string id = req.matches[1];
+            Document doc = vectorSearch_->getDocument(id);
+            
+            if (doc.id.empty()) {
+                json error = {{"error", "Document not found"}};
+                res.status = 404;
+                res.set_content(error.dump(), "application/json");
+                return;
+            }
+
+            json response = {
+                {"id", doc.id},
+                {"text", doc.text},
+                {"metadata", doc.metadata}
+            };
+            res.set_content(response.dump(), "application/json");
+        } catch (const std::exception& e) {
+            json error = {{"error", e.what()}};
+            res.status = 500;
+            res.set_content(error.dump(), "application/json");
+        }
+    }
+
+void SearchServer::handleGetByIds(const httplib::Request& req, httplib::Response& res) {
+        try {
+            json request = parseRequest(req.body);
+            
+            if (!request.contains("ids") || !request["ids"].is_array()) {
+                json error = {{"error", "Missing 'ids' array"}};
+                res.status = 400;
+                res.set_content(error.dump(), "application/json");
+                return;
+            }
+
+            std::vector<std::string> ids;
+            for (const auto& id : request["ids"]) {
+                if (!id.is_string()) {
+                    json error = {{"error", "Each id must be a string"}};
+                    res.status = 400;
+                    res.set_content(error.dump(), "application/json");
+                    return;
+                }
+                ids.push_back(id.get<std::string>());
+            }
+
+            // Documents come back in request order; unknown ids are skipped
+            auto documents = vectorSearch_->getDocumentsByIds(ids);
+            json response = json::array();
+            
+            for (const auto& doc : documents) {
+                if (doc.id.empty()) {
+                    continue;
+                }
+                json docJson = {
+                    {"id", doc.id},
+                    {"text", doc.text},
+                    {"metadata", doc.metadata}
+                };
+                response.push_back(docJson);
+            }
+
+            res.set_content(response.dump(), "application/json");
+        } catch (const std::exception& e) {
+            json error = {{"error", e.what()}};
+            res.status = 500;
+            res.set_content(error.dump(), "application/json");
+        }
+    }
+
+void SearchServer::handleGetByMetadata(const httplib::Request& req, httplib::Response& res) {
+        try {
+            std::string key = req.get_param_value("key");
+            std::string value = req.get_param_value("value");
+            
+            if (key.empty() || value.empty()) {
+                // Return all documents if no metadata filter
+                auto documents = vectorSearch_->getAllDocuments();
+                json response = json::array();
+                
+                for (const auto& doc : documents) {
+                    json docJson = {
+                        {"id", doc.id},
+                        {"text", doc.text},
+                        {"metadata", doc.metadata}
+                    };
+                    response.push_back(docJson);
+                }
+                
+                res.set_content(response.dump(), "application/json");
+                return;
+            }
+
+            auto documents = vectorSearch_->searchByMetadata(key, value, 1000);
+            json response = json::array();
+            
+            for (const auto& result : documents) {
+                json doc = {
+                    {"id", result.id},
+                    {"text", result.text},
+                    {"metadata", result.metadata}
+                };
+                response.push_back(doc);
+            }
+
+            res.set_content(response.dump(), "application/json");
+        } catch (const std::exception& e) {
+            json error = {{"error", e.what()}};
+            res.status = 500;
+            res.set_content(error.dump(), "application/json");
+        }
+    }
+
+void SearchServer::handleDelete(const httplib::Request& req, httplib::Response& res) {
+        try {
+            std::string id = req.matches[1];
+            
+            int64_t sequence = 0;
+            bool success = vectorSearch_->deleteDocument(id, &sequence);
+            if (!success) {
+                json error = {{"error", "Document not found or failed to delete"}};
+                res.status = 404;
+                res.set_content(error.dump(), "application/json");
+                return;
+            }
+
+            json response = {{"message", "Document deleted successfully"}};
+            finishWrite(*vectorSearch_, req, json::object(), sequence, response);
+            res.set_content(response.dump(), "application/json");
+        } catch (const std::exception& e) {
+            json error = {{"error", e.what()}};
+            res.status = 500;
+            res.set_content(error.dump(), "application/json");
+        }
+    }
+
+void SearchServer::handleCount(const httplib::Request& req, httplib::Response& res) {
+        try {
+            std::string key = req.get_param_value("key");
+            std::string value = req.get_param_value("value");
+            
+            size_t count = 0;
+            
+            if (!key.empty() && !value.empty()) {
+                // Count documents with specific metadata
+                auto documents = vectorSearch_->getStorage()->getDocumentsByMetadata(key, value);
+                count = documents.size();
+            } else {
+                // Count all documents
+                count = vectorSearch_->getDocumentCount();
+            }
+            
+            json response = {
+                {"count", count}
+            };
+            
+            if (!key.empty() && !value.empty()) {
+                response["filter"] = {
+                    {"key", key},
+                    {"value", value}
+                };
+            }
+            
+            res.set_content(response.dump(), "application/json");
+        } catch (const std::exception& e) {
+            json error = {{"error", e.what()}};
+            res.status = 500;
+            res.set_content(error.dump(), "application/json");
+        }
+    }
+
+void SearchServer::handleIndexStats(const httplib::Request& req, httplib::Response& res) {
+        try {
+            // Recall is only measured on request: it scans every stored vector once
+            if (req.has_param("recall_queries")) {
+                size_t queries = static_cast<size_t>(std::max(0, std::stoi(req.get_param_value("recall_queries"))));
+                int k = req.has_param("k") ? std::stoi(req.get_param_value("k")) : 10;
+                int efSearch = req.has_param("ef_search") ? std::stoi(req.get_param_value("ef_search")) : 200;
+                vectorSearch_->measureRecall(queries, k, efSearch);
+            }
+            
+            IndexStats stats = vectorSearch_->getIndexStats();
+            const IndexOptions& options = vectorSearch_->getIndexOptions();
+            json response = {
+                {"type", indexTypeName(stats.type)},
+                {"configured_type", indexTypeName(options.type)},
+                {"vectors", stats.vectors},
+                {"dimension", vectorSearch_->getEmbeddingDimension()},
+                {"memory_bytes", stats.memoryBytes},
+                {"code_bytes", stats.codeBytes},
+                {"rerank_factor", options.rerankFactor},
+                {"mapped", stats.mapped}
+            };
+            
+            if (stats.recallK > 0) {
+                response["recall"] = {
+                    {"k", stats.recallK},
+                    {"queries", stats.recallQueries},
+                    {"value", stats.recall}
+                };
+            }
+            
+            EfSearchCalibration calibration = vectorSearch_->getEfSearchCalibration();
+            if (!calibration.points.empty()) {
+                response["ef_search_calibration"] = calibrationToJson(calibration);
+            }
+            
+            res.set_content(response.dump(), "application/json");
+        } catch (const std::exception& e) {
+            json error = {{"error", e.what()}};
+            res.status = 500;
+            res.set_content(error.dump(), "application/json");
+        }
+    }
+
+void SearchServer::handleIndexCalibrate(const httplib::Request& req, httplib::Response& res) {
+        try {
+            // Runs on the request thread: one exact pass over the stored vectors, then every sampled query
+            // is searched at each candidate efSearch
+            size_t queries = req.has_param("queries") ? static_cast<size_t>(std::max(1, std::stoi(req.get_param_value("queries")))) : 200;
+            int k = req.has_param("k") ? std::max(1, std::stoi(req.get_param_value("k"))) : 10;
+            if (!vectorSearch_->calibrateEfSearch(queries, k)) {
+                json error = {{"error", "Nothing to calibrate: the index is empty or does not use efSearch"}};
+                res.status = 400;
+                res.set_content(error.dump(), "application/json");
+                return;
+            }
+            
+            json response = {
+                {"status", "success"},
+                {"ef_search_calibration", calibrationToJson(vectorSearch_->getEfSearchCalibration())}
+            };
+            res.set_content(response.dump(), "application/json");
+        } catch (const std::exception& e) {
+            json error = {{"error", e.what()}};
+            res.status = 500;
+            res.set_content(error.dump(), "application/json");
+        }
+    }
+
+void SearchServer::handleBatchInsert(const httplib::Request& req, httplib::Response& res) {
+        try {
+            json request = parseRequest(req.body);
+            
+            if (!request.contains("documents") || !request["documents"].is_array()) {
+                json error = {{"error", "Missing 'documents' array"}};
+                res.status = 400;
+                res.set_content(error.dump(), "application/json");
+                return;
+            }
+
+            DocumentBatch batch;
+            std::string problem;
+            if (!parseDocumentBatch(request["documents"], vectorSearch_->getEmbeddingDimension(), batch, problem)) {
+                json error = {{"error", problem}};
+                res.status = 400;
+                res.set_content(error.dump(), "application/json");
+                return;
+            }
+
+            int64_t sequence = 0;
+            if (!vectorSearch_->addDocuments(batch.texts, batch.metadataList, batch.customIds, &sequence,
+                                             batch.precomputed ? &batch.embeddings : nullptr)) {
+                json error = {{"error", "Failed to insert documents. If you provided custom IDs, some may already exist."}};
+                res.status = 500;
+                res.set_content(error.dump(), "application/json");
+                return;
+            }
+
+            json response = {
+                {"message", "Documents inserted successfully"},
+                {"count", batch.texts.size()}
+            };
+            finishWrite(*vectorSearch_, req, request, sequence, response);
+            res.set_content(response.dump(), "application/json");
+        } catch (const std::exception& e) {
+            json error = {{"error", e.what()}};
+            res.status = 500;
+            res.set_content(error.dump(), "application/json");
+        }
+    }
+
+void SearchServer::handleStreamInsert(const httplib::Request& req, httplib::Response& res,
+                                      const httplib::ContentReader& contentReader) {
+        try {
+            StreamIngest ingest(*vectorSearch_);
+            contentReader([&ingest](const char* data, size_t length) {
+                return ingest.consume(data, length);
+            });
+            
+            // Statuses go out once the upload has been read: clients such as the Python SDK only read
+            // the response after sending the whole body, so writing during the upload would fill both
+            // socket buffers and stall the two sides on each other. The spool is sent back in pieces.
+            std::shared_ptr<std::FILE> statuses = ingest.finish(wantsIndexedWrite(req, json::object()));
+            res.set_chunked_content_provider("application/x-ndjson", [statuses](size_t, httplib::DataSink& sink) {
+                std::string piece(STREAM_STATUS_BUFFER_BYTES, '\0');
+                size_t read = std::fread(&piece[0], 1, piece.size(), statuses.get());
+                if (read > 0 && !sink.write(piece.data(), read)) {
+                    return false;
+                }
+                if (read < piece.size()) {
+                    sink.done();
+                }
+                return true;
+            });
+        } catch (const std::exception& e) {
+            json error = {{"error", e.what()}};
+            res.status = 500;
+            res.set_content(error.dump(), "application/json");
+        }
+    }
+
+std::shared_ptr<Collection> SearchServer::findCollection(const httplib::Request& req, httplib::Response& res) {
+    auto collection = collections_->get(req.matches[1]);
+    if (!collection) {
+        json error = {{"error", "Collection not found"}};
+        res.status = 404;
+        res.set_content(error.dump(), "application/json");
+    }
+    return collection;
+}
+
+void SearchServer::handleCreateCollection(const httplib::Request& req, httplib::Response& res) {
+        try {
+            json request = parseRequest(req.body);
+            
+            if (!request.contains("name") || !request["name"].is_string()) {
+                json error = {{"error", "Missing 'name' field"}};
+                res.status = 400;
+                res.set_content(error.dump(), "application/json");
+                return;
+            }
+
+            // Settings the request leaves out follow the server's own index configuration
+            CollectionConfig config;
+            config.indexOptions = vectorSearch_->getIndexOptions();
+            config.metric = vectorSearch_->getMetric();
+            config.compactionRatio = config_.compaction_ratio;
+            std::string problem;
+            if (!parseCollectionConfig(request, config, problem)) {
+                json error = {{"error", problem}};
+                res.status = 400;
+                res.set_content(error.dump(), "application/json");
+                return;
+            }
+
+            auto collection = collections_->create(request["name"].get<std::string>(), config, problem);
+            if (!collection) {
+                json error = {{"error", problem}};
+                res.status = problem.find("already exists") != std::string::npos ? 409 : 400;
+                res.set_content(error.dump(), "application/json");
+                return;
+            }
+
+            json response = {
+                {"name", collection->getName()},
+                {"config", collectionConfigToJson(collection->getConfig())},
+                {"message", "Collection created successfully"}
+            };
+            res.status = 201;
+            res.set_content(response.dump(), "application/json");
+        } catch (const std::exception& e) {
+            json error = {{"error", e.what()}};
+            res.status = 500;
+            res.set_content(error.dump(), "application/json");
+        }
+    }
 
-        // Count endpoint
-        server_.Get("/documents/count", [this](const httplib::Request& req, httplib::Response& res) {
-            handleCount(req, res);
-        });
+void SearchServer::handleGetCollection(const httplib::Request& req, httplib::Response& res) {
+        try {
+            auto collection = findCollection(req, res);
+            if (!collection) {
+                return;
+            }
 
-        // Index management endpoints
-        server_.Post("/index/rebuild", [this](const httplib::Request& req, httplib::Response& res) {
-            vectorSearch_->rebuildIndex();
-            vectorSearch_->saveIndex(config_.index_path);
-            json response = {{"status", "success"}, {"message", "Index rebuilt"}};
-            res.set_content(response.dump(), "application/json");
-        });
+            json shards = json::array();
+            size_t documents = 0;
+            size_t memoryBytes = 0;
+            for (const ShardStats& stats : collection->getShardStats()) {
+                shards.push_back({
+                    {"documents", stats.documents},
+                    {"tombstones", stats.tombstones},
+                    {"logged_sequence", stats.loggedSequence},
+                    {"applied_sequence", stats.appliedSequence},
+                    {"pending", std::max<int64_t>(0, stats.loggedSequence - stats.appliedSequence)},
+                    {"index", {
+                        {"type", indexTypeName(stats.index.type)},
+                        {"vectors", stats.index.vectors},
+                        {"memory_bytes", stats.index.memoryBytes},
+                        {"mapped", stats.index.mapped}
+                    }}
+                });
+                documents += stats.documents;
+                memoryBytes += stats.index.memoryBytes;
+            }
 
-        server_.Post("/index/save", [this](const httplib::Request& req, httplib::Response& res) {
-            vectorSearch_->saveIndex(config_.index_path);
-            json response = {{"status", "success"}, {"message", "Index saved"}};
+            json response = {
+                {"name", collection->getName()},
+                {"config", collectionConfigToJson(collection->getConfig())},
+                {"documents", documents},
+                {"memory_bytes", memoryBytes},
+                {"shards", shards}
+            };
             res.set_content(response.dump(), "application/json");
-        });
+        } catch (const std::exception& e) {
+            json error = {{"error", e.what()}};
+            res.status = 500;
+            res.set_content(error.dump(), "application/json");
+        }
     }
 
-void SearchServer::handleSearch(const httplib::Request& req, httplib::Response& res) {
+void SearchServer::handleCollectionInsert(const httplib::Request& req, httplib::Response& res) {
         try {
-            json request = json::parse(req.body);
+            auto collection = findCollection(req, res);
+            if (!collection) {
+                return;
+            }
+            json request = parseRequest(req.body);
             
-            if (!request.contains("query")) {
-                json error = {{"error", "Missing 'query' field"}};
+            if (!request.contains("text") && !request.contains("embedding")) {
+                json error = {{"error", "Missing 'text' field"}};
                 res.status = 400;
                 res.set_content(error.dump(), "application/json");
                 return;
             }
 
-            std::string query = request["query"];
-            int k = request.value("k", 10);
-            float threshold = request.value("threshold", 0.0f);
-            int efSearch = request.value("efSearch", 200);
-            
-            std::vector<SearchResult> results;
-            std::string searchType = request.value("type", "semantic");
-            
+            std::vector<float> embedding;
+            std::string problem;
+            if (request.contains("embedding") &&
+                !parseEmbedding(request["embedding"], vectorSearch_->getEmbeddingDimension(), embedding, "embedding", problem)) {
+                json error = {{"error", problem}};
+                res.status = 400;
+                res.set_content(error.dump(), "application/json");
+                return;
+            }
+
+            std::map<std::string, std::string> metadata;
             if (request.contains("metadata")) {
-                // Search by metadata
-                auto metadata = request["metadata"];
-                if (metadata.contains("key") && metadata.contains("value")) {
-                    results = vectorSearch_->searchByMetadata(
-                        metadata["key"], metadata["value"], k);
-                }
-            } else if (searchType == "text" || searchType == "fulltext") {
-                // Full text search using SQL
-                auto documents = vectorSearch_->getStorage()->searchDocuments(query);
-                
-                // Convert to SearchResult format and limit results
-                for (size_t i = 0; i < documents.size() && i < static_cast<size_t>(k); ++i) {
-                    const auto& doc = documents[i];
-                    SearchResult result;
-                    result.id = doc.id;
-                    result.text = doc.text;
-                    result.score = 1.0f; // No relevance scoring for text search
-                    result.metadata = doc.metadata;
-                    // Apply threshold for text search too
-                    if (result.score >= threshold) {
-                        results.push_back(result);
-                    }
-                }
-            } else {
-                // Semantic search (default)
-                results = vectorSearch_->searchText(query, k, threshold, efSearch);
+                metadata = metadataFromJson(request["metadata"]);
             }
 
-            json response = json::array();
-            for (const auto& result : results) {
-                json doc = {
-                    {"id", result.id},
-                    {"text", result.text},
-                    {"score", result.score},
-                    {"metadata", result.metadata}
-                };
-                response.push_back(doc);
+            std::vector<int64_t> sequences;
+            std::string documentId = collection->addDocument(request.value("text", ""), metadata, request.value("id", ""),
+                                                             &sequences, embedding.empty() ? nullptr : &embedding);
+            if (documentId.empty()) {
+                json error = {{"error", "Failed to insert document. If you provided a custom ID, it may already exist."}};
+                res.status = 500;
+                res.set_content(error.dump(), "application/json");
+                return;
             }
 
+            json response = {
+                {"id", documentId},
+                {"shard", collection->shardFor(documentId)},
+                {"message", "Document inserted successfully"}
+            };
+            finishCollectionWrite(*collection, req, request, sequences, response);
             res.set_content(response.dump(), "application/json");
         } catch (const std::exception& e) {
             json error = {{"error", e.what()}};
@@ -196,42 +1991,47 @@ void SearchServer::handleSearch(const httplib::Request& req, httplib::Response&
         }
     }
 
-void SearchServer::handleInsert(const httplib::Request& req, httplib::Response& res) {
+void SearchServer::handleCollectionBatchInsert(const httplib::Request& req, httplib::Response& res) {
         try {
-            json request = json::parse(req.body);
+            auto collection = findCollection(req, res);
+            if (!collection) {
+                return;
+            }
+            json request = parseRequest(req.body);
             
-            if (!request.contains("text")) {
-                json error = {{"error", "Missing 'text' field"}};
+            if (!request.contains("documents") || !request["documents"].is_array()) {
+                json error = {{"error", "Missing 'documents' array"}};
                 res.status = 400;
                 res.set_content(error.dump(), "application/json");
                 return;
             }
 
-            std::string text = request["text"];
-            std::map<std::string, std::string> metadata;
-            std::string customId = request.value("id", "");
-            
-            if (request.contains("metadata")) {
-                for (auto& [key, value] : request["metadata"].items()) {
-                    metadata[key] = value.is_string() ? value.get<std::string>() : value.dump();
-                }
+            DocumentBatch batch;
+            std::string problem;
+            if (!parseDocumentBatch(request["documents"], vectorSearch_->getEmbeddingDimension(), batch, problem)) {
+                json error = {{"error", problem}};
+                res.status = 400;
+                res.set_content(error.dump(), "application/json");
+                return;
             }
 
-            std::string documentId = vectorSearch_->addDocument(text, metadata, customId);
-            if (documentId.empty()) {
-                json error = {{"error", "Failed to insert document. If you provided a custom ID, it may already exist."}};
+            // Each shard commits its part separately, so on failure other shards may hold theirs
+            std::vector<int64_t> sequences;
+            std::vector<std::string> documentIds;
+            if (!collection->addDocuments(batch.texts, batch.metadataList, batch.customIds, &sequences,
+                                          batch.precomputed ? &batch.embeddings : nullptr, &documentIds)) {
+                json error = {{"error", "Failed to insert documents. If you provided custom IDs, some may already exist."}};
                 res.status = 500;
                 res.set_content(error.dump(), "application/json");
                 return;
             }
 
-            // Save index after insertion
-            vectorSearch_->saveIndex(config_.index_path);
-
             json response = {
-                {"id", documentId},
-                {"message", "Document inserted successfully"}
+                {"message", "Documents inserted successfully"},
+                {"count", batch.texts.size()},
+                {"ids", documentIds}
             };
+            finishCollectionWrite(*collection, req, request, sequences, response);
             res.set_content(response.dump(), "application/json");
         } catch (const std::exception& e) {
             json error = {{"error", e.what()}};
@@ -240,44 +2040,52 @@ void SearchServer::handleInsert(const httplib::Request& req, httplib::Response&
         }
     }
 
-void SearchServer::handleUpsert(const httplib::Request& req, httplib::Response& res) {
+void SearchServer::handleCollectionUpsert(const httplib::Request& req, httplib::Response& res) {
         try {
-            std::string id = req.matches[1];
-            json request = json::parse(req.body);
+            auto collection = findCollection(req, res);
+            if (!collection) {
+                return;
+            }
+            std::string id = req.matches[2];
+            json request = parseRequest(req.body);
             
-            if (!request.contains("text")) {
+            if (!request.contains("text") && !request.contains("embedding")) {
                 json error = {{"error", "Missing 'text' field"}};
                 res.status = 400;
                 res.set_content(error.dump(), "application/json");
                 return;
             }
 
-            std::string text = request["text"];
+            std::vector<float> embedding;
+            std::string problem;
+            if (request.contains("embedding") &&
+                !parseEmbedding(request["embedding"], vectorSearch_->getEmbeddingDimension(), embedding, "embedding", problem)) {
+                json error = {{"error", problem}};
+                res.status = 400;
+                res.set_content(error.dump(), "application/json");
+                return;
+            }
+
             std::map<std::string, std::string> metadata;
-            
             if (request.contains("metadata")) {
-                for (auto& [key, value] : request["metadata"].items()) {
-                    metadata[key] = value.is_string() ? value.get<std::string>() : value.dump();
-                }
+                metadata = metadataFromJson(request["metadata"]);
             }
 
-            // Use upsert which handles both insert and update
-            bool success = vectorSearch_->upsertDocument(id, text, metadata);
-
-            if (!success) {
+            std::vector<int64_t> sequences;
+            if (!collection->upsertDocument(id, request.value("text", ""), metadata, &sequences,
+                                            embedding.empty() ? nullptr : &embedding)) {
                 json error = {{"error", "Failed to upsert document"}};
                 res.status = 500;
                 res.set_content(error.dump(), "application/json");
                 return;
             }
 
-            // Save index after upsert
-            vectorSearch_->saveIndex(config_.index_path);
-
             json response = {
                 {"id", id},
+                {"shard", collection->shardFor(id)},
                 {"message", "Document upserted successfully"}
             };
+            finishCollectionWrite(*collection, req, request, sequences, response);
             res.set_content(response.dump(), "application/json");
         } catch (const std::exception& e) {
             json error = {{"error", e.what()}};
@@ -286,10 +2094,13 @@ void SearchServer::handleUpsert(const httplib::Request& req, httplib::Response&
         }
     }
 
-void SearchServer::handleGetById(const httplib::Request& req, httplib::Response& res) {
+void SearchServer::handleCollectionGetById(const httplib::Request& req, httplib::Response& res) {
         try {
-            std::string id = req.matches[1];
-            Document doc = vectorSearch_->getDocument(id);
+            auto collection = findCollection(req, res);
+            if (!collection) {
+                return;
+            }
+            Document doc = collection->getDocument(req.matches[2]);
             
             if (doc.id.empty()) {
                 json error = {{"error", "Document not found"}};
@@ -311,65 +2122,23 @@ void SearchServer::handleGetById(const httplib::Request& req, httplib::Response&
         }
     }
 
-void SearchServer::handleGetByMetadata(const httplib::Request& req, httplib::Response& res) {
+void SearchServer::handleCollectionDelete(const httplib::Request& req, httplib::Response& res) {
         try {
-            std::string key = req.get_param_value("key");
-            std::string value = req.get_param_value("value");
-            
-            if (key.empty() || value.empty()) {
-                // Return all documents if no metadata filter
-                auto documents = vectorSearch_->getAllDocuments();
-                json response = json::array();
-                
-                for (const auto& doc : documents) {
-                    json docJson = {
-                        {"id", doc.id},
-                        {"text", doc.text},
-                        {"metadata", doc.metadata}
-                    };
-                    response.push_back(docJson);
-                }
-                
-                res.set_content(response.dump(), "application/json");
+            auto collection = findCollection(req, res);
+            if (!collection) {
                 return;
             }
-
-            auto documents = vectorSearch_->searchByMetadata(key, value, 1000);
-            json response = json::array();
-            
-            for (const auto& result : documents) {
-                json doc = {
-                    {"id", result.id},
-                    {"text", result.text},
-                    {"metadata", result.metadata}
-                };
-                response.push_back(doc);
-            }
-
-            res.set_content(response.dump(), "application/json");
-        } catch (const std::exception& e) {
-            json error = {{"error", e.what()}};
-            res.status = 500;
-            res.set_content(error.dump(), "application/json");
-        }
-    }
-
-void SearchServer::handleDelete(const httplib::Request& req, httplib::Response& res) {
-        try {
-            std::string id = req.matches[1];
             
-            bool success = vectorSearch_->deleteDocument(id);
-            if (!success) {
+            std::vector<int64_t> sequences;
+            if (!collection->deleteDocument(req.matches[2], &sequences)) {
                 json error = {{"error", "Document not found or failed to delete"}};
                 res.status = 404;
                 res.set_content(error.dump(), "application/json");
                 return;
             }
 
-            // Save index after deletion
-            vectorSearch_->saveIndex(config_.index_path);
-
             json response = {{"message", "Document deleted successfully"}};
+            finishCollectionWrite(*collection, req, json::object(), sequences, response);
             res.set_content(response.dump(), "application/json");
         } catch (const std::exception& e) {
             json error = {{"error", e.what()}};
@@ -378,34 +2147,90 @@ void SearchServer::handleDelete(const httplib::Request& req, httplib::Response&
         }
     }
 
-void SearchServer::handleCount(const httplib::Request& req, httplib::Response& res) {
+void SearchServer::handleCollectionSearch(const httplib::Request& req, httplib::Response& res) {
         try {
-            std::string key = req.get_param_value("key");
-            std::string value = req.get_param_value("value");
-            
-            size_t count = 0;
+            SearchBudget budget;
+            auto collection = findCollection(req, res);
+            if (!collection) {
+                return;
+            }
+            json request = parseRequest(req.body);
             
-            if (!key.empty() && !value.empty()) {
-                // Count documents with specific metadata
-                auto documents = vectorSearch_->getStorage()->getDocumentsByMetadata(key, value);
-                count = documents.size();
-            } else {
-                // Count all documents
-                count = vectorSearch_->getDocumentCount();
+            if (!request.contains("query") && !request.contains("embedding")) {
+                json error = {{"error", "Missing 'query' field"}};
+                res.status = 400;
+                res.set_content(error.dump(), "application/json");
+                return;
             }
+
+            std::string query = request.value("query", "");
+            int k = request.value("k", 10);
+            float threshold = request.value("threshold", 0.0f);
+            int efSearch = request.value("efSearch", 200);
+            std::string searchType = request.value("type", "semantic");
             
-            json response = {
-                {"count", count}
-            };
+            std::unique_ptr<MetadataFilter> filter;
+            if (request.contains("metadata")) {
+                filter = std::make_unique<MetadataFilter>();
+                if (!parseMetadataFilter(request["metadata"], *filter)) {
+                    json error = {{"error", "'metadata' needs 'key' and 'value'"}};
+                    res.status = 400;
+                    res.set_content(error.dump(), "application/json");
+                    return;
+                }
+            }
             
-            if (!key.empty() && !value.empty()) {
-                response["filter"] = {
-                    {"key", key},
-                    {"value", value}
-                };
+            // Hybrid fusion needs one candidate list per retriever, which per-shard top k lists do not give
+            std::string problem;
+            if (searchType == "hybrid") {
+                problem = "Hybrid search is not supported on collections";
+            } else if (request.contains("embedding") && searchType != "semantic") {
+                problem = "'embedding' applies to semantic searches only";
+            } else if (filter && searchType != "semantic" && searchType != "metadata" && !query.empty()) {
+                problem = "Metadata filters apply to semantic searches only";
+            }
+            ResultFields fields;
+            const bool adaptive = problem.empty() && parseResultFields(req, request, fields, problem) &&
+                                  parseSearchBudget(req, request, efSearch, budget, problem);
+            if (adaptive && searchType != "semantic") {
+                problem = "'latency_budget_ms' and 'target_recall' apply to semantic searches only";
+            }
+            if (!problem.empty()) {
+                json error = {{"error", problem}};
+                res.status = 400;
+                res.set_content(error.dump(), "application/json");
+                return;
             }
             
-            res.set_content(response.dump(), "application/json");
+            std::vector<SearchResult> results;
+            if (request.contains("embedding")) {
+                std::vector<float> embedding;
+                if (!parseEmbedding(request["embedding"], vectorSearch_->getEmbeddingDimension(), embedding, "embedding", problem)) {
+                    json error = {{"error", problem}};
+                    res.status = 400;
+                    res.set_content(error.dump(), "application/json");
+                    return;
+                }
+                results = adaptive ? collection->searchEmbedding(embedding, k, threshold, budget, filter.get(), fields)
+                                   : collection->searchEmbedding(embedding, k, threshold, efSearch, filter.get(), fields);
+            } else if (filter && (searchType == "metadata" || query.empty())) {
+                results = collection->searchByMetadata(filter->key, filter->value, k);
+            } else if (searchType == "text" || searchType == "fulltext") {
+                results = collection->searchKeyword(query, k, threshold, fields);
+            } else {
+                results = adaptive ? collection->searchText(query, k, threshold, budget, filter.get(), fields)
+                                   : collection->searchText(query, k, threshold, efSearch, filter.get(), fields);
+            }
+            if (adaptive) {
+                setSearchBudgetHeaders(res, budget);
+            }
+
+            ResponseWriter writer = responseWriter(req, fields);
+            {
+                ScopedTimer serializeTimer(stageHistogram(Stage::Serialize));
+                writer.results(results);
+            }
+            sendResponse(req, res, writer);
         } catch (const std::exception& e) {
             json error = {{"error", e.what()}};
             res.status = 500;
@@ -413,56 +2238,62 @@ void SearchServer::handleCount(const httplib::Request& req, httplib::Response& r
         }
     }
 
-void SearchServer::handleBatchInsert(const httplib::Request& req, httplib::Response& res) {
+void SearchServer::handleCollectionIndex(const httplib::Request& req, httplib::Response& res, IndexAction action) {
         try {
-            json request = json::parse(req.body);
-            
-            if (!request.contains("documents") || !request["documents"].is_array()) {
-                json error = {{"error", "Missing 'documents' array"}};
-                res.status = 400;
-                res.set_content(error.dump(), "application/json");
+            auto collection = findCollection(req, res);
+            if (!collection) {
                 return;
             }
 
-            std::vector<std::string> texts;
-            std::vector<std::map<std::string, std::string>> metadataList;
-            std::vector<std::string> customIds;
-            
-            for (const auto& doc : request["documents"]) {
-                if (!doc.contains("text")) {
-                    json error = {{"error", "Each document must have 'text' field"}};
+            // ?shard=i limits the operation to one shard; by default every shard is handled in turn
+            size_t first = 0;
+            size_t last = collection->getShardCount();
+            if (req.has_param("shard")) {
+                int shard = std::stoi(req.get_param_value("shard"));
+                if (shard < 0 || static_cast<size_t>(shard) >= collection->getShardCount()) {
+                    json error = {{"error", "'shard' must be below " + std::to_string(collection->getShardCount())}};
                     res.status = 400;
                     res.set_content(error.dump(), "application/json");
                     return;
                 }
-                
-                texts.push_back(doc["text"]);
-                
-                // Check for custom ID
-                if (doc.contains("id")) {
-                    customIds.push_back(doc["id"]);
+                first = static_cast<size_t>(shard);
+                last = first + 1;
+            }
+
+            size_t queries = req.has_param("queries") ? static_cast<size_t>(std::max(1, std::stoi(req.get_param_value("queries")))) : 200;
+            int k = req.has_param("k") ? std::max(1, std::stoi(req.get_param_value("k"))) : 10;
+            json calibrations = json::array();
+            for (size_t shard = first; shard < last; ++shard) {
+                bool saved = true;
+                if (action == IndexAction::Rebuild) {
+                    saved = collection->rebuildShard(shard);
+                } else if (action == IndexAction::Save) {
+                    saved = collection->saveShard(shard);
                 } else {
-                    customIds.push_back("");  // Empty string means generate random ID
+                    // Empty shards stay uncalibrated and keep using the request's efSearch
+                    collection->calibrateShard(shard, queries, k);
+                    json calibration = calibrationToJson(collection->getShardCalibration(shard));
+                    calibration["shard"] = shard;
+                    calibrations.push_back(calibration);
                 }
-                
-                std::map<std::string, std::string> metadata;
-                if (doc.contains("metadata")) {
-                    for (auto& [key, value] : doc["metadata"].items()) {
-                        metadata[key] = value.is_string() ? value.get<std::string>() : value.dump();
-                    }
+                if (!saved) {
+                    json error = {{"error", "Failed to save the index of shard " + std::to_string(shard)}};
+                    res.status = 500;
+                    res.set_content(error.dump(), "application/json");
+                    return;
                 }
-                metadataList.push_back(metadata);
             }
 
-            vectorSearch_->addDocuments(texts, metadataList, customIds);
-            
-            // Save index after batch insertion
-            vectorSearch_->saveIndex(config_.index_path);
-
+            const char* message = action == IndexAction::Rebuild ? "Index rebuilt"
+                                : action == IndexAction::Save ? "Index saved" : "Index calibrated";
             json response = {
-                {"message", "Documents inserted successfully"},
-                {"count", texts.size()}
+                {"status", "success"},
+                {"message", message},
+                {"shards", last - first}
             };
+            if (action == IndexAction::Calibrate) {
+                response["ef_search_calibration"] = calibrations;
+            }
             res.set_content(response.dump(), "application/json");
         } catch (const std::exception& e) {
             json error = {{"error", e.what()}};
@@ -500,14 +2331,103 @@ ServerConfig parseServerOptions(int argc, char** argv) {
             config.index_path = argv[++i];
         } else if (arg == "--new-db") {
             config.create_new_db = true;
+        } else if (arg == "--threads" && i + 1 < argc) {
+            config.threads = std::stoi(argv[++i]);
+        } else if (arg == "--collections-dir" && i + 1 < argc) {
+            config.collections_dir = argv[++i];
+        } else if (arg == "--search-threads" && i + 1 < argc) {
+            config.search_threads = std::stoi(argv[++i]);
+        } else if (arg == "--batch-wait-ms" && i + 1 < argc) {
+            config.batch_wait_ms = std::stod(argv[++i]);
+        } else if (arg == "--batch-max-size" && i + 1 < argc) {
+            config.batch_max_size = std::stoi(argv[++i]);
+        } else if (arg == "--query-cache-mb" && i + 1 < argc) {
+            config.query_cache_mb = std::stoi(argv[++i]);
+        } else if (arg == "--result-cache-mb" && i + 1 < argc) {
+            config.result_cache_mb = std::stoi(argv[++i]);
+        } else if (arg == "--compaction-ratio" && i + 1 < argc) {
+            config.compaction_ratio = std::stof(argv[++i]);
+        } else if (arg == "--intra-op-threads" && i + 1 < argc) {
+            config.intra_op_threads = std::stoi(argv[++i]);
+        } else if (arg == "--inter-op-threads" && i + 1 < argc) {
+            config.inter_op_threads = std::stoi(argv[++i]);
+        } else if (arg == "--no-spinning") {
+            config.ort_spinning = false;
+        } else if (arg == "--execution-provider" && i + 1 < argc) {
+            config.execution_provider = argv[++i];
+        } else if (arg == "--device-id" && i + 1 < argc) {
+            config.device_id = std::stoi(argv[++i]);
+        } else if (arg == "--no-io-binding") {
+            config.io_binding = false;
+        } else if (arg == "--no-warmup") {
+            config.warmup = false;
+        } else if (arg == "--embedding-dim" && i + 1 < argc) {
+            config.embedding_dim = std::stoi(argv[++i]);
+        } else if (arg == "--index-type" && i + 1 < argc) {
+            config.index_type = argv[++i];
+        } else if (arg == "--pq-m" && i + 1 < argc) {
+            config.pq_m = std::stoi(argv[++i]);
+        } else if (arg == "--ivf-lists" && i + 1 < argc) {
+            config.ivf_lists = std::stoi(argv[++i]);
+        } else if (arg == "--ivf-probes" && i + 1 < argc) {
+            config.ivf_probes = std::stoi(argv[++i]);
+        } else if (arg == "--train-samples" && i + 1 < argc) {
+            config.train_samples = std::stoi(argv[++i]);
+        } else if (arg == "--rerank-factor" && i + 1 < argc) {
+            config.rerank_factor = std::stoi(argv[++i]);
+        } else if (arg == "--index-mmap") {
+            config.index_mmap = true;
+        } else if (arg == "--metric" && i + 1 < argc) {
+            config.metric = argv[++i];
+        } else if (arg == "--snapshot-interval" && i + 1 < argc) {
+            config.snapshot_interval_s = std::stoi(argv[++i]);
+        } else if (arg == "--snapshot-threshold" && i + 1 < argc) {
+            config.snapshot_threshold = std::stoi(argv[++i]);
+        } else if (arg == "--sqlite-journal-mode" && i + 1 < argc) {
+            config.sqlite_journal_mode = argv[++i];
+        } else if (arg == "--sqlite-synchronous" && i + 1 < argc) {
+            config.sqlite_synchronous = argv[++i];
+        } else if (arg == "--sqlite-mmap-mb" && i + 1 < argc) {
+            config.sqlite_mmap_mb = std::stoi(argv[++i]);
+        } else if (arg == "--sqlite-cache-mb" && i + 1 < argc) {
+            config.sqlite_cache_mb = std::stoi(argv[++i]);
+        } else if (arg == "--validate-model" && i + 1 < argc) {
+            config.validate_model_path = argv[++i];
+        } else if (arg == "--validate-probes" && i + 1 < argc) {
+            config.validate_probes_path = argv[++i];
+        } else if (arg == "--validate-samples" && i + 1 < argc) {
+            config.validate_samples = std::stoi(argv[++i]);
+        } else if (arg == "--validate-min-cosine" && i + 1 < argc) {
+            config.validate_min_cosine = std::stod(argv[++i]);
+        } else if (arg == "--calibrate-ef-search" && i + 1 < argc) {
+            config.calibrate_queries = std::stoi(argv[++i]);
+        } else if (arg == "--calibrate-k" && i + 1 < argc) {
+            config.calibrate_k = std::stoi(argv[++i]);
         } else if (arg == "--level" && i + 1 < argc) {
             int level = std::stoi(argv[++i]);
             switch (level) {
-                case 1: config.logging_level = ORT_LOGGING_LEVEL_WARNING; break;
-                case 2: config.logging_level = ORT_LOGGING_LEVEL_INFO; break;
-                case 3: config.logging_level = ORT_LOGGING_LEVEL_VERBOSE; break;
+                case 1: config.logging_level = ORT_LOGGING_LEVEL_WARNING; config.log_level = LogLevel::Warning; break;
+                case 2: config.logging_level = ORT_LOGGING_LEVEL_INFO; config.log_level = LogLevel::Info; break;
+                case 3: config.logging_level = ORT_LOGGING_LEVEL_VERBOSE; config.log_level = LogLevel::Debug; break;
                 default: std::cout << "Invalid log level. Using default (INFO)." << std::endl;
             }
+        } else if (arg == "--log-level" && i + 1 < argc) {
+            std::string level = argv[++i];
+            if (level == "error") {
+                config.logging_level = ORT_LOGGING_LEVEL_ERROR;
+                config.log_level = LogLevel::Error;
+            } else if (level == "warning") {
+                config.logging_level = ORT_LOGGING_LEVEL_WARNING;
+                config.log_level = LogLevel::Warning;
+            } else if (level == "info") {
+                config.logging_level = ORT_LOGGING_LEVEL_INFO;
+                config.log_level = LogLevel::Info;
+            } else if (level == "verbose" || level == "debug") {
+                config.logging_level = ORT_LOGGING_LEVEL_VERBOSE;
+                config.log_level = LogLevel::Debug;
+            } else {
+                std::cout << "Invalid log level. Using default (info)." << std::endl;
+            }
         } else if (arg == "--help") {
             std::cout << "Usage: " << argv[0] << " [options]\n\n";
             std::cout << "Options:\n";
@@ -518,6 +2438,43 @@ ServerConfig parseServerOptions(int argc, char** argv) {
             std::cout << "  --database PATH     Path to SQLite database file\n";
             std::cout << "  --index PATH        Path to FAISS index file\n";
             std::cout << "  --new-db            Create new database (removes existing)\n";
+            std::cout << "  --threads N         HTTP worker threads (default: hardware threads)\n";
+            std::cout << "  --collections-dir PATH  Directory holding the collections (default: collections)\n";
+            std::cout << "  --search-threads N  Workers searching collection shards in parallel (default: hardware threads)\n";
+            std::cout << "  --batch-wait-ms MS  Max wait to batch concurrent query embeddings (default: 2)\n";
+            std::cout << "  --batch-max-size N  Max queries per embedding batch, 0 disables (default: 32)\n";
+            std::cout << "  --query-cache-mb MB   Query embedding cache size, 0 disables (default: 64)\n";
+            std::cout << "  --result-cache-mb MB  Search result cache size, 0 disables (default: 0)\n";
+            std::cout << "  --compaction-ratio R  Tombstone ratio that triggers index compaction (default: 0.2, 0 disables)\n";
+            std::cout << "  --intra-op-threads N  ONNX Runtime threads per operator (default: physical cores)\n";
+            std::cout << "  --inter-op-threads N  ONNX Runtime threads for parallel graph branches (default: sequential)\n";
+            std::cout << "  --no-spinning       Let idle ONNX Runtime threads sleep instead of busy-waiting\n";
+            std::cout << "  --execution-provider EP  cpu, cuda, tensorrt or coreml (default: cpu)\n";
+            std::cout << "  --device-id N       GPU ordinal for cuda and tensorrt (default: 0)\n";
+            std::cout << "  --no-io-binding     Let ONNX Runtime allocate outputs on every run\n";
+            std::cout << "  --no-warmup         Skip the inference warmup at startup\n";
+            std::cout << "  --embedding-dim N   Truncate embeddings to N dimensions, e.g. 512, 256, 128 (default: model size)\n";
+            std::cout << "  --index-type TYPE   Index layout: hnsw_flat, hnsw_sq8, hnsw_pq, ivf_pq (default: hnsw_flat)\n";
+            std::cout << "  --pq-m N            PQ code bytes per vector (default: dimension / 16)\n";
+            std::cout << "  --ivf-lists N       IVF-PQ coarse centroids (default: 4 * sqrt(documents))\n";
+            std::cout << "  --ivf-probes N      IVF-PQ lists scanned per query (default: 16)\n";
+            std::cout << "  --train-samples N   Stored vectors sampled to train quantizers (default: 32768)\n";
+            std::cout << "  --rerank-factor N   Re-score k * N quantized candidates exactly, 0 disables (default: 0)\n";
+            std::cout << "  --index-mmap        Serve the loaded index from mapped file pages; the first insert copies it to memory\n";
+            std::cout << "  --metric METRIC     Index metric: l2 or ip (cosine similarity) (default: l2)\n";
+            std::cout << "  --snapshot-interval SEC  Max seconds between index snapshots while writes are unsaved (default: 30)\n";
+            std::cout << "  --snapshot-threshold N   Unsaved writes that trigger an index snapshot (default: 1000)\n";
+            std::cout << "  --sqlite-journal-mode MODE  SQLite journal mode (default: WAL)\n";
+            std::cout << "  --sqlite-synchronous MODE   SQLite synchronous mode: OFF, NORMAL, FULL, EXTRA (default: NORMAL)\n";
+            std::cout << "  --sqlite-mmap-mb MB   SQLite memory-mapped I/O size, 0 disables (default: 256)\n";
+            std::cout << "  --sqlite-cache-mb MB  SQLite page cache per connection (default: 64)\n";
+            std::cout << "  --validate-model PATH  Compare embeddings from PATH (e.g. an int8 export) with --model and exit\n";
+            std::cout << "  --validate-probes FILE Probe texts for --validate-model, one per line (default: sample the database)\n";
+            std::cout << "  --validate-samples N   Documents sampled as probes (default: 256)\n";
+            std::cout << "  --validate-min-cosine C  Fail if the 5th-percentile cosine is below C (default: 0.98)\n";
+            std::cout << "  --calibrate-ef-search N  Time searches at each efSearch on N sampled vectors per index, save the tables and exit\n";
+            std::cout << "  --calibrate-k K     Results per calibration search (default: 10)\n";
+            std::cout << "  --log-level LEVEL   Logging level: error, warning, info or verbose (default: info)\n";
             std::cout << "  --level LEVEL       Logging level (1=WARNING, 2=INFO, 3=VERBOSE)\n";
             std::cout << "  --help              Show this help message\n";
             exit(0);
@@ -527,8 +2484,82 @@ ServerConfig parseServerOptions(int argc, char** argv) {
     return config;
 }
 
+int runModelValidation(const ServerConfig& config) {
+    std::vector<std::string> probes;
+    if (!config.validate_probes_path.empty()) {
+        std::ifstream file(config.validate_probes_path);
+        if (!file) {
+            std::cerr << "Cannot open probe file " << config.validate_probes_path << std::endl;
+            return 1;
+        }
+        std::string line;
+        while (std::getline(file, line)) {
+            if (!line.empty()) {
+                probes.push_back(line);
+            }
+        }
+    } else {
+        Storage storage(config.database_path);
+        if (!storage.initialize()) {
+            std::cerr << "Failed to open database " << config.database_path << std::endl;
+            return 1;
+        }
+        probes = storage.sampleDocumentTexts(static_cast<size_t>(std::max(1, config.validate_samples)));
+    }
+    if (probes.empty()) {
+        std::cerr << "No probe texts to validate with; pass --validate-probes or a non-empty database" << std::endl;
+        return 1;
+    }
+    
+    InferenceOptions options;
+    if (!buildInferenceOptions(config, options)) {
+        return 1;
+    }
+    options.warmup = false;
+    
+    InferenceEngine reference;
+    InferenceEngine candidate;
+    reference.setOutputDimension(static_cast<size_t>(std::max(0, config.embedding_dim)));
+    candidate.setOutputDimension(static_cast<size_t>(std::max(0, config.embedding_dim)));
+    if (!reference.loadModel(config.model_path, config.tokenizer_path, options) ||
+        !candidate.loadModel(config.validate_model_path, config.tokenizer_path, options)) {
+        return 1;
+    }
+    
+    EmbeddingDrift drift;
+    try {
+        drift = measureEmbeddingDrift(reference, candidate, probes);
+    } catch (const std::exception& e) {
+        std::cerr << "Validation failed: " << e.what() << std::endl;
+        return 1;
+    }
+    
+    bool passed = drift.p5Cosine >= config.validate_min_cosine;
+    json report = {
+        {"reference", {{"model", config.model_path}, {"precision", reference.getPrecision()}}},
+        {"candidate", {{"model", config.validate_model_path}, {"precision", candidate.getPrecision()}}},
+        {"dimension", reference.getEmbeddingDimension()},
+        {"probes", drift.probes},
+        {"cosine", {
+            {"mean", drift.meanCosine},
+            {"p50", drift.p50Cosine},
+            {"p5", drift.p5Cosine},
+            {"min", drift.minCosine}
+        }},
+        {"min_cosine", config.validate_min_cosine},
+        {"passed", passed}
+    };
+    std::cout << report.dump(2) << std::endl;
+    return passed ? 0 : 2;
+}
+
 int main(int argc, char** argv) {
     ServerConfig config = parseServerOptions(argc, argv);
+    setLogLevel(config.log_level);
+    
+    if (!config.validate_model_path.empty()) {
+        return runModelValidation(config);
+    }
     
     std::cout << "Starting Semantic Search Server..." << std::endl;
     std::cout << "Model: " << config.model_path << std::endl;
@@ -536,6 +2567,14 @@ int main(int argc, char** argv) {
     std::cout << "Database: " << config.database_path << std::endl;
     std::cout << "Index: " << config.index_path << std::endl;
     
+    // SIGINT and SIGTERM are blocked before any background thread starts, so every thread inherits the
+    // mask and only the waiter below receives them
+    sigset_t shutdownSignals;
+    sigemptyset(&shutdownSignals);
+    sigaddset(&shutdownSignals, SIGINT);
+    sigaddset(&shutdownSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &shutdownSignals, nullptr);
+    
     SearchServer server(config);
     
     if (!server.initialize()) {
@@ -543,13 +2582,28 @@ int main(int argc, char** argv) {
         return 1;
     }
     
-    // Handle Ctrl+C gracefully
-    signal(SIGINT, [](int) {
-        std::cout << "\nShutting down server..." << std::endl;
-        exit(0);
+    if (config.calibrate_queries > 0) {
+        return server.calibrateIndexes();
+    }
+    
+    // Ctrl+C only stops the listener: run() returns and main unwinds, so ~SearchServer stops the indexer
+    // (taking its final snapshot) and the worker threads before static destructors run
+    std::atomic<bool> shuttingDown{false};
+    std::thread signalWaiter([&] {
+        int signal = 0;
+        sigwait(&shutdownSignals, &signal);
+        if (!shuttingDown.exchange(true)) {
+            std::cout << "\nShutting down server..." << std::endl;
+            server.stop();
+        }
     });
     
     server.run();
     
+    // The listener can also stop on its own (the port was taken); wake the waiter so it can be joined
+    if (!shuttingDown.exchange(true)) {
+        kill(getpid(), SIGTERM);
+    }
+    signalWaiter.join();
     return 0;
 }
\ No newline at end of file
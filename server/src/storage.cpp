@@ -1,12 +1,16 @@
 #include "storage.h"
-#include <iostream>
+#include "log.h"
 #include <sstream>
 #include <algorithm>
 #include <random>
 #include <chrono>
+#include <cstring>
+#include <unordered_map>
+#include <strings.h>
 
 Storage::Storage(const std::string& dbPath) 
-    : db_(nullptr), dbPath_(dbPath), inTransaction_(false) {
+    : db_(nullptr), dbPath_(dbPath), inTransaction_(false)
+    , poolReaders_(dbPath != ":memory:" && !dbPath.empty()) {
 }
 
 Storage::~Storage() {
@@ -14,30 +18,44 @@ Storage::~Storage() {
 }
 
 bool Storage::initialize() {
+    std::lock_guard<std::recursive_mutex> lock(writerMutex_);
     if (db_) {
         return true; // Already initialized
     }
     
     int rc = sqlite3_open(dbPath_.c_str(), &db_);
     if (rc != SQLITE_OK) {
-        std::cerr << "Cannot open database: " << sqlite3_errmsg(db_) << std::endl;
+        LOG_ERROR("Cannot open database: " << sqlite3_errmsg(db_));
         sqlite3_close(db_);
         db_ = nullptr;
         return false;
     }
     
+    // Readers and the writer wait on each other's locks instead of failing with SQLITE_BUSY
+    sqlite3_busy_timeout(db_, 5000);
+    
     // Enable foreign key constraints
     executeSQL("PRAGMA foreign_keys = ON;");
+    applyConnectionOptions(db_, true);
     
     return createTables();
 }
 
 void Storage::close() {
+    std::lock_guard<std::recursive_mutex> lock(writerMutex_);
+    {
+        std::lock_guard<std::mutex> poolLock(readerPoolMutex_);
+        for (sqlite3* reader : idleReaders_) {
+            closeConnection(reader);
+        }
+        idleReaders_.clear();
+    }
+    
     if (db_) {
         if (inTransaction_) {
             rollbackTransaction();
         }
-        sqlite3_close(db_);
+        closeConnection(db_);
         db_ = nullptr;
     }
 }
@@ -45,6 +63,9 @@ void Storage::close() {
 bool Storage::createTables() {
     // Drop old tables if they exist (for migration)
     const std::string dropOldTables = R"(
+        DROP TABLE IF EXISTS documents_fts;
+        DROP TABLE IF EXISTS ingest_log;
+        DROP TABLE IF EXISTS document_embeddings;
         DROP TABLE IF EXISTS document_metadata;
         DROP TABLE IF EXISTS documents;
     )";
@@ -71,8 +92,55 @@ bool Storage::createTables() {
         );
     )";
     
-    const std::string createTextIndex = R"(
-        CREATE INDEX IF NOT EXISTS idx_documents_text ON documents(text);
+    const std::string createEmbeddingsTable = R"(
+        CREATE TABLE IF NOT EXISTS document_embeddings (
+            document_id TEXT PRIMARY KEY,
+            model TEXT NOT NULL,
+            dimension INTEGER NOT NULL,
+            vector BLOB NOT NULL,
+            FOREIGN KEY (document_id) REFERENCES documents(id) ON DELETE CASCADE
+        );
+    )";
+    
+    // AUTOINCREMENT keeps sequences monotonic after the applied prefix is truncated
+    const std::string createIngestLogTable = R"(
+        CREATE TABLE IF NOT EXISTS ingest_log (
+            seq INTEGER PRIMARY KEY AUTOINCREMENT,
+            op INTEGER NOT NULL,
+            document_id TEXT NOT NULL,
+            created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
+            vector BLOB
+        );
+    )";
+    
+    // A B-tree over whole texts cannot serve keyword queries and only added write amplification
+    const std::string dropTextIndex = R"(
+        DROP INDEX IF EXISTS idx_documents_text;
+    )";
+    
+    // External-content FTS5 index over documents.text, addressed by the documents rowid and kept in
+    // sync by triggers. VACUUM may renumber those rowids, so startup checks the index against the
+    // table and rebuilds it when they disagree.
+    const std::string createFullTextTable = R"(
+        CREATE VIRTUAL TABLE IF NOT EXISTS documents_fts USING fts5(
+            text,
+            content='documents',
+            content_rowid='rowid',
+            tokenize='unicode61'
+        );
+    )";
+    
+    const std::string createFullTextTriggers = R"(
+        CREATE TRIGGER IF NOT EXISTS documents_fts_insert AFTER INSERT ON documents BEGIN
+            INSERT INTO documents_fts(rowid, text) VALUES (new.rowid, new.text);
+        END;
+        CREATE TRIGGER IF NOT EXISTS documents_fts_delete AFTER DELETE ON documents BEGIN
+            INSERT INTO documents_fts(documents_fts, rowid, text) VALUES ('delete', old.rowid, old.text);
+        END;
+        CREATE TRIGGER IF NOT EXISTS documents_fts_update AFTER UPDATE OF text ON documents BEGIN
+            INSERT INTO documents_fts(documents_fts, rowid, text) VALUES ('delete', old.rowid, old.text);
+            INSERT INTO documents_fts(rowid, text) VALUES (new.rowid, new.text);
+        END;
     )";
     
     const std::string createMetadataIndex = R"(
@@ -94,14 +162,53 @@ bool Storage::createTables() {
     }
     
     if (needsMigration) {
-        std::cout << "Migrating database to support custom text IDs..." << std::endl;
+        LOG_INFO("Migrating database to support custom text IDs...");
         executeSQL(dropOldTables);
     }
     
-    return executeSQL(createDocumentsTable) &&
-           executeSQL(createMetadataTable) &&
-           executeSQL(createTextIndex) &&
-           executeSQL(createMetadataIndex);
+    // Databases created before the full-text index need it populated from existing documents
+    bool needsFullTextBackfill = true;
+    stmt = prepareStatement("SELECT 1 FROM sqlite_master WHERE type='table' AND name='documents_fts';");
+    if (stmt) {
+        needsFullTextBackfill = sqlite3_step(stmt) != SQLITE_ROW;
+        finalizeStatement(stmt);
+    }
+    
+    bool created = executeSQL(createDocumentsTable) &&
+                   executeSQL(createMetadataTable) &&
+                   executeSQL(createEmbeddingsTable) &&
+                   executeSQL(createIngestLogTable) &&
+                   executeSQL(dropTextIndex) &&
+                   executeSQL(createFullTextTable) &&
+                   executeSQL(createFullTextTriggers) &&
+                   executeSQL(createMetadataIndex);
+    
+    // With rank 1 the integrity check also compares every entry against the content table, which is
+    // what catches rowids renumbered by a VACUUM since the last start
+    if (created && !needsFullTextBackfill) {
+        std::lock_guard<std::recursive_mutex> lock(writerMutex_);
+        if (sqlite3_exec(db_, "INSERT INTO documents_fts(documents_fts, rank) VALUES ('integrity-check', 1);",
+                         nullptr, nullptr, nullptr) != SQLITE_OK) {
+            LOG_WARN("Full-text index does not match the documents table, rebuilding it");
+            needsFullTextBackfill = true;
+        }
+    }
+    
+    if (created && needsFullTextBackfill) {
+        created = executeSQL("INSERT INTO documents_fts(documents_fts) VALUES ('rebuild');");
+    }
+    
+    // Logs created before precomputed embeddings were accepted lack the vector column
+    bool hasLogVector = false;
+    stmt = prepareStatement("SELECT 1 FROM pragma_table_info('ingest_log') WHERE name = 'vector';");
+    if (stmt) {
+        hasLogVector = sqlite3_step(stmt) == SQLITE_ROW;
+        finalizeStatement(stmt);
+    }
+    if (created && !hasLogVector) {
+        created = executeSQL("ALTER TABLE ingest_log ADD COLUMN vector BLOB;");
+    }
+    return created;
 }
 
 std::string Storage::generateRandomId() {
@@ -129,16 +236,17 @@ std::string Storage::generateRandomId() {
 }
 
 std::string Storage::addDocument(const std::string& text, const std::map<std::string, std::string>& metadata, const std::string& customId) {
+    std::lock_guard<std::recursive_mutex> lock(writerMutex_);
     if (!db_) {
-        std::cerr << "Database not initialized" << std::endl;
+        LOG_ERROR("Database not initialized");
         return "";
     }
     
     std::string documentId = customId.empty() ? generateRandomId() : customId;
     
     // Check if document already exists
-    if (!customId.empty() && documentExists(documentId)) {
-        std::cerr << "Document with id '" << documentId << "' already exists. Use upsert to update." << std::endl;
+    if (!customId.empty() && documentExists(db_, documentId)) {
+        LOG_WARN("Document with id '" << documentId << "' already exists. Use upsert to update.");
         return "";
     }
     
@@ -153,14 +261,14 @@ std::string Storage::addDocument(const std::string& text, const std::map<std::st
     finalizeStatement(stmt);
     
     if (rc != SQLITE_DONE) {
-        std::cerr << "Error inserting document: " << sqlite3_errmsg(db_) << std::endl;
+        LOG_ERROR("Error inserting document: " << sqlite3_errmsg(db_));
         return "";
     }
     
     // Add metadata
     for (const auto& [key, value] : metadata) {
         if (!addMetadata(documentId, key, value)) {
-            std::cerr << "Warning: Failed to add metadata " << key << " for document " << documentId << std::endl;
+            LOG_WARN("Failed to add metadata " << key << " for document " << documentId);
         }
     }
     
@@ -168,8 +276,9 @@ std::string Storage::addDocument(const std::string& text, const std::map<std::st
 }
 
 bool Storage::updateDocument(const std::string& id, const std::string& text, const std::map<std::string, std::string>& metadata) {
+    std::lock_guard<std::recursive_mutex> lock(writerMutex_);
     if (!db_) {
-        std::cerr << "Database not initialized" << std::endl;
+        LOG_ERROR("Database not initialized");
         return false;
     }
     
@@ -184,7 +293,7 @@ bool Storage::updateDocument(const std::string& id, const std::string& text, con
     finalizeStatement(stmt);
     
     if (rc != SQLITE_DONE) {
-        std::cerr << "Error updating document: " << sqlite3_errmsg(db_) << std::endl;
+        LOG_ERROR("Error updating document: " << sqlite3_errmsg(db_));
         return false;
     }
     
@@ -203,7 +312,7 @@ bool Storage::updateDocument(const std::string& id, const std::string& text, con
     
     for (const auto& [key, value] : metadata) {
         if (!addMetadata(id, key, value)) {
-            std::cerr << "Warning: Failed to update metadata " << key << " for document " << id << std::endl;
+            LOG_WARN("Failed to update metadata " << key << " for document " << id);
         }
     }
     
@@ -211,17 +320,17 @@ bool Storage::updateDocument(const std::string& id, const std::string& text, con
 }
 
 bool Storage::upsertDocument(const std::string& id, const std::string& text, const std::map<std::string, std::string>& metadata) {
+    std::lock_guard<std::recursive_mutex> lock(writerMutex_);
     if (!db_) {
-        std::cerr << "Database not initialized" << std::endl;
+        LOG_ERROR("Database not initialized");
         return false;
     }
     
-    // Use INSERT OR REPLACE for atomic upsert
+    // Update in place on conflict: REPLACE would delete the row, so the full-text triggers would
+    // miss the old text and cascades would drop the stored embedding
     const std::string sql = R"(
-        INSERT OR REPLACE INTO documents (id, text, created_at, updated_at) 
-        VALUES (?, ?, 
-                COALESCE((SELECT created_at FROM documents WHERE id = ?), CURRENT_TIMESTAMP),
-                CURRENT_TIMESTAMP);
+        INSERT INTO documents (id, text) VALUES (?, ?)
+        ON CONFLICT(id) DO UPDATE SET text = excluded.text, updated_at = CURRENT_TIMESTAMP;
     )";
     
     sqlite3_stmt* stmt = prepareStatement(sql);
@@ -229,13 +338,12 @@ bool Storage::upsertDocument(const std::string& id, const std::string& text, con
     
     sqlite3_bind_text(stmt, 1, id.c_str(), -1, SQLITE_STATIC);
     sqlite3_bind_text(stmt, 2, text.c_str(), -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 3, id.c_str(), -1, SQLITE_STATIC);
     
     int rc = sqlite3_step(stmt);
     finalizeStatement(stmt);
     
     if (rc != SQLITE_DONE) {
-        std::cerr << "Error upserting document: " << sqlite3_errmsg(db_) << std::endl;
+        LOG_ERROR("Error upserting document: " << sqlite3_errmsg(db_));
         return false;
     }
     
@@ -250,7 +358,7 @@ bool Storage::upsertDocument(const std::string& id, const std::string& text, con
     
     for (const auto& [key, value] : metadata) {
         if (!addMetadata(id, key, value)) {
-            std::cerr << "Warning: Failed to update metadata " << key << " for document " << id << std::endl;
+            LOG_WARN("Failed to update metadata " << key << " for document " << id);
         }
     }
     
@@ -258,8 +366,9 @@ bool Storage::upsertDocument(const std::string& id, const std::string& text, con
 }
 
 bool Storage::deleteDocument(const std::string& id) {
+    std::lock_guard<std::recursive_mutex> lock(writerMutex_);
     if (!db_) {
-        std::cerr << "Database not initialized" << std::endl;
+        LOG_ERROR("Database not initialized");
         return false;
     }
     
@@ -273,7 +382,7 @@ bool Storage::deleteDocument(const std::string& id) {
     finalizeStatement(stmt);
     
     if (rc != SQLITE_DONE) {
-        std::cerr << "Error deleting document: " << sqlite3_errmsg(db_) << std::endl;
+        LOG_ERROR("Error deleting document: " << sqlite3_errmsg(db_));
         return false;
     }
     
@@ -283,39 +392,112 @@ bool Storage::deleteDocument(const std::string& id) {
 Document Storage::getDocument(const std::string& id) {
     Document doc;
     if (!db_) {
-        std::cerr << "Database not initialized" << std::endl;
+        LOG_ERROR("Database not initialized");
         return doc;
     }
     
     const std::string sql = "SELECT id, text FROM documents WHERE id = ?;";
-    sqlite3_stmt* stmt = prepareStatement(sql);
+    ReaderLease reader = acquireReader();
+    sqlite3_stmt* stmt = prepareStatement(reader.get(), sql);
     if (!stmt) return doc;
     
     sqlite3_bind_text(stmt, 1, id.c_str(), -1, SQLITE_STATIC);
     
     if (sqlite3_step(stmt) == SQLITE_ROW) {
         doc = buildDocumentFromRow(stmt);
-        loadDocumentMetadata(doc);
+        loadDocumentMetadata(reader.get(), doc);
     }
     
     finalizeStatement(stmt);
     return doc;
 }
 
+std::vector<Document> Storage::getDocumentsByIds(const std::vector<std::string>& ids, const DocumentFields& fields) {
+    std::vector<Document> documents(ids.size());
+    if (!db_) {
+        LOG_ERROR("Database not initialized");
+        return documents;
+    }
+    
+    // Stay well under SQLITE_MAX_VARIABLE_NUMBER, which is 999 on older builds
+    constexpr size_t MAX_IDS_PER_QUERY = 512;
+    
+    std::unordered_map<std::string, Document> found;
+    found.reserve(ids.size());
+    ReaderLease reader = acquireReader();
+    
+    for (size_t start = 0; start < ids.size(); start += MAX_IDS_PER_QUERY) {
+        size_t count = std::min(MAX_IDS_PER_QUERY, ids.size() - start);
+        
+        // Placeholder counts are rounded up to a power of two, padded with a repeated id, so only a
+        // handful of statement shapes end up in the cache
+        size_t slots = 1;
+        while (slots < count) {
+            slots <<= 1;
+        }
+        
+        // Texts and metadata come back in one pass: one row per metadata entry, or one with NULLs. Columns
+        // that were not asked for are selected as NULL, so long texts are never copied out of the page cache
+        std::string sql = std::string("SELECT d.id, ") + (fields.text ? "d.text" : "NULL") +
+                          (fields.metadata ? ", m.key, m.value FROM documents d "
+                                             "LEFT JOIN document_metadata m ON m.document_id = d.id"
+                                           : ", NULL, NULL FROM documents d") +
+                          " WHERE d.id IN (";
+        for (size_t i = 0; i < slots; ++i) {
+            sql += (i == 0) ? "?" : ", ?";
+        }
+        sql += ");";
+        
+        sqlite3_stmt* stmt = prepareStatement(reader.get(), sql);
+        if (!stmt) return documents;
+        
+        for (size_t i = 0; i < slots; ++i) {
+            const std::string& id = ids[start + std::min(i, count - 1)];
+            sqlite3_bind_text(stmt, static_cast<int>(i + 1), id.c_str(), -1, SQLITE_STATIC);
+        }
+        
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            std::string id = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+            auto it = found.find(id);
+            if (it == found.end()) {
+                it = found.emplace(id, buildDocumentFromRow(stmt)).first;
+            }
+            
+            const char* key = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
+            const char* value = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
+            if (key && value) {
+                it->second.metadata[key] = value;
+            }
+        }
+        
+        finalizeStatement(stmt);
+    }
+    
+    for (size_t i = 0; i < ids.size(); ++i) {
+        auto it = found.find(ids[i]);
+        if (it != found.end()) {
+            documents[i] = it->second;
+        }
+    }
+    
+    return documents;
+}
+
 std::vector<Document> Storage::getAllDocuments() {
     std::vector<Document> documents;
     if (!db_) {
-        std::cerr << "Database not initialized" << std::endl;
+        LOG_ERROR("Database not initialized");
         return documents;
     }
     
     const std::string sql = "SELECT id, text FROM documents ORDER BY id;";
-    sqlite3_stmt* stmt = prepareStatement(sql);
+    ReaderLease reader = acquireReader();
+    sqlite3_stmt* stmt = prepareStatement(reader.get(), sql);
     if (!stmt) return documents;
     
     while (sqlite3_step(stmt) == SQLITE_ROW) {
         Document doc = buildDocumentFromRow(stmt);
-        loadDocumentMetadata(doc);
+        loadDocumentMetadata(reader.get(), doc);
         documents.push_back(doc);
     }
     
@@ -323,34 +505,91 @@ std::vector<Document> Storage::getAllDocuments() {
     return documents;
 }
 
-std::vector<Document> Storage::searchDocuments(const std::string& textQuery) {
-    std::vector<Document> documents;
+std::vector<std::string> Storage::sampleDocumentTexts(size_t limit) {
+    std::vector<std::string> texts;
     if (!db_) {
-        std::cerr << "Database not initialized" << std::endl;
-        return documents;
+        LOG_ERROR("Database not initialized");
+        return texts;
     }
     
-    const std::string sql = "SELECT id, text FROM documents WHERE text LIKE ? ORDER BY id;";
-    sqlite3_stmt* stmt = prepareStatement(sql);
-    if (!stmt) return documents;
+    const std::string sql = R"(
+        SELECT text FROM documents
+        WHERE rowid IN (SELECT rowid FROM documents ORDER BY RANDOM() LIMIT ?);
+    )";
+    ReaderLease reader = acquireReader();
+    sqlite3_stmt* stmt = prepareStatement(reader.get(), sql);
+    if (!stmt) return texts;
+    
+    sqlite3_bind_int64(stmt, 1, static_cast<sqlite3_int64>(limit));
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char* text = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+        if (text) {
+            texts.push_back(text);
+        }
+    }
+    
+    finalizeStatement(stmt);
+    return texts;
+}
+
+size_t Storage::searchFullText(const std::string& textQuery, size_t limit,
+                               std::vector<std::string>& documentIds, std::vector<float>& scores) {
+    if (!db_) {
+        LOG_ERROR("Database not initialized");
+        return 0;
+    }
+    
+    // Every whitespace-separated term must match. Terms are quoted so user input is never parsed as
+    // FTS5 query syntax.
+    std::string matchExpression;
+    std::istringstream terms(textQuery);
+    std::string term;
+    while (terms >> term) {
+        std::string quoted = "\"";
+        for (char c : term) {
+            quoted += c;
+            if (c == '"') {
+                quoted += '"';
+            }
+        }
+        quoted += '"';
+        matchExpression += matchExpression.empty() ? quoted : " " + quoted;
+    }
+    if (matchExpression.empty()) {
+        return 0;
+    }
+    
+    // bm25() is lower for better matches; scores are negated so that higher is better, as elsewhere
+    const std::string sql = R"(
+        SELECT d.id, -bm25(documents_fts) AS score
+        FROM documents_fts
+        JOIN documents d ON d.rowid = documents_fts.rowid
+        WHERE documents_fts MATCH ?
+        ORDER BY bm25(documents_fts)
+        LIMIT ?;
+    )";
+    ReaderLease reader = acquireReader();
+    sqlite3_stmt* stmt = prepareStatement(reader.get(), sql);
+    if (!stmt) return 0;
     
-    std::string likePattern = "%" + textQuery + "%";
-    sqlite3_bind_text(stmt, 1, likePattern.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 1, matchExpression.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(limit));
     
+    size_t count = 0;
     while (sqlite3_step(stmt) == SQLITE_ROW) {
-        Document doc = buildDocumentFromRow(stmt);
-        loadDocumentMetadata(doc);
-        documents.push_back(doc);
+        documentIds.emplace_back(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)));
+        scores.push_back(static_cast<float>(sqlite3_column_double(stmt, 1)));
+        ++count;
     }
     
     finalizeStatement(stmt);
-    return documents;
+    return count;
 }
 
 std::vector<Document> Storage::getDocumentsByMetadata(const std::string& key, const std::string& value) {
     std::vector<Document> documents;
     if (!db_) {
-        std::cerr << "Database not initialized" << std::endl;
+        LOG_ERROR("Database not initialized");
         return documents;
     }
     
@@ -362,7 +601,8 @@ std::vector<Document> Storage::getDocumentsByMetadata(const std::string& key, co
         ORDER BY d.id;
     )";
     
-    sqlite3_stmt* stmt = prepareStatement(sql);
+    ReaderLease reader = acquireReader();
+    sqlite3_stmt* stmt = prepareStatement(reader.get(), sql);
     if (!stmt) return documents;
     
     sqlite3_bind_text(stmt, 1, key.c_str(), -1, SQLITE_STATIC);
@@ -370,7 +610,7 @@ std::vector<Document> Storage::getDocumentsByMetadata(const std::string& key, co
     
     while (sqlite3_step(stmt) == SQLITE_ROW) {
         Document doc = buildDocumentFromRow(stmt);
-        loadDocumentMetadata(doc);
+        loadDocumentMetadata(reader.get(), doc);
         documents.push_back(doc);
     }
     
@@ -378,9 +618,34 @@ std::vector<Document> Storage::getDocumentsByMetadata(const std::string& key, co
     return documents;
 }
 
+std::vector<std::string> Storage::getDocumentIdsByMetadata(const std::string& key, const std::string& value) {
+    std::vector<std::string> documentIds;
+    if (!db_) {
+        LOG_ERROR("Database not initialized");
+        return documentIds;
+    }
+    
+    // Served by idx_metadata_key_value without touching the documents table
+    const std::string sql = "SELECT document_id FROM document_metadata WHERE key = ? AND value = ?;";
+    ReaderLease reader = acquireReader();
+    sqlite3_stmt* stmt = prepareStatement(reader.get(), sql);
+    if (!stmt) return documentIds;
+    
+    sqlite3_bind_text(stmt, 1, key.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, value.c_str(), -1, SQLITE_STATIC);
+    
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        documentIds.emplace_back(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)));
+    }
+    
+    finalizeStatement(stmt);
+    return documentIds;
+}
+
 bool Storage::addMetadata(const std::string& documentId, const std::string& key, const std::string& value) {
+    std::lock_guard<std::recursive_mutex> lock(writerMutex_);
     if (!db_) {
-        std::cerr << "Database not initialized" << std::endl;
+        LOG_ERROR("Database not initialized");
         return false;
     }
     
@@ -403,8 +668,9 @@ bool Storage::updateMetadata(const std::string& documentId, const std::string& k
 }
 
 bool Storage::deleteMetadata(const std::string& documentId, const std::string& key) {
+    std::lock_guard<std::recursive_mutex> lock(writerMutex_);
     if (!db_) {
-        std::cerr << "Database not initialized" << std::endl;
+        LOG_ERROR("Database not initialized");
         return false;
     }
     
@@ -422,14 +688,19 @@ bool Storage::deleteMetadata(const std::string& documentId, const std::string& k
 }
 
 std::map<std::string, std::string> Storage::getMetadata(const std::string& documentId) {
-    std::map<std::string, std::string> metadata;
     if (!db_) {
-        std::cerr << "Database not initialized" << std::endl;
-        return metadata;
+        LOG_ERROR("Database not initialized");
+        return {};
     }
     
+    ReaderLease reader = acquireReader();
+    return getMetadata(reader.get(), documentId);
+}
+
+std::map<std::string, std::string> Storage::getMetadata(sqlite3* db, const std::string& documentId) {
+    std::map<std::string, std::string> metadata;
     const std::string sql = "SELECT key, value FROM document_metadata WHERE document_id = ?;";
-    sqlite3_stmt* stmt = prepareStatement(sql);
+    sqlite3_stmt* stmt = prepareStatement(db, sql);
     if (!stmt) return metadata;
     
     sqlite3_bind_text(stmt, 1, documentId.c_str(), -1, SQLITE_STATIC);
@@ -444,14 +715,363 @@ std::map<std::string, std::string> Storage::getMetadata(const std::string& docum
     return metadata;
 }
 
+bool Storage::putEmbedding(const std::string& documentId, const std::string& model, const float* vector, size_t dimension) {
+    std::lock_guard<std::recursive_mutex> lock(writerMutex_);
+    if (!db_) {
+        LOG_ERROR("Database not initialized");
+        return false;
+    }
+    
+    const std::string sql = "INSERT OR REPLACE INTO document_embeddings (document_id, model, dimension, vector) VALUES (?, ?, ?, ?);";
+    sqlite3_stmt* stmt = prepareStatement(sql);
+    if (!stmt) return false;
+    
+    sqlite3_bind_text(stmt, 1, documentId.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, model.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(dimension));
+    sqlite3_bind_blob(stmt, 4, vector, static_cast<int>(dimension * sizeof(float)), SQLITE_STATIC);
+    
+    int rc = sqlite3_step(stmt);
+    finalizeStatement(stmt);
+    
+    if (rc != SQLITE_DONE) {
+        LOG_ERROR("Error storing embedding: " << sqlite3_errmsg(db_));
+        return false;
+    }
+    
+    return true;
+}
+
+bool Storage::deleteEmbedding(const std::string& documentId) {
+    std::lock_guard<std::recursive_mutex> lock(writerMutex_);
+    if (!db_) {
+        LOG_ERROR("Database not initialized");
+        return false;
+    }
+    
+    const std::string sql = "DELETE FROM document_embeddings WHERE document_id = ?;";
+    sqlite3_stmt* stmt = prepareStatement(sql);
+    if (!stmt) return false;
+    
+    sqlite3_bind_text(stmt, 1, documentId.c_str(), -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    finalizeStatement(stmt);
+    
+    if (rc != SQLITE_DONE) {
+        LOG_ERROR("Error deleting embedding: " << sqlite3_errmsg(db_));
+        return false;
+    }
+    
+    return true;
+}
+
+size_t Storage::getEmbeddings(const std::string& model, size_t dimension, const std::string& afterId, size_t limit,
+                              std::vector<std::string>& documentIds, std::vector<float>& vectors) {
+    if (!db_) {
+        LOG_ERROR("Database not initialized");
+        return 0;
+    }
+    
+    const std::string sql = R"(
+        SELECT document_id, vector FROM document_embeddings
+        WHERE model = ? AND dimension = ? AND document_id > ?
+        ORDER BY document_id
+        LIMIT ?;
+    )";
+    ReaderLease reader = acquireReader();
+    sqlite3_stmt* stmt = prepareStatement(reader.get(), sql);
+    if (!stmt) return 0;
+    
+    sqlite3_bind_text(stmt, 1, model.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(dimension));
+    sqlite3_bind_text(stmt, 3, afterId.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 4, static_cast<sqlite3_int64>(limit));
+    
+    const size_t rowBytes = dimension * sizeof(float);
+    size_t count = 0;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char* id = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+        const void* blob = sqlite3_column_blob(stmt, 1);
+        if (!id || !blob || static_cast<size_t>(sqlite3_column_bytes(stmt, 1)) != rowBytes) {
+            continue;
+        }
+        
+        documentIds.push_back(id);
+        size_t offset = vectors.size();
+        vectors.resize(offset + dimension);
+        std::memcpy(vectors.data() + offset, blob, rowBytes);
+        ++count;
+    }
+    
+    finalizeStatement(stmt);
+    return count;
+}
+
+size_t Storage::sampleEmbeddings(const std::string& model, size_t dimension, size_t limit,
+                                 std::vector<std::string>& documentIds, std::vector<float>& vectors) {
+    if (!db_) {
+        LOG_ERROR("Database not initialized");
+        return 0;
+    }
+    
+    // The shuffle runs over rowids so vector blobs are only read for the sampled rows
+    const std::string sql = R"(
+        SELECT document_id, vector FROM document_embeddings
+        WHERE rowid IN (
+            SELECT rowid FROM document_embeddings
+            WHERE model = ? AND dimension = ?
+            ORDER BY RANDOM()
+            LIMIT ?
+        );
+    )";
+    ReaderLease reader = acquireReader();
+    sqlite3_stmt* stmt = prepareStatement(reader.get(), sql);
+    if (!stmt) return 0;
+    
+    sqlite3_bind_text(stmt, 1, model.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(dimension));
+    sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(limit));
+    
+    const size_t rowBytes = dimension * sizeof(float);
+    size_t count = 0;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char* id = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+        const void* blob = sqlite3_column_blob(stmt, 1);
+        if (!id || !blob || static_cast<size_t>(sqlite3_column_bytes(stmt, 1)) != rowBytes) {
+            continue;
+        }
+        
+        documentIds.push_back(id);
+        size_t offset = vectors.size();
+        vectors.resize(offset + dimension);
+        std::memcpy(vectors.data() + offset, blob, rowBytes);
+        ++count;
+    }
+    
+    finalizeStatement(stmt);
+    return count;
+}
+
+size_t Storage::getEmbeddingsByIds(const std::string& model, size_t dimension, const std::vector<std::string>& ids,
+                                   std::vector<std::string>& documentIds, std::vector<float>& vectors) {
+    if (!db_) {
+        LOG_ERROR("Database not initialized");
+        return 0;
+    }
+    
+    constexpr size_t MAX_IDS_PER_QUERY = 512;
+    const size_t rowBytes = dimension * sizeof(float);
+    size_t total = 0;
+    ReaderLease reader = acquireReader();
+    
+    for (size_t start = 0; start < ids.size(); start += MAX_IDS_PER_QUERY) {
+        size_t count = std::min(MAX_IDS_PER_QUERY, ids.size() - start);
+        
+        // Padded to a power of two as in getDocumentsByIds; IN matches the repeated id only once
+        size_t slots = 1;
+        while (slots < count) {
+            slots <<= 1;
+        }
+        
+        std::string sql = "SELECT document_id, vector FROM document_embeddings "
+                          "WHERE model = ? AND dimension = ? AND document_id IN (";
+        for (size_t i = 0; i < slots; ++i) {
+            sql += (i == 0) ? "?" : ", ?";
+        }
+        sql += ");";
+        
+        sqlite3_stmt* stmt = prepareStatement(reader.get(), sql);
+        if (!stmt) return total;
+        
+        sqlite3_bind_text(stmt, 1, model.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(dimension));
+        for (size_t i = 0; i < slots; ++i) {
+            const std::string& id = ids[start + std::min(i, count - 1)];
+            sqlite3_bind_text(stmt, static_cast<int>(i + 3), id.c_str(), -1, SQLITE_STATIC);
+        }
+        
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            const char* id = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+            const void* blob = sqlite3_column_blob(stmt, 1);
+            if (!id || !blob || static_cast<size_t>(sqlite3_column_bytes(stmt, 1)) != rowBytes) {
+                continue;
+            }
+            
+            documentIds.push_back(id);
+            size_t offset = vectors.size();
+            vectors.resize(offset + dimension);
+            std::memcpy(vectors.data() + offset, blob, rowBytes);
+            ++total;
+        }
+        
+        finalizeStatement(stmt);
+    }
+    
+    return total;
+}
+
+std::vector<Document> Storage::getDocumentsWithoutEmbedding(const std::string& model, size_t dimension,
+                                                            const std::string& afterId, size_t limit) {
+    std::vector<Document> documents;
+    if (!db_) {
+        LOG_ERROR("Database not initialized");
+        return documents;
+    }
+    
+    const std::string sql = R"(
+        SELECT d.id, d.text
+        FROM documents d
+        LEFT JOIN document_embeddings e ON d.id = e.document_id
+        WHERE (e.document_id IS NULL OR e.model != ? OR e.dimension != ?) AND d.id > ?
+        ORDER BY d.id
+        LIMIT ?;
+    )";
+    ReaderLease reader = acquireReader();
+    sqlite3_stmt* stmt = prepareStatement(reader.get(), sql);
+    if (!stmt) return documents;
+    
+    sqlite3_bind_text(stmt, 1, model.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(dimension));
+    sqlite3_bind_text(stmt, 3, afterId.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 4, static_cast<sqlite3_int64>(limit));
+    
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        documents.push_back(buildDocumentFromRow(stmt));
+    }
+    
+    finalizeStatement(stmt);
+    return documents;
+}
+
+int64_t Storage::appendLog(LogOp op, const std::string& documentId, const float* embedding, size_t dimension) {
+    std::lock_guard<std::recursive_mutex> lock(writerMutex_);
+    if (!db_) {
+        LOG_ERROR("Database not initialized");
+        return -1;
+    }
+    
+    const std::string sql = "INSERT INTO ingest_log (op, document_id, vector) VALUES (?, ?, ?);";
+    sqlite3_stmt* stmt = prepareStatement(sql);
+    if (!stmt) return -1;
+    
+    sqlite3_bind_int(stmt, 1, static_cast<int>(op));
+    sqlite3_bind_text(stmt, 2, documentId.c_str(), -1, SQLITE_STATIC);
+    if (embedding) {
+        sqlite3_bind_blob(stmt, 3, embedding, static_cast<int>(dimension * sizeof(float)), SQLITE_STATIC);
+    } else {
+        sqlite3_bind_null(stmt, 3);
+    }
+    
+    int rc = sqlite3_step(stmt);
+    finalizeStatement(stmt);
+    
+    if (rc != SQLITE_DONE) {
+        LOG_ERROR("Error appending to ingest log: " << sqlite3_errmsg(db_));
+        return -1;
+    }
+    
+    return static_cast<int64_t>(sqlite3_last_insert_rowid(db_));
+}
+
+std::vector<LogEntry> Storage::getLogEntries(int64_t afterSequence, size_t limit) {
+    std::vector<LogEntry> entries;
+    if (!db_) {
+        LOG_ERROR("Database not initialized");
+        return entries;
+    }
+    
+    // Entries carry the document's current text, so replaying an old entry indexes the latest version
+    const std::string sql = R"(
+        SELECT l.seq, l.op, l.document_id, d.text, l.vector
+        FROM ingest_log l
+        LEFT JOIN documents d ON d.id = l.document_id
+        WHERE l.seq > ?
+        ORDER BY l.seq
+        LIMIT ?;
+    )";
+    ReaderLease reader = acquireReader();
+    sqlite3_stmt* stmt = prepareStatement(reader.get(), sql);
+    if (!stmt) return entries;
+    
+    sqlite3_bind_int64(stmt, 1, static_cast<sqlite3_int64>(afterSequence));
+    sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(limit));
+    
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        LogEntry entry;
+        entry.sequence = sqlite3_column_int64(stmt, 0);
+        entry.op = static_cast<LogOp>(sqlite3_column_int(stmt, 1));
+        entry.documentId = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
+        const char* text = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
+        entry.documentExists = text != nullptr;
+        if (text) {
+            entry.text = text;
+        }
+        if (const void* vector = sqlite3_column_blob(stmt, 4)) {
+            const size_t bytes = static_cast<size_t>(sqlite3_column_bytes(stmt, 4));
+            entry.embedding.resize(bytes / sizeof(float));
+            std::memcpy(entry.embedding.data(), vector, entry.embedding.size() * sizeof(float));
+        }
+        entries.push_back(std::move(entry));
+    }
+    
+    finalizeStatement(stmt);
+    return entries;
+}
+
+int64_t Storage::getLatestLogSequence() {
+    if (!db_) {
+        LOG_ERROR("Database not initialized");
+        return 0;
+    }
+    
+    // sqlite_sequence remembers the highest sequence ever issued, even once the log is truncated
+    const std::string sql = "SELECT seq FROM sqlite_sequence WHERE name = 'ingest_log';";
+    ReaderLease reader = acquireReader();
+    sqlite3_stmt* stmt = prepareStatement(reader.get(), sql);
+    if (!stmt) return 0;
+    
+    int64_t sequence = 0;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        sequence = sqlite3_column_int64(stmt, 0);
+    }
+    
+    finalizeStatement(stmt);
+    return sequence;
+}
+
+bool Storage::truncateLog(int64_t throughSequence) {
+    std::lock_guard<std::recursive_mutex> lock(writerMutex_);
+    if (!db_) {
+        LOG_ERROR("Database not initialized");
+        return false;
+    }
+    
+    const std::string sql = "DELETE FROM ingest_log WHERE seq <= ?;";
+    sqlite3_stmt* stmt = prepareStatement(sql);
+    if (!stmt) return false;
+    
+    sqlite3_bind_int64(stmt, 1, static_cast<sqlite3_int64>(throughSequence));
+    
+    int rc = sqlite3_step(stmt);
+    finalizeStatement(stmt);
+    
+    if (rc != SQLITE_DONE) {
+        LOG_ERROR("Error truncating ingest log: " << sqlite3_errmsg(db_));
+        return false;
+    }
+    
+    return true;
+}
+
 size_t Storage::getDocumentCount() {
     if (!db_) {
-        std::cerr << "Database not initialized" << std::endl;
+        LOG_ERROR("Database not initialized");
         return 0;
     }
     
     const std::string sql = "SELECT COUNT(*) FROM documents;";
-    sqlite3_stmt* stmt = prepareStatement(sql);
+    ReaderLease reader = acquireReader();
+    sqlite3_stmt* stmt = prepareStatement(reader.get(), sql);
     if (!stmt) return 0;
     
     size_t count = 0;
@@ -466,12 +1086,13 @@ size_t Storage::getDocumentCount() {
 std::vector<std::string> Storage::getAllDocumentIds() {
     std::vector<std::string> ids;
     if (!db_) {
-        std::cerr << "Database not initialized" << std::endl;
+        LOG_ERROR("Database not initialized");
         return ids;
     }
     
     const std::string sql = "SELECT id FROM documents ORDER BY id;";
-    sqlite3_stmt* stmt = prepareStatement(sql);
+    ReaderLease reader = acquireReader();
+    sqlite3_stmt* stmt = prepareStatement(reader.get(), sql);
     if (!stmt) return ids;
     
     while (sqlite3_step(stmt) == SQLITE_ROW) {
@@ -487,12 +1108,17 @@ std::vector<std::string> Storage::getAllDocumentIds() {
 
 bool Storage::documentExists(const std::string& id) {
     if (!db_) {
-        std::cerr << "Database not initialized" << std::endl;
+        LOG_ERROR("Database not initialized");
         return false;
     }
     
+    ReaderLease reader = acquireReader();
+    return documentExists(reader.get(), id);
+}
+
+bool Storage::documentExists(sqlite3* db, const std::string& id) {
     const std::string sql = "SELECT 1 FROM documents WHERE id = ? LIMIT 1;";
-    sqlite3_stmt* stmt = prepareStatement(sql);
+    sqlite3_stmt* stmt = prepareStatement(db, sql);
     if (!stmt) return false;
     
     sqlite3_bind_text(stmt, 1, id.c_str(), -1, SQLITE_STATIC);
@@ -504,6 +1130,7 @@ bool Storage::documentExists(const std::string& id) {
 }
 
 bool Storage::beginTransaction() {
+    std::lock_guard<std::recursive_mutex> lock(writerMutex_);
     if (!db_ || inTransaction_) {
         return false;
     }
@@ -516,6 +1143,7 @@ bool Storage::beginTransaction() {
 }
 
 bool Storage::commitTransaction() {
+    std::lock_guard<std::recursive_mutex> lock(writerMutex_);
     if (!db_ || !inTransaction_) {
         return false;
     }
@@ -528,6 +1156,7 @@ bool Storage::commitTransaction() {
 }
 
 bool Storage::rollbackTransaction() {
+    std::lock_guard<std::recursive_mutex> lock(writerMutex_);
     if (!db_ || !inTransaction_) {
         return false;
     }
@@ -540,6 +1169,7 @@ bool Storage::rollbackTransaction() {
 }
 
 bool Storage::executeSQL(const std::string& sql) {
+    std::lock_guard<std::recursive_mutex> lock(writerMutex_);
     if (!db_) {
         return false;
     }
@@ -548,7 +1178,7 @@ bool Storage::executeSQL(const std::string& sql) {
     int rc = sqlite3_exec(db_, sql.c_str(), nullptr, nullptr, &errMsg);
     
     if (rc != SQLITE_OK) {
-        std::cerr << "SQL error: " << errMsg << std::endl;
+        LOG_ERROR("SQL error: " << errMsg);
         sqlite3_free(errMsg);
         return false;
     }
@@ -557,21 +1187,132 @@ bool Storage::executeSQL(const std::string& sql) {
 }
 
 sqlite3_stmt* Storage::prepareStatement(const std::string& sql) {
+    return prepareStatement(db_, sql);
+}
+
+sqlite3_stmt* Storage::prepareStatement(sqlite3* db, const std::string& sql) {
+    std::unordered_map<std::string, sqlite3_stmt*>* statements = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(statementCacheMutex_);
+        statements = &statementCache_[db];
+    }
+    
+    auto it = statements->find(sql);
+    if (it != statements->end()) {
+        sqlite3_reset(it->second);  // In case the last user bailed out before finalizeStatement
+        return it->second;
+    }
+    
     sqlite3_stmt* stmt = nullptr;
-    int rc = sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt, nullptr);
+    int rc = sqlite3_prepare_v3(db, sql.c_str(), -1, SQLITE_PREPARE_PERSISTENT, &stmt, nullptr);
     
     if (rc != SQLITE_OK) {
-        std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db_) << std::endl;
+        LOG_ERROR("Failed to prepare statement: " << sqlite3_errmsg(db));
         return nullptr;
     }
     
+    statements->emplace(sql, stmt);
     return stmt;
 }
 
+Storage::ReaderLease Storage::acquireReader() {
+    if (poolReaders_) {
+        {
+            std::lock_guard<std::mutex> lock(readerPoolMutex_);
+            if (!idleReaders_.empty()) {
+                sqlite3* db = idleReaders_.back();
+                idleReaders_.pop_back();
+                return ReaderLease(this, db, {});
+            }
+        }
+        
+        if (sqlite3* db = openReader()) {
+            return ReaderLease(this, db, {});
+        }
+    }
+    
+    // In-memory databases cannot be shared across connections, so read through the writer
+    return ReaderLease(this, db_, std::unique_lock<std::recursive_mutex>(writerMutex_));
+}
+
+void Storage::releaseReader(sqlite3* db) {
+    std::lock_guard<std::mutex> lock(readerPoolMutex_);
+    idleReaders_.push_back(db);
+}
+
+sqlite3* Storage::openReader() {
+    sqlite3* db = nullptr;
+    int rc = sqlite3_open_v2(dbPath_.c_str(), &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, nullptr);
+    if (rc != SQLITE_OK) {
+        LOG_ERROR("Cannot open read connection: " << sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return nullptr;
+    }
+    
+    sqlite3_busy_timeout(db, 5000);
+    applyConnectionOptions(db, false);
+    return db;
+}
+
+void Storage::applyConnectionOptions(sqlite3* db, bool writer) {
+    // Pragma values cannot be bound as parameters, so only recognised keywords are spliced in
+    static const char* const journalModes[] = {"DELETE", "TRUNCATE", "PERSIST", "MEMORY", "WAL", "OFF"};
+    static const char* const synchronousModes[] = {"OFF", "NORMAL", "FULL", "EXTRA"};
+    auto isOneOf = [](const std::string& value, const auto& allowed) {
+        return std::any_of(std::begin(allowed), std::end(allowed), [&value](const char* option) {
+            return strcasecmp(value.c_str(), option) == 0;
+        });
+    };
+    
+    std::string pragmas;
+    if (writer && poolReaders_) {
+        // The journal mode belongs to the database file, and in-memory databases have no WAL
+        if (isOneOf(options_.journalMode, journalModes)) {
+            pragmas += "PRAGMA journal_mode = " + options_.journalMode + ";";
+        } else {
+            LOG_WARN("Ignoring unknown journal mode " << options_.journalMode);
+        }
+    }
+    if (writer) {
+        if (isOneOf(options_.synchronous, synchronousModes)) {
+            pragmas += "PRAGMA synchronous = " + options_.synchronous + ";";
+        } else {
+            LOG_WARN("Ignoring unknown synchronous mode " << options_.synchronous);
+        }
+    }
+    pragmas += "PRAGMA mmap_size = " + std::to_string(options_.mmapSizeBytes) + ";";
+    pragmas += "PRAGMA cache_size = " + std::to_string(-options_.cacheSizeKb) + ";";  // Negative means KiB
+    if (options_.tempStoreMemory) {
+        pragmas += "PRAGMA temp_store = MEMORY;";
+    }
+    
+    char* errMsg = nullptr;
+    if (sqlite3_exec(db, pragmas.c_str(), nullptr, nullptr, &errMsg) != SQLITE_OK) {
+        LOG_WARN("Failed to apply connection options: " << errMsg);
+        sqlite3_free(errMsg);
+    }
+}
+
 void Storage::finalizeStatement(sqlite3_stmt* stmt) {
+    // Cached statements are reset for reuse rather than finalized; see closeConnection
     if (stmt) {
-        sqlite3_finalize(stmt);
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+    }
+}
+
+void Storage::closeConnection(sqlite3* db) {
+    {
+        std::lock_guard<std::mutex> lock(statementCacheMutex_);
+        auto it = statementCache_.find(db);
+        if (it != statementCache_.end()) {
+            for (auto& [sql, stmt] : it->second) {
+                sqlite3_finalize(stmt);
+            }
+            statementCache_.erase(it);
+        }
     }
+    sqlite3_close(db);
 }
 
 Document Storage::buildDocumentFromRow(sqlite3_stmt* stmt) {
@@ -590,8 +1331,8 @@ Document Storage::buildDocumentFromRow(sqlite3_stmt* stmt) {
     return doc;
 }
 
-void Storage::loadDocumentMetadata(Document& doc) {
-    doc.metadata = getMetadata(doc.id);
+void Storage::loadDocumentMetadata(sqlite3* db, Document& doc) {
+    doc.metadata = getMetadata(db, doc.id);
 }
 
 int Storage::countCallback(void* data, int argc, char** argv, char** azColName) {
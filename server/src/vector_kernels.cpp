@@ -0,0 +1,315 @@
+#include "vector_kernels.h"
+#include <cmath>
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define VECTOR_KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define VECTOR_KERNELS_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace vector_kernels {
+
+namespace {
+
+struct Kernels {
+    void (*add)(float*, const float*, size_t);
+    void (*addHalf)(float*, const uint16_t*, size_t);
+    void (*scale)(float*, float, size_t);
+    float (*dot)(const float*, const float*, size_t);
+    const char* name;
+};
+
+void addScalar(float* dst, const float* src, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        dst[i] += src[i];
+    }
+}
+
+float halfToFloat(uint16_t h) {
+    const uint32_t sign = static_cast<uint32_t>(h & 0x8000u) << 16;
+    uint32_t exponent = (h >> 10) & 0x1fu;
+    uint32_t mantissa = h & 0x3ffu;
+    uint32_t bits;
+    
+    if (exponent == 0x1fu) {
+        bits = sign | 0x7f800000u | (mantissa << 13);  // Inf or NaN
+    } else if (exponent != 0) {
+        bits = sign | ((exponent + 112u) << 23) | (mantissa << 13);
+    } else if (mantissa == 0) {
+        bits = sign;
+    } else {
+        // Subnormal: shift the mantissa up until it is normalized
+        exponent = 113u;
+        while ((mantissa & 0x400u) == 0) {
+            mantissa <<= 1;
+            --exponent;
+        }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3ffu) << 13);
+    }
+    
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+void addHalfScalar(float* dst, const uint16_t* src, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        dst[i] += halfToFloat(src[i]);
+    }
+}
+
+void scaleScalar(float* x, float factor, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        x[i] *= factor;
+    }
+}
+
+float dotScalar(const float* a, const float* b, size_t n) {
+    // Independent accumulators let the compiler overlap the additions
+    float acc[4] = {0.f, 0.f, 0.f, 0.f};
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc[0] += a[i] * b[i];
+        acc[1] += a[i + 1] * b[i + 1];
+        acc[2] += a[i + 2] * b[i + 2];
+        acc[3] += a[i + 3] * b[i + 3];
+    }
+    for (; i < n; ++i) {
+        acc[0] += a[i] * b[i];
+    }
+    return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+#ifdef VECTOR_KERNELS_X86
+
+__attribute__((target("avx2,fma")))
+void addAvx2(float* dst, const float* src, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(dst + i), _mm256_loadu_ps(src + i)));
+    }
+    for (; i < n; ++i) {
+        dst[i] += src[i];
+    }
+}
+
+// Every AVX2 CPU also has F16C
+__attribute__((target("avx2,fma,f16c")))
+void addHalfAvx2(float* dst, const uint16_t* src, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 half = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)));
+        _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(dst + i), half));
+    }
+    for (; i < n; ++i) {
+        dst[i] += halfToFloat(src[i]);
+    }
+}
+
+__attribute__((target("avx2,fma")))
+void scaleAvx2(float* x, float factor, size_t n) {
+    const __m256 f = _mm256_set1_ps(factor);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(x + i, _mm256_mul_ps(_mm256_loadu_ps(x + i), f));
+    }
+    for (; i < n; ++i) {
+        x[i] *= factor;
+    }
+}
+
+__attribute__((target("avx2,fma")))
+float dotAvx2(const float* a, const float* b, size_t n) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    }
+
+    __m256 acc = _mm256_add_ps(acc0, acc1);
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    float result = _mm_cvtss_f32(sum);
+
+    for (; i < n; ++i) {
+        result += a[i] * b[i];
+    }
+    return result;
+}
+
+__attribute__((target("avx512f")))
+void addAvx512(float* dst, const float* src, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        _mm512_storeu_ps(dst + i, _mm512_add_ps(_mm512_loadu_ps(dst + i), _mm512_loadu_ps(src + i)));
+    }
+    if (i < n) {
+        const __mmask16 tail = static_cast<__mmask16>((1u << (n - i)) - 1);
+        _mm512_mask_storeu_ps(dst + i, tail,
+                              _mm512_add_ps(_mm512_maskz_loadu_ps(tail, dst + i), _mm512_maskz_loadu_ps(tail, src + i)));
+    }
+}
+
+__attribute__((target("avx512f")))
+void addHalfAvx512(float* dst, const uint16_t* src, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 half = _mm512_cvtph_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i)));
+        _mm512_storeu_ps(dst + i, _mm512_add_ps(_mm512_loadu_ps(dst + i), half));
+    }
+    for (; i < n; ++i) {
+        dst[i] += halfToFloat(src[i]);
+    }
+}
+
+__attribute__((target("avx512f")))
+void scaleAvx512(float* x, float factor, size_t n) {
+    const __m512 f = _mm512_set1_ps(factor);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        _mm512_storeu_ps(x + i, _mm512_mul_ps(_mm512_loadu_ps(x + i), f));
+    }
+    if (i < n) {
+        const __mmask16 tail = static_cast<__mmask16>((1u << (n - i)) - 1);
+        _mm512_mask_storeu_ps(x + i, tail, _mm512_mul_ps(_mm512_maskz_loadu_ps(tail, x + i), f));
+    }
+}
+
+__attribute__((target("avx512f")))
+float dotAvx512(const float* a, const float* b, size_t n) {
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+    }
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+    }
+    if (i < n) {
+        const __mmask16 tail = static_cast<__mmask16>((1u << (n - i)) - 1);
+        acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(tail, a + i), _mm512_maskz_loadu_ps(tail, b + i), acc1);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+#endif  // VECTOR_KERNELS_X86
+
+#ifdef VECTOR_KERNELS_NEON
+
+void addNeon(float* dst, const float* src, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        vst1q_f32(dst + i, vaddq_f32(vld1q_f32(dst + i), vld1q_f32(src + i)));
+    }
+    for (; i < n; ++i) {
+        dst[i] += src[i];
+    }
+}
+
+void addHalfNeon(float* dst, const uint16_t* src, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t half = vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(src + i)));
+        vst1q_f32(dst + i, vaddq_f32(vld1q_f32(dst + i), half));
+    }
+    for (; i < n; ++i) {
+        dst[i] += halfToFloat(src[i]);
+    }
+}
+
+void scaleNeon(float* x, float factor, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        vst1q_f32(x + i, vmulq_n_f32(vld1q_f32(x + i), factor));
+    }
+    for (; i < n; ++i) {
+        x[i] *= factor;
+    }
+}
+
+float dotNeon(const float* a, const float* b, size_t n) {
+    float32x4_t acc0 = vdupq_n_f32(0.f);
+    float32x4_t acc1 = vdupq_n_f32(0.f);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+        acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    for (; i + 4 <= n; i += 4) {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+    }
+    float result = vaddvq_f32(vaddq_f32(acc0, acc1));
+    for (; i < n; ++i) {
+        result += a[i] * b[i];
+    }
+    return result;
+}
+
+#endif  // VECTOR_KERNELS_NEON
+
+Kernels selectKernels() {
+#ifdef VECTOR_KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return {addAvx512, addHalfAvx512, scaleAvx512, dotAvx512, "avx512"};
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return {addAvx2, addHalfAvx2, scaleAvx2, dotAvx2, "avx2"};
+    }
+#endif
+#ifdef VECTOR_KERNELS_NEON
+    // NEON is part of the AArch64 baseline, so no runtime check is needed
+    return {addNeon, addHalfNeon, scaleNeon, dotNeon, "neon"};
+#endif
+    return {addScalar, addHalfScalar, scaleScalar, dotScalar, "scalar"};
+}
+
+const Kernels& kernels() {
+    static const Kernels selected = selectKernels();
+    return selected;
+}
+
+}
+
+void add(float* dst, const float* src, size_t n) {
+    kernels().add(dst, src, n);
+}
+
+void addHalf(float* dst, const uint16_t* src, size_t n) {
+    kernels().addHalf(dst, src, n);
+}
+
+void scale(float* x, float factor, size_t n) {
+    kernels().scale(x, factor, n);
+}
+
+float dot(const float* a, const float* b, size_t n) {
+    return kernels().dot(a, b, n);
+}
+
+void l2Normalize(float* x, size_t n) {
+    const Kernels& k = kernels();
+    float norm = std::sqrt(k.dot(x, x, n));
+    if (norm > 0.f) {
+        k.scale(x, 1.0f / (norm + 1e-12f), n);
+    }
+}
+
+const char* implementationName() {
+    return kernels().name;
+}
+
+}
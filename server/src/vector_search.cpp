@@ -1,399 +1,2412 @@
 #include "vector_search.h"
-#include <iostream>
+#include "log.h"
+#include "metrics.h"
 #include <fstream>
 #include <filesystem>
 #include <faiss/index_io.h>
+#include <faiss/clone_index.h>
+#include <faiss/IndexIVFPQ.h>
+#include <faiss/impl/IDSelector.h>
+#include <faiss/utils/distances.h>
 #include <algorithm>
+#include <array>
 #include <chrono>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <limits>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+// Excludes tombstoned labels during HNSW traversal so deleted documents never surface
+struct TombstoneFilter : faiss::IDSelector {
+    const std::unordered_set<faiss::idx_t>& tombstones;
+    explicit TombstoneFilter(const std::unordered_set<faiss::idx_t>& t) : tombstones(t) {}
+    bool is_member(faiss::idx_t id) const override { return tombstones.count(id) == 0; }
+};
+
+// Sidecar written next to the FAISS file mapping labels to document ids:
+//   header | entryCount x (int64 label, uint32 idLength, id bytes) | tombstoneCount x int64 label
+// Integers are stored in host byte order. appliedSequence is the last ingest log entry the
+// snapshot reflects; startup replays the log from there.
+constexpr char LABEL_MAP_MAGIC[4] = {'F', 'F', 'I', 'D'};
+constexpr uint32_t LABEL_MAP_VERSION = 3;
+
+struct LabelMapHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t indexSize;
+    int64_t nextLabel;
+    uint64_t entryCount;
+    uint64_t tombstoneCount;
+    int64_t appliedSequence;
+    uint32_t dimension;  // Embedding dimension the index was built with
+    uint32_t reserved;
+};
+
+std::string labelMapPath(const std::string& index_file) {
+    return index_file + ".ids";
+}
+
+// fsync of a file, or of a directory so that renames into it survive a power loss
+bool syncPath(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bool synced = ::fsync(fd) == 0;
+    ::close(fd);
+    return synced;
+}
+
+std::string parentDirectory(const std::string& path) {
+    std::string parent = std::filesystem::path(path).parent_path().string();
+    return parent.empty() ? "." : parent;
+}
+
+// Text sidecar beside the index: "magic type k queries vectors", then "efSearch recall meanMs p95Ms" lines
+constexpr char CALIBRATION_MAGIC[] = "fastfindr-efsearch-v1";
+
+std::string calibrationPath(const std::string& index_file) {
+    return index_file + ".efsearch";
+}
+
+// Share of the remaining budget an adaptive search gives the index search; hydration and
+// serialization have to fit in the rest
+constexpr double ADAPTIVE_INDEX_SHARE = 0.75;
+
+// Adaptive searches by the efSearch they ran with; the values are EF_SEARCH_CANDIDATES, or
+// "fallback" while uncalibrated, so the label set stays small
+Counter& adaptiveEfSearchCounter(int efSearch) {
+    constexpr size_t candidates = sizeof(EF_SEARCH_CANDIDATES) / sizeof(EF_SEARCH_CANDIDATES[0]);
+    static const std::array<Counter*, candidates + 1> counters = [] {
+        std::array<Counter*, candidates + 1> registered{};
+        for (size_t i = 0; i <= candidates; ++i) {
+            registered[i] = &metrics().counter("fastfindr_adaptive_ef_search_total",
+                                               "Searches run with an efSearch chosen from their budget",
+                                               {{"ef_search", i < candidates ? std::to_string(EF_SEARCH_CANDIDATES[i]) : "fallback"}});
+        }
+        return registered;
+    }();
+    const int* found = std::find(std::begin(EF_SEARCH_CANDIDATES), std::end(EF_SEARCH_CANDIDATES), efSearch);
+    return *counters[static_cast<size_t>(found - std::begin(EF_SEARCH_CANDIDATES))];
+}
+
+// What a deadline cut short: embedding used up the budget, an exact scan stopped early, or
+// re-scoring was skipped
+enum class DeadlineStage { Embed, Filter, Rerank };
+
+void recordDeadlineExceeded(SearchBudget& budget, DeadlineStage stage) {
+    static const std::array<Counter*, 3> counters = [] {
+        const char* const stages[] = {"embed", "filter", "rerank"};
+        std::array<Counter*, 3> registered{};
+        for (size_t i = 0; i < registered.size(); ++i) {
+            registered[i] = &metrics().counter("fastfindr_search_deadline_exceeded_total",
+                                               "Searches cut short by their latency budget", {{"stage", stages[i]}});
+        }
+        return registered;
+    }();
+    budget.deadlineExceeded = true;
+    counters[static_cast<size_t>(stage)]->increment();
+}
+
+// The first k hits at or above the threshold, for candidates that are already ranked
+std::vector<std::pair<std::string, float>> truncateHits(std::vector<std::pair<std::string, float>> hits, int k,
+                                                        float threshold) {
+    size_t kept = 0;
+    while (kept < hits.size() && kept < static_cast<size_t>(std::max(k, 0)) && hits[kept].second >= threshold) {
+        ++kept;
+    }
+    hits.resize(kept);
+    return hits;
+}
+
+double elapsedMs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Token limit queries are embedded with (the InferenceEngine::getEmbedding default)
+constexpr int64_t QUERY_MAX_TOKENS = 256;
+
+// The fingerprint keeps entries from one model from answering for another
+std::string queryCacheKey(const std::string& modelFingerprint, const std::string& query) {
+    std::string key = modelFingerprint;
+    key += '\0';
+    key += std::to_string(QUERY_MAX_TOKENS);
+    key += '\0';
+    key += query;
+    return key;
+}
+
+std::string resultCacheKey(uint64_t generation, const float* embedding, size_t dimension, int k, float threshold,
+                           int efSearch, const MetadataFilter* filter) {
+    std::string key;
+    key.reserve(sizeof(generation) + 3 * sizeof(int) + dimension * sizeof(float) + 32);
+    auto append = [&key](const void* data, size_t size) { key.append(static_cast<const char*>(data), size); };
+    append(&generation, sizeof(generation));
+    append(&k, sizeof(k));
+    append(&threshold, sizeof(threshold));
+    append(&efSearch, sizeof(efSearch));
+    append(embedding, dimension * sizeof(float));
+    if (filter) {
+        // Length-prefixed so no two filters serialize the same way
+        uint32_t keyLength = static_cast<uint32_t>(filter->key.size());
+        append(&keyLength, sizeof(keyLength));
+        key += filter->key;
+        key += filter->value;
+    }
+    return key;
+}
+
+size_t hitsBytes(const std::vector<std::pair<std::string, float>>& hits) {
+    size_t bytes = hits.size() * sizeof(std::pair<std::string, float>);
+    for (const auto& hit : hits) {
+        bytes += hit.first.size();
+    }
+    return bytes;
+}
+
+// FAISS search parameters for whichever index type is installed
+struct IndexSearchParams {
+    faiss::SearchParametersHNSW hnsw;
+    faiss::SearchParametersIVF ivf;
+    faiss::SearchParameters* params;
+    
+    IndexSearchParams(const faiss::Index* inner, int efSearch, faiss::IDSelector* selector) : params(&hnsw) {
+        hnsw.efSearch = efSearch;
+        if (auto* invertedFile = dynamic_cast<const faiss::IndexIVF*>(inner)) {
+            ivf.nprobe = invertedFile->nprobe;
+            params = &ivf;
+        }
+        params->sel = selector;
+    }
+};
+
+constexpr int HNSW_M = 32;
+constexpr int HNSW_EF_CONSTRUCTION = 300;
+
+faiss::IndexIDMap* wrapWithIdMap(faiss::Index* inner) {
+    auto* idMap = new faiss::IndexIDMap(inner);
+    idMap->own_fields = true;
+    return idMap;
+}
+
+faiss::IndexIDMap* createIdMappedIndex(int d, faiss::MetricType metric) {
+    auto* hnsw = new faiss::IndexHNSWFlat(d, HNSW_M, metric);
+    hnsw->hnsw.efConstruction = HNSW_EF_CONSTRUCTION;
+    return wrapWithIdMap(hnsw);
+}
+
+IndexType detectIndexType(const faiss::Index* inner) {
+    if (dynamic_cast<const faiss::IndexIVFPQ*>(inner)) return IndexType::IvfPQ;
+    if (dynamic_cast<const faiss::IndexHNSWPQ*>(inner)) return IndexType::HnswPQ;
+    if (dynamic_cast<const faiss::IndexHNSWSQ*>(inner)) return IndexType::HnswSQ8;
+    return IndexType::HnswFlat;
+}
+
+// PQ splits vectors into equal sub-vectors, so the code size has to divide the dimension
+int pqSubquantizers(int d, int requested) {
+    if (requested > 0 && d % requested == 0) {
+        return requested;
+    }
+    if (requested > 0) {
+        LOG_WARN("PQ code size " << requested << " does not divide dimension " << d
+              << ", picking one that does");
+    }
+    
+    int m = std::max(1, d / 16);
+    while (d % m != 0) {
+        --m;
+    }
+    return m;
+}
+
+// read_index flags that leave an index of this type in mapped file pages, or 0 if it has to be read onto
+// the heap. IVF inverted lists are mapped with IO_FLAG_MMAP. Flat-coded storage, the bulk of an HNSW
+// index, needs IO_FLAG_MMAP_IFC from FAISS 1.10 (detected by CMake). The two go through different FAISS
+// file readers and cannot be combined, so the configured type picks one.
+int mappedIndexFlags(IndexType type) {
+    if (type == IndexType::IvfPQ) {
+        return faiss::IO_FLAG_MMAP | faiss::IO_FLAG_READ_ONLY;
+    }
+#ifdef FAISS_HAS_MMAP_IFC
+    return faiss::IO_FLAG_MMAP_IFC;
+#else
+    return 0;
+#endif
+}
+
+// Empty index with the same layout and trained quantizers as `trained`, without copying codes or graph
+faiss::Index* createEmptyLike(const faiss::Index* trained) {
+    if (auto* ivf = dynamic_cast<const faiss::IndexIVFPQ*>(trained)) {
+        auto* copy = new faiss::IndexIVFPQ(faiss::clone_index(ivf->quantizer), ivf->d, ivf->nlist,
+                                           ivf->pq.M, ivf->pq.nbits, ivf->metric_type);
+        copy->own_fields = true;
+        copy->pq = ivf->pq;
+        copy->nprobe = ivf->nprobe;
+        copy->is_trained = true;
+        copy->precompute_table();
+        copy->make_direct_map(true);
+        return copy;
+    }
+    
+    auto* hnsw = dynamic_cast<const faiss::IndexHNSW*>(trained);
+    faiss::IndexHNSW* copy = nullptr;
+    if (auto* sq = dynamic_cast<const faiss::IndexScalarQuantizer*>(hnsw->storage)) {
+        copy = new faiss::IndexHNSWSQ(hnsw->d, sq->sq.qtype, HNSW_M, hnsw->metric_type);
+        static_cast<faiss::IndexScalarQuantizer*>(copy->storage)->sq = sq->sq;
+    } else if (auto* pq = dynamic_cast<const faiss::IndexPQ*>(hnsw->storage)) {
+        copy = new faiss::IndexHNSWPQ(hnsw->d, static_cast<int>(pq->pq.M), HNSW_M,
+                                      static_cast<int>(pq->pq.nbits), hnsw->metric_type);
+        static_cast<faiss::IndexPQ*>(copy->storage)->pq = pq->pq;
+    } else {
+        copy = new faiss::IndexHNSWFlat(hnsw->d, HNSW_M, hnsw->metric_type);
+    }
+    copy->storage->is_trained = true;
+    copy->is_trained = true;
+    copy->hnsw.efConstruction = HNSW_EF_CONSTRUCTION;
+    return copy;
+}
+
+size_t codeBytes(const faiss::Index* inner) {
+    if (auto* ivf = dynamic_cast<const faiss::IndexIVF*>(inner)) {
+        return ivf->code_size;
+    }
+    if (auto* hnsw = dynamic_cast<const faiss::IndexHNSW*>(inner)) {
+        if (auto* codes = dynamic_cast<const faiss::IndexFlatCodes*>(hnsw->storage)) {
+            return codes->code_size;
+        }
+    }
+    return 0;
+}
+
+// Resident size of the vector data structures; allocator overhead and the document id maps are not counted
+size_t estimateIndexBytes(const faiss::IndexIDMap* index) {
+    size_t bytes = index->id_map.size() * sizeof(faiss::idx_t);
+    const faiss::Index* inner = index->index;
+    
+    if (auto* ivf = dynamic_cast<const faiss::IndexIVF*>(inner)) {
+        // Each entry stores its code and id in an inverted list plus a direct map slot
+        bytes += static_cast<size_t>(ivf->ntotal) * (ivf->code_size + 2 * sizeof(faiss::idx_t));
+        bytes += ivf->nlist * static_cast<size_t>(ivf->d) * sizeof(float);
+    } else if (auto* hnsw = dynamic_cast<const faiss::IndexHNSW*>(inner)) {
+        bytes += hnsw->hnsw.neighbors.size() * sizeof(faiss::HNSW::storage_idx_t);
+        bytes += hnsw->hnsw.offsets.size() * sizeof(size_t);
+        bytes += hnsw->hnsw.levels.size() * sizeof(int);
+        if (auto* codes = dynamic_cast<const faiss::IndexFlatCodes*>(hnsw->storage)) {
+            bytes += codes->codes.size();
+        }
+    }
+    return bytes;
+}
+
+}
+
+const char* indexTypeName(IndexType type) {
+    switch (type) {
+        case IndexType::HnswSQ8: return "hnsw_sq8";
+        case IndexType::HnswPQ: return "hnsw_pq";
+        case IndexType::IvfPQ: return "ivf_pq";
+        case IndexType::HnswFlat: break;
+    }
+    return "hnsw_flat";
+}
+
+bool parseIndexType(const std::string& name, IndexType& type) {
+    for (IndexType candidate : {IndexType::HnswFlat, IndexType::HnswSQ8, IndexType::HnswPQ, IndexType::IvfPQ}) {
+        if (name == indexTypeName(candidate)) {
+            type = candidate;
+            return true;
+        }
+    }
+    return false;
+}
 
 VectorSearch::VectorSearch(const std::string& modelPath, const std::string& tokenizerPath, 
                          const std::string& dbPath, int M, int efConstruction)
     : modelPath_(modelPath), tokenizerPath_(tokenizerPath), dbPath_(dbPath)
-    , d(0), index(nullptr) {
-    inferenceEngine_ = std::make_unique<InferenceEngine>();
+    , d(0), metric_(faiss::METRIC_L2), index(nullptr), nextLabel_(0), indexMapped_(false)
+    , compactionRatio_(0.2f), indexEpoch_(0), indexGeneration_(0)
+    , compacting_(false)
+    , appliedSequence_(0), unsavedWrites_(0), indexerRunning_(false), indexerStopping_(false), writesPending_(false)
+    , snapshotInterval_(0), snapshotThreshold_(0) {
+    inferenceEngine_ = std::make_shared<InferenceEngine>();
     storage_ = std::make_unique<Storage>(dbPath_);
 }
 
-VectorSearch::~VectorSearch() {
+VectorSearch::VectorSearch(std::shared_ptr<InferenceEngine> engine, const std::string& dbPath)
+    : VectorSearch("", "", dbPath) {
+    inferenceEngine_ = std::move(engine);
+}
+
+VectorSearch::~VectorSearch() {
+    stopIndexer();
+    if (compactionThread_.joinable()) {
+        compactionThread_.join();
+    }
+    delete index;
+}
+
+bool VectorSearch::initialize() {
+    if (!storage_->initialize()) {
+        LOG_ERROR("Failed to initialize storage");
+        return false;
+    }
+    
+    if (inferenceEngine_->isLoaded()) {
+        d = static_cast<int>(inferenceEngine_->getEmbeddingDimension());
+        return true;
+    }
+    
+    if (!inferenceEngine_->loadModel(modelPath_, tokenizerPath_, inferenceOptions_)) {
+        LOG_ERROR("Failed to load inference model");
+        return false;
+    }
+    
+    d = static_cast<int>(inferenceEngine_->getEmbeddingDimension());
+    LOG_INFO("Model loaded with embedding dimension: " << d);
+    
+    return true;
+}
+
+void VectorSearch::enableQueryBatching(std::chrono::microseconds maxWait, size_t maxBatch) {
+    if (!isModelLoaded()) {
+        LOG_ERROR("Model not loaded. Call initialize() first.");
+        return;
+    }
+    
+    queryScheduler_ = std::make_unique<EmbeddingScheduler>(*inferenceEngine_, maxWait, maxBatch);
+}
+
+void VectorSearch::enableQueryCache(size_t capacityBytes) {
+    queryCache_ = capacityBytes > 0 ? std::make_unique<ShardedLruCache<std::vector<float>>>(capacityBytes) : nullptr;
+}
+
+void VectorSearch::enableResultCache(size_t capacityBytes) {
+    resultCache_ = capacityBytes > 0 ? std::make_unique<ShardedLruCache<SearchHits>>(capacityBytes) : nullptr;
+}
+
+void VectorSearch::loadOrCreateIndex(const std::string& index_file) {
+    if (!isModelLoaded()) {
+        LOG_ERROR("Model not loaded. Call initialize() first.");
+        return;
+    }
+    
+    std::lock_guard<std::mutex> applyLock(applyMutex_);
+    calibrationFile_ = calibrationPath(index_file);
+    
+    if (std::filesystem::exists(index_file)) {
+        LOG_INFO("Loading existing index...");
+        
+        // Mapped pages are shared by every process serving the same file and are faulted in on demand,
+        // so startup does not wait for the whole index to be read
+        int ioFlags = 0;
+        if (indexOptions_.memoryMap) {
+            ioFlags = mappedIndexFlags(indexOptions_.type);
+            if (ioFlags == 0) {
+                LOG_INFO("This FAISS build cannot map " << indexTypeName(indexOptions_.type)
+                      << " indexes (needs FAISS 1.10 or later); reading the index onto the heap");
+            }
+        }
+        
+        faiss::Index* loaded = faiss::read_index(index_file.c_str(), ioFlags);
+        bool restored = false;
+        {
+            std::unique_lock<std::shared_mutex> lock(indexMutex_);
+            delete index;
+            index = dynamic_cast<faiss::IndexIDMap*>(loaded);
+            indexMapped_ = index && ioFlags != 0;
+            mappedIndexPath_ = index_file;
+            ++indexEpoch_;
+            ++indexGeneration_;
+            
+            if (!index) {
+                // Legacy files hold a bare HNSW graph with no recoverable label mapping
+                LOG_INFO("Index file predates label maps. Rebuilding from stored embeddings...");
+                delete loaded;
+            } else if (index->d != d) {
+                LOG_INFO("Index has dimension " << index->d << ", embeddings have " << d
+                      << ". Rebuilding from stored embeddings...");
+            } else if (index->metric_type != metric_) {
+                LOG_INFO("Index was built with a different metric. Rebuilding from stored embeddings...");
+            } else if (detectIndexType(index->index) != indexOptions_.type) {
+                LOG_INFO("Index is " << indexTypeName(detectIndexType(index->index)) << ", configured "
+                      << indexTypeName(indexOptions_.type) << ". Rebuilding from stored embeddings...");
+            } else if (loadLabelMap(labelMapPath(index_file))) {
+                restored = true;
+            } else {
+                LOG_INFO("Label map missing or stale. Rebuilding...");
+            }
+        }
+        
+        if (!restored || !synchronizeIndex()) {
+            rebuildIndexLocked();
+        }
+        
+        LOG_INFO("Loaded HNSW index with " << index->ntotal << " vectors"
+                 << (indexMapped_ ? " (memory-mapped, read-only until the first insert)" : ""));
+    } else {
+        LOG_INFO("Creating new HNSW index...");
+        rebuildIndexLocked();
+        LOG_INFO("Created and populated HNSW index");
+    }
+    
+    loadCalibration();
+}
+
+std::vector<SearchResult> VectorSearch::searchText(const std::string& query, int k, float threshold, int efSearch,
+                                                   const MetadataFilter* filter, const ResultFields& fields) {
+    if (!isInitialized()) {
+        LOG_ERROR("System not initialized");
+        return {};
+    }
+    
+    return searchEmbedding(embedQuery(query), k, threshold, efSearch, filter, fields);
+}
+
+std::vector<SearchResult> VectorSearch::searchEmbedding(const std::vector<float>& queryEmbedding, int k, float threshold, int efSearch,
+                                                        const MetadataFilter* filter, const ResultFields& fields) {
+    if (!isInitialized()) {
+        LOG_ERROR("System not initialized");
+        return {};
+    }
+    
+    return hydrateResults(cachedVectorHits(queryEmbedding, k, threshold, efSearch, filter), fields);
+}
+
+std::vector<SearchResult> VectorSearch::searchText(const std::string& query, int k, float threshold, SearchBudget& budget,
+                                                   const MetadataFilter* filter, const ResultFields& fields) {
+    if (!isInitialized()) {
+        LOG_ERROR("System not initialized");
+        return {};
+    }
+    
+    return searchEmbedding(embedQuery(query), k, threshold, budget, filter, fields);
+}
+
+std::vector<SearchResult> VectorSearch::searchEmbedding(const std::vector<float>& queryEmbedding, int k, float threshold,
+                                                        SearchBudget& budget, const MetadataFilter* filter,
+                                                        const ResultFields& fields) {
+    if (!isInitialized()) {
+        LOG_ERROR("System not initialized");
+        return {};
+    }
+    
+    // With the budget already spent the cheapest calibrated search still returns something
+    const double remaining = budget.remainingMs();
+    if (remaining <= 0.0) {
+        recordDeadlineExceeded(budget, DeadlineStage::Embed);
+    }
+    const int efSearch = chooseEfSearch(budget.targetRecall, remaining * ADAPTIVE_INDEX_SHARE, budget.fallbackEfSearch);
+    adaptiveEfSearchCounter(efSearch).increment();
+    int largest = budget.efSearch;
+    while (largest < efSearch && !budget.efSearch.compare_exchange_weak(largest, efSearch)) {
+    }
+    
+    return hydrateResults(cachedVectorHits(queryEmbedding, k, threshold, efSearch, filter, nullptr, &budget), fields);
+}
+
+std::vector<std::vector<SearchResult>> VectorSearch::searchBatch(const std::vector<BatchQuery>& queries,
+                                                                 const ResultFields& fields) {
+    if (!isInitialized()) {
+        LOG_ERROR("System not initialized");
+        return {};
+    }
+    
+    // Raw vectors are used as given; cached texts are copied in; the rest share one inference call
+    EmbeddingMatrix embeddings(queries.size(), static_cast<size_t>(d));
+    std::vector<std::string> pendingTexts;
+    std::vector<size_t> pendingRows;
+    const std::string& model = inferenceEngine_->getModelFingerprint();
+    std::vector<float> cached;
+    for (size_t i = 0; i < queries.size(); ++i) {
+        const BatchQuery& query = queries[i];
+        if (!query.embedding.empty()) {
+            if (query.embedding.size() != static_cast<size_t>(d)) {
+                throw std::invalid_argument("Query " + std::to_string(i) + " has dimension " +
+                                            std::to_string(query.embedding.size()) + ", expected " + std::to_string(d));
+            }
+            std::copy(query.embedding.begin(), query.embedding.end(), embeddings.row(i));
+        } else if (queryCache_ && queryCache_->get(queryCacheKey(model, query.text), cached)) {
+            std::copy(cached.begin(), cached.end(), embeddings.row(i));
+        } else {
+            pendingTexts.push_back(query.text);
+            pendingRows.push_back(i);
+        }
+    }
+    
+    if (!pendingTexts.empty()) {
+        EmbeddingMatrix fresh = inferenceEngine_->getEmbeddings(pendingTexts, QUERY_MAX_TOKENS);
+        for (size_t j = 0; j < pendingRows.size(); ++j) {
+            EmbeddingView row = fresh[j];
+            std::copy(row.begin(), row.end(), embeddings.row(pendingRows[j]));
+            if (queryCache_) {
+                queryCache_->put(queryCacheKey(model, pendingTexts[j]), row.toVector(), row.size() * sizeof(float));
+            }
+        }
+    }
+    
+    // Filtered queries each need their own selector and run alone; the rest share batched searches
+    std::vector<SearchHits> hits(queries.size());
+    std::vector<std::string> cacheKeys(queries.size());
+    std::vector<size_t> batched;
+    const uint64_t generation = indexGeneration_;
+    for (size_t i = 0; i < queries.size(); ++i) {
+        const BatchQuery& query = queries[i];
+        const MetadataFilter* filter = query.hasFilter ? &query.filter : nullptr;
+        if (resultCache_) {
+            cacheKeys[i] = resultCacheKey(generation, embeddings[i].data(), embeddings.dimension(),
+                                          query.k, query.threshold, query.efSearch, filter);
+            if (resultCache_->get(cacheKeys[i], hits[i])) {
+                continue;
+            }
+        }
+        
+        if (filter) {
+            auto allowedIds = storage_->getDocumentIdsByMetadata(filter->key, filter->value);
+            hits[i] = vectorHits(embeddings[i].toVector(), query.k, query.threshold, query.efSearch, &allowedIds);
+            if (resultCache_) {
+                resultCache_->put(cacheKeys[i], hits[i], hitsBytes(hits[i]));
+            }
+        } else {
+            batched.push_back(i);
+        }
+    }
+    
+    batchVectorHits(embeddings, batched, queries, hits);
+    if (resultCache_) {
+        for (size_t i : batched) {
+            resultCache_->put(cacheKeys[i], hits[i], hitsBytes(hits[i]));
+        }
+    }
+    
+    return hydrateBatch(hits, fields);
+}
+
+std::vector<SearchResult> VectorSearch::searchKeyword(const std::string& query, int k, float threshold,
+                                                      const ResultFields& fields) {
+    if (!storage_ || !storage_->isOpen()) {
+        return {};
+    }
+    
+    return hydrateResults(keywordHits(query, k, threshold), fields);
+}
+
+std::vector<SearchResult> VectorSearch::searchHybrid(const std::string& query, int k, float threshold, int efSearch,
+                                                     const HybridSearchOptions& options, SearchTimings* timings,
+                                                     const MetadataFilter* filter, const ResultFields& fields) {
+    if (!isInitialized()) {
+        LOG_ERROR("System not initialized");
+        return {};
+    }
+    
+    SearchTimings stages;
+    const auto searchStart = std::chrono::steady_clock::now();
+    const int candidates = options.candidates > 0 ? options.candidates : std::max(4 * k, 50);
+    const float noThreshold = std::numeric_limits<float>::lowest();
+    
+    std::vector<std::string> allowedIds;
+    if (filter) {
+        allowedIds = storage_->getDocumentIdsByMetadata(filter->key, filter->value);
+    }
+    
+    // Keyword retrieval only touches SQLite, so it overlaps with embedding the query and the HNSW search
+    auto keywordFuture = std::async(std::launch::async, [&] {
+        auto start = std::chrono::steady_clock::now();
+        SearchHits hits = keywordHits(query, candidates, noThreshold);
+        if (filter) {
+            std::unordered_set<std::string> allowed(allowedIds.begin(), allowedIds.end());
+            hits.erase(std::remove_if(hits.begin(), hits.end(), [&allowed](const auto& hit) { return !allowed.count(hit.first); }),
+                       hits.end());
+        }
+        stages.keywordMs = elapsedMs(start);
+        return hits;
+    });
+    
+    auto start = std::chrono::steady_clock::now();
+    auto queryEmbedding = embedQuery(query);
+    stages.embedMs = elapsedMs(start);
+    
+    start = std::chrono::steady_clock::now();
+    SearchHits semantic;
+    if (!queryEmbedding.empty()) {
+        semantic = cachedVectorHits(queryEmbedding, candidates, noThreshold, std::max(efSearch, candidates),
+                                    filter, filter ? &allowedIds : nullptr);
+    }
+    stages.vectorMs = elapsedMs(start);
+    
+    SearchHits keyword = keywordFuture.get();
+    
+    start = std::chrono::steady_clock::now();
+    std::unordered_map<std::string, float> fused;
+    std::vector<std::string> order;  // First appearance, used to break score ties deterministically
+    auto accumulate = [&](const SearchHits& hits, float weight, bool byRank) {
+        float minScore = 0.0f;
+        float range = 0.0f;
+        if (!byRank && !hits.empty()) {
+            auto [lowest, highest] = std::minmax_element(hits.begin(), hits.end(),
+                [](const auto& a, const auto& b) { return a.second < b.second; });
+            minScore = lowest->second;
+            range = highest->second - lowest->second;
+        }
+        
+        for (size_t rank = 0; rank < hits.size(); ++rank) {
+            const auto& [documentId, score] = hits[rank];
+            float contribution = byRank
+                ? 1.0f / (options.rrfK + static_cast<float>(rank + 1))
+                : weight * (range > 0.0f ? (score - minScore) / range : 1.0f);
+            auto [it, inserted] = fused.emplace(documentId, 0.0f);
+            if (inserted) {
+                order.push_back(documentId);
+            }
+            it->second += contribution;
+        }
+    };
+    
+    bool byRank = options.fusion == FusionMethod::ReciprocalRank;
+    accumulate(semantic, options.semanticWeight, byRank);
+    accumulate(keyword, 1.0f - options.semanticWeight, byRank);
+    
+    SearchHits hits;
+    hits.reserve(order.size());
+    for (const auto& documentId : order) {
+        hits.emplace_back(documentId, fused[documentId]);
+    }
+    std::stable_sort(hits.begin(), hits.end(), [](const auto& a, const auto& b) { return a.second > b.second; });
+    
+    // Only the fused top-k is hydrated
+    hits.erase(std::remove_if(hits.begin(), hits.end(), [threshold](const auto& hit) { return hit.second < threshold; }),
+               hits.end());
+    if (hits.size() > static_cast<size_t>(std::max(k, 0))) {
+        hits.resize(static_cast<size_t>(std::max(k, 0)));
+    }
+    stages.fusionMs = elapsedMs(start);
+    
+    start = std::chrono::steady_clock::now();
+    std::vector<SearchResult> results = hydrateResults(hits, fields);
+    stages.hydrateMs = elapsedMs(start);
+    stages.totalMs = elapsedMs(searchStart);
+    
+    if (timings) {
+        *timings = stages;
+    }
+    return results;
+}
+
+VectorSearch::SearchHits VectorSearch::cachedVectorHits(const std::vector<float>& queryEmbedding, int k, float threshold,
+                                                        int efSearch, const MetadataFilter* filter,
+                                                        const std::vector<std::string>* allowedIds, SearchBudget* budget) {
+    auto search = [&] {
+        if (filter && !allowedIds) {
+            auto resolved = storage_->getDocumentIdsByMetadata(filter->key, filter->value);
+            return vectorHits(queryEmbedding, k, threshold, efSearch, &resolved, budget);
+        }
+        return vectorHits(queryEmbedding, k, threshold, efSearch, filter ? allowedIds : nullptr, budget);
+    };
+    if (!resultCache_) {
+        return search();
+    }
+    
+    // Read before searching: if the index changes mid-search the entry lands under the old
+    // generation and is never looked up again
+    std::string key = resultCacheKey(indexGeneration_, queryEmbedding.data(), queryEmbedding.size(),
+                                     k, threshold, efSearch, filter);
+    SearchHits hits;
+    if (resultCache_->get(key, hits)) {
+        return hits;
+    }
+    
+    hits = search();
+    if (!budget || !budget->deadlineExceeded) {
+        resultCache_->put(key, hits, hitsBytes(hits));
+    }
+    return hits;
+}
+
+VectorSearch::SearchHits VectorSearch::vectorHits(const std::vector<float>& queryEmbedding, int k, float threshold, int efSearch,
+                                                  const std::vector<std::string>* allowedIds, SearchBudget* budget) {
+    ScopedTimer timer(stageHistogram(Stage::Vector));
+    SearchHits hits;
+    std::shared_lock<std::shared_mutex> lock(indexMutex_);
+    if (!index) {
+        return hits;
+    }
+    
+    long liveCount = index->ntotal - static_cast<long>(tombstones_.size());
+    if (liveCount <= 0) {
+        LOG_ERROR("Index is empty");
+        return hits;
+    }
+    
+    // Quantized scores are approximate: over-fetch, re-score on full-precision vectors, then threshold
+    const bool rerank = indexOptions_.rerankFactor > 1 && detectIndexType(index->index) != IndexType::HnswFlat;
+    const int fetch = rerank ? k * indexOptions_.rerankFactor : k;
+    const float cutoff = rerank ? -std::numeric_limits<float>::infinity() : threshold;
+    // Past the deadline the approximate ranking is returned instead of spending more time re-scoring
+    auto finish = [&](SearchHits candidates) {
+        if (!rerank) {
+            return candidates;
+        }
+        if (budget && budget->expired()) {
+            recordDeadlineExceeded(*budget, DeadlineStage::Rerank);
+            return truncateHits(std::move(candidates), k, threshold);
+        }
+        return rerankHits(queryEmbedding, candidates, k, threshold);
+    };
+    
+    TombstoneFilter filter(tombstones_);
+    std::vector<uint8_t> allowedBitmap;
+    std::unique_ptr<faiss::IDSelectorBitmap> allowedSelector;
+    IndexSearchParams search(index->index, efSearch, tombstones_.empty() ? nullptr : &filter);
+    
+    if (allowedIds) {
+        // Only live labels are mapped, so the allowed set never includes tombstones
+        std::vector<faiss::idx_t> allowedLabels;
+        allowedLabels.reserve(allowedIds->size());
+        for (const auto& documentId : *allowedIds) {
+            auto it = documentIdToLabel_.find(documentId);
+            if (it != documentIdToLabel_.end()) {
+                allowedLabels.push_back(it->second);
+            }
+        }
+        
+        if (allowedLabels.empty()) {
+            return hits;
+        }
+        
+        // HNSW degrades when most neighbours are filtered out, while exact scoring is cheap for few vectors
+        if (allowedLabels.size() <= FILTER_BRUTE_FORCE_MAX ||
+            allowedLabels.size() * FILTER_BRUTE_FORCE_DIVISOR < static_cast<size_t>(liveCount)) {
+            hits = exactHits(queryEmbedding, allowedLabels, fetch, cutoff, budget);
+            lock.unlock();
+            return finish(std::move(hits));
+        }
+        
+        allowedBitmap.assign(static_cast<size_t>(nextLabel_ + 7) / 8, 0);
+        for (faiss::idx_t label : allowedLabels) {
+            allowedBitmap[label >> 3] |= static_cast<uint8_t>(1u << (label & 7));
+        }
+        allowedSelector = std::make_unique<faiss::IDSelectorBitmap>(allowedBitmap.size(), allowedBitmap.data());
+        search.params->sel = allowedSelector.get();
+        liveCount = static_cast<long>(allowedLabels.size());
+    }
+    
+    const int n = std::min(fetch, static_cast<int>(liveCount));
+    
+    std::vector<float> distances(n);
+    std::vector<faiss::idx_t> labels(n);
+    
+    index->search(1, queryEmbedding.data(), n, distances.data(), labels.data(), search.params);
+    hits = collectHits(distances.data(), labels.data(), n, cutoff);
+    
+    lock.unlock();
+    return finish(std::move(hits));
+}
+
+VectorSearch::SearchHits VectorSearch::collectHits(const float* distances, const faiss::idx_t* labels, int n, float cutoff) const {
+    SearchHits hits;
+    hits.reserve(n);
+    for (int i = 0; i < n; ++i) {
+        if (labels[i] < 0) {
+            break;  // Fewer than k reachable results
+        }
+        
+        // Results come back best first, so nothing after the first one under the threshold can qualify
+        float score = scoreFromDistance(distances[i]);
+        if (score < cutoff) {
+            break;
+        }
+        
+        auto it = labelToDocumentId_.find(labels[i]);
+        if (it != labelToDocumentId_.end()) {
+            hits.emplace_back(it->second, score);
+        }
+    }
+    return hits;
+}
+
+void VectorSearch::batchVectorHits(const EmbeddingMatrix& embeddings, const std::vector<size_t>& rows,
+                                   const std::vector<BatchQuery>& queries, std::vector<SearchHits>& hits) {
+    // One FAISS call per distinct efSearch; each call fetches the largest k in its group and every
+    // query keeps its own prefix. FAISS spreads the queries of a call over its OpenMP threads.
+    ScopedTimer timer(stageHistogram(Stage::Vector));
+    std::map<int, std::vector<size_t>> groups;
+    for (size_t row : rows) {
+        groups[queries[row].efSearch].push_back(row);
+    }
+    
+    std::vector<size_t> reranked;
+    {
+        std::shared_lock<std::shared_mutex> lock(indexMutex_);
+        if (!index) {
+            return;
+        }
+        long liveCount = index->ntotal - static_cast<long>(tombstones_.size());
+        if (liveCount <= 0) {
+            return;
+        }
+        
+        const bool rerank = indexOptions_.rerankFactor > 1 && detectIndexType(index->index) != IndexType::HnswFlat;
+        TombstoneFilter filter(tombstones_);
+        
+        for (const auto& [efSearch, group] : groups) {
+            int fetch = 0;
+            for (size_t row : group) {
+                fetch = std::max(fetch, rerank ? queries[row].k * indexOptions_.rerankFactor : queries[row].k);
+            }
+            const int n = std::min(fetch, static_cast<int>(liveCount));
+            if (n <= 0) {
+                continue;
+            }
+            
+            std::vector<float> batch(group.size() * embeddings.dimension());
+            for (size_t i = 0; i < group.size(); ++i) {
+                EmbeddingView row = embeddings[group[i]];
+                std::copy(row.begin(), row.end(), batch.begin() + i * embeddings.dimension());
+            }
+            
+            std::vector<float> distances(group.size() * n);
+            std::vector<faiss::idx_t> labels(group.size() * n);
+            IndexSearchParams search(index->index, efSearch, tombstones_.empty() ? nullptr : &filter);
+            index->search(static_cast<faiss::idx_t>(group.size()), batch.data(), n,
+                          distances.data(), labels.data(), search.params);
+            
+            for (size_t i = 0; i < group.size(); ++i) {
+                const BatchQuery& query = queries[group[i]];
+                const int own = std::min(n, rerank ? query.k * indexOptions_.rerankFactor : query.k);
+                const float cutoff = rerank ? -std::numeric_limits<float>::infinity() : query.threshold;
+                hits[group[i]] = collectHits(distances.data() + i * n, labels.data() + i * n, own, cutoff);
+            }
+        }
+        if (rerank) {
+            reranked = rows;
+        }
+    }
+    
+    for (size_t row : reranked) {
+        hits[row] = rerankHits(embeddings[row].toVector(), hits[row], queries[row].k, queries[row].threshold);
+    }
+}
+
+VectorSearch::SearchHits VectorSearch::rerankHits(const std::vector<float>& queryEmbedding, const SearchHits& candidates,
+                                                  int k, float threshold) {
+    std::vector<std::string> candidateIds;
+    candidateIds.reserve(candidates.size());
+    for (const auto& candidate : candidates) {
+        candidateIds.push_back(candidate.first);
+    }
+    
+    std::vector<std::string> storedIds;
+    std::vector<float> vectors;
+    storage_->getEmbeddingsByIds(inferenceEngine_->getModelFingerprint(), d, candidateIds, storedIds, vectors);
+    
+    std::unordered_map<std::string, float> exactScores;
+    exactScores.reserve(storedIds.size());
+    for (size_t i = 0; i < storedIds.size(); ++i) {
+        exactScores[storedIds[i]] = exactScore(queryEmbedding.data(), vectors.data() + i * d);
+    }
+    
+    // A candidate without a stored vector keeps its approximate score
+    SearchHits rescored = candidates;
+    for (auto& hit : rescored) {
+        auto it = exactScores.find(hit.first);
+        if (it != exactScores.end()) {
+            hit.second = it->second;
+        }
+    }
+    std::stable_sort(rescored.begin(), rescored.end(),
+                     [](const auto& a, const auto& b) { return a.second > b.second; });
+    
+    SearchHits hits;
+    for (const auto& hit : rescored) {
+        if (static_cast<int>(hits.size()) >= k || hit.second < threshold) {
+            break;
+        }
+        hits.push_back(hit);
+    }
+    
+    return hits;
+}
+
+float VectorSearch::scoreFromDistance(float distance) const {
+    // Embeddings are L2-normalized, so inner product is cosine similarity; L2 distances are mapped into (0, 1]
+    return metric_ == faiss::METRIC_INNER_PRODUCT ? distance : 1.0f / (1.0f + distance);
+}
+
+float VectorSearch::exactScore(const float* a, const float* b) const {
+    return scoreFromDistance(metric_ == faiss::METRIC_INNER_PRODUCT
+        ? faiss::fvec_inner_product(a, b, static_cast<size_t>(d))
+        : faiss::fvec_L2sqr(a, b, static_cast<size_t>(d)));
+}
+
+VectorSearch::SearchHits VectorSearch::exactHits(const std::vector<float>& queryEmbedding, std::vector<faiss::idx_t>& labels,
+                                                 int k, float threshold, SearchBudget* budget) {
+    // Caller holds indexMutex_. Labels are assigned in increasing order and compaction preserves it,
+    // so id_map is sorted and a label's storage slot can be found by binary search.
+    std::sort(labels.begin(), labels.end());
+    
+    std::vector<std::pair<float, faiss::idx_t>> scored;
+    scored.reserve(labels.size());
+    std::vector<float> vector(d);
+    auto slot = index->id_map.begin();
+    for (size_t i = 0; i < labels.size(); ++i) {
+        // The clock is read once per 256 vectors; what has been scored so far is the answer past the deadline
+        if (budget && (i & 255) == 255 && budget->expired()) {
+            recordDeadlineExceeded(*budget, DeadlineStage::Filter);
+            break;
+        }
+        const faiss::idx_t label = labels[i];
+        slot = std::lower_bound(slot, index->id_map.end(), label);
+        if (slot == index->id_map.end() || *slot != label) {
+            continue;
+        }
+        index->index->reconstruct(static_cast<faiss::idx_t>(slot - index->id_map.begin()), vector.data());
+        float score = exactScore(queryEmbedding.data(), vector.data());
+        if (score >= threshold) {
+            scored.emplace_back(score, label);
+        }
+    }
+    
+    size_t count = std::min(scored.size(), static_cast<size_t>(std::max(k, 0)));
+    std::partial_sort(scored.begin(), scored.begin() + count, scored.end(), std::greater<>());
+    
+    SearchHits hits;
+    hits.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        hits.emplace_back(labelToDocumentId_.at(scored[i].second), scored[i].first);
+    }
+    
+    return hits;
+}
+
+VectorSearch::SearchHits VectorSearch::keywordHits(const std::string& query, int k, float threshold) {
+    ScopedTimer timer(stageHistogram(Stage::Keyword));
+    SearchHits hits;
+    if (k <= 0) {
+        return hits;
+    }
+    
+    std::vector<std::string> documentIds;
+    std::vector<float> scores;
+    storage_->searchFullText(query, static_cast<size_t>(k), documentIds, scores);
+    
+    hits.reserve(documentIds.size());
+    for (size_t i = 0; i < documentIds.size(); ++i) {
+        if (scores[i] >= threshold) {
+            hits.emplace_back(std::move(documentIds[i]), scores[i]);
+        }
+    }
+    
+    return hits;
+}
+
+std::vector<SearchResult> VectorSearch::searchByMetadata(const std::string& key, const std::string& value, int k) {
+    if (!isInitialized()) {
+        LOG_ERROR("System not initialized");
+        return {};
+    }
+    
+    auto documents = storage_->getDocumentsByMetadata(key, value);
+    std::vector<SearchResult> results;
+    
+    int count = std::min(k, static_cast<int>(documents.size()));
+    for (int i = 0; i < count; ++i) {
+        SearchResult result;
+        result.id = documents[i].id;
+        result.text = documents[i].text;
+        result.metadata = documents[i].metadata;
+        result.score = 1.0f; // Exact metadata match
+        results.push_back(result);
+    }
+    
+    return results;
+}
+
+bool VectorSearch::saveIndex(const std::string& index_file) {
+    // Log application is held off so the index, its label map and the applied sequence agree
+    std::lock_guard<std::mutex> applyLock(applyMutex_);
+    const int64_t sequence = appliedSequence_;
+    try {
+        std::shared_lock<std::shared_mutex> lock(indexMutex_);
+        if (!index) {
+            return true;
+        }
+        
+        // Write to a temporary file, fsync it and rename so a crash never leaves a truncated index behind
+        std::string tmpFile = index_file + ".tmp";
+        faiss::write_index(index, tmpFile.c_str());
+        if (!syncPath(tmpFile)) {
+            LOG_ERROR("Failed to sync " << tmpFile);
+            return false;
+        }
+        std::error_code ec;
+        std::filesystem::rename(tmpFile, index_file, ec);
+        if (ec) {
+            LOG_ERROR("Failed to rename " << tmpFile << " to " << index_file << ": " << ec.message());
+            return false;
+        }
+        
+        if (!saveLabelMap(labelMapPath(index_file), sequence)) {
+            LOG_ERROR("Failed to write label map for " << index_file);
+            return false;
+        }
+        if (!syncPath(parentDirectory(index_file))) {
+            LOG_ERROR("Failed to sync the directory of " << index_file);
+            return false;
+        }
+    } catch (const std::exception& e) {
+        // Disk full or permissions; the log still holds every write, so nothing is lost
+        LOG_ERROR("Failed to save index to " << index_file << ": " << e.what());
+        return false;
+    }
+    
+    // Entries up to the snapshot are no longer needed for replay, now that the index and label map are on disk
+    unsavedWrites_ = 0;
+    storage_->truncateLog(sequence);
+    return true;
+}
+
+bool VectorSearch::saveLabelMap(const std::string& path, int64_t appliedSequence) {
+    std::string tmpPath = path + ".tmp";
+    {
+        std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            return false;
+        }
+        
+        LabelMapHeader header{};
+        std::memcpy(header.magic, LABEL_MAP_MAGIC, sizeof(header.magic));
+        header.version = LABEL_MAP_VERSION;
+        header.indexSize = static_cast<uint64_t>(index->ntotal);
+        header.nextLabel = nextLabel_;
+        header.entryCount = labelToDocumentId_.size();
+        header.tombstoneCount = tombstones_.size();
+        header.appliedSequence = appliedSequence;
+        header.dimension = static_cast<uint32_t>(d);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        
+        for (const auto& [label, documentId] : labelToDocumentId_) {
+            int64_t rawLabel = label;
+            uint32_t length = static_cast<uint32_t>(documentId.size());
+            out.write(reinterpret_cast<const char*>(&rawLabel), sizeof(rawLabel));
+            out.write(reinterpret_cast<const char*>(&length), sizeof(length));
+            out.write(documentId.data(), length);
+        }
+        
+        for (faiss::idx_t label : tombstones_) {
+            int64_t rawLabel = label;
+            out.write(reinterpret_cast<const char*>(&rawLabel), sizeof(rawLabel));
+        }
+        
+        out.flush();
+        if (!out) {
+            return false;
+        }
+    }
+    
+    if (!syncPath(tmpPath)) {
+        return false;
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmpPath, path, ec);
+    return !ec;
+}
+
+bool VectorSearch::loadLabelMap(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        return false;
+    }
+    
+    LabelMapHeader header{};
+    in.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!in || std::memcmp(header.magic, LABEL_MAP_MAGIC, sizeof(header.magic)) != 0) {
+        LOG_ERROR("Label map " << path << " is corrupt");
+        return false;
+    }
+    if (header.version != LABEL_MAP_VERSION) {
+        LOG_ERROR("Unsupported label map version " << header.version);
+        return false;
+    }
+    
+    if (header.dimension != static_cast<uint32_t>(d)) {
+        LOG_ERROR("Label map " << path << " was built for dimension " << header.dimension
+               << ", embeddings have " << d);
+        return false;
+    }
+    
+    // Every vector in the graph must be accounted for as either live or tombstoned
+    if (header.indexSize != static_cast<uint64_t>(index->ntotal) ||
+        header.entryCount + header.tombstoneCount != header.indexSize) {
+        LOG_ERROR("Label map " << path << " does not match the index");
+        return false;
+    }
+    
+    std::unordered_map<faiss::idx_t, std::string> labelToDocumentId;
+    std::unordered_map<std::string, faiss::idx_t> documentIdToLabel;
+    std::unordered_set<faiss::idx_t> tombstones;
+    labelToDocumentId.reserve(header.entryCount);
+    documentIdToLabel.reserve(header.entryCount);
+    
+    std::string documentId;
+    for (uint64_t i = 0; i < header.entryCount; ++i) {
+        int64_t label = 0;
+        uint32_t length = 0;
+        in.read(reinterpret_cast<char*>(&label), sizeof(label));
+        in.read(reinterpret_cast<char*>(&length), sizeof(length));
+        documentId.resize(length);
+        in.read(&documentId[0], length);
+        if (!in) {
+            LOG_ERROR("Label map " << path << " is truncated");
+            return false;
+        }
+        labelToDocumentId.emplace(label, documentId);
+        documentIdToLabel.emplace(documentId, label);
+    }
+    
+    for (uint64_t i = 0; i < header.tombstoneCount; ++i) {
+        int64_t label = 0;
+        in.read(reinterpret_cast<char*>(&label), sizeof(label));
+        if (!in) {
+            LOG_ERROR("Label map " << path << " is truncated");
+            return false;
+        }
+        tombstones.insert(label);
+    }
+    
+    labelToDocumentId_ = std::move(labelToDocumentId);
+    documentIdToLabel_ = std::move(documentIdToLabel);
+    tombstones_ = std::move(tombstones);
+    nextLabel_ = header.nextLabel;
+    appliedSequence_ = header.appliedSequence;
+    return true;
+}
+
+std::string VectorSearch::addDocument(const std::string& text, const std::map<std::string, std::string>& metadata,
+                                      const std::string& customId, int64_t* sequence, const std::vector<float>* embedding) {
+    if (!isInitialized()) {
+        LOG_ERROR("System not initialized");
+        return "";
+    }
+    if (embedding && !checkEmbeddingDimension(embedding->size())) {
+        return "";
+    }
+    
+    // Use custom ID if provided, otherwise generate one
+    std::string documentId = customId.empty() ? Storage::generateRandomId() : customId;
+    
+    bool committed = commitLogged([&]() -> int64_t {
+        std::string storedId = storage_->addDocument(text, metadata, documentId);
+        if (storedId.empty()) {
+            LOG_ERROR("Failed to add document to storage");
+            return -1;
+        }
+        documentId = storedId;  // Use the ID returned by storage
+        if (embedding && !storeProvidedEmbedding(documentId, embedding->data())) {
+            return -1;
+        }
+        return storage_->appendLog(LogOp::Upsert, documentId, embedding ? embedding->data() : nullptr, d);
+    }, sequence);
+    
+    return committed ? documentId : "";
+}
+
+bool VectorSearch::addDocuments(const std::vector<std::string>& texts, 
+                               const std::vector<std::map<std::string, std::string>>& metadataList,
+                               const std::vector<std::string>& customIds, int64_t* sequence,
+                               const EmbeddingMatrix* embeddings, std::vector<std::string>* documentIds) {
+    if (!isInitialized()) {
+        LOG_ERROR("System not initialized");
+        return false;
+    }
+    
+    if (texts.empty()) {
+        return true;
+    }
+    if (embeddings && (embeddings->rows() != texts.size() || !checkEmbeddingDimension(embeddings->dimension()))) {
+        LOG_ERROR("Error adding documents: expected one embedding per text");
+        return false;
+    }
+    
+    // The whole batch is logged in one transaction; the indexer embeds it chunk by chunk
+    std::vector<std::string> storedIds;
+    storedIds.reserve(texts.size());
+    // One random, wall-clock-stamped prefix per batch, as Collection::addDocuments uses
+    const std::string prefix = Storage::generateRandomId() + "_";
+    bool committed = commitLogged([&]() -> int64_t {
+        int64_t logged = -1;
+        storedIds.clear();
+        for (size_t i = 0; i < texts.size(); ++i) {
+            const auto& metadata = (i < metadataList.size()) ? metadataList[i] : std::map<std::string, std::string>{};
+            std::string documentId = (i < customIds.size() && !customIds[i].empty()) ? 
+                                    customIds[i] : 
+                                    prefix + std::to_string(i);
+            
+            std::string storedId = storage_->addDocument(texts[i], metadata, documentId);
+            if (storedId.empty()) {
+                LOG_ERROR("Error adding documents: failed to add document " << documentId << " to storage");
+                return -1;
+            }
+            const float* embedding = embeddings ? (*embeddings)[i].data() : nullptr;
+            if (embedding && !storeProvidedEmbedding(storedId, embedding)) {
+                return -1;
+            }
+            
+            logged = storage_->appendLog(LogOp::Upsert, storedId, embedding, d);
+            if (logged < 0) {
+                return -1;
+            }
+            storedIds.push_back(std::move(storedId));
+        }
+        return logged;
+    }, sequence);
+    
+    if (committed) {
+        LOG_DEBUG("Logged " << texts.size() << " documents for indexing");
+        if (documentIds) {
+            *documentIds = std::move(storedIds);
+        }
+    }
+    return committed;
+}
+
+bool VectorSearch::updateDocument(const std::string& id, const std::string& text, const std::map<std::string, std::string>& metadata,
+                                  int64_t* sequence, const std::vector<float>* embedding) {
+    if (!isInitialized()) {
+        LOG_ERROR("System not initialized");
+        return false;
+    }
+    if (embedding && !checkEmbeddingDimension(embedding->size())) {
+        return false;
+    }
+    
+    return commitLogged([&]() -> int64_t {
+        if (!storage_->updateDocument(id, text, metadata) ||
+            !storeProvidedEmbedding(id, embedding ? embedding->data() : nullptr)) {
+            return -1;
+        }
+        return storage_->appendLog(LogOp::Upsert, id, embedding ? embedding->data() : nullptr, d);
+    }, sequence);
+}
+
+bool VectorSearch::deleteDocument(const std::string& id, int64_t* sequence) {
+    if (!isInitialized()) {
+        LOG_ERROR("System not initialized");
+        return false;
+    }
+    
+    return commitLogged([&]() -> int64_t {
+        if (!storage_->deleteDocument(id)) {
+            return -1;
+        }
+        return storage_->appendLog(LogOp::Delete, id);
+    }, sequence);
+}
+
+bool VectorSearch::upsertDocument(const std::string& id, const std::string& text, const std::map<std::string, std::string>& metadata,
+                                  int64_t* sequence, const std::vector<float>* embedding) {
+    if (!isInitialized()) {
+        LOG_ERROR("System not initialized");
+        return false;
+    }
+    if (embedding && !checkEmbeddingDimension(embedding->size())) {
+        return false;
+    }
+    
+    // One INSERT ... ON CONFLICT on the writer connection, so there is no existence check to race with
+    return commitLogged([&]() -> int64_t {
+        if (!storage_->upsertDocument(id, text, metadata) ||
+            !storeProvidedEmbedding(id, embedding ? embedding->data() : nullptr)) {
+            return -1;
+        }
+        return storage_->appendLog(LogOp::Upsert, id, embedding ? embedding->data() : nullptr, d);
+    }, sequence);
+}
+
+bool VectorSearch::checkEmbeddingDimension(size_t dimension) const {
+    if (dimension != static_cast<size_t>(d)) {
+        LOG_ERROR("Embedding has dimension " << dimension << ", expected " << d);
+        return false;
+    }
+    return true;
+}
+
+bool VectorSearch::storeProvidedEmbedding(const std::string& documentId, const float* embedding) {
+    // Stored at write time so a rebuild before the log is applied still finds it. It is tagged with the
+    // served model; under another model the text is embedded instead. A text-only write drops the old
+    // vector so a rebuild cannot pair it with the new text.
+    if (embedding) {
+        return storage_->putEmbedding(documentId, inferenceEngine_->getModelFingerprint(), embedding, static_cast<size_t>(d));
+    }
+    return storage_->deleteEmbedding(documentId);
+}
+
+bool VectorSearch::commitLogged(const std::function<int64_t()>& write, int64_t* sequence) {
+    int64_t logged = -1;
+    {
+        std::lock_guard<std::recursive_mutex> writeLock(writeMutex_);
+        bool ownsTransaction = storage_->beginTransaction();
+        
+        try {
+            logged = write();
+        } catch (...) {
+            if (ownsTransaction) {
+                storage_->rollbackTransaction();
+            }
+            throw;
+        }
+        
+        if (logged < 0 || (ownsTransaction && !storage_->commitTransaction())) {
+            if (ownsTransaction) {
+                storage_->rollbackTransaction();
+            }
+            return false;
+        }
+    }
+    
+    if (sequence) {
+        *sequence = logged;
+    }
+    onWriteLogged();
+    return true;
+}
+
+void VectorSearch::onWriteLogged() {
+    {
+        std::lock_guard<std::mutex> lock(indexerMutex_);
+        if (indexerRunning_) {
+            writesPending_ = true;
+            indexerCv_.notify_one();
+            return;
+        }
+    }
+    
+    // Without a background indexer the write is made searchable before returning
+    applyPendingWrites();
+}
+
+void VectorSearch::startIndexer(const std::string& index_file, std::chrono::seconds snapshotInterval, size_t snapshotThreshold) {
+    std::lock_guard<std::mutex> lock(indexerMutex_);
+    if (indexerRunning_) {
+        return;
+    }
+    
+    snapshotFile_ = index_file;
+    snapshotInterval_ = std::max(snapshotInterval, std::chrono::seconds(1));
+    snapshotThreshold_ = std::max<size_t>(1, snapshotThreshold);
+    indexerStopping_ = false;
+    indexerRunning_ = true;
+    indexerThread_ = std::thread(&VectorSearch::runIndexer, this);
+}
+
+void VectorSearch::stopIndexer() {
+    {
+        std::lock_guard<std::mutex> lock(indexerMutex_);
+        if (!indexerRunning_) {
+            return;
+        }
+        indexerStopping_ = true;
+    }
+    indexerCv_.notify_all();
+    
+    if (indexerThread_.joinable()) {
+        indexerThread_.join();
+    }
+    
+    std::lock_guard<std::mutex> lock(indexerMutex_);
+    indexerRunning_ = false;
+}
+
+bool VectorSearch::waitForIndexed(int64_t sequence, std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(indexerMutex_);
+    return appliedCv_.wait_for(lock, timeout, [this, sequence] { return appliedSequence_ >= sequence; });
+}
+
+void VectorSearch::runIndexer() {
+    auto lastSnapshot = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(indexerMutex_);
+    
+    while (true) {
+        // Sleep until new writes arrive or the pending snapshot falls due
+        auto deadline = (unsavedWrites_ > 0 ? lastSnapshot : std::chrono::steady_clock::now()) + snapshotInterval_;
+        indexerCv_.wait_until(lock, deadline, [this] { return indexerStopping_ || writesPending_; });
+        
+        bool stopping = indexerStopping_;
+        writesPending_ = false;
+        lock.unlock();
+        
+        applyPendingWrites();
+        
+        // A final snapshot on shutdown keeps the next startup's replay short
+        auto now = std::chrono::steady_clock::now();
+        size_t unsaved = unsavedWrites_;
+        if (unsaved > 0 && (stopping || unsaved >= snapshotThreshold_ || now - lastSnapshot >= snapshotInterval_)) {
+            // A failed snapshot is retried after the next interval; until then the log covers the writes
+            if (!saveIndex(snapshotFile_)) {
+                LOG_WARN("Snapshot of " << snapshotFile_ << " failed; keeping the ingest log");
+            }
+            lastSnapshot = now;
+        }
+        
+        if (stopping) {
+            return;
+        }
+        lock.lock();
+    }
+}
+
+size_t VectorSearch::applyPendingWrites() {
+    std::lock_guard<std::mutex> applyLock(applyMutex_);
+    return applyPendingWritesLocked();
+}
+
+size_t VectorSearch::applyPendingWritesLocked() {
+    if (!index) {
+        return 0;  // The log is replayed once the index is loaded
+    }
+    
+    // Log pages are embedded as a stream. Entries of pages handed to the engine but not yet
+    // applied wait in pendingPages, with the sequence that each page ends at.
+    struct PendingPage {
+        std::vector<LogEntry> entries;
+        int64_t end;
+        std::vector<bool> stored;  // Per existing entry: its write carried the vector, already in storage
+    };
+    std::deque<PendingPage> pendingPages;
+    int64_t cursor = appliedSequence_;
+    size_t applied = 0;
+    
+    try {
+        inferenceEngine_->embedStream(
+            [&](std::vector<std::string>& texts) {
+                auto entries = storage_->getLogEntries(cursor, INGEST_CHUNK_SIZE);
+                if (entries.empty()) {
+                    return false;
+                }
+                cursor = entries.back().sequence;
+                
+                // Every entry sees the document's current state, so only the last one per document matters
+                std::unordered_map<std::string, size_t> lastEntry;
+                for (size_t i = 0; i < entries.size(); ++i) {
+                    lastEntry[entries[i].documentId] = i;
+                }
+                
+                PendingPage page;
+                page.end = cursor;
+                page.entries.reserve(lastEntry.size());
+                bool anyStored = false;
+                for (size_t i = 0; i < entries.size(); ++i) {
+                    if (lastEntry[entries[i].documentId] != i) {
+                        continue;
+                    }
+                    if (entries[i].documentExists) {
+                        // Precomputed vectors skip inference; one of another dimension is re-embedded
+                        bool precomputed = entries[i].embedding.size() == static_cast<size_t>(d);
+                        page.stored.push_back(precomputed);
+                        anyStored |= precomputed;
+                        if (!precomputed) {
+                            texts.push_back(entries[i].text);
+                        }
+                    }
+                    page.entries.push_back(std::move(entries[i]));
+                }
+                if (!anyStored) {
+                    page.stored.clear();
+                }
+                pendingPages.push_back(std::move(page));
+                return true;
+            },
+            [&](EmbeddingMatrix& embeddings) {
+                PendingPage page = std::move(pendingPages.front());
+                pendingPages.pop_front();
+                
+                if (page.stored.empty()) {
+                    applyLogChunk(page.entries, embeddings);
+                } else {
+                    // Interleave precomputed and freshly embedded rows back into entry order
+                    EmbeddingMatrix merged(page.stored.size(), static_cast<size_t>(d));
+                    size_t row = 0;
+                    size_t nextEmbedded = 0;
+                    for (const auto& entry : page.entries) {
+                        if (!entry.documentExists) {
+                            continue;
+                        }
+                        const float* source = page.stored[row] ? entry.embedding.data() : embeddings[nextEmbedded++].data();
+                        std::copy(source, source + d, merged.row(row++));
+                    }
+                    applyLogChunk(page.entries, merged, &page.stored);
+                }
+                applied += page.entries.size();
+                publishAppliedSequence(page.end);
+            });
+    } catch (const std::exception& e) {
+        // Unapplied entries stay in the log and are retried on the next pass
+        LOG_ERROR("Error applying ingest log: " << e.what());
+    }
+    
+    unsavedWrites_ += applied;
+    return applied;
+}
+
+void VectorSearch::applyLogChunk(const std::vector<LogEntry>& entries, const EmbeddingMatrix& embeddings,
+                                 const std::vector<bool>* stored) {
+    const std::string& model = inferenceEngine_->getModelFingerprint();
+    
+    // Rows line up with the entries whose document still exists, in order, so the matrix is added as is
+    {
+        std::lock_guard<std::recursive_mutex> writeLock(writeMutex_);
+        bool ownsTransaction = storage_->beginTransaction();
+        size_t next = 0;
+        for (const auto& entry : entries) {
+            if (!entry.documentExists) {
+                continue;
+            }
+            const size_t row = next++;
+            if (stored && (*stored)[row]) {
+                continue;
+            }
+            EmbeddingView embedding = embeddings[row];
+            if (!storage_->putEmbedding(entry.documentId, model, embedding.data(), embedding.size())) {
+                LOG_WARN("Failed to persist embedding for document " << entry.documentId);
+            }
+        }
+        if (ownsTransaction) {
+            storage_->commitTransaction();
+        }
+    }
+    
+    // Deletes only add tombstones, so a mapped index survives until it has to take a vector. The heap
+    // copy is built while searches go on; only swapping it in needs the exclusive lock.
+    faiss::IndexIDMap* heap = nullptr;
+    const faiss::IndexIDMap* mapped = nullptr;
+    if (embeddings.rows() > 0) {
+        std::shared_lock<std::shared_mutex> lock(indexMutex_);
+        if (indexMapped_) {
+            mapped = index;
+            heap = copyMappedIndex();
+        }
+    }
+    
+    // Retire each document's old vector and insert the new one under a fresh label
+    std::unique_lock<std::shared_mutex> lock(indexMutex_);
+    if (heap) {
+        // A compaction may have swapped in a heap index meanwhile, which makes the copy unnecessary
+        if (indexMapped_ && index == mapped) {
+            delete index;
+            index = heap;
+            indexMapped_ = false;
+        } else {
+            delete heap;
+        }
+    }
+    std::vector<faiss::idx_t> labels;
+    labels.reserve(embeddings.rows());
+    for (const auto& entry : entries) {
+        tombstoneDocument(entry.documentId);
+        if (entry.documentExists) {
+            faiss::idx_t label = nextLabel_++;
+            labelToDocumentId_[label] = entry.documentId;
+            documentIdToLabel_[entry.documentId] = label;
+            labels.push_back(label);
+        }
+    }
+    
+    if (!labels.empty()) {
+        index->add_with_ids(static_cast<faiss::idx_t>(labels.size()), embeddings.data(), labels.data());
+    }
+    ++indexGeneration_;
+    scheduleCompactionIfNeeded();
+}
+
+void VectorSearch::publishAppliedSequence(int64_t sequence) {
+    {
+        std::lock_guard<std::mutex> lock(indexerMutex_);
+        if (sequence > appliedSequence_) {
+            appliedSequence_ = sequence;
+        }
+    }
+    appliedCv_.notify_all();
+}
+
+void VectorSearch::rebuildIndex() {
+    if (!isInitialized()) {
+        LOG_ERROR("System not initialized");
+        return;
+    }
+    
+    // Log application is held off for the whole rebuild, but searches keep using the old graph
+    // until the swap and writers keep appending to the log
+    std::lock_guard<std::mutex> applyLock(applyMutex_);
+    rebuildIndexLocked();
+}
+
+void VectorSearch::rebuildIndexLocked() {
+    // Every write logged so far is already in storage, which is what the rebuild reads
+    const int64_t sequence = storage_->getLatestLogSequence();
+    
+    std::unordered_map<faiss::idx_t, std::string> labelToDocumentId;
+    std::unordered_map<std::string, faiss::idx_t> documentIdToLabel;
+    faiss::IndexIDMap* rebuilt = buildIndexFromStorage(labelToDocumentId, documentIdToLabel);
+    
+    {
+        std::unique_lock<std::shared_mutex> lock(indexMutex_);
+        installIndex(rebuilt, std::move(labelToDocumentId), std::move(documentIdToLabel));
+    }
+    
+    // Assigned rather than advanced: a sequence from a snapshot of another database must not stick
+    {
+        std::lock_guard<std::mutex> lock(indexerMutex_);
+        appliedSequence_ = sequence;
+    }
+    appliedCv_.notify_all();
+    ++unsavedWrites_;
+}
+
+void VectorSearch::installIndex(faiss::IndexIDMap* rebuilt,
+                                std::unordered_map<faiss::idx_t, std::string> labelToDocumentId,
+                                std::unordered_map<std::string, faiss::idx_t> documentIdToLabel) {
     delete index;
+    index = rebuilt;
+    nextLabel_ = static_cast<faiss::idx_t>(labelToDocumentId.size());
+    labelToDocumentId_ = std::move(labelToDocumentId);
+    documentIdToLabel_ = std::move(documentIdToLabel);
+    tombstones_.clear();
+    indexMapped_ = false;
+    ++indexEpoch_;
+    ++indexGeneration_;
 }
 
-bool VectorSearch::initialize() {
-    if (!storage_->initialize()) {
-        std::cerr << "Failed to initialize storage" << std::endl;
-        return false;
-    }
+faiss::IndexIDMap* VectorSearch::copyMappedIndex() {
+    LOG_INFO("Index is memory-mapped and read-only; copying it onto the heap to apply writes...");
+    auto start = std::chrono::steady_clock::now();
     
-    if (!inferenceEngine_->loadModel(modelPath_, tokenizerPath_, useCuda_)) {
-        std::cerr << "Failed to load inference model" << std::endl;
-        return false;
+    // Re-reading the file mostly hits the page cache the mapping already filled. A snapshot may have replaced
+    // the file since it was mapped, so the copy is only taken if it holds exactly the mapped labels.
+    faiss::IndexIDMap* heap = nullptr;
+    try {
+        faiss::Index* loaded = faiss::read_index(mappedIndexPath_.c_str());
+        heap = dynamic_cast<faiss::IndexIDMap*>(loaded);
+        if (!heap || heap->id_map != index->id_map) {
+            delete loaded;
+            heap = nullptr;
+        }
+    } catch (const std::exception& e) {
+        LOG_WARN("Failed to re-read " << mappedIndexPath_ << ": " << e.what());
     }
     
-    d = static_cast<int>(inferenceEngine_->getEmbeddingDimension());
-    std::cout << "Model loaded with embedding dimension: " << d << std::endl;
+    if (!heap) {
+        // Slow path: decode the mapped vectors and add them to a fresh index of the same layout
+        LOG_INFO("Index file changed since it was mapped; re-adding its vectors instead");
+        heap = wrapWithIdMap(createEmptyLike(index->index));
+        if (index->ntotal > 0) {
+            std::vector<float> vectors(static_cast<size_t>(index->ntotal) * d);
+            index->index->reconstruct_n(0, index->ntotal, vectors.data());
+            heap->add_with_ids(index->ntotal, vectors.data(), index->id_map.data());
+        }
+    }
     
-    return true;
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    LOG_INFO("Index copied onto the heap in " << elapsed.count() << " ms");
+    return heap;
 }
 
-void VectorSearch::loadOrCreateIndex(const std::string& index_file) {
-    if (!isModelLoaded()) {
-        std::cerr << "Error: Model not loaded. Call initialize() first." << std::endl;
-        return;
-    }
+faiss::IndexIDMap* VectorSearch::createIndex(size_t expectedVectors) const {
+    const int m = pqSubquantizers(d, indexOptions_.pqSubquantizers);
     
-    if (std::filesystem::exists(index_file)) {
-        printf("Loading existing index...\n");
-        
-        delete index;
-        index = dynamic_cast<faiss::IndexHNSWFlat*>(faiss::read_index(index_file.c_str()));
-        
-        synchronizeIndex();
-        
-        printf("Loaded HNSW index with %lld vectors\n", index->ntotal);
-    } else {
-        printf("Creating new HNSW index...\n");
-        initializeIndex();
-        rebuildIndex();
-        printf("Created and populated HNSW index\n");
+    switch (indexOptions_.type) {
+        case IndexType::HnswSQ8: {
+            auto* hnsw = new faiss::IndexHNSWSQ(d, faiss::ScalarQuantizer::QT_8bit, HNSW_M, metric_);
+            hnsw->hnsw.efConstruction = HNSW_EF_CONSTRUCTION;
+            return wrapWithIdMap(hnsw);
+        }
+        case IndexType::HnswPQ: {
+            auto* hnsw = new faiss::IndexHNSWPQ(d, m, HNSW_M, 8, metric_);
+            hnsw->hnsw.efConstruction = HNSW_EF_CONSTRUCTION;
+            return wrapWithIdMap(hnsw);
+        }
+        case IndexType::IvfPQ: {
+            size_t lists = indexOptions_.ivfLists > 0
+                ? static_cast<size_t>(indexOptions_.ivfLists)
+                : std::max<size_t>(1, static_cast<size_t>(4.0 * std::sqrt(static_cast<double>(expectedVectors))));
+            auto* ivf = new faiss::IndexIVFPQ(new faiss::IndexFlat(d, metric_), d, lists, m, 8, metric_);
+            ivf->own_fields = true;
+            ivf->nprobe = static_cast<size_t>(std::max(1, indexOptions_.ivfProbes));
+            ivf->make_direct_map(true);  // exactHits and compaction reconstruct by position
+            return wrapWithIdMap(ivf);
+        }
+        case IndexType::HnswFlat:
+            break;
     }
+    
+    return createIdMappedIndex(d, metric_);
 }
 
-std::vector<SearchResult> VectorSearch::searchText(const std::string& query, int k, float threshold, int efSearch) {
-    if (!isInitialized()) {
-        std::cerr << "Error: System not initialized" << std::endl;
-        return {};
+size_t VectorSearch::minTrainingVectors(const faiss::IndexIDMap* untrained) const {
+    if (untrained->is_trained) {
+        return 0;
     }
     
-    auto queryEmbedding = getEmbedding(query);
-    return searchEmbedding(queryEmbedding, k, threshold, efSearch);
+    // k-means needs at least one point per centroid: 256 per 8-bit PQ codebook, nlist for the coarse quantizer
+    if (auto* ivf = dynamic_cast<const faiss::IndexIVF*>(untrained->index)) {
+        return std::max<size_t>(ivf->nlist, 256);
+    }
+    if (detectIndexType(untrained->index) == IndexType::HnswPQ) {
+        return 256;
+    }
+    return 1;
 }
 
-std::vector<SearchResult> VectorSearch::searchEmbedding(const std::vector<float>& queryEmbedding, int k, float threshold, int efSearch) {
-    if (!isInitialized()) {
-        std::cerr << "Error: System not initialized" << std::endl;
-        return {};
-    }
+faiss::IndexIDMap* VectorSearch::buildIndexFromStorage(std::unordered_map<faiss::idx_t, std::string>& labelToDocumentId,
+                                                        std::unordered_map<std::string, faiss::idx_t>& documentIdToLabel) {
+    LOG_INFO("Rebuilding index...");
     
-    if (index->ntotal == 0) {
-        std::cerr << "Error: Index is empty" << std::endl;
-        return {};
+    faiss::IndexIDMap* rebuilt = createIndex(storage_->getDocumentCount());
+    const std::string& model = inferenceEngine_->getModelFingerprint();
+    const size_t minTraining = minTrainingVectors(rebuilt);
+    const size_t trainingSamples = std::max(indexOptions_.trainingSamples, minTraining);
+    
+    auto train = [&](const float* vectors, size_t count) {
+        LOG_INFO("Training " << indexTypeName(indexOptions_.type) << " index on " << count << " vectors");
+        rebuilt->train(static_cast<faiss::idx_t>(count), vectors);
+    };
+    
+    // Quantized layouts are trained before anything is added, on a random sample of stored vectors.
+    // Without enough of those (e.g. after a model change) the first vectors to arrive are held back
+    // and used for training instead.
+    if (!rebuilt->is_trained) {
+        std::vector<std::string> sampleIds;
+        std::vector<float> sample;
+        size_t sampled = storage_->sampleEmbeddings(model, d, trainingSamples, sampleIds, sample);
+        if (sampled >= minTraining) {
+            train(sample.data(), sampled);
+        }
     }
     
-    k = std::min(k, static_cast<int>(index->ntotal));
+    std::vector<faiss::idx_t> heldLabels;
+    std::vector<float> heldVectors;
     
-    std::vector<float> distances(k);
-    std::vector<faiss::idx_t> indices(k);
+    auto addChunk = [&](const std::vector<std::string>& documentIds, const float* vectors) {
+        std::vector<faiss::idx_t> labels(documentIds.size());
+        for (size_t i = 0; i < documentIds.size(); ++i) {
+            labels[i] = static_cast<faiss::idx_t>(labelToDocumentId.size());
+            labelToDocumentId[labels[i]] = documentIds[i];
+            documentIdToLabel[documentIds[i]] = labels[i];
+        }
+        
+        if (rebuilt->is_trained) {
+            rebuilt->add_with_ids(static_cast<faiss::idx_t>(documentIds.size()), vectors, labels.data());
+            return;
+        }
+        
+        heldLabels.insert(heldLabels.end(), labels.begin(), labels.end());
+        heldVectors.insert(heldVectors.end(), vectors, vectors + documentIds.size() * d);
+        if (heldLabels.size() >= trainingSamples) {
+            train(heldVectors.data(), heldLabels.size());
+            rebuilt->add_with_ids(static_cast<faiss::idx_t>(heldLabels.size()), heldVectors.data(), heldLabels.data());
+            heldLabels.clear();
+            heldVectors = {};
+        }
+    };
     
-    index->hnsw.efSearch = efSearch;
-    index->search(1, queryEmbedding.data(), k, distances.data(), indices.data());
+    // Stored vectors from the current model are paged straight into the index
+    std::string cursor;
+    while (true) {
+        std::vector<std::string> documentIds;
+        std::vector<float> vectors;
+        storage_->getEmbeddings(model, d, cursor, INGEST_CHUNK_SIZE, documentIds, vectors);
+        if (documentIds.empty()) {
+            break;
+        }
+        cursor = documentIds.back();
+        addChunk(documentIds, vectors.data());
+    }
     
-    std::vector<SearchResult> results;
-    results.reserve(k);
+    // Documents without such a vector are embedded in chunks, persisted and added as each chunk completes.
+    // Ids of chunks handed to the engine but not yet embedded wait in pendingIds.
+    std::deque<std::vector<std::string>> pendingIds;
+    size_t embedded = 0;
+    cursor.clear();
     
-    for (int i = 0; i < k; ++i) {
-        if (indices[i] >= 0 && indices[i] < static_cast<faiss::idx_t>(indexToDocumentId_.size())) {
-            std::string documentId = indexToDocumentId_[indices[i]];
-            float score = 1.0f / (1.0f + distances[i]); // Convert distance to similarity score
+    inferenceEngine_->embedStream(
+        [&](std::vector<std::string>& texts) {
+            auto documents = storage_->getDocumentsWithoutEmbedding(model, d, cursor, INGEST_CHUNK_SIZE);
+            if (documents.empty()) {
+                return false;
+            }
+            cursor = documents.back().id;
             
-            // Only include results above the threshold
-            if (score >= threshold) {
-                results.push_back(buildSearchResult(documentId, score));
+            std::vector<std::string> ids;
+            ids.reserve(documents.size());
+            for (auto& doc : documents) {
+                ids.push_back(doc.id);
+                texts.push_back(std::move(doc.text));
             }
+            pendingIds.push_back(std::move(ids));
+            return true;
+        },
+        [&](EmbeddingMatrix& embeddings) {
+            std::vector<std::string> ids = std::move(pendingIds.front());
+            pendingIds.pop_front();
+            
+            {
+                std::lock_guard<std::recursive_mutex> writeLock(writeMutex_);
+                bool ownsTransaction = storage_->beginTransaction();
+                for (size_t i = 0; i < embeddings.rows(); ++i) {
+                    storage_->putEmbedding(ids[i], model, embeddings[i].data(), embeddings.dimension());
+                }
+                if (ownsTransaction) {
+                    storage_->commitTransaction();
+                }
+            }
+            
+            addChunk(ids, embeddings.data());
+            embedded += ids.size();
+        });
+    
+    if (!rebuilt->is_trained) {
+        if (heldLabels.size() >= minTraining) {
+            train(heldVectors.data(), heldLabels.size());
+        } else {
+            LOG_INFO("Only " << heldLabels.size() << " vectors to train " << indexTypeName(indexOptions_.type)
+                  << " (need " << minTraining << "); using hnsw_flat until the next rebuild");
+            delete rebuilt;
+            rebuilt = createIdMappedIndex(d, metric_);
+        }
+        if (!heldLabels.empty()) {
+            rebuilt->add_with_ids(static_cast<faiss::idx_t>(heldLabels.size()), heldVectors.data(), heldLabels.data());
         }
     }
     
-    return results;
+    if (embedded > 0) {
+        LOG_INFO("Embedded " << embedded << " documents without a stored vector");
+    }
+    LOG_INFO("Rebuilt index with " << rebuilt->ntotal << " vectors");
+    return rebuilt;
 }
 
-std::vector<SearchResult> VectorSearch::searchByMetadata(const std::string& key, const std::string& value, int k) {
-    if (!isInitialized()) {
-        std::cerr << "Error: System not initialized" << std::endl;
-        return {};
+bool VectorSearch::synchronizeIndex() {
+    if (!storage_ || !storage_->isOpen()) {
+        LOG_ERROR("Storage not available");
+        return false;
     }
     
-    auto documents = storage_->getDocumentsByMetadata(key, value);
-    std::vector<SearchResult> results;
+    // A snapshot claiming writes this database never logged belongs to some other database
+    if (appliedSequence_ > storage_->getLatestLogSequence()) {
+        LOG_INFO("Index snapshot is ahead of the ingest log. Rebuilding...");
+        return false;
+    }
     
-    int count = std::min(k, static_cast<int>(documents.size()));
-    for (int i = 0; i < count; ++i) {
-        SearchResult result;
-        result.id = documents[i].id;
-        result.text = documents[i].text;
-        result.metadata = documents[i].metadata;
-        result.score = 1.0f; // Exact metadata match
-        results.push_back(result);
+    size_t replayed = applyPendingWritesLocked();
+    if (replayed > 0) {
+        LOG_INFO("Replayed " << replayed << " logged writes since the last snapshot");
     }
     
-    return results;
+    size_t liveCount = static_cast<size_t>(getIndexSize()) - getTombstoneCount();
+    if (liveCount == storage_->getDocumentCount()) {
+        return true;
+    }
+    
+    LOG_INFO("Index size mismatch. Rebuilding...");
+    return false;
 }
 
-void VectorSearch::saveIndex(const std::string& index_file) {
-    if (index) {
-        faiss::write_index(index, index_file.c_str());
+Document VectorSearch::getDocument(const std::string& id) {
+    if (!storage_) {
+        return Document();
     }
+    return storage_->getDocument(id);
 }
 
-std::string VectorSearch::addDocument(const std::string& text, const std::map<std::string, std::string>& metadata, const std::string& customId) {
-    if (!isInitialized()) {
-        std::cerr << "Error: System not initialized" << std::endl;
-        return "";
+std::vector<Document> VectorSearch::getDocumentsByIds(const std::vector<std::string>& ids) {
+    if (!storage_) {
+        return std::vector<Document>(ids.size());
     }
-    
-    // Use custom ID if provided, otherwise generate one
-    std::string documentId = customId.empty() ? std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) : customId;
-    
-    // Add document to storage first
-    std::string storedId = storage_->addDocument(text, metadata, documentId);
-    if (storedId.empty()) {
-        std::cerr << "Failed to add document to storage" << std::endl;
-        return "";
+    return storage_->getDocumentsByIds(ids);
+}
+
+std::vector<Document> VectorSearch::getAllDocuments() {
+    if (!storage_) {
+        return {};
     }
-    documentId = storedId;  // Use the ID returned by storage
-    
-    // Generate embedding
-    auto embedding = getEmbedding(text);
-    if (embedding.empty()) {
-        std::cerr << "Failed to generate embedding" << std::endl;
-        storage_->deleteDocument(documentId);
-        return "";
+    return storage_->getAllDocuments();
+}
+
+size_t VectorSearch::getDocumentCount() {
+    if (!storage_) {
+        return 0;
+    }
+    return storage_->getDocumentCount();
+}
+
+long VectorSearch::getIndexSize() const {
+    std::shared_lock<std::shared_mutex> lock(indexMutex_);
+    return index ? index->ntotal : 0;
+}
+
+size_t VectorSearch::getTombstoneCount() const {
+    std::shared_lock<std::shared_mutex> lock(indexMutex_);
+    return tombstones_.size();
+}
+
+IndexStats VectorSearch::getIndexStats() const {
+    IndexStats recall;
+    {
+        std::lock_guard<std::mutex> lock(recallMutex_);
+        recall = lastRecall_;
     }
     
+    IndexStats stats;
+    std::shared_lock<std::shared_mutex> lock(indexMutex_);
     if (!index) {
-        initializeIndex();
+        return stats;
     }
     
-    // Add to FAISS index
-    index->add(1, embedding.data());
-    indexToDocumentId_.push_back(documentId);
+    stats.type = detectIndexType(index->index);
+    stats.vectors = index->ntotal;
+    stats.memoryBytes = estimateIndexBytes(index);
+    stats.codeBytes = codeBytes(index->index);
+    stats.mapped = indexMapped_;
     
-    std::cout << "Added document " << documentId << " to index. Total: " << index->ntotal << std::endl;
-    return documentId;
+    // A measurement taken on another index layout says nothing about this one
+    if (recall.recallK > 0 && recall.type == stats.type) {
+        stats.recall = recall.recall;
+        stats.recallK = recall.recallK;
+        stats.recallQueries = recall.recallQueries;
+    }
+    return stats;
 }
 
-void VectorSearch::addDocuments(const std::vector<std::string>& texts, 
-                               const std::vector<std::map<std::string, std::string>>& metadataList,
-                               const std::vector<std::string>& customIds) {
-    if (!isInitialized()) {
-        std::cerr << "Error: System not initialized" << std::endl;
-        return;
+double VectorSearch::measureRecall(size_t queries, int k, int efSearch) {
+    if (!isInitialized() || queries == 0 || k <= 0) {
+        return -1.0;
     }
     
-    storage_->beginTransaction();
+    const std::string& model = inferenceEngine_->getModelFingerprint();
+    std::vector<std::string> queryIds;
+    std::vector<float> queryVectors;
+    size_t count = storage_->sampleEmbeddings(model, d, queries, queryIds, queryVectors);
+    if (count == 0) {
+        return -1.0;
+    }
     
-    try {
-        std::vector<std::string> documentIds;
-        documentIds.reserve(texts.size());
-        
-        // Add documents to storage
-        for (size_t i = 0; i < texts.size(); ++i) {
-            const auto& metadata = (i < metadataList.size()) ? metadataList[i] : std::map<std::string, std::string>{};
-            std::string documentId = (i < customIds.size() && !customIds[i].empty()) ? 
-                                    customIds[i] : 
-                                    std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + "_" + std::to_string(i);
-            
-            std::string storedId = storage_->addDocument(texts[i], metadata, documentId);
-            if (storedId.empty()) {
-                throw std::runtime_error("Failed to add document to storage");
-            }
-            documentIds.push_back(storedId);
+    auto truth = exactNeighbors(queryVectors, count, k);
+    size_t expected = 0;
+    size_t matched = 0;
+    for (size_t q = 0; q < count; ++q) {
+        std::vector<float> query(queryVectors.begin() + q * d, queryVectors.begin() + (q + 1) * d);
+        for (const auto& hit : vectorHits(query, k, -std::numeric_limits<float>::infinity(), efSearch)) {
+            matched += truth[q].count(hit.first);
         }
-        
-        // Generate embeddings
-        auto embeddings = inferenceEngine_->getEmbeddings(texts);
-        if (embeddings.size() != texts.size()) {
-            throw std::runtime_error("Embedding generation failed");
+        expected += truth[q].size();
+    }
+    
+    double recall = expected > 0 ? static_cast<double>(matched) / static_cast<double>(expected) : -1.0;
+    IndexType type = getIndexStats().type;
+    
+    std::lock_guard<std::mutex> lock(recallMutex_);
+    lastRecall_.type = type;
+    lastRecall_.recall = recall;
+    lastRecall_.recallK = k;
+    lastRecall_.recallQueries = count;
+    return recall;
+}
+
+std::vector<std::unordered_set<std::string>> VectorSearch::exactNeighbors(const std::vector<float>& queryVectors,
+                                                                          size_t count, int k) {
+    const std::string& model = inferenceEngine_->getModelFingerprint();
+    // Each heap keeps its worst hit on top
+    using ScoredId = std::pair<float, std::string>;
+    auto worseFirst = [](const ScoredId& a, const ScoredId& b) { return a.first > b.first; };
+    std::vector<std::vector<ScoredId>> truth(count);
+    
+    std::string cursor;
+    while (true) {
+        std::vector<std::string> documentIds;
+        std::vector<float> vectors;
+        storage_->getEmbeddings(model, d, cursor, INGEST_CHUNK_SIZE, documentIds, vectors);
+        if (documentIds.empty()) {
+            break;
         }
+        cursor = documentIds.back();
         
-        // Add to FAISS index
-        std::vector<float> flatEmbeddings;
-        flatEmbeddings.reserve(embeddings.size() * d);
-        
-        for (const auto& emb : embeddings) {
-            flatEmbeddings.insert(flatEmbeddings.end(), emb.begin(), emb.end());
+        for (size_t q = 0; q < count; ++q) {
+            auto& heap = truth[q];
+            for (size_t i = 0; i < documentIds.size(); ++i) {
+                float score = exactScore(queryVectors.data() + q * d, vectors.data() + i * d);
+                if (heap.size() < static_cast<size_t>(k)) {
+                    heap.emplace_back(score, documentIds[i]);
+                    std::push_heap(heap.begin(), heap.end(), worseFirst);
+                } else if (score > heap.front().first) {
+                    std::pop_heap(heap.begin(), heap.end(), worseFirst);
+                    heap.back() = {score, documentIds[i]};
+                    std::push_heap(heap.begin(), heap.end(), worseFirst);
+                }
+            }
         }
-        
-        if (!index) {
-            initializeIndex();
+    }
+    
+    std::vector<std::unordered_set<std::string>> neighbors(count);
+    for (size_t q = 0; q < count; ++q) {
+        for (auto& exact : truth[q]) {
+            neighbors[q].insert(std::move(exact.second));
         }
-        
-        index->add(static_cast<int>(embeddings.size()), flatEmbeddings.data());
-        indexToDocumentId_.insert(indexToDocumentId_.end(), documentIds.begin(), documentIds.end());
-        
-        storage_->commitTransaction();
-        
-        std::cout << "Added " << texts.size() << " documents to index. Total: " << index->ntotal << std::endl;
-    } catch (const std::exception& e) {
-        std::cerr << "Error adding documents: " << e.what() << std::endl;
-        storage_->rollbackTransaction();
     }
+    return neighbors;
 }
 
-bool VectorSearch::updateDocument(const std::string& id, const std::string& text, const std::map<std::string, std::string>& metadata) {
-    if (!isInitialized()) {
-        std::cerr << "Error: System not initialized" << std::endl;
+bool VectorSearch::calibrateEfSearch(size_t queries, int k) {
+    if (!isInitialized() || queries == 0 || k <= 0) {
         return false;
     }
     
-    if (!storage_->updateDocument(id, text, metadata)) {
+    const IndexType type = getIndexStats().type;
+    if (type == IndexType::IvfPQ) {
+        LOG_WARN("IVF-PQ indexes search by nprobe, not efSearch; nothing to calibrate");
         return false;
     }
     
-    // Rebuild index to reflect changes
-    rebuildIndex();
-    return true;
-}
-
-bool VectorSearch::deleteDocument(const std::string& id) {
-    if (!isInitialized()) {
-        std::cerr << "Error: System not initialized" << std::endl;
+    std::vector<std::string> queryIds;
+    std::vector<float> queryVectors;
+    size_t count = storage_->sampleEmbeddings(inferenceEngine_->getModelFingerprint(), d, queries, queryIds, queryVectors);
+    if (count == 0) {
         return false;
     }
     
-    if (!storage_->deleteDocument(id)) {
-        return false;
+    auto truth = exactNeighbors(queryVectors, count, k);
+    std::vector<std::vector<float>> queryList(count);
+    for (size_t q = 0; q < count; ++q) {
+        queryList[q].assign(queryVectors.begin() + q * d, queryVectors.begin() + (q + 1) * d);
+    }
+    
+    const float noThreshold = -std::numeric_limits<float>::infinity();
+    // An untimed pass brings the graph and codes into cache so the first candidate is not charged for it
+    for (const auto& query : queryList) {
+        vectorHits(query, k, noThreshold, EF_SEARCH_CANDIDATES[0]);
+    }
+    
+    EfSearchCalibration calibration;
+    calibration.type = type;
+    calibration.k = k;
+    calibration.queries = count;
+    calibration.vectors = getIndexSize();
+    for (int efSearch : EF_SEARCH_CANDIDATES) {
+        std::vector<double> latencies;
+        latencies.reserve(count);
+        size_t expected = 0;
+        size_t matched = 0;
+        for (size_t q = 0; q < count; ++q) {
+            auto started = std::chrono::steady_clock::now();
+            SearchHits hits = vectorHits(queryList[q], k, noThreshold, efSearch);
+            latencies.push_back(elapsedMs(started));
+            for (const auto& hit : hits) {
+                matched += truth[q].count(hit.first);
+            }
+            expected += truth[q].size();
+        }
+        
+        EfSearchPoint point;
+        point.efSearch = efSearch;
+        point.recall = expected > 0 ? static_cast<double>(matched) / static_cast<double>(expected) : 0.0;
+        for (double ms : latencies) {
+            point.meanMs += ms / static_cast<double>(count);
+        }
+        std::sort(latencies.begin(), latencies.end());
+        point.p95Ms = latencies[std::min(count - 1, count * 95 / 100)];
+        calibration.points.push_back(point);
+        LOG_INFO("efSearch " << efSearch << ": recall@" << k << " " << point.recall
+              << ", mean " << point.meanMs << " ms, p95 " << point.p95Ms << " ms");
+    }
+    
+    if (!calibrationFile_.empty() && !saveCalibration(calibration)) {
+        LOG_WARN("Failed to write efSearch calibration to " << calibrationFile_);
     }
     
-    // Rebuild index to reflect changes
-    rebuildIndex();
+    std::lock_guard<std::mutex> lock(calibrationMutex_);
+    calibration_ = std::move(calibration);
     return true;
 }
 
-bool VectorSearch::upsertDocument(const std::string& id, const std::string& text, const std::map<std::string, std::string>& metadata) {
-    if (!isInitialized()) {
-        std::cerr << "Error: System not initialized" << std::endl;
-        return false;
+EfSearchCalibration VectorSearch::getEfSearchCalibration() const {
+    std::lock_guard<std::mutex> lock(calibrationMutex_);
+    return calibration_;
+}
+
+int VectorSearch::chooseEfSearch(double targetRecall, double budgetMs, int fallback) const {
+    std::lock_guard<std::mutex> lock(calibrationMutex_);
+    if (calibration_.points.empty()) {
+        return fallback;
     }
     
-    // Check if document exists
-    Document existingDoc = storage_->getDocument(id);
-    if (!existingDoc.id.empty()) {
-        // Document exists, update it
-        return updateDocument(id, text, metadata);
-    } else {
-        // Document doesn't exist, add it
-        std::string result = addDocument(text, metadata, id);
-        return !result.empty();
+    // Points ascend in efSearch, so the first one reaching the target is the cheapest
+    const EfSearchPoint* chosen = nullptr;
+    for (const auto& point : calibration_.points) {
+        if (point.p95Ms > budgetMs) {
+            continue;
+        }
+        chosen = &point;
+        if (targetRecall > 0.0 && point.recall >= targetRecall) {
+            break;
+        }
     }
+    return chosen ? chosen->efSearch : calibration_.points.front().efSearch;
 }
 
-void VectorSearch::rebuildIndex() {
-    if (!isInitialized()) {
-        std::cerr << "Error: System not initialized" << std::endl;
-        return;
+bool VectorSearch::saveCalibration(const EfSearchCalibration& calibration) const {
+    std::string tmpPath = calibrationFile_ + ".tmp";
+    {
+        std::ofstream out(tmpPath, std::ios::trunc);
+        if (!out) {
+            return false;
+        }
+        out << CALIBRATION_MAGIC << ' ' << indexTypeName(calibration.type) << ' ' << calibration.k << ' '
+            << calibration.queries << ' ' << calibration.vectors << '\n';
+        for (const auto& point : calibration.points) {
+            out << point.efSearch << ' ' << point.recall << ' ' << point.meanMs << ' ' << point.p95Ms << '\n';
+        }
+        out.flush();
+        if (!out) {
+            return false;
+        }
     }
     
-    std::cout << "Rebuilding index..." << std::endl;
-    
-    // Clear existing index
-    delete index;
-    initializeIndex();
-    indexToDocumentId_.clear();
-    
-    // Get all documents
-    auto documents = storage_->getAllDocuments();
-    if (documents.empty()) {
-        std::cout << "No documents to index" << std::endl;
+    std::error_code ec;
+    std::filesystem::rename(tmpPath, calibrationFile_, ec);
+    return !ec;
+}
+
+void VectorSearch::loadCalibration() {
+    std::ifstream in(calibrationFile_);
+    if (!in) {
         return;
     }
     
-    // Extract texts and generate embeddings
-    std::vector<std::string> texts;
-    texts.reserve(documents.size());
+    EfSearchCalibration calibration;
+    std::string magic;
+    std::string typeName;
+    if (!(in >> magic >> typeName >> calibration.k >> calibration.queries >> calibration.vectors) ||
+        magic != CALIBRATION_MAGIC || !parseIndexType(typeName, calibration.type)) {
+        LOG_WARN("Ignoring unreadable efSearch calibration " << calibrationFile_);
+        return;
+    }
     
-    for (const auto& doc : documents) {
-        texts.push_back(doc.text);
+    // Latency and recall measured on another index layout say nothing about this one
+    const IndexType type = getIndexStats().type;
+    if (calibration.type != type) {
+        LOG_INFO("efSearch calibration was measured on a " << typeName << " index, this one is "
+              << indexTypeName(type) << "; recalibrate to use latency budgets");
+        return;
     }
     
-    auto embeddings = inferenceEngine_->getEmbeddings(texts);
+    EfSearchPoint point;
+    while (in >> point.efSearch >> point.recall >> point.meanMs >> point.p95Ms) {
+        calibration.points.push_back(point);
+    }
+    std::sort(calibration.points.begin(), calibration.points.end(),
+              [](const auto& a, const auto& b) { return a.efSearch < b.efSearch; });
     
-    // Flatten embeddings and add to index
-    std::vector<float> flatEmbeddings;
-    flatEmbeddings.reserve(embeddings.size() * d);
+    LOG_INFO("Loaded efSearch calibration of " << calibration.points.size() << " points, measured at "
+          << calibration.vectors << " vectors");
+    std::lock_guard<std::mutex> lock(calibrationMutex_);
+    calibration_ = std::move(calibration);
+}
+
+size_t VectorSearch::getEmbeddingDimension() const {
+    return inferenceEngine_ ? inferenceEngine_->getEmbeddingDimension() : 0;
+}
+
+void VectorSearch::tombstoneDocument(const std::string& documentId) {
+    auto it = documentIdToLabel_.find(documentId);
+    if (it == documentIdToLabel_.end()) {
+        return;
+    }
     
-    for (const auto& emb : embeddings) {
-        flatEmbeddings.insert(flatEmbeddings.end(), emb.begin(), emb.end());
+    tombstones_.insert(it->second);
+    labelToDocumentId_.erase(it->second);
+    documentIdToLabel_.erase(it);
+}
+
+void VectorSearch::scheduleCompactionIfNeeded() {
+    if (!index || compactionRatio_ <= 0.0f || compacting_ || tombstones_.empty()) {
+        return;
     }
     
-    index->add(static_cast<int>(embeddings.size()), flatEmbeddings.data());
+    if (static_cast<float>(tombstones_.size()) < compactionRatio_ * static_cast<float>(index->ntotal)) {
+        return;
+    }
     
-    // Update mapping
-    for (const auto& doc : documents) {
-        indexToDocumentId_.push_back(doc.id);
+    if (compactionThread_.joinable()) {
+        compactionThread_.join();
     }
     
-    std::cout << "Rebuilt index with " << index->ntotal << " vectors" << std::endl;
+    compacting_ = true;
+    compactionThread_ = std::thread(&VectorSearch::compactIndex, this);
 }
 
-void VectorSearch::synchronizeIndex() {
-    if (!storage_ || !storage_->isOpen()) {
-        std::cerr << "Error: Storage not available" << std::endl;
+void VectorSearch::compactIndex() {
+    // Tombstones, labels and the index only change under the exclusive lock, so a shared one is enough
+    // to snapshot the live vectors while searches go on; the graph itself is rebuilt without any lock
+    std::shared_lock<std::shared_mutex> snapshotLock(indexMutex_);
+    if (!index) {
+        compacting_ = false;
         return;
     }
     
-    // Get all document IDs from storage
-    auto allDocumentIds = storage_->getAllDocumentIds();
-    indexToDocumentId_ = allDocumentIds;
+    const uint64_t epoch = indexEpoch_;
+    const faiss::idx_t baseline = index->ntotal;
+    const auto droppedLabels = tombstones_;
+    faiss::IndexIDMap* compacted = wrapWithIdMap(createEmptyLike(index->index));
     
-    if (index && index->ntotal != static_cast<long>(allDocumentIds.size())) {
-        std::cout << "Index size mismatch. Rebuilding..." << std::endl;
-        rebuildIndex();
+    std::vector<float> vectors(static_cast<size_t>(baseline) * d);
+    index->index->reconstruct_n(0, baseline, vectors.data());
+    
+    std::vector<faiss::idx_t> liveLabels;
+    liveLabels.reserve(baseline - droppedLabels.size());
+    size_t live = 0;
+    for (faiss::idx_t i = 0; i < baseline; ++i) {
+        if (droppedLabels.count(index->id_map[i])) {
+            continue;
+        }
+        if (static_cast<faiss::idx_t>(live) != i) {
+            std::copy_n(vectors.begin() + i * d, d, vectors.begin() + live * d);
+        }
+        liveLabels.push_back(index->id_map[i]);
+        ++live;
     }
-}
-
-Document VectorSearch::getDocument(const std::string& id) {
-    if (!storage_) {
-        return Document();
+    vectors.resize(live * d);
+    snapshotLock.unlock();
+    
+    LOG_INFO("Compacting index: dropping " << droppedLabels.size() << " tombstones");
+    
+    // Decoded quantized vectors re-encode to the same codes, except that IVF-PQ may move a few to a
+    // neighbouring list
+    if (!liveLabels.empty()) {
+        compacted->add_with_ids(static_cast<faiss::idx_t>(liveLabels.size()), vectors.data(), liveLabels.data());
     }
-    return storage_->getDocument(id);
+    
+    std::unique_lock<std::shared_mutex> lock(indexMutex_);
+    if (epoch != indexEpoch_) {
+        // The index was rebuilt or reloaded meanwhile; this result is stale
+        delete compacted;
+        compacting_ = false;
+        return;
+    }
+    
+    // Carry over vectors added while the graph was being rebuilt
+    if (index->ntotal > baseline) {
+        faiss::idx_t tail = index->ntotal - baseline;
+        std::vector<float> tailVectors(static_cast<size_t>(tail) * d);
+        index->index->reconstruct_n(baseline, tail, tailVectors.data());
+        compacted->add_with_ids(tail, tailVectors.data(), index->id_map.data() + baseline);
+    }
+    
+    for (faiss::idx_t label : droppedLabels) {
+        tombstones_.erase(label);
+    }
+    
+    delete index;
+    index = compacted;
+    indexMapped_ = false;
+    compacting_ = false;
+    ++indexGeneration_;  // The rebuilt graph can rank near ties differently
+    
+    LOG_INFO("Compacted index to " << index->ntotal << " vectors");
 }
 
-std::vector<Document> VectorSearch::getAllDocuments() {
-    if (!storage_) {
+std::vector<float> VectorSearch::getEmbedding(const std::string& text) {
+    if (!isModelLoaded()) {
+        LOG_ERROR("Model not loaded");
         return {};
     }
-    return storage_->getAllDocuments();
+    
+    return inferenceEngine_->getEmbedding(text);
 }
 
-size_t VectorSearch::getDocumentCount() {
-    if (!storage_) {
-        return 0;
+std::vector<float> VectorSearch::embedQuery(const std::string& query) {
+    auto embed = [this, &query] { return queryScheduler_ ? queryScheduler_->embed(query) : getEmbedding(query); };
+    if (!queryCache_) {
+        return embed();
     }
-    return storage_->getDocumentCount();
-}
-
-size_t VectorSearch::getEmbeddingDimension() const {
-    return inferenceEngine_ ? inferenceEngine_->getEmbeddingDimension() : 0;
+    
+    std::string key = queryCacheKey(inferenceEngine_->getModelFingerprint(), query);
+    
+    std::vector<float> embedding;
+    if (queryCache_->get(key, embedding)) {
+        return embedding;
+    }
+    
+    embedding = embed();
+    if (!embedding.empty()) {
+        queryCache_->put(key, embedding, embedding.size() * sizeof(float));
+    }
+    return embedding;
 }
 
-void VectorSearch::initializeIndex() {
-    if (d <= 0) {
-        std::cerr << "Error: Invalid embedding dimension" << std::endl;
-        return;
+std::vector<std::vector<SearchResult>> VectorSearch::hydrateBatch(const std::vector<SearchHits>& hits,
+                                                                  const ResultFields& fields) {
+    // Queries in a batch often share hits, so each document is read once
+    ScopedTimer timer(stageHistogram(Stage::Hydrate));
+    std::vector<std::string> documentIds;
+    std::unordered_map<std::string, size_t> position;
+    for (const auto& queryHits : hits) {
+        for (const auto& hit : queryHits) {
+            if (position.emplace(hit.first, documentIds.size()).second) {
+                documentIds.push_back(hit.first);
+            }
+        }
     }
     
-    index = new faiss::IndexHNSWFlat(d, 32); // M = 16
-    index->hnsw.efConstruction = 300;
+    std::vector<Document> documents = storage_->getDocumentsByIds(documentIds, fields.stored());
     
-    std::cout << "Initialized HNSW index with dimension " << d << std::endl;
-}
-
-std::vector<float> VectorSearch::getEmbedding(const std::string& text) {
-    if (!isModelLoaded()) {
-        std::cerr << "Error: Model not loaded" << std::endl;
-        return {};
+    std::vector<std::vector<SearchResult>> results(hits.size());
+    for (size_t q = 0; q < hits.size(); ++q) {
+        results[q].reserve(hits[q].size());
+        for (const auto& [documentId, score] : hits[q]) {
+            const Document& document = documents[position[documentId]];
+            if (document.id.empty()) {
+                continue;  // Deleted after the search but before its log entry was applied
+            }
+            
+            SearchResult result;
+            result.id = document.id;
+            result.text = document.text;
+            result.metadata = document.metadata;
+            result.score = score;
+            results[q].push_back(std::move(result));
+        }
     }
     
-    return inferenceEngine_->getEmbedding(text);
+    return results;
 }
 
-SearchResult VectorSearch::buildSearchResult(const std::string& documentId, float score) {
-    Document doc = storage_->getDocument(documentId);
+std::vector<SearchResult> VectorSearch::hydrateResults(const SearchHits& hits, const ResultFields& fields) {
+    ScopedTimer timer(stageHistogram(Stage::Hydrate));
+    std::vector<std::string> documentIds;
+    documentIds.reserve(hits.size());
+    for (const auto& hit : hits) {
+        documentIds.push_back(hit.first);
+    }
+    
+    // One batched lookup for all hits; it preserves order, so results stay ranked by score
+    std::vector<Document> documents = storage_->getDocumentsByIds(documentIds, fields.stored());
     
-    SearchResult result;
-    result.id = doc.id;
-    result.text = doc.text;
-    result.metadata = doc.metadata;
-    result.score = score;
+    std::vector<SearchResult> results;
+    results.reserve(hits.size());
+    for (size_t i = 0; i < hits.size(); ++i) {
+        if (documents[i].id.empty()) {
+            continue;  // Deleted after the search but before its log entry was applied
+        }
+        
+        SearchResult result;
+        result.id = std::move(documents[i].id);
+        result.text = std::move(documents[i].text);
+        result.metadata = std::move(documents[i].metadata);
+        result.score = hits[i].second;
+        results.push_back(std::move(result));
+    }
     
-    return result;
+    return results;
 }
\ No newline at end of file
@@ -1,10 +1,20 @@
-from subprocess import run 
+from argparse import ArgumentParser
+from subprocess import run
 from pathlib import Path
 
 MODEL = "google/embeddinggemma-300m"
 
 OUTPUT = Path(__file__).parent.parent / "server" / "embeddinggemma-onnx"
 
+parser = ArgumentParser(description=f"Export {MODEL} to ONNX")
+parser.add_argument(
+    "--precision",
+    choices=["fp32", "fp16", "int8"],
+    default="fp32",
+    help="fp32 graph (default), fp16 weights and activations, or int8 dynamically quantized weights",
+)
+args = parser.parse_args()
+
 print(f"Starting export of {MODEL} to {OUTPUT}")
 
 run([
@@ -14,6 +24,35 @@ run([
     "--model",
     MODEL,
     str(OUTPUT),
-])
+], check=True)
 
 print(f"Model {MODEL} exported to {OUTPUT}")
+
+if args.precision != "fp32":
+    import onnx
+
+    source = OUTPUT / "model.onnx"
+    target = OUTPUT / f"model_{args.precision}.onnx"
+
+    if args.precision == "int8":
+        # Weights are stored as int8 and activations are quantized per batch at run time, so inputs and
+        # outputs stay float32 and no calibration data is needed
+        from onnxruntime.quantization import QuantType, quantize_dynamic
+
+        quantize_dynamic(str(source), str(target), weight_type=QuantType.QInt8)
+        model = onnx.load(str(target))
+    else:
+        # keep_io_types=False leaves the hidden states in float16; the server widens them while pooling
+        from onnxruntime.transformers.float16 import convert_float_to_float16
+
+        model = convert_float_to_float16(onnx.load(str(source)), keep_io_types=False)
+
+    # The server reports this tag as its precision in /health
+    entry = model.metadata_props.add()
+    entry.key = "precision"
+    entry.value = args.precision
+    onnx.save(model, str(target))
+
+    print(f"{args.precision} model written to {target}")
+    print(f"Check it against the fp32 model before switching: "
+          f"./server --model {source} --validate-model {target}")